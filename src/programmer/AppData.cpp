@@ -41,7 +41,10 @@ AppData::AppData() :
     device_id(0),
     silicon_revision(0),
     debug_enable(0),
-    reserved(0)
+    reserved(0),
+    rows(),
+    rows_code_bytes(0),
+    rows_config_bytes(0)
 {
 }
 
@@ -62,6 +65,8 @@ void AppData::clear(void)
     silicon_revision = 0;
     debug_enable = 0;
     reserved = 0;
+
+    rows.clear();
 }
 
 
@@ -244,6 +249,86 @@ bool AppData::extra_flash_used_for_config(void) const
 }
 
 
+static void map_hex_rows(const HexData *hex, uint32_t base_address, int bytes_per_row, std::vector<uint8_t> &flags)
+{
+    int nblocks = hex ? hex->nblocks() : 0;
+    int i, j;
+
+    for (i=0; i<nblocks; i++)
+    {
+        const Block *block = (*hex)[i];
+        if (block->length() == 0 || block->base_address < base_address)
+            continue;
+
+        uint32_t offset = block->base_address - base_address;
+        size_t last_row = (offset + block->length() - 1) / bytes_per_row;
+        if (flags.size() <= last_row)
+            flags.resize(last_row + 1, 0);
+
+        for (j=0; j<block->length(); j++)
+        {
+            uint8_t *f = &flags[(offset + j) / bytes_per_row];
+            *f |= ROW_OCCUPIED;
+            if (block->data[j]) *f |= ROW_NONZERO;
+        }
+    }
+}
+
+
+void AppData::map_rows(int code_bytes_per_row, int config_bytes_per_row, std::vector<uint8_t> &flags) const
+{
+    // config_bytes_per_row 0: code only (ECC enabled)
+    flags.clear();
+    map_hex_rows(code, HexFileFormat::FLASH_CODE_ADDRESS, code_bytes_per_row, flags);
+    if (config_bytes_per_row)
+        map_hex_rows(config, HexFileFormat::CONFIG_ADDRESS, config_bytes_per_row, flags);
+}
+
+
+void AppData::encode_rows(int code_bytes_per_row, int config_bytes_per_row)
+{
+    // config_bytes_per_row 0: code only (ECC enabled)
+    rows.clear();
+    rows_code_bytes = code_bytes_per_row;
+    rows_config_bytes = config_bytes_per_row;
+
+    int code_len = code ? code->length() : 0;
+    int config_len = (config && config_bytes_per_row) ? config->length() : 0;
+
+    std::vector<uint8_t> row_map;
+    map_rows(code_bytes_per_row, config_bytes_per_row, row_map);
+    int num_rows = row_map.size();
+
+    rows.resize(num_rows);
+
+    int row;
+    for (row=0; row<num_rows; row++)
+    {
+        v_uint8_t &data = rows[row];
+        data.resize(code_bytes_per_row + config_bytes_per_row); // zero filled
+        if (!(row_map[row] & ROW_NONZERO))
+            continue;
+
+        if (code_len)
+            code->extract2bin(HexFileFormat::FLASH_CODE_ADDRESS + row * code_bytes_per_row, code_bytes_per_row, data.data());
+
+        if (config_len)
+            config->extract2bin(HexFileFormat::CONFIG_ADDRESS + row * config_bytes_per_row, config_bytes_per_row,
+                data.data() + code_bytes_per_row);
+    }
+}
+
+
+const uint8_t *AppData::encoded_row(int row, int code_bytes_per_row, int config_bytes_per_row) const
+{
+    if (code_bytes_per_row != rows_code_bytes || config_bytes_per_row != rows_config_bytes)
+        return NULL;
+    if (row < 0 || row >= (int)rows.size())
+        return NULL;
+    return rows[row].data();
+}
+
+
 void AppData::dump(bool shortform, const char *filename) const
 {
     FILE *fp = stderr;
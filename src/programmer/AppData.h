@@ -22,9 +22,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <vector>
+
 #include "HexData.h"
 
 
+// flash row flags (AppData::map_rows)
+#define ROW_OCCUPIED    0x01    // the image has data for the row
+#define ROW_NONZERO     0x02    // and not all of it is zero
+
+
 struct AppData
 {
     HexData *code;
@@ -45,6 +52,12 @@ struct AppData
 
 //    uint8_t metadata[12]; // not stored in PSoC
 
+    // Flash rows (code bytes then config bytes) built once by encode_rows() so several
+    // programmers (gang mode) can share them read only. Empty: rows are extracted as written.
+    std::vector<v_uint8_t> rows;
+    int rows_code_bytes;
+    int rows_config_bytes;
+
     // ...
 
     AppData();
@@ -61,6 +74,13 @@ struct AppData
     void _set_metadata(uint8_t metadata[12]) const; // utility function
     uint32_t calc_checksum(bool truncate=false) const;
     bool extra_flash_used_for_config(void) const;
+
+    // ROW_xxx flags of each flash row, from one pass over the hex blocks. Ends at the last
+    // row with data (rows are counted by address, not bytes: an image may have gaps).
+    void map_rows(int code_bytes_per_row, int config_bytes_per_row, std::vector<uint8_t> &flags) const;
+
+    void encode_rows(int code_bytes_per_row, int config_bytes_per_row);
+    const uint8_t *encoded_row(int row, int code_bytes_per_row, int config_bytes_per_row) const; // NULL: not encoded
 };
 
 #endif
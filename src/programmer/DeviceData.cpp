@@ -50,6 +50,8 @@ bool DeviceData::read_file(const std::string filename, const std::string device)
         return false;
     }
 
+    name = device;
+
     flash_size = reader.GetInteger(device, "flash_size", 0 );
     flash_rows_per_array = reader.GetInteger(device, "flash_rows_per_array", 0);
     flash_num_arrays = reader.GetInteger(device, "flash_num_arrays", 0); // DERIVED - Easy to Calc ??
@@ -65,6 +67,7 @@ bool DeviceData::read_file(const std::string filename, const std::string device)
     flash_config_bytes_per_row = reader.GetInteger(device, "flash_config_bytes_per_row", 0);
     flash_config_max_size = total_flash_rows * flash_config_bytes_per_row;
     flash_config_base_address = reader.GetUint32(device, "flash_config_base_address", 0);
+    flash_config_ahb_address = reader.GetUint32(device, "flash_config_ahb_address", 0);
 
     eeprom_size = reader.GetInteger(device, "eeprom_size", 0);
     eeprom_bytes_per_row = reader.GetInteger(device, "eeprom_bytes_per_row", 0);
@@ -114,6 +117,7 @@ void DeviceData::dump(void) const
     fprintf(stderr, "Flash config bytes per row: %d\n", flash_config_bytes_per_row);
     fprintf(stderr, "Flash config max size: %d\n", flash_config_max_size);
     fprintf(stderr, "Flash config base address: 0x%08x\n", flash_config_base_address);
+    fprintf(stderr, "Flash config AHB address: 0x%08x\n", flash_config_ahb_address);
 
     fprintf(stderr, "EEPROM size: %d\n", eeprom_size);
     fprintf(stderr, "EEPROM bytes per row: %d\n", eeprom_bytes_per_row);
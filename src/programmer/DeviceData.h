@@ -26,6 +26,8 @@
 
 struct DeviceData
 {
+    std::string name;   // devices.dat section
+
     // NV flash
     int flash_size;
     int flash_rows_per_array;
@@ -39,6 +41,7 @@ struct DeviceData
     int flash_config_bytes_per_row;
     int flash_config_max_size; // derived
     uint32_t flash_config_base_address;
+    uint32_t flash_config_ahb_address; // config/ECC bytes on the bus (packed, all arrays), 0: SPC only
 
     int flash_rows_per_protection_byte;
 
@@ -0,0 +1,170 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "FlashJournal.h"
+
+
+FlashJournal::FlashJournal()
+    : m_fp(NULL)
+    , m_rows_done(0)
+    , m_synced_rows(0)
+{
+}
+
+
+FlashJournal::~FlashJournal()
+{
+    close();
+}
+
+
+uint32_t FlashJournal::hash(uint32_t h, const uint8_t *data, int len)
+{
+    int i;
+    for (i=0; i<len; i++)
+    {
+        h ^= data[i];
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+
+int FlashJournal::begin(const std::string &filename, uint32_t image_id, int num_rows, int row_len)
+{
+    close();
+    m_filename = filename;
+    m_rows_done = 0;
+    m_synced_rows = 0;
+
+    // a previous run of the same image: take the furthest it got
+    int prev_done = 0;
+    FILE *fp = fopen(filename.c_str(), "r");
+    if (fp)
+    {
+        char line[256];
+        bool same_image = false;
+
+        while (fgets(line, sizeof(line), fp))
+        {
+            unsigned long id;
+            int rows, len, done;
+
+            if (sscanf(line, "image %lx %d %d", &id, &rows, &len) == 3)
+                same_image = id == image_id && rows == num_rows && len == row_len;
+            else if (same_image && sscanf(line, "done %d", &done) == 1 && done > prev_done && done <= num_rows)
+                prev_done = done;
+        }
+        fclose(fp);
+    }
+
+    // rewrite it for this run (no point carrying old lines forward)
+    m_fp = fopen(filename.c_str(), "w");
+    if (!m_fp)
+    {
+        fprintf(stderr, "FlashJournal: can't write %s - writes won't be resumable\n", filename.c_str());
+        return 0;
+    }
+
+    fprintf(m_fp, "# flash write journal: image id, rows, row length, then rows confirmed programmed\n");
+    fprintf(m_fp, "image %08lx %d %d\n", (unsigned long)image_id, num_rows, row_len);
+    sync();
+
+    return prev_done;
+}
+
+
+void FlashJournal::accept(int rows_done)
+{
+    // the caller has checked the flash still holds them
+    if (!m_fp || rows_done <= 0)
+        return;
+
+    m_rows_done = rows_done;
+    fprintf(m_fp, "done %d\n", rows_done);
+    sync();
+}
+
+
+bool FlashJournal::sync(void)
+{
+    if (!m_fp)
+        return false;
+
+    if (fflush(m_fp) != 0 || fsync(fileno(m_fp)) != 0)
+    {
+        fprintf(stderr, "FlashJournal: can't sync %s\n", m_filename.c_str());
+        return false;
+    }
+
+    m_synced_rows = m_rows_done;
+    return true;
+}
+
+
+void FlashJournal::confirmed(int rows_done, bool sync_now)
+{
+    if (!m_fp || rows_done <= m_rows_done)
+        return;
+
+    m_rows_done = rows_done;
+    fprintf(m_fp, "done %d\n", rows_done);
+
+    if (sync_now || m_rows_done - m_synced_rows >= FLASH_JOURNAL_SYNC_ROWS)
+        sync();
+}
+
+
+void FlashJournal::finish(void)
+{
+    if (m_fp)
+    {
+        fclose(m_fp);
+        m_fp = NULL;
+    }
+
+    if (m_filename.length() > 0)
+        remove(m_filename);
+    m_filename.clear();
+}
+
+
+void FlashJournal::remove(const std::string &filename)
+{
+    if (unlink(filename.c_str()) != 0 && errno != ENOENT)
+        fprintf(stderr, "FlashJournal: can't remove %s\n", filename.c_str());
+}
+
+
+void FlashJournal::close(void)
+{
+    if (!m_fp)
+        return;
+
+    sync();
+    fclose(m_fp);
+    m_fp = NULL;
+}
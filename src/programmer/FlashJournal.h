@@ -0,0 +1,77 @@
+#ifndef _FLASHJOURNAL_H
+#define _FLASHJOURNAL_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string>
+
+
+// Durable record of how far a flash write got, so one that is interrupted (USB stall, timeout,
+// killed process) can carry on from there rather than from row 0.
+//
+// One journal per device type, transport and programmer (<config dir>/<device>.<transport>
+// [.<programmer>].journal, text). It names the image being written (a hash of every row, see
+// hash()) and then has a line for each batch of rows confirmed programmed. It is removed once
+// the whole image is written.
+//
+// Rows are only ever confirmed after the SPC was seen idle following them, and the journal is
+// synced every FLASH_JOURNAL_SYNC_ROWS rows: a crash loses at most that many rows of progress.
+// Programmer::NV_flash_write checks the flash checksum of confirmed rows before skipping them,
+// and starts the count again from 0 if its plan erases.
+
+#define FLASH_JOURNAL_SYNC_ROWS     16
+
+
+class FlashJournal
+{
+    std::string m_filename;
+    FILE *m_fp;
+    int m_rows_done;
+    int m_synced_rows;
+
+    bool sync(void);
+
+  public:
+    FlashJournal();
+    ~FlashJournal();
+
+    // FNV-1a, for the image id
+    static uint32_t hash(uint32_t h, const uint8_t *data, int len);
+    static uint32_t hash_init(void) { return 0x811c9dc5; }
+
+    // Starts writing image_id with no rows confirmed. Returns the rows a previous run of the
+    // same image confirmed, 0 if none or the journal can't be used: they only count once
+    // accept()ed, after checking the flash still has them.
+    int begin(const std::string &filename, uint32_t image_id, int num_rows, int row_len);
+    void accept(int rows_done);
+
+    // image rows 0..rows_done-1 are programmed (or need nothing)
+    void confirmed(int rows_done, bool sync_now=false);
+    int rows_done(void) const { return m_rows_done; }
+
+    void finish(void);      // image written: nothing to resume
+    void close(void);       // keeps what has been confirmed for a later run
+
+    static void remove(const std::string &filename);  // a journal of no further use, if any
+};
+
+#endif
@@ -0,0 +1,334 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "FlashPlan.h"
+#include "SpcTiming.h"
+#include "SwdProtocol.h"
+
+
+FlashPlan::FlashPlan(int num_arrays, int rows_per_array, int num_rows)
+    : m_num_arrays(num_arrays)
+    , m_rows_per_array(rows_per_array)
+    , m_sectors_per_array((rows_per_array + FLASH_ROWS_PER_SECTOR - 1) / FLASH_ROWS_PER_SECTOR)
+    , m_num_rows(num_rows)
+    , m_image_blank(num_rows, false)
+    , m_wanted(num_rows, true)
+    , m_keep_protection(true)
+    , m_plan(FLASH_PLAN_WRITE_ROW)
+{
+    struct sector_s unknown = { false, false, false };
+    m_sectors.assign(m_num_arrays * m_sectors_per_array, unknown);
+
+    set_cost(FLASH_OP_WRITE_ROW, (uint64_t)FLASH_PLAN_DEFAULT_WRITE_ROW_US * 1000, false);
+    set_cost(FLASH_OP_PROG_ROW, (uint64_t)FLASH_PLAN_DEFAULT_PROG_ROW_US * 1000, false);
+    set_cost(FLASH_OP_ERASE_SECTOR, (uint64_t)FLASH_PLAN_DEFAULT_ERASE_SECTOR_US * 1000, false);
+    set_cost(FLASH_OP_ERASE_ALL, (uint64_t)FLASH_PLAN_DEFAULT_ERASE_ALL_US * 1000, false);
+    set_cost(FLASH_OP_LOAD_ROW, (uint64_t)FLASH_PLAN_DEFAULT_LOAD_ROW_US * 1000, false);
+
+    int i;
+    for (i=0; i<FLASH_PLAN_COUNT; i++)
+    {
+        m_plan_valid[i] = false;
+        m_plan_ns[i] = 0;
+    }
+}
+
+
+const char *FlashPlan::name(int plan)
+{
+    switch (plan)
+    {
+        case FLASH_PLAN_WRITE_ROW:      return "WRITE_ROW";
+        case FLASH_PLAN_ERASE_SECTOR:   return "ERASE_SECTOR";
+        case FLASH_PLAN_ERASE_ALL:      return "ERASE_ALL";
+    }
+    return "?";
+}
+
+
+const char *FlashPlan::op_name(int op)
+{
+    switch (op)
+    {
+        case FLASH_OP_WRITE_ROW:        return "WRITE_ROW";
+        case FLASH_OP_PROG_ROW:         return "PROG_ROW";
+        case FLASH_OP_ERASE_SECTOR:     return "ERASE_SECTOR";
+        case FLASH_OP_ERASE_ALL:        return "ERASE_ALL";
+        case FLASH_OP_LOAD_ROW:         return "LOAD_ROW";
+    }
+    return "?";
+}
+
+
+int FlashPlan::sector_index(int row) const
+{
+    return (row / m_rows_per_array) * m_sectors_per_array + (row % m_rows_per_array) / FLASH_ROWS_PER_SECTOR;
+}
+
+
+int FlashPlan::sector_first_row(int s) const
+{
+    return sector_array(s) * m_rows_per_array + sector_in_array(s) * FLASH_ROWS_PER_SECTOR;
+}
+
+
+int FlashPlan::sector_rows(int s) const
+{
+    int first = sector_first_row(s);
+    int n = m_rows_per_array - sector_in_array(s) * FLASH_ROWS_PER_SECTOR;
+    if (n > FLASH_ROWS_PER_SECTOR) n = FLASH_ROWS_PER_SECTOR;
+
+    if (m_num_rows <= first) return 0;
+    return m_num_rows - first < n ? m_num_rows - first : n;
+}
+
+
+void FlashPlan::set_sector_state(int s, bool blank, bool outside_blank)
+{
+    m_sectors[s].blank = blank;
+    m_sectors[s].outside_blank = outside_blank;
+}
+
+
+void FlashPlan::load_costs(const SpcTiming &timing)
+{
+    static const uint8_t cmds[FLASH_OP_COUNT] = {
+        SPC_CMD_WRITE_ROW, SPC_CMD_PROG_ROW, SPC_CMD_ERASE_SECTOR, SPC_CMD_ERASE_ALL, SPC_CMD_LOAD_ROW
+    };
+
+    int op;
+    for (op=0; op<FLASH_OP_COUNT; op++)
+    {
+        uint64_t ns = timing.mean_ns(SpcTiming::key(cmds[op], NULL, 0));
+        if (ns)
+            set_cost(op, ns, true);
+    }
+}
+
+
+bool FlashPlan::state_matters(void) const
+{
+    int nwanted = 0;
+    int row;
+    for (row = 0; row < m_num_rows; row++)
+    {
+        if (!m_wanted[row]) continue;
+        if (m_image_blank[row]) return true; // may need no writing at all
+        nwanted++;
+    }
+
+    uint64_t erase_ns = m_cost_ns[FLASH_OP_ERASE_SECTOR];
+    if (m_cost_ns[FLASH_OP_ERASE_ALL] < erase_ns) erase_ns = m_cost_ns[FLASH_OP_ERASE_ALL];
+
+    if (row_ns(true) <= row_ns(false))
+        return false;
+
+    return nwanted * (row_ns(true) - row_ns(false)) > erase_ns;
+}
+
+
+bool FlashPlan::needed(int row) const
+{
+    // wanted unless blank and already blank in flash
+    return m_wanted[row] && !(m_image_blank[row] && m_sectors[sector_index(row)].blank);
+}
+
+
+uint64_t FlashPlan::row_ns(bool erase_first) const
+{
+    return m_cost_ns[FLASH_OP_LOAD_ROW] + m_cost_ns[erase_first ? FLASH_OP_WRITE_ROW : FLASH_OP_PROG_ROW];
+}
+
+
+bool FlashPlan::sector_erase_ns(int s, uint64_t *ns) const
+{
+    // ERASE_SECTOR (unless blank already) then PROG_ROW of the non blank image rows
+    const struct sector_s *sector = &m_sectors[s];
+    if (!sector->outside_blank)
+        return false;
+
+    *ns = sector->blank ? 0 : m_cost_ns[FLASH_OP_ERASE_SECTOR];
+
+    int first = sector_first_row(s);
+    int i;
+    for (i=0; i<sector_rows(s); i++)
+    {
+        if (!m_image_blank[first + i])
+            *ns += row_ns(false);
+    }
+    return true;
+}
+
+
+uint64_t FlashPlan::sector_write_ns(int s) const
+{
+    uint64_t ns = 0;
+    int first = sector_first_row(s);
+    int i;
+    for (i=0; i<sector_rows(s); i++)
+    {
+        if (needed(first + i))
+            ns += row_ns(!m_sectors[s].blank);
+    }
+    return ns;
+}
+
+
+int FlashPlan::choose(void)
+{
+    int s, row;
+
+    // WRITE_ROW: always possible
+    m_plan_valid[FLASH_PLAN_WRITE_ROW] = true;
+    m_plan_ns[FLASH_PLAN_WRITE_ROW] = 0;
+    for (row = 0; row < m_num_rows; row++)
+    {
+        if (needed(row))
+            m_plan_ns[FLASH_PLAN_WRITE_ROW] += row_ns(!m_sectors[sector_index(row)].blank);
+    }
+
+    // ERASE_SECTOR: the cheaper way for each sector. Only a plan of its own if some sector erases.
+    m_plan_valid[FLASH_PLAN_ERASE_SECTOR] = false;
+    m_plan_ns[FLASH_PLAN_ERASE_SECTOR] = 0;
+    for (s = 0; s < num_sectors(); s++)
+    {
+        uint64_t write_ns = sector_write_ns(s);
+        uint64_t erase_ns;
+
+        m_sectors[s].erase = sector_rows(s) > 0 && write_ns > 0 && sector_erase_ns(s, &erase_ns) && erase_ns < write_ns;
+        if (m_sectors[s].erase)
+        {
+            m_plan_valid[FLASH_PLAN_ERASE_SECTOR] = true;
+            m_plan_ns[FLASH_PLAN_ERASE_SECTOR] += erase_ns;
+        }
+        else
+            m_plan_ns[FLASH_PLAN_ERASE_SECTOR] += write_ns;
+    }
+
+    // ERASE_ALL: nothing outside the image to lose
+    m_plan_valid[FLASH_PLAN_ERASE_ALL] = !m_keep_protection;
+    m_plan_ns[FLASH_PLAN_ERASE_ALL] = m_cost_ns[FLASH_OP_ERASE_ALL];
+    for (s = 0; s < num_sectors(); s++)
+    {
+        if (!m_sectors[s].outside_blank)
+            m_plan_valid[FLASH_PLAN_ERASE_ALL] = false;
+    }
+    for (row = 0; row < m_num_rows; row++)
+    {
+        if (!m_image_blank[row])
+            m_plan_ns[FLASH_PLAN_ERASE_ALL] += row_ns(false);
+    }
+
+    int plan;
+    m_plan = FLASH_PLAN_WRITE_ROW;
+    for (plan = 0; plan < FLASH_PLAN_COUNT; plan++)
+    {
+        if (m_plan_valid[plan] && m_plan_ns[plan] < m_plan_ns[m_plan])
+            m_plan = plan;
+    }
+
+    // rows in order, each with WRITE_ROW or (erased, or blank already) PROG_ROW
+    m_rows.clear();
+    m_erase_first.clear();
+    for (row = 0; row < m_num_rows; row++)
+    {
+        const struct sector_s *sector = &m_sectors[sector_index(row)];
+        bool erased = m_plan == FLASH_PLAN_ERASE_ALL || sector->blank ||
+                      (m_plan == FLASH_PLAN_ERASE_SECTOR && sector->erase);
+
+        if (erased ? !m_image_blank[row] : needed(row))
+        {
+            m_rows.push_back(row);
+            m_erase_first.push_back(!erased);
+        }
+    }
+
+    return m_plan;
+}
+
+
+bool FlashPlan::erase_sector(int s) const
+{
+    return m_plan == FLASH_PLAN_ERASE_SECTOR && m_sectors[s].erase && !m_sectors[s].blank;
+}
+
+
+bool FlashPlan::has_erases(void) const
+{
+    if (m_plan == FLASH_PLAN_ERASE_ALL)
+        return true;
+
+    int s;
+    for (s = 0; s < num_sectors(); s++)
+    {
+        if (erase_sector(s))
+            return true;
+    }
+    return false;
+}
+
+
+void FlashPlan::print(FILE *fp) const
+{
+    int op, plan, s, i;
+
+    int nwanted = 0;
+    for (i=0; i<m_num_rows; i++)
+        if (m_wanted[i]) nwanted++;
+
+    fprintf(fp, "Flash write plan: %d image rows, %d to write\n", m_num_rows, nwanted);
+
+    fprintf(fp, "  operation costs (us):");
+    for (op=0; op<FLASH_OP_COUNT; op++)
+        fprintf(fp, " %s %.0f%s", op_name(op), m_cost_ns[op] / 1e3, m_measured[op] ? "" : " (default)");
+    fprintf(fp, "\n");
+
+    for (plan=0; plan<FLASH_PLAN_COUNT; plan++)
+    {
+        if (m_plan_valid[plan])
+            fprintf(fp, "  %-12s %10.1f ms%s\n", name(plan), m_plan_ns[plan] / 1e6, plan == m_plan ? "  <- chosen" : "");
+        else
+            fprintf(fp, "  %-12s %10s\n", name(plan), "not valid");
+    }
+
+    if (m_plan == FLASH_PLAN_ERASE_ALL)
+        fprintf(fp, "  erase all\n");
+
+    bool any = false;
+    for (s = 0; s < num_sectors(); s++)
+    {
+        if (!erase_sector(s)) continue;
+        fprintf(fp, "%s %d.%d", any ? "" : "  erase sectors (array.sector):", sector_array(s), sector_in_array(s));
+        any = true;
+    }
+    if (any) fprintf(fp, "\n");
+
+    int nwrite = 0;
+    int nprog = 0;
+    for (i=0; i<(int)m_rows.size(); i++)
+    {
+        if (m_erase_first[i]) nwrite++;
+        else nprog++;
+    }
+    fprintf(fp, "  %d rows WRITE_ROW, %d rows PROG_ROW, %d skipped\n", nwrite, nprog, m_num_rows - nwrite - nprog);
+}
@@ -0,0 +1,163 @@
+#ifndef _FLASHPLAN_H
+#define _FLASHPLAN_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <vector>
+
+
+// How to get a flash image into the device: which erases to do and which rows to program.
+//
+// Rows can be written with WRITE_ROW (erase + program the row) or, once erased, with
+// PROG_ROW, which takes about half as long. An erased row reads all zero so blank image rows
+// need no programming at all after an erase, or if their sector is blank already (a sparse
+// image on a blank device costs its content, not its address span). The plans considered are:
+//
+//   WRITE_ROW     every row to write with WRITE_ROW (what always used to happen), PROG_ROW
+//                 where the sector is blank already
+//   ERASE_SECTOR  per 64 row sector, ERASE_SECTOR + PROG_ROW of its non blank image rows,
+//                 or WRITE_ROW of its rows, whichever is cheaper. A sector already blank
+//                 isn't erased again.
+//   ERASE_ALL     ERASE_ALL + PROG_ROW of every non blank image row
+//
+// Erases must not lose anything the image doesn't rewrite: a sector can only be erased if its
+// rows past the end of the image are blank, the whole device only if all rows past the end
+// of the image are blank and the image doesn't need flash protection kept (ERASE_ALL clears
+// it). The device state comes from flash checksums (a range sums to 0 only if blank).
+//
+// Costs are per operation times, normally those SpcTiming learned on this device type and
+// transport (load_costs()), else datasheet typicals. Each row programmed also costs a
+// LOAD_ROW. The cheapest valid plan wins.
+
+#define FLASH_ROWS_PER_SECTOR           64
+
+// PSoC 5LP datasheet typicals, for operations not timed yet (us)
+#define FLASH_PLAN_DEFAULT_WRITE_ROW_US     20000
+#define FLASH_PLAN_DEFAULT_PROG_ROW_US      10000
+#define FLASH_PLAN_DEFAULT_ERASE_SECTOR_US  15000
+#define FLASH_PLAN_DEFAULT_ERASE_ALL_US     35000
+#define FLASH_PLAN_DEFAULT_LOAD_ROW_US      1000    // mostly USB
+
+
+class SpcTiming;
+
+enum flash_plan_e
+{
+    FLASH_PLAN_WRITE_ROW = 0,
+    FLASH_PLAN_ERASE_SECTOR,
+    FLASH_PLAN_ERASE_ALL,
+    FLASH_PLAN_COUNT
+};
+
+enum flash_op_e
+{
+    FLASH_OP_WRITE_ROW = 0,
+    FLASH_OP_PROG_ROW,
+    FLASH_OP_ERASE_SECTOR,
+    FLASH_OP_ERASE_ALL,
+    FLASH_OP_LOAD_ROW,
+    FLASH_OP_COUNT
+};
+
+
+class FlashPlan
+{
+    struct sector_s
+    {
+        bool blank;             // on the device, rows in the image
+        bool outside_blank;     // on the device, rows past the end of the image
+        bool erase;             // chosen: ERASE_SECTOR (or already blank) + PROG_ROW
+    };
+
+    int m_num_arrays;
+    int m_rows_per_array;
+    int m_sectors_per_array;
+    int m_num_rows;                     // image rows (from row 0)
+    std::vector<bool> m_image_blank;    // per image row
+    std::vector<bool> m_wanted;         // per image row: differs from the device (or not known to match)
+    std::vector<struct sector_s> m_sectors;
+    bool m_keep_protection;
+
+    uint64_t m_cost_ns[FLASH_OP_COUNT];
+    bool m_measured[FLASH_OP_COUNT];
+
+    // chosen plan
+    int m_plan;
+    bool m_plan_valid[FLASH_PLAN_COUNT];
+    uint64_t m_plan_ns[FLASH_PLAN_COUNT];
+    std::vector<int> m_rows;
+    std::vector<bool> m_erase_first;
+
+    int sector_index(int row) const;
+    bool needed(int row) const;
+    int sector_first_row(int s) const;
+    uint64_t row_ns(bool erase_first) const;
+    bool sector_erase_ns(int s, uint64_t *ns) const;   // false: can't erase it
+    uint64_t sector_write_ns(int s) const;
+
+  public:
+    FlashPlan(int num_arrays, int rows_per_array, int num_rows);
+
+    static const char *name(int plan);
+    static const char *op_name(int op);
+
+    // image row is all zero / needs writing (all do unless set otherwise)
+    void set_image_blank(int row, bool blank) { m_image_blank[row] = blank; }
+    void set_wanted(int row, bool wanted) { m_wanted[row] = wanted; }
+
+    // device state of a sector (index counts through all arrays): its rows in the image /
+    // past the end of the image are blank. Not known: leave it (not blank).
+    void set_sector_state(int s, bool blank, bool outside_blank);
+    int num_sectors(void) const { return m_sectors.size(); }
+    int sector_rows(int s) const;               // rows of sector s in the image (0..FLASH_ROWS_PER_SECTOR)
+
+    void set_keep_protection(bool keep) { m_keep_protection = keep; }
+
+    void set_cost(int op, uint64_t ns, bool measured) { m_cost_ns[op] = ns; m_measured[op] = measured; }
+    void load_costs(const SpcTiming &timing);
+
+    // could the device state change the choice: are there blank rows to write (they may be
+    // blank already) or enough rows for PROG_ROW to save more than an erase costs. Else it
+    // isn't worth reading.
+    bool state_matters(void) const;
+
+    // prices each plan and picks the cheapest valid one
+    int choose(void);
+
+    int plan(void) const { return m_plan; }
+    bool valid(int plan) const { return m_plan_valid[plan]; }
+    uint64_t cost_ns(int plan) const { return m_plan_ns[plan]; }
+
+    // what the chosen plan does: erases first, then rows[i] (image row) in order
+    bool erase_all(void) const { return m_plan == FLASH_PLAN_ERASE_ALL; }
+    bool erase_sector(int s) const;
+    int sector_array(int s) const { return s / m_sectors_per_array; }
+    int sector_in_array(int s) const { return s % m_sectors_per_array; }
+    const std::vector<int> &rows(void) const { return m_rows; }
+    bool erase_first(int i) const { return m_erase_first[i]; }  // WRITE_ROW, else PROG_ROW
+    int rows_done(int n) const { return n < (int)m_rows.size() ? m_rows[n] : m_num_rows; } // image rows 0.. done once rows[0..n-1] are
+    bool has_erases(void) const;
+
+    void print(FILE *fp) const;
+};
+
+#endif
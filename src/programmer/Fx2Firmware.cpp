@@ -0,0 +1,318 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "Fx2Firmware.h"
+#include "HexData.h"
+
+
+static int debug = 0;
+
+
+// blob layout (host byte order):
+//   magic[8] version:u32 nchunks:u32 hex_size:u64 hex_mtime:i64 fingerprint:u64
+//   nchunks * { address:u16 len:u16 data[len] }
+
+struct fx2_blob_header_s
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nchunks;
+    uint64_t hex_size;
+    int64_t hex_mtime;
+    uint64_t fingerprint;
+};
+
+
+Fx2Firmware::Fx2Firmware()
+    : m_chunks()
+    , m_signature()
+    , m_fingerprint(0)
+{
+}
+
+
+bool Fx2Firmware::load(const std::string &hex_file)
+{
+    m_chunks.clear();
+    m_signature.clear();
+    m_fingerprint = 0;
+
+    struct stat st;
+    if (stat(hex_file.c_str(), &st) < 0)
+    {
+        fprintf(stderr, "Can't find FX2 config file: %s\n", hex_file.c_str());
+        return false;
+    }
+
+    std::string blob_file = hex_file + ".blob";
+
+    if (!read_blob(blob_file, st.st_size, st.st_mtime))
+    {
+        if (!read_hex(hex_file))
+            return false;
+
+        m_fingerprint = calc_fingerprint();
+
+        if (!write_blob(blob_file, st.st_size, st.st_mtime) && debug)
+            fprintf(stderr, "Can't cache FX2 firmware in %s\n", blob_file.c_str());
+    }
+
+    find_signature();
+
+    fprintf(stderr, "FX2 firmware: %d bytes in %d chunks, fingerprint %016llx\n",
+        size(), nchunks(), (unsigned long long)m_fingerprint);
+
+    return true;
+}
+
+
+int Fx2Firmware::size(void) const
+{
+    int total = 0;
+    int i;
+    for (i=0; i<nchunks(); i++)
+        total += m_chunks[i].data.size();
+    return total;
+}
+
+
+bool Fx2Firmware::read_hex(const std::string &hex_file)
+{
+    HexData hexdata;
+
+    if (!hexdata.read_hex(hex_file.c_str()))
+    {
+        fprintf(stderr, "Error reading FX2 config file: %s\n", hex_file.c_str());
+        return false;
+    }
+
+    HexData *newhexdata = hexdata.reshape(FX2_LOAD_CHUNK);
+
+    int nblocks = newhexdata->nblocks();
+    int i;
+    for (i=0; i<nblocks; i++)
+    {
+        const Block *block = (*newhexdata)[i];
+
+        if (block->base_address + block->length() > 0x10000)
+        {
+            fprintf(stderr, "FX2 config file has data outside the 64K address space: 0x%08x\n", block->base_address);
+            delete newhexdata;
+            m_chunks.clear();
+            return false;
+        }
+
+        Fx2Chunk chunk;
+        chunk.address = block->base_address;
+        chunk.data = block->data;
+        m_chunks.push_back(chunk);
+    }
+
+    delete newhexdata;
+    return true;
+}
+
+
+bool Fx2Firmware::read_blob(const std::string &blob_file, uint64_t hex_size, int64_t hex_mtime)
+{
+    FILE *fp = fopen(blob_file.c_str(), "rb");
+    if (!fp)
+        return false;
+
+    struct fx2_blob_header_s header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+        memcmp(header.magic, FX2_BLOB_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == FX2_BLOB_VERSION &&
+        header.hex_size == hex_size && header.hex_mtime == hex_mtime; // stale if hex file changed
+
+    uint32_t i;
+    for (i=0; ok && i<header.nchunks; i++)
+    {
+        uint16_t addr_len[2];
+        ok = fread(addr_len, sizeof(addr_len), 1, fp) == 1 && addr_len[1] <= FX2_LOAD_CHUNK;
+        if (!ok)
+            break;
+
+        Fx2Chunk chunk;
+        chunk.address = addr_len[0];
+        chunk.data.resize(addr_len[1]);
+        ok = fread(chunk.data.data(), 1, addr_len[1], fp) == addr_len[1];
+        if (ok)
+            m_chunks.push_back(chunk);
+    }
+
+    fclose(fp);
+
+    if (ok && calc_fingerprint() != header.fingerprint)
+    {
+        fprintf(stderr, "FX2 firmware cache %s is corrupt - ignoring\n", blob_file.c_str());
+        ok = false;
+    }
+
+    if (!ok)
+        m_chunks.clear();
+    else
+        m_fingerprint = header.fingerprint;
+
+    return ok;
+}
+
+
+bool Fx2Firmware::write_blob(const std::string &blob_file, uint64_t hex_size, int64_t hex_mtime) const
+{
+    // write to a temporary and rename so a concurrent reader never sees a partial blob
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+    std::string tmp_file = blob_file + suffix;
+
+    FILE *fp = fopen(tmp_file.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    struct fx2_blob_header_s header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FX2_BLOB_MAGIC, sizeof(header.magic));
+    header.version = FX2_BLOB_VERSION;
+    header.nchunks = m_chunks.size();
+    header.hex_size = hex_size;
+    header.hex_mtime = hex_mtime;
+    header.fingerprint = m_fingerprint;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    int i;
+    for (i=0; ok && i<nchunks(); i++)
+    {
+        uint16_t addr_len[2] = { m_chunks[i].address, (uint16_t)m_chunks[i].data.size() };
+        ok = fwrite(addr_len, sizeof(addr_len), 1, fp) == 1 &&
+            fwrite(m_chunks[i].data.data(), 1, addr_len[1], fp) == addr_len[1];
+    }
+
+    if (fclose(fp) != 0)
+        ok = false;
+
+    if (ok && rename(tmp_file.c_str(), blob_file.c_str()) < 0)
+        ok = false;
+
+    if (!ok)
+        unlink(tmp_file.c_str());
+
+    return ok;
+}
+
+
+uint64_t Fx2Firmware::calc_fingerprint(void) const
+{
+    // FNV-1a 64 over addresses, lengths and data
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    int i;
+    for (i=0; i<nchunks(); i++)
+    {
+        const Fx2Chunk &chunk = m_chunks[i];
+        uint8_t addr_len[4] = { (uint8_t)(chunk.address >> 8), (uint8_t)chunk.address,
+                                (uint8_t)(chunk.data.size() >> 8), (uint8_t)chunk.data.size() };
+
+        unsigned j;
+        for (j=0; j<sizeof(addr_len); j++)
+            hash = (hash ^ addr_len[j]) * 0x100000001b3ULL;
+        for (j=0; j<chunk.data.size(); j++)
+            hash = (hash ^ chunk.data[j]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+
+void Fx2Firmware::find_signature(void)
+{
+    m_signature.clear();
+
+    if (nchunks() == 0)
+        return;
+
+    // start of the image (reset vector) and end of the code: differ between almost any two builds
+    const Fx2Chunk &first = m_chunks.front();
+    const Fx2Chunk &last = m_chunks.back();
+    int first_len = first.data.size() < FX2_SIGNATURE_LEN ? first.data.size() : FX2_SIGNATURE_LEN;
+    int last_len = last.data.size() < FX2_SIGNATURE_LEN ? last.data.size() : FX2_SIGNATURE_LEN;
+
+    Fx2Chunk head;
+    head.address = first.address;
+    head.data.assign(first.data.begin(), first.data.begin() + first_len);
+    m_signature.push_back(head);
+
+    Fx2Chunk tail;
+    tail.address = last.address + last.data.size() - last_len;
+    tail.data.assign(last.data.end() - last_len, last.data.end());
+    m_signature.push_back(tail);
+
+    // windows spread across every chunk so a build differing only in the middle is noticed.
+    // Where in each part of a chunk comes from the fingerprint: fixed for an image, different
+    // between images.
+    uint64_t bits = m_fingerprint;
+    int i, k;
+    for (i=0; i<nchunks(); i++)
+    {
+        const Fx2Chunk &chunk = m_chunks[i];
+        int size = chunk.data.size();
+        if (size <= FX2_SIGNATURE_LEN && (i == 0 || i == nchunks() - 1))
+            continue; // all in the head or tail already
+
+        int nsamples = size >= FX2_SAMPLES_PER_CHUNK * FX2_SIGNATURE_LEN ? FX2_SAMPLES_PER_CHUNK : 1;
+        int part = size / nsamples;
+        int len = part < FX2_SIGNATURE_LEN ? part : FX2_SIGNATURE_LEN; // small chunks (vectors): all of it
+
+        for (k=0; k<nsamples; k++)
+        {
+            int offset = k * part + (int)(bits % (part - len + 1));
+            bits = (bits >> 7) | (bits << 57);
+
+            Fx2Chunk sample;
+            sample.address = chunk.address + offset;
+            sample.data.assign(chunk.data.begin() + offset, chunk.data.begin() + offset + len);
+            m_signature.push_back(sample);
+        }
+    }
+
+    // USB device descriptor: VID, PID and bcdDevice (firmware version)
+    for (i=0; i<nchunks(); i++)
+    {
+        const std::vector<uint8_t> &d = m_chunks[i].data;
+        unsigned j;
+        for (j=0; j + 18 <= d.size(); j++)
+        {
+            // bLength 18, DEVICE, bcdUSB 1.1 or 2.0, bMaxPacketSize0 64, 1 or 2 configurations
+            if (d[j] == 18 && d[j+1] == 0x01 && d[j+3] <= 0x02 && d[j+7] == 64 && (d[j+17] == 1 || d[j+17] == 2))
+            {
+                Fx2Chunk descriptor;
+                descriptor.address = m_chunks[i].address + j;
+                descriptor.data.assign(d.begin() + j, d.begin() + j + 18);
+                m_signature.push_back(descriptor);
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef _FX2FIRMWARE_H
+#define _FX2FIRMWARE_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string>
+#include <vector>
+
+
+// FX2 programmer firmware as a list of RAM load chunks ready to send.
+//
+// Parsing the hex file and reshaping it is done once: the result is cached in a binary blob
+// next to the hex file (<hex file>.blob, host byte order) and reused while the hex file's
+// size and mtime are unchanged. If the blob can't be written (read only config dir) the hex
+// file is simply parsed every time.
+//
+// Signature regions (start and end of the image, a few windows in every chunk, the USB device
+// descriptor) are small parts of the image that can be read back from FX2 RAM to tell if this
+// firmware is already loaded.
+
+#define FX2_LOAD_CHUNK          4096    // bytes per Firmware Load request (usbfs control limit)
+#define FX2_SIGNATURE_LEN       16      // max bytes read back per region
+#define FX2_SAMPLES_PER_CHUNK   4       // windows read back from each chunk
+
+#define FX2_BLOB_MAGIC          "FX2BLOB1"
+#define FX2_BLOB_VERSION        1
+
+
+struct Fx2Chunk
+{
+    uint16_t address;
+    std::vector<uint8_t> data;
+};
+
+
+class Fx2Firmware
+{
+    std::vector<Fx2Chunk> m_chunks;
+    std::vector<Fx2Chunk> m_signature;
+    uint64_t m_fingerprint;
+
+    bool read_hex(const std::string &hex_file);
+    bool read_blob(const std::string &blob_file, uint64_t hex_size, int64_t hex_mtime);
+    bool write_blob(const std::string &blob_file, uint64_t hex_size, int64_t hex_mtime) const;
+
+    uint64_t calc_fingerprint(void) const;
+    void find_signature(void);
+
+  public:
+    Fx2Firmware();
+
+    bool load(const std::string &hex_file);
+
+    int nchunks(void) const { return m_chunks.size(); }
+    const Fx2Chunk &chunk(int i) const { return m_chunks[i]; }
+    int size(void) const;
+
+    int nsignatures(void) const { return m_signature.size(); }
+    const Fx2Chunk &signature(int i) const { return m_signature[i]; }
+
+    uint64_t fingerprint(void) const { return m_fingerprint; }
+};
+
+#endif
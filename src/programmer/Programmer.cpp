@@ -20,19 +20,31 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
 #include <memory>
+#include <map>
 //#include <stdexcept>
 
 #include "Programmer.h"
 
 #include "HexFileFormat.h"
 #include "HierINIReader.h"
-#include "usb.h"
-#include "fx2.h"
+#include "SwdProtocol.h"
+#include "Transport.h"
+#include "SwdQueue.h"
+#include "SwdFrame.h"
+#include "swdreply.h"
 #include "utils.h"
+#include "usbtrace.h"
+#include "latency.h"
+#include "usbtimeout.h"
+#include "SpcTiming.h"
+#include "FlashJournal.h"
+#include "FlashPlan.h"
+#include "psoc_loader.h"
 
 
 #define VID_CYPRESS     0x04B4
@@ -45,6 +57,11 @@
 #define DEFAULT_FX2_PID_UNCONFIGURED    PID_PROG_DEVKIT5_UNCONFIGURED
 #define DEFAULT_FX2_VID_CONFIGURED      VID_CYPRESS
 #define DEFAULT_FX2_PID_CONFIGURED      PID_PROG_DEVKIT5_CONFIGURED
+#define DEFAULT_TRANSPORT               "usb"
+
+// SRAM loader: how long it may take to start, poll interval when the row time isn't known yet
+#define LOADER_START_TIMEOUT_MS         50
+#define LOADER_DEFAULT_POLL_US          2000
 
 
 //#define VID_ANY         -1
@@ -54,91 +71,26 @@
 //#define CTRL_OUT  (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT)
 
 
-// SWD Packet Header definitions
-#define APACC_ADDR_WRITE         0x8B
-#define APACC_DATA_READ          0x9F
-#define APACC_CTRLSTAT_WRITE     0xA3
-#define APACC_DATA_WRITE         0xBB
-
-#define DPACC_READBUFF_WRITE     0x99
-#define DPACC_IDOCDE_READ        0xA5
-#define DPACC_CTRLSTAT_WRITE     0xA9
-#define DPACC_SELECT_WRITE       0xB1
-
-#if 0
-#define PORT_ACQUIRE_KEY_HEADER  0x99
-#define TESTMODE_ADDRESS_HEADER  0x8B
-#define TESTMODE_KEY_HEADER      0xBB
-#endif
+// number of SPC status polls kept in flight while waiting (async transport only)
+#define SPC_POLL_DEPTH        3
 
+// longest SPC data read (Read Multi Bytes, 256 bytes)
+#define SPC_MAX_READ_LEN      256
 
-// FIXME: where did TIMEOUT value come from !?
-#define SPC_POLL_TIMEOUT      8404
-#define SPC_STATUS_DATA_READY 0x01
-#define SPC_STATUS_IDLE       0x02
+// most status reads put ahead of speculative SPC data reads (SPC_cmd_read_fused)
+#define SPC_MAX_READ_PAD      64
 
 
 // each addr/data cmd is 5 bytes each (1 cmd, 4 data)
-// Longest request relates to writing 288 bytes = 288 * 5 = 1440 so allow 2048
-#define REQUEST_MAX_LEN 2048
-#define REPLY_MAX_LEN 2048
+// Longest single Request relates to writing 288 bytes = 288 * 5 = 1440 so allow 2048
+// (SwdQueue splits longer sequences across transfers)
+#define REQUEST_MAX_LEN SWD_QUEUE_MAX_REQUEST_LEN
+#define REPLY_MAX_LEN SWD_QUEUE_MAX_REPLY_LEN
 
 
 #define EPADDR_BULK_OUT 0x02 
 #define EPADDR_BULK_IN  0x84 
 
-// System Performance Controller (SPC)
-
-#define REG_SPC_CPU_DATA        0x40004720
-#define REG_SPC_DMA_DATA        0x40004721
-#define REG_SPC_STATUS          0x40004722
-
-#define SPC_CMD_LOAD_BYTE           0x00
-#define SPC_CMD_LOAD_MULTI_BYTE     0x01
-#define SPC_CMD_LOAD_ROW            0x02
-#define SPC_CMD_READ_BYTE           0x03
-#define SPC_CMD_READ_MULTI_BYTE     0x04
-#define SPC_CMD_WRITE_ROW           0x05
-#define SPC_CMD_WRITE_NVL           0x06
-// PSoC TRM 50235 Ch 44.3 suggest 0x05 erases first then writes but 0x07 only writes
-#define SPC_CMD_PROG_ROW            0x07
-#define SPC_CMD_ERASE_SECTOR        0x08
-#define SPC_CMD_ERASE_ALL           0x09
-#define SPC_CMD_READ_HIDDEN_ROW     0x0A
-#define SPC_CMD_PROTECT             0x0B
-#define SPC_CMD_GET_CHECKSUM        0x0C
-#define SPC_CMD_GET_TEMPERATURE     0x0E
-#define SPC_CMD_READ_NVL_VOL_BYTE   0x10
-
-#define SPC_KEY1                0xb6
-#define SPC_KEY2                0xd3
-
-#define SPC_NV_AID_FLASH_START  0x00
-#define SPC_NV_AID_FLASH_END    0x3E
-#define SPC_NV_AID_FLASH_ALL    0x3F
-#define SPC_NV_AID_EEPROM       0x40
-#define SPC_NV_AID_CONFIG       0x80
-#define SPC_NV_AID_WOL          0xF8
-
-
-#define TEST_MODE_KEY_REGISTER  0x40050210
-#define TEST_MODE_KEY           0xEA7E30A9
-
-
-//#define CONFIG_ADDRESS_OFFSET   0x00800000
-
-// ACK response is stored as a byte. Possible ACK values are:
-//  0x01 - SWD_OK_ACK (SUCCESS)
-//  0x02 - SWD_WAIT_ACK
-//  0x04 - SWD_FAULT_ACK
-//  0x1x - Timeout (T_testmode exceeded) - treat same as FAULT_ACK
-// reply returned by USB interface. ACK may be LSbit. What are bits 5,6
-#define REPLY_OK                    0x21
-#define REPLY_XX1                   0x24
-
-#define REPLY_JTAGID_MATCHED        0x31
-#define REPLY_JTAGID_NOMATCH        0x27
-// also get 0x31, 0x37
 
 //--------
 
@@ -168,13 +120,18 @@ class Program
 
 static int debug = 1;
 
+// fixed sequences, built at compile time (SwdFrame.h)
+static constexpr SwdFrame<30> FRAME_LINE_RESET = swd_frame_line_reset();
+static constexpr SwdFrame<11 * SWD_FRAME_WRITE_LEN> FRAME_DAP_SETUP = swd_frame_dap_setup();
+static constexpr SwdFrame<SWD_FRAME_WRITE_LEN + 2 * SWD_FRAME_READ_LEN> FRAME_SPC_STATUS = swd_frame_spc_status();
+
 // ========================
 
 class Request
 {
     int m_len;
     uint8_t m_ep_addr;
-    uint8_t m_data[REQUEST_MAX_LEN];
+    uint8_t *m_data;    // transport pool buffer, REQUEST_MAX_LEN
 
   public:
     uint32_t m_debug;
@@ -183,10 +140,13 @@ class Request
   public:
     Request(uint8_t ep_addr);
 
+    bool attach(Transport *transport);
+    void detach(Transport *transport);
     void reset(void);
     inline int length(void) { return m_len;}; // TEMP
-    bool send(libusb_device_handle *dev_handle);
-    bool clear_stall(libusb_device_handle *dev_handle);
+    inline const uint8_t *data(void) const { return m_data; }
+    bool send(Transport *transport);
+    bool clear_stall(Transport *transport);
 
 
     inline void apacc_addr_write(uint32_t addr) { c1d4(APACC_ADDR_WRITE, addr); }
@@ -202,6 +162,7 @@ class Request
     void c1(uint8_t cmd);
     void c1d4(uint8_t cmd, uint32_t data);
     void raw_hex(const char *hexstr);
+    void frame(const uint8_t *bytes, int len);
 };
 
 
@@ -211,18 +172,24 @@ class Reply
 {
     uint8_t m_ep_addr;
     int m_len;
-    uint8_t *m_data;
+    uint8_t *m_data;    // transport pool buffer, REPLY_MAX_LEN
     int m_head;
 
   public:
     uint32_t m_debug;
 
-    Reply(uint8_t ep_addr);
+    Reply(uint8_t ep_addr=EPADDR_BULK_IN);
     ~Reply();
 
+    bool attach(Transport *transport);
+    void detach(Transport *transport);
+
 //    void set_data(uint8_t *data, int len);
-    bool receive(libusb_device_handle *dev_handle);
-    bool clear_stall(libusb_device_handle *dev_handle);
+    bool receive(Transport *transport);
+    inline uint8_t *buffer(void) { return m_data; }
+    inline int capacity(void) const { return REPLY_MAX_LEN; }
+    void received(int len);
+    bool clear_stall(Transport *transport);
 
     bool pop_ok(int n=1);
     bool pop_b4_ok(uint8_t *data);
@@ -233,14 +200,86 @@ class Reply
 // ========================
 
 
+// Records the time spent in a scope (transport clock) to a latency histogram
+
+class OpTimer
+{
+    const Transport *m_transport;
+    int m_op;
+    uint64_t m_start_ns;
+
+  public:
+    OpTimer(const Transport *transport, int op) : m_transport(transport), m_op(op), m_start_ns(transport->clock_ns()) {}
+    ~OpTimer() { latency_record(m_op, m_transport->clock_ns() - m_start_ns); }
+};
+
+
+// ========================
+
+
 // contains programmer state: (FIXME excluding other things .. maybe adjust this. It was used to hide impl)
 struct programmer_priv_s
 {
     Request request;
     Reply   reply;
-    libusb_device_handle * dev_handle;
+    Transport *transport;
+
+    SwdQueue queue;
+
+    Request status_request;
+    Reply   poll_replies[SPC_POLL_DEPTH];
+
+    bool spc_idle;  // SPC was seen idle and nothing has been sent to it since
+    std::map<uint32_t, int> spc_read_pad; // cmd << 16 | len -> status reads to cover SPC busy time
+
+    SwdQueue row_queue;     // next LOAD_ROW, encoded while the SPC programs the current row
+    int row_queue_len;
+
+    SpcTiming spc_timing;
+    bool spc_pending;       // command sent, completion not yet seen by SPC_wait_for_status
+    uint32_t spc_pending_key;
+    uint64_t spc_start_ns;  // transport clock just before it was sent
+
+    struct progress_meter_s progress;
+
+    programmer_priv_s() : request(EPADDR_BULK_OUT), reply(EPADDR_BULK_IN), transport(NULL),
+                          status_request(EPADDR_BULK_OUT), spc_idle(false), row_queue_len(0),
+                          spc_pending(false), spc_pending_key(0), spc_start_ns(0)
+    {
+        progress_init(&progress, NULL, NULL, PROGRESS_DEFAULT_INTERVAL_MS);
+    }
+
+    void spc_sent(uint32_t key, uint64_t start_ns)
+    {
+        spc_idle = false;
+        spc_pending = true;
+        spc_pending_key = key;
+        spc_start_ns = start_ns;
+    }
+
+    // Transfer buffers come from the transport (DMA-able where the backend supports it)
+    // so can only be attached while it is open.
+    bool attach_buffers(void)
+    {
+        bool ok = request.attach(transport) && reply.attach(transport) && status_request.attach(transport);
+        for (int i=0; ok && i<SPC_POLL_DEPTH; i++)
+            ok = poll_replies[i].attach(transport);
+        if (ok)
+            ok = queue.attach(transport);
+        if (!ok)
+            detach_buffers();
+        return ok;
+    }
 
-    programmer_priv_s() : request(EPADDR_BULK_OUT), reply(EPADDR_BULK_IN), dev_handle(NULL) {}
+    void detach_buffers(void)
+    {
+        queue.detach(transport);
+        for (int i=0; i<SPC_POLL_DEPTH; i++)
+            poll_replies[i].detach(transport);
+        status_request.detach(transport);
+        reply.detach(transport);
+        request.detach(transport);
+    }
 };
 
 
@@ -254,6 +293,14 @@ Programmer::Programmer()
     , m_debug(0)
     , m_devdata(0)
     , m_fx2_config_file()
+    , m_config_filepath()
+    , m_transport_name()
+    , m_trace_file()
+    , m_job_timeout_ms(0)
+    , m_device_id()
+    , m_flash_loader(false)   // experimental (psoc_loader.h)
+    , m_flash_journal(true)
+    , m_flash_write_retries(FLASH_WRITE_DEFAULT_RETRIES)
     , m_vid_unconfigured(0)
     , m_pid_unconfigured(0)
     , m_vid_configured(0)
@@ -290,6 +337,28 @@ bool Programmer::read_config(std::string config_path, std::string config_filenam
 
     std::string Programmer_Config_Section = "Programmer";
 
+    m_config_filepath = config_filepath;
+
+    if (m_transport_name.length() == 0) // not overridden (eg from command line)
+        m_transport_name = reader.Get(Programmer_Config_Section, "transport", DEFAULT_TRANSPORT);
+
+    if (m_trace_file.length() == 0)
+        m_trace_file = reader.Get(Programmer_Config_Section, "trace_file", "");
+
+    if (m_job_timeout_ms == 0)
+        m_job_timeout_ms = reader.GetInteger(Programmer_Config_Section, "job_timeout_ms", 0);
+
+    m_flash_loader = reader.GetBoolean(Programmer_Config_Section, "flash_loader", false);
+    m_flash_journal = reader.GetBoolean(Programmer_Config_Section, "flash_journal", true);
+    m_flash_write_retries = reader.GetInteger(Programmer_Config_Section, "flash_write_retries", FLASH_WRITE_DEFAULT_RETRIES);
+
+    usb_timeout_set_limits(USB_TIMEOUT_BULK,
+        reader.GetInteger(Programmer_Config_Section, "bulk_timeout_min_ms", USB_TIMEOUT_BULK_MIN_MS),
+        reader.GetInteger(Programmer_Config_Section, "bulk_timeout_max_ms", USB_TIMEOUT_BULK_MAX_MS));
+    usb_timeout_set_limits(USB_TIMEOUT_CONTROL,
+        reader.GetInteger(Programmer_Config_Section, "control_timeout_min_ms", USB_TIMEOUT_CONTROL_MIN_MS),
+        reader.GetInteger(Programmer_Config_Section, "control_timeout_max_ms", USB_TIMEOUT_CONTROL_MAX_MS));
+
     m_fx2_config_file = config_path + std::string("/") + reader.Get(Programmer_Config_Section, "fx2_config_file", DEFAULT_FX2_CONFIG_FILE); // FIXME: pathcat
     m_vid_unconfigured = reader.GetInteger(Programmer_Config_Section, "VID_unconfigured", DEFAULT_FX2_VID_UNCONFIGURED);
     m_pid_unconfigured = reader.GetInteger(Programmer_Config_Section, "PID_unconfigured", DEFAULT_FX2_PID_UNCONFIGURED);
@@ -319,7 +388,7 @@ int Programmer::open(std::string config_path, std::string config_filename, Devic
     }
 #endif
 
-    if (m_priv->dev_handle != NULL)
+    if (m_priv->transport != NULL)
     {
         fprintf(stderr, "Device already open\n");
         return SUCCESS;
@@ -331,13 +400,36 @@ int Programmer::open(std::string config_path, std::string config_filename, Devic
         return FAILURE;
     }
 
+    // Whole job (including loading the FX2 firmware) must finish by then. Every transfer
+    // timeout is capped at the time remaining, so a faulty board fails in bounded time.
+    if (m_job_timeout_ms > 0)
+        usb_deadline_set(m_job_timeout_ms);
+
+    m_priv->transport = Transport::create(m_transport_name, EPADDR_BULK_OUT, EPADDR_BULK_IN, m_devdata, m_config_filepath);
+    if (m_priv->transport == NULL)
+        return FAILURE;
+
+    // several programmers may be running at once: one trace each
+    std::string trace_file = m_trace_file;
+    if (m_device_id.length() > 0)
+    {
+        if (!m_priv->transport->select_device(m_device_id))
+        {
+            delete m_priv->transport;
+            m_priv->transport = NULL;
+            return FAILURE;
+        }
+
+        if (trace_file.length() > 0)
+            trace_file += "." + m_device_id;
+    }
+
 
     int i;
     for (i=0; i<2; i++) // try twice
     {
         fprintf(stderr, "Opening configured device 0x[%04x:%04x]...\n", m_vid_configured, m_pid_configured);
-        m_priv->dev_handle = open_device(m_vid_configured, m_pid_configured, 1, 0, 0); // vid, pic, config, interface, alternate
-        if (m_priv->dev_handle)
+        if (m_priv->transport->open(m_vid_configured, m_pid_configured))
             break;
 
         if (!m_programmer_configured)
@@ -346,10 +438,49 @@ int Programmer::open(std::string config_path, std::string config_filename, Devic
         if (i > 0)
         {
             fprintf(stderr, "Failed to configure programmer\n");
+            delete m_priv->transport;
+            m_priv->transport = NULL;
             return FAILURE;
         }
     }
 
+    if (!m_priv->attach_buffers())
+    {
+        fprintf(stderr, "Failed to allocate transfer buffers\n");
+        m_priv->transport->close();
+        delete m_priv->transport;
+        m_priv->transport = NULL;
+        return FAILURE;
+    }
+
+    // Trace starts once the configured programmer is open (FX2 firmware load is not traced)
+    if (trace_file.length() > 0 && usbtrace_open(trace_file.c_str(), m_priv->transport->name()))
+    {
+        fprintf(stderr, "Tracing USB transfers to %s\n", trace_file.c_str());
+        trace_mark("open");
+    }
+
+    // SPC command times from previous runs on this device type and transport (missing is fine)
+    m_priv->spc_timing.clear();
+    m_spc_timing_file.clear();
+    if (m_devdata && m_devdata->name.length() > 0)
+    {
+        m_spc_timing_file = config_path + std::string("/") + m_devdata->name + "." + m_priv->transport->name() + ".spc_timing"; // FIXME: pathcat
+        m_priv->spc_timing.load(m_spc_timing_file);
+    }
+
+    // where a flash write got to, so an interrupted one can resume (FlashJournal.h)
+    m_flash_journal_file.clear();
+    if (m_flash_journal && m_devdata && m_devdata->name.length() > 0)
+    {
+        std::string programmer_id;
+        for (size_t i=0; i<m_device_id.length(); i++)
+            programmer_id += isalnum((unsigned char)m_device_id[i]) ? m_device_id[i] : '_';
+
+        m_flash_journal_file = config_path + std::string("/") + m_devdata->name + "." + m_priv->transport->name()
+            + (programmer_id.length() ? "." + programmer_id : "") + ".journal"; // FIXME: pathcat
+    }
+
 #if 0
     // instantiate programmable device info
     // Note: This is clearly a hack but I've only got one device for now...
@@ -373,10 +504,31 @@ int Programmer::open(std::string config_path, std::string config_filename, Devic
 void Programmer::close()
 {
     fprintf(stderr,"CLOSE\n");
-    if (m_priv->dev_handle)
-        close_device(m_priv->dev_handle, 0);
 
-    m_priv->dev_handle = NULL;
+    if (m_priv->transport)
+    {
+        trace_mark("close");
+        m_priv->detach_buffers();
+        m_priv->transport->close();
+        delete m_priv->transport;
+    }
+
+    usbtrace_close();
+
+    if (usb_deadline_passed())
+        fprintf(stderr, "Job deadline (%u ms) exceeded - device rejected\n", m_job_timeout_ms);
+    usb_deadline_clear();
+
+    m_priv->transport = NULL;
+    m_priv->spc_idle = false;
+    m_priv->spc_pending = false;
+
+    // only an optimisation: can't save, relearn next time
+    if (m_spc_timing_file.length() > 0 && m_priv->spc_timing.dirty())
+    {
+        if (m_debug & DEBUG_SPC) m_priv->spc_timing.dump(stderr);
+        m_priv->spc_timing.save(m_spc_timing_file);
+    }
 
     if (m_devdata) delete(m_devdata); // FIXME: who owns/frees this
     m_devdata = NULL;
@@ -391,17 +543,22 @@ bool Programmer::read_device(AppData *appdata, uint32_t flags)
 
     bool rc;
 
+    trace_mark("read_jtag_id");
     appdata->device_id = get_jtag_id();
 
+    trace_mark("read_wol");
     rc = NV_WOL_read(appdata);
     if (!rc) return false;
 
+    trace_mark("read_device_config");
     rc = NV_device_config_read(appdata);
     if (!rc) return false;
 
+    trace_mark("read_flash");
     rc = NV_flash_read(appdata, config_trim_flash); // code and config
     if (!rc) return false;
 
+    trace_mark("read_checksum");
     rc = NV_flash_checksum(appdata); // stores checksum in appdata
 
     uint32_t cksum = appdata->calc_checksum(false);
@@ -410,9 +567,11 @@ bool Programmer::read_device(AppData *appdata, uint32_t flags)
     if (cksum != appdata->checksum)
         fprintf(stderr, "Flash checksum: 0x%02x, calculated checksum: 0x%02x\n", appdata->checksum, cksum);
 
+    trace_mark("read_protection");
     rc = NV_protection_read(appdata);
     if (!rc) return false;
 
+    trace_mark("read_eeprom");
     rc = NV_eeprom_read(appdata, config_trim_eeprom);
     if (!rc) return false;
 
@@ -422,25 +581,29 @@ bool Programmer::read_device(AppData *appdata, uint32_t flags)
 
 bool Programmer::erase_flash(void)
 {
-    return NV_erase_flash();
+    trace_mark("erase");
+    progress_phase(PROGRESS_ERASE, 1, 0);
+    bool rc = NV_erase_flash();
+    if (rc) progress_rows(1, 0);
+    progress_phase_end();
+    return rc;
 }
 
 
-bool Programmer::write_device(const AppData *appdata)
+bool Programmer::write_device(const AppData *appdata, uint32_t flags)
 {
     fprintf(stderr,"Note: WOL/device_config writes are disabled\n");
     // Assume checksum ok !?
     // TODO: Check device_id matches (file vs actual device)
 
     bool rc;
-#if 0
-    NV_erase_flash();  // FIXME: could optionally just erase written blocks
-                        // using CMD 0x05 in flash_write which self erases
-    return true;
-#endif
-    rc = NV_flash_write(appdata); // code and config. Note erases as it goes (but just written locations)
+    trace_mark("write_flash");
+    rc = NV_flash_write(appdata, flags); // code and config. Erases what it needs to (FlashPlan.h)
     if (!rc) return false;
 
+    if (flags & WR_PLAN_ONLY)
+        return true;
+
 
     if (appdata->protection->length() == 0)
         fprintf(stderr,"Note: protection memory remains unchanged (ie not cleared)\n");
@@ -452,9 +615,11 @@ bool Programmer::write_device(const AppData *appdata)
         fprintf(stderr,"Note: protection memory write is disabled (code not tested)\n");
 #endif
 
+    trace_mark("write_wol");
     rc = NV_WOL_write(appdata);
     if (!rc) return false;
 
+    trace_mark("write_device_config");
     rc = NV_device_config_write(appdata);
     if (!rc) return false;
 
@@ -499,221 +664,517 @@ std::string Programmer::verify_status_string(uint32_t match_status)
 }
 
 
-uint32_t Programmer::verify_device(const AppData *file_appdata, uint32_t flags)
+uint32_t Programmer::verify_device(const AppData *file_appdata, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches)
 {
-    // flags:  how to handle extra data sets (eg eeprom/protection etc) from device that are not in file data and non-zero
-    // return bitmask of mismatches
-    
-    assert(0 && "TO DO");
-    uint32_t match_status;
+    // Each region is read back in chunks and compared with the file as it arrives, nothing of
+    // the device is kept. Stops at the first region that differs unless VR_CONTINUE.
+    // flags: VR_xxx. Only what the file has is compared (FIXME: non blank device data the file
+    // lacks, eg EEPROM, isn't checked).
+    // return bitmask of mismatches. mismatches (optional): each byte that differs
 
     if (!file_appdata) return VERIFY_MISSING_FILE_DATA;
 
-    AppData device_appdata;
-    uint32_t read_dev_flags = 0; // FIXME correct !?
-
-    bool rc = read_device(&device_appdata, read_dev_flags);
-    if (!rc) return VERIFY_DEVICE_READ_FAILED;
+    uint32_t match_status = VERIFY_MATCH;
+    bool stop = !(flags & VR_CONTINUE);
 
-    // compare code and config via checksum. if checksum mismatches check code and config by length/byte-by-byte if both exist
-    if (file_appdata->checksum != device_appdata.checksum)
+    // compare jtag_id to relevant field in metadata. Ignore rest of metadata
+    trace_mark("verify_jtag_id");
+    uint32_t jtag_id = get_jtag_id();
+    if (file_appdata->device_id != jtag_id)
     {
-        // For now:
-        match_status |= (VERIFY_MISMATCH_CODE | VERIFY_MISMATCH_CONFIG);
-        // FIXME: more checks to distinguish CODE and CONFIG mismatch
+        fprintf(stderr, "verify: jtag id: file 0x%08x, device 0x%08x\n", file_appdata->device_id, jtag_id);
+        match_status |= VERIFY_MISMATCH_JTAGID;
+        if (stop) return match_status;
     }
 
-    // compare protection, eeprom byte for byte. missing data assume == 0
-    // FIXME
-
     // compare security_WOL, devconfig
-    if (file_appdata->security_WOL != device_appdata.security_WOL)
+    trace_mark("verify_wol");
+    uint32_t wol, device_config;
+    if (!NV_read_b4(SPC_NV_AID_WOL, &wol) || !NV_read_b4(SPC_NV_AID_CONFIG, &device_config))
+        return match_status | VERIFY_DEVICE_READ_FAILED;
+
+    if (file_appdata->security_WOL != wol)
+    {
+        fprintf(stderr, "verify: WOL: file 0x%08x, device 0x%08x\n", file_appdata->security_WOL, wol);
         match_status |= VERIFY_MISMATCH_WOL;
+    }
 
-    if (file_appdata->device_config != device_appdata.device_config)
+    if (file_appdata->device_config != device_config)
+    {
+        fprintf(stderr, "verify: device config: file 0x%08x, device 0x%08x\n", file_appdata->device_config, device_config);
         match_status |= VERIFY_MISMATCH_DEVCONFIG;
+    }
+
+    if (match_status && stop) return match_status;
+
+    // code and config: by checksum, reading back only rows that differ, or every row (VR_STRICT)
+    trace_mark("verify_flash");
+    match_status |= NV_flash_verify(file_appdata, flags, mismatches);
+    if ((match_status && stop) || (match_status & VERIFY_DEVICE_READ_FAILED))
+        return match_status;
+
+    // protection, eeprom byte for byte where the file has data
+    if (file_appdata->protection && file_appdata->protection->length() > 0)
+    {
+        trace_mark("verify_protection");
+        match_status |= NV_protection_verify(file_appdata->protection, flags, mismatches);
+        if ((match_status && stop) || (match_status & VERIFY_DEVICE_READ_FAILED))
+            return match_status;
+    }
+
+    if (file_appdata->eeprom && file_appdata->eeprom->length() > 0)
+    {
+        trace_mark("verify_eeprom");
+        match_status |= NV_eeprom_verify(file_appdata->eeprom, flags, mismatches);
+    }
 
-    // compare jtag_id to relevant field in metadata. Ignore rest of metadata
-    if (file_appdata->device_id != device_appdata.device_id)
-        match_status |= VERIFY_MISMATCH_JTAGID;
-    
     return match_status;
 }
 
 
-
-#if 0
-bool Programmer::verify_flash(Program &prog)
+int Programmer::verify_bytes(uint32_t what, int row, int offset, const uint8_t *expected, const uint8_t *actual, int len,
+                             const char *label, int label_offset, std::vector<struct verify_mismatch_s> *mismatches)
 {
-    int prog_len = PSoC5::flash_size(); // FIXME
+    // number of bytes that differ, each added to mismatches (if any). memcmp does the work
+    // while they match, only a row that differs is looked at byte by byte.
+    // The bytes are at offset in the row, printed as label byte label_offset..
+    if (memcmp(expected, actual, len) == 0)
+        return 0;
 
-    uint8_t *data = (uint8_t *)calloc(prog_len, 1); // HACK
-    assert(data != NULL);
+    int nbad = 0;
+    int i;
+    for (i=0; i<len; i++)
+    {
+        if (expected[i] == actual[i])
+            continue;
 
-    bool rc = read_flash(data, prog_len);
-    assert(rc == true);
+        if (mismatches)
+        {
+            struct verify_mismatch_s mismatch;
+            mismatch.what = what;
+            mismatch.row = row;
+            mismatch.offset = offset + i;
+            mismatch.expected = expected[i];
+            mismatch.actual = actual[i];
+            mismatches->push_back(mismatch);
+        }
 
-    bool same = false;
-    if (memcmp(data, prog.m_data, prog.m_length) == 0)
-    {
-        same = true;
+        if (nbad++ < VERIFY_REPORT_BYTES)
+            fprintf(stderr, "verify: %s byte %d: file 0x%02x, device 0x%02x\n", label, label_offset + i, expected[i], actual[i]);
     }
 
-    free(data);
+    if (nbad > VERIFY_REPORT_BYTES)
+        fprintf(stderr, "verify: %s: %d bytes differ\n", label, nbad);
 
-    return same;
+    return nbad;
 }
-#endif
 
 
+int Programmer::verify_hexdata(uint32_t what, int row, const HexData *file_data, uint32_t address, const uint8_t *actual, int len,
+                               const char *label, std::vector<struct verify_mismatch_s> *mismatches)
+{
+    // the parts of file_data's blocks in address..address+len against the device bytes there
+    int nbad = 0;
+    int i;
+    for (i=0; i<file_data->nblocks(); i++)
+    {
+        const Block *block = (*file_data)[i];
+        uint32_t start = block->base_address > address ? block->base_address : address;
+        uint32_t end = block->base_address + block->length();
+        if (end > address + len) end = address + len;
+        if (start >= end)
+            continue;
+
+        nbad += verify_bytes(what, row, start - address, block->data.data() + (start - block->base_address),
+                             actual + (start - address), end - start, label, start - address, mismatches);
+    }
+    return nbad;
+}
 
-// Low level support routines
-// ==========================
 
-bool Programmer::configure_usb_programmer(/*const char *config_file*/)
+bool Programmer::hexdata_overlaps(const HexData *file_data, uint32_t address, int len)
 {
-    if (m_programmer_configured)
+    int i;
+    for (i=0; i<file_data->nblocks(); i++)
     {
-        // FIXME: maybe close and retry
-        fprintf(stderr, "Can't (re)configure - device already configured\n");
-        return m_programmer_configured; // true
+        const Block *block = (*file_data)[i];
+        if (block->base_address < address + len && block->base_address + block->length() > address)
+            return true;
     }
+    return false;
+}
+
 
-    if (m_priv->dev_handle)
+uint32_t Programmer::NV_flash_verify(const AppData *appdata, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches)
+{
+    // Image rows are found to match by checksum, a GET_CHECKSUM per array when all is well.
+    // Where an array doesn't match its ranges are bisected down to single rows
+    // (NV_flash_changed_rows) and only those rows are read back and compared byte by byte.
+    // VR_STRICT reads back and compares every image row instead (blank ones too: they must
+    // be blank).
+    //
+    // When config bytes hold ECC rather than data (ECC enabled) the device checksums include
+    // bytes the image doesn't have (NV_flash_checksum_covers_image): no checksums are asked
+    // for and every image row is read back, as VR_STRICT. Only code bytes are compared, the
+    // ECC bytes are the device's.
+    //
+    // Rows are read in runs of up to VERIFY_STREAM_ROWS and compared as each run arrives.
+    int code_bytes = m_devdata->flash_code_bytes_per_row;
+    int row_len = NV_flash_row_length(appdata);
+    int config_bytes = row_len - code_bytes;
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    bool strict = flags & VR_STRICT;
+
+    std::vector<uint8_t> row_map;
+    appdata->map_rows(code_bytes, config_bytes, row_map);
+    int num_rows = row_map.size();
+    if (num_rows == 0)
+        return VERIFY_MATCH;
+
+    if (num_rows > m_devdata->flash_num_arrays * rows_per_array)
     {
-        // FIXME: maybe close and retry
-        fprintf(stderr, "Shouldn't configure - device already open\n");
-        return m_programmer_configured;
+        fprintf(stderr, "verify: image has %d flash rows, device %d\n", num_rows,
+            m_devdata->flash_num_arrays * rows_per_array);
+        return VERIFY_MISMATCH_CODE;
     }
 
-    // Unconfigured device handle (not same as m_dev_handle)
-    fprintf(stderr, "Opening unconfigured device 0x[%04x:%04x]...\n", m_vid_unconfigured, m_pid_unconfigured);
-    libusb_device_handle *dev_handle = open_device(m_vid_unconfigured, m_pid_unconfigured, 1, 0, 0); // vid, pic, config, interface, alternate
-    if (!dev_handle)
+    uint8_t *row_data = (uint8_t *)malloc(row_len);
+    assert(row_data);
+
+    bool read_all = strict || !NV_flash_checksum_covers_image(appdata);
+    std::vector<int> rows;
+    if (read_all)
     {
-        fprintf(stderr, "Failed to find unconfigured programmer 0x%04x.%04x\n", m_vid_unconfigured, m_pid_unconfigured);
-        return m_programmer_configured;
+        int row;
+        for (row = 0; row < num_rows; row++)
+            rows.push_back(row);
+    }
+    else
+    {
+        progress_phase(PROGRESS_CHECKSUM, num_rows, 0);
+        bool ok = NV_flash_changed_rows(appdata, row_map, row_len, row_data, rows);
+        progress_phase_end();
+        if (!ok)
+        {
+            free(row_data);
+            return VERIFY_DEVICE_READ_FAILED;
+        }
     }
 
-    fprintf(stderr, "Configuring USB programmer\n");
+    v_uint8_t device_code(VERIFY_STREAM_ROWS * code_bytes);
+    v_uint8_t device_config(VERIFY_STREAM_ROWS * config_bytes);
 
-    int rc;
+    uint32_t match_status = VERIFY_MATCH;
+    int nread = 0;
+    int nbad_rows = 0;
+    size_t i = 0;
+    progress_phase(PROGRESS_VERIFY, rows.size(), (uint64_t)rows.size() * row_len);
+    while (i < rows.size())
+    {
+        // consecutive rows in one array
+        int first = rows[i];
+        int n = 1;
+        while (i + n < rows.size() && n < VERIFY_STREAM_ROWS && rows[i + n] == first + n &&
+               (first + n) % rows_per_array != 0)
+            n++;
+
+        if (!NV_flash_read_image_rows(first, n, row_len, device_code.data(), device_config.data()))
+        {
+            match_status |= VERIFY_DEVICE_READ_FAILED;
+            break;
+        }
+        nread += n;
+        progress_rows(nread, (uint64_t)nread * row_len);
 
-//    rc = fx2_cmd_rw_ram(dev_handle, FX2_REG_CTRLSTATUS, "01"); // FX2  force 8051 into reset
-    rc = fx2_cmd_8051_enable(dev_handle, false);
+        int k;
+        for (k=0; k<n; k++)
+        {
+            int row = first + k;
+            const uint8_t *expected = NV_flash_row_data(appdata, row, row_data, row_len);
+            char label[48];
+            int nbad;
 
-//    try {
-    HexData hexdata;
+            snprintf(label, sizeof(label), "array %d row %d code", row / rows_per_array, row % rows_per_array);
+            nbad = verify_bytes(VERIFY_MISMATCH_CODE, row, 0, expected, &device_code[k * code_bytes], code_bytes,
+                                label, 0, mismatches);
+            if (nbad) match_status |= VERIFY_MISMATCH_CODE;
 
-    if (!hexdata.read_hex(m_fx2_config_file.c_str()))
-    {
-        fprintf(stderr, "Error reading FX2 config file: %s\n", m_fx2_config_file.c_str());
-        close_device(dev_handle, 0);
+            if (config_bytes)
+            {
+                snprintf(label, sizeof(label), "array %d row %d config", row / rows_per_array, row % rows_per_array);
+                int nbad_config = verify_bytes(VERIFY_MISMATCH_CONFIG, row, code_bytes, expected + code_bytes,
+                                               &device_config[k * config_bytes], config_bytes, label, 0, mismatches);
+                if (nbad_config) match_status |= VERIFY_MISMATCH_CONFIG;
+                nbad += nbad_config;
+            }
+
+            if (nbad)
+                nbad_rows++;
+        }
+
+        i += n;
+        if (match_status && !(flags & VR_CONTINUE))
+            break;
     }
 
-    //fprintf(stderr, "read hex config file\n");
+    progress_phase_end();
+
+    fprintf(stderr, "verify: %d flash rows, %d read back (%s), %d differ%s\n", num_rows, nread,
+        read_all ? (strict ? "all" : "all, ECC") : "checksum differs", nbad_rows, i < rows.size() ? " (stopped at the first)" : "");
+
+    free(row_data);
+    return match_status;
+}
 
-    HexData *newhexdata = hexdata.reshape(2048);
 
-    int nblocks = newhexdata->nblocks();
+bool Programmer::NV_flash_read_image_rows(int first_row, int nrows, int row_len, uint8_t *code, uint8_t *config)
+{
+    // Code and config bytes of image rows first_row.. (one array) from the device, memory mapped
+    // if possible: code[nrows * code bytes], config[nrows * config bytes].
+    int code_bytes = m_devdata->flash_code_bytes_per_row;
+    int config_bytes = row_len - code_bytes;
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    uint8_t ai = first_row / rows_per_array;
+    int ri = first_row % rows_per_array;
     int i;
-    fprintf(stderr,"Configuring (%d) : ", nblocks);
-    for(i=0; i<nblocks; i++)
+
+    if (!ahb_read(m_devdata->flash_code_base_address + first_row * code_bytes, code, nrows * code_bytes))
     {
-        const Block *block = (*newhexdata)[i];
-        assert(block != NULL);
-        fprintf(stderr,"%d ", i);
-        if (debug)
+        for (i=0; i<nrows; i++)
         {
-            fprintf(stderr,"Sending...:\n");
-            block->dump(stderr, 48);
+            if (!NV_read_multi_bytes(ai, m_devdata->flash_code_base_address + (ri + i) * code_bytes,
+                                     code + i * code_bytes, code_bytes))
+                return false;
         }
-        rc = fx2_cmd_rw_ram(dev_handle, block);
     }
-    fprintf(stderr,"\n");
-    delete newhexdata;
-#if 0
+
+    if (config_bytes == 0)
+        return true;
+
+    if (m_devdata->flash_config_ahb_address != 0 &&
+        ahb_read(m_devdata->flash_config_ahb_address + first_row * config_bytes, config, nrows * config_bytes))
+        return true;
+
+    for (i=0; i<nrows; i++)
+    {
+        if (!NV_read_multi_bytes(ai, m_devdata->flash_config_base_address + (ri + i) * config_bytes,
+                                 config + i * config_bytes, config_bytes))
+            return false;
     }
-    catch (std::runtime_error& e)
+    return true;
+}
+
+
+uint32_t Programmer::NV_protection_verify(const HexData *file_protection, uint32_t flags,
+                                          std::vector<struct verify_mismatch_s> *mismatches)
+{
+    // One hidden row per array (see NV_protection_read), read only for arrays the file covers.
+    int row_len = m_devdata->flash_code_bytes_per_row;
+    int num_protection_bytes_per_array = m_devdata->flash_rows_per_array / m_devdata->flash_rows_per_protection_byte;
+    v_uint8_t data(row_len);
+    uint32_t match_status = VERIFY_MATCH;
+
+    int ai;
+    for (ai = 0; ai < m_devdata->flash_num_arrays; ai++)
     {
-        //fprintf(stderr, "Failed to read FX2 config file: %s\n", m_fx2_config_file.c_str());
-        fprintf(stderr, "Error reading FX2 config file: %s\n", e.what()); // m_fx2_config_file.c_str());
-        // FIXME: should rethrow here  and not attempt to configure again in this case
-        close_device(dev_handle, 0);
-        return false;
+        uint32_t address = HexFileFormat::PROTECTION_ADDRESS + ai * num_protection_bytes_per_array;
+        if (!hexdata_overlaps(file_protection, address, num_protection_bytes_per_array))
+            continue;
+
+        if (!SPC_cmd_read(data.data(), row_len, SPC_CMD_READ_HIDDEN_ROW, ai, 0 /* row_id */))
+        {
+            fprintf(stderr, "Failed reading protection data\n");
+            return match_status | VERIFY_DEVICE_READ_FAILED;
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "protection array %d", ai);
+        if (verify_hexdata(VERIFY_MISMATCH_PROTECTION, ai, file_protection, address, data.data(),
+                           num_protection_bytes_per_array, label, mismatches))
+        {
+            match_status |= VERIFY_MISMATCH_PROTECTION;
+            if (!(flags & VR_CONTINUE))
+                break;
+        }
     }
-#endif
 
-    // Re-enable CPU
-//    rc = fx2_cmd_rw_ram(dev_handle, FX2_REG_CTRLSTATUS, "00"); // FX2  run 8051
-    rc = fx2_cmd_8051_enable(dev_handle, true);
+    return match_status;
+}
 
 
-//    libusb_reset_device(dev_handle);
-    close_device(dev_handle, 0);
-    sleep(3); // one second isn't long enough for device to reset
+uint32_t Programmer::NV_eeprom_verify(const HexData *file_eeprom, uint32_t flags,
+                                      std::vector<struct verify_mismatch_s> *mismatches)
+{
+    // Memory mapped, VERIFY_STREAM_ROWS EEPROM rows at a time, only those the file covers.
+    int bytes_per_row = m_devdata->eeprom_bytes_per_row;
+    int nrows = m_devdata->eeprom_size / bytes_per_row;
+    v_uint8_t data(VERIFY_STREAM_ROWS * bytes_per_row);
+    uint32_t match_status = VERIFY_MATCH;
 
-    m_programmer_configured = true;
+    int first;
+    for (first = 0; first < nrows; first += VERIFY_STREAM_ROWS)
+    {
+        int n = nrows - first < VERIFY_STREAM_ROWS ? nrows - first : VERIFY_STREAM_ROWS;
+        uint32_t address = HexFileFormat::EEPROM_ADDRESS + first * bytes_per_row;
+        if (!hexdata_overlaps(file_eeprom, address, n * bytes_per_row))
+            continue;
 
-    fprintf(stderr, "Configured USB programmer\n");
+        if (!ahb_read(m_devdata->eeprom_base_address + first * bytes_per_row, data.data(), n * bytes_per_row))
+        {
+            fprintf(stderr, "Failed reading EEPROM data\n");
+            return match_status | VERIFY_DEVICE_READ_FAILED;
+        }
 
-    return m_programmer_configured;
+        int k;
+        for (k=0; k<n; k++)
+        {
+            char label[32];
+            snprintf(label, sizeof(label), "EEPROM row %d", first + k);
+            if (verify_hexdata(VERIFY_MISMATCH_EEPROM, first + k, file_eeprom, address + k * bytes_per_row,
+                               &data[k * bytes_per_row], bytes_per_row, label, mismatches))
+                match_status |= VERIFY_MISMATCH_EEPROM;
+        }
+
+        if (match_status && !(flags & VR_CONTINUE))
+            break;
+    }
+
+    return match_status;
 }
 
 
-// ==============
 
-bool Programmer::switch_to_swd(void)
+#if 0
+bool Programmer::verify_flash(Program &prog)
 {
-    // Switches the PSoC programming interface to SWD interface
-
-    // The switching sequence is implemented in JtagToSwdSequence()
-    // Device ID read (DPACC IDCODE Read) is needed to complete the switching.
-    // The Device ID code returned may be discarded.
+    int prog_len = PSoC5::flash_size(); // FIXME
 
-    // Return:
-    //  SUCCESS - Successfully switched to SWD interface
-    //  FAILURE - SWD interface switching failed 
+    uint8_t *data = (uint8_t *)calloc(prog_len, 1); // HACK
+    assert(data != NULL);
 
-    bool ok = true;
+    bool rc = read_flash(data, prog_len);
+    assert(rc == true);
 
-    if (!jtag_to_swd())  /* Initial part of the switching sequence */
+    bool same = false;
+    if (memcmp(data, prog.m_data, prog.m_length) == 0)
     {
-        fprintf(stderr,"Jtag to SWD FAILED\n");
+        same = true;
     }
-    
-    get_jtag_id();
 
-    // FIXME: set return value appropriately
+    free(data);
 
-    return ok;
+    return same;
 }
+#endif
 
 
-bool Programmer::jtag_to_swd(void)
+
+// Low level support routines
+// ==========================
+
+int Programmer::find_programmers(std::string config_path, std::string config_filename, std::vector<std::string> &ids)
 {
-    // line reset
-    //  swdio high
-    //   loop 51:
-    //     clk  Low, High
-    // send 0x9e, 0xe7
-    // line reset
-    //    ....
-    // line idle:
-    //   line reset
-    //   swdio low
-    //   loop 3:  (Dummy clocks)
-    //     clk Low, High
+    // Every attached programmer (configured or not) this config would use. Doesn't open any.
 
-    fprintf(stderr, "JTAG TO SWD\n");
-    uint8_t bmRequestType = 0xc0;
+    if (!read_config(config_path, config_filename))
+    {
+        fprintf(stderr, "Failed to read/parse config file: '%s %s'\n", config_path.c_str(), config_filename.c_str());
+        return -1;
+    }
+
+    Transport *transport = Transport::create(m_transport_name, EPADDR_BULK_OUT, EPADDR_BULK_IN, m_devdata, m_config_filepath);
+    if (transport == NULL)
+        return -1;
+
+    int n = transport->enumerate(m_vid_configured, m_pid_configured, m_vid_unconfigured, m_pid_unconfigured, ids);
+    delete transport;
+
+    return n;
+}
+
+
+bool Programmer::configure_usb_programmer(/*const char *config_file*/)
+{
+    if (m_programmer_configured)
+    {
+        // FIXME: maybe close and retry
+        fprintf(stderr, "Can't (re)configure - device already configured\n");
+        return m_programmer_configured; // true
+    }
+
+    if (m_priv->transport->is_open())
+    {
+        // FIXME: maybe close and retry
+        fprintf(stderr, "Shouldn't configure - device already open\n");
+        return m_programmer_configured;
+    }
+
+    // Loads FX2 firmware into unconfigured device (which then re-enumerates as the configured device)
+    if (!m_priv->transport->configure_programmer(m_vid_unconfigured, m_pid_unconfigured, m_fx2_config_file))
+        return m_programmer_configured;
+
+    m_programmer_configured = true;
+
+    fprintf(stderr, "Configured USB programmer\n");
+
+    return m_programmer_configured;
+}
+
+
+// ==============
+
+bool Programmer::switch_to_swd(void)
+{
+    // Switches the PSoC programming interface to SWD interface
+
+    // The switching sequence is implemented in JtagToSwdSequence()
+    // Device ID read (DPACC IDCODE Read) is needed to complete the switching.
+    // The Device ID code returned may be discarded.
+    // Note: the IDCODE read is only queued. It goes out with the caller's next queue flush.
+
+    // Return:
+    //  SUCCESS - Successfully switched to SWD interface
+    //  FAILURE - SWD interface switching failed 
+
+    bool ok = true;
+
+    if (!jtag_to_swd())  /* Initial part of the switching sequence */
+    {
+        fprintf(stderr,"Jtag to SWD FAILED\n");
+    }
+    
+    m_priv->queue.dpacc_idcode_read(NULL);
+
+    // FIXME: set return value appropriately
+
+    return ok;
+}
+
+
+bool Programmer::jtag_to_swd(void)
+{
+    // line reset
+    //  swdio high
+    //   loop 51:
+    //     clk  Low, High
+    // send 0x9e, 0xe7
+    // line reset
+    //    ....
+    // line idle:
+    //   line reset
+    //   swdio low
+    //   loop 3:  (Dummy clocks)
+    //     clk Low, High
+
+    fprintf(stderr, "JTAG TO SWD\n");
+    uint8_t bmRequestType = 0xc0;
     uint8_t reply_data[100];
     uint16_t reply_length = 0;
     int rc;
 
 #if 1
 // FIXME: Try to remove this:
-    rc = control_transfer(m_priv->dev_handle, bmRequestType, 95, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 10); // test4.766
+    rc = m_priv->transport->control_in(bmRequestType, 95, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 10); // test4.766
         // without this we normally get SPC timeout errors. Maybe some var isn't set or maybe there some timing issue
 //    usleep(20);
 
@@ -727,7 +1188,7 @@ bool Programmer::jtag_to_swd(void)
 
     m_priv->request.reset();
     //m_priv->request.raw_hex("f0f0f0f0f0f0f0f0f0f0f0f0f0e09070e0f0f0f0f0f0f0f0f0f0f0f0f0f0");
-    m_priv->request.raw_hex("F0F000000000000000000000000000000000000000000000000000000000");
+    m_priv->request.frame(FRAME_LINE_RESET.bytes, FRAME_LINE_RESET.len); // "F0F0" + 28 x "00"
     if (!send_receive()) return false;
 //    m_priv->reply.pop_ok(15);
     m_priv->reply.pop_ok(-1);
@@ -773,7 +1234,7 @@ bool Programmer::jtag_to_swd(void)
 
 #if 0
 // FIXME: Try to remove this:
-    rc = control_transfer(m_priv->dev_handle, bmRequestType, 95, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 10); // test4.766
+    rc = m_priv->transport->control_in(bmRequestType, 95, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 10); // test4.766
 
     m_priv->request.reset();
     m_priv->request.apacc_addr_write(TEST_MODE_KEY_REGISTER);
@@ -790,35 +1251,63 @@ bool Programmer::enter_programming_mode(void)
 {
 //    fprintf(stderr,"configure_target_device - START\n");
     fprintf(stderr,"enter_programming_mode - START\n");
+    trace_mark("enter_programming_mode");
+    OpTimer timer(m_priv->transport, LATENCY_ENTER_PROG_MODE);
     // Configures the PSoC device to prepare for programming
 
+    m_priv->queue.reset();
+    m_priv->spc_idle = false; // target may have been reset or replaced
+    m_priv->spc_pending = false;
+
     if (switch_to_swd() == FAILURE)
         return false;
     
-    m_priv->request.reset();
-    m_priv->request.dpacc_ctrl_write(0x50000000); // test4.823
-    m_priv->request.dpacc_select_write(0x00000000); // Clear DP Select Register  // test4.825
-    m_priv->request.apacc_ctrl_write(0x22000002); // Set 32-bit DAP transfer mode  // test4.827
+    // all in one transfer along with the IDCODE read queued by switch_to_swd()
+    // DP power up (test4.823), clear DP Select (test4.825), 32-bit DAP transfer mode (test4.827),
+    // halt CPU and activate debug, release Cortex-M3 CPU reset (test4.835), enable individual
+    // chip subsystems, IMO set to 24MHz. See swd_frame_dap_setup().
+    m_priv->queue.frame(FRAME_DAP_SETUP.bytes, FRAME_DAP_SETUP.len);
+ 
+    m_priv->queue.flush(m_priv->transport); // FIXME: ACK failures here have always been ignored
 
-    m_priv->request.apacc_addr_write(0xE000EDF0); // ..
-    m_priv->request.apacc_data_write(0xA05F0003); // Halt CPU and Activate Debug  // ..
+    //fprintf(stderr,"configure_target_device - END\n");
+    fprintf(stderr,"enter_programming_mode - END\n");
+    return true;   
+}
 
-    m_priv->request.apacc_addr_write(0x4008000C); // ..
-    m_priv->request.apacc_data_write(0x00000002); // release Cortex-M3 CPU reset  // test4.835
 
-    m_priv->request.apacc_addr_write(0x400043A0);
-    m_priv->request.apacc_data_write(0x000000BF); // enable individual chip subsystem
+void Programmer::trace_mark(const char *phase)
+{
+    // Phase boundary in the USB trace. Replay (prog_replay) reports timing per phase.
+    if (usbtrace_enabled() && m_priv->transport)
+        usbtrace_mark(m_priv->transport->clock_ns(), phase);
+}
 
-    m_priv->request.apacc_addr_write(0x40004200);
-    m_priv->request.apacc_data_write(0x00000002); // IMO set to 24MHz
- 
-    if (!send_receive()) return false;
 
-    m_priv->reply.pop_ok(-1); // FIXME
+void Programmer::set_progress(progress_fn fn, void *ctx, unsigned int interval_ms)
+{
+    progress_init(&m_priv->progress, fn, ctx, interval_ms);
+}
 
-    //fprintf(stderr,"configure_target_device - END\n");
-    fprintf(stderr,"enter_programming_mode - END\n");
-    return true;   
+
+void Programmer::progress_phase(int phase, int rows_total, uint64_t bytes_total)
+{
+    progress_begin(&m_priv->progress, phase, rows_total, bytes_total, m_priv->transport->clock_ns());
+}
+
+
+void Programmer::progress_rows(int rows_done, uint64_t bytes_done)
+{
+    // cheap unless a report is due
+    if (!m_priv->progress.fn)
+        return;
+    progress_update(&m_priv->progress, rows_done, bytes_done, m_priv->transport->clock_ns());
+}
+
+
+void Programmer::progress_phase_end(void)
+{
+    progress_end(&m_priv->progress, m_priv->transport->clock_ns());
 }
 
 
@@ -831,11 +1320,14 @@ void Programmer::exit_programming_mode(void)
 
 void Programmer::reset_cpu(void)
 {
+    trace_mark("reset");
+    m_priv->spc_idle = false;
+    m_priv->spc_pending = false;
     uint8_t reply_data[2];
     uint16_t reply_length = 0;
-    bool rc = control_transfer(m_priv->dev_handle, 0xc0, 100, 0x0001 /*wValue*/, 0, reply_data, &reply_length, 2);
+    bool rc = m_priv->transport->control_in(0xc0, 100, 0x0001 /*wValue*/, 0, reply_data, &reply_length, 2);
     usleep(100); // enough !?
-    rc = control_transfer(m_priv->dev_handle, 0xc0, 100, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 2);
+    rc = m_priv->transport->control_in(0xc0, 100, 0x0000 /*wValue*/, 0, reply_data, &reply_length, 2);
 }
 
 #if 0
@@ -861,214 +1353,954 @@ bool Programmer::NV_flash_read(AppData *appdata, bool trim)
     // Note: If extra flash is being used for ECC then we'll ens up storign ECC data in config structure. Issued ?? FIXME ??.
     // Prob just want to avoid writing it back later on.
 
-    assert(appdata != NULL);
+    assert(appdata != NULL);
+
+    if (appdata->code) delete appdata->code;
+    if (appdata->config) delete appdata->config;
+
+    appdata->code = new HexData();
+    appdata->config = new HexData();
+
+    int code_bytes_per_row = m_devdata->flash_code_bytes_per_row;
+    int config_bytes_per_row = m_devdata->flash_config_bytes_per_row;
+    int rows_per_array = m_devdata->flash_rows_per_array;
+
+    // Config bytes are only kept when they hold data (ECC disabled), so aren't read otherwise.
+    bool read_config = appdata->extra_flash_used_for_config();
+
+    // Whole arrays are read memory mapped (ahb_read) where possible, else row by row through the
+    // SPC. Code is always on the bus, config/ECC only if devices.dat says where.
+    bool code_ahb = true;
+    bool config_ahb = m_devdata->flash_config_ahb_address != 0;
+
+    v_uint8_t array_code(rows_per_array * code_bytes_per_row);
+    v_uint8_t array_config(rows_per_array * config_bytes_per_row);
+
+    v_uint8_t pcode(code_bytes_per_row); // local buffer
+    v_uint8_t pconfig(config_bytes_per_row); // local buffer
+
+    int row_len = code_bytes_per_row + (read_config ? config_bytes_per_row : 0);
+    int num_rows = m_devdata->flash_num_arrays * rows_per_array;
+    progress_phase(PROGRESS_READ, num_rows, (uint64_t)num_rows * row_len);
+
+    uint8_t ai; // array index
+    for(ai = 0; ai < m_devdata->flash_num_arrays; ai++)
+    {
+        if (code_ahb)
+        {
+            uint32_t ahb_address = m_devdata->flash_code_base_address + ai * array_code.size();
+            code_ahb = ahb_read(ahb_address, array_code.data(), array_code.size());
+            if (!code_ahb)
+                fprintf(stderr, "FLASH READ: memory mapped read failed, reading through SPC\n");
+        }
+
+        if (read_config && config_ahb)
+        {
+            uint32_t ahb_address = m_devdata->flash_config_ahb_address + ai * array_config.size();
+            config_ahb = ahb_read(ahb_address, array_config.data(), array_config.size());
+            if (!config_ahb)
+                fprintf(stderr, "FLASH READ: memory mapped config read failed, reading through SPC\n");
+        }
+
+        int ri; // row index
+        for(ri = 0; ri < rows_per_array; ri++)
+        {
+            // Code region address
+            uint32_t address_offset = ri * code_bytes_per_row;
+            uint32_t dev_address = address_offset + m_devdata->flash_code_base_address;
+
+            if (code_ahb)
+                pcode.assign(array_code.begin() + address_offset, array_code.begin() + address_offset + code_bytes_per_row);
+            else
+            {
+                pcode.assign(code_bytes_per_row, 0);
+                bool rc = NV_read_multi_bytes(ai, dev_address, pcode.data(), pcode.size());
+                if (!rc)
+                {
+                    progress_phase_end();
+                    return false;
+                }
+            }
+            appdata->code->add(HexFileFormat::FLASH_CODE_ADDRESS + address_offset, pcode);
+
+            int rows_done = ai * rows_per_array + ri + 1;
+            progress_rows(rows_done, (uint64_t)rows_done * row_len);
+
+            if (!read_config)
+                continue;
+
+            // Config region address
+            address_offset = ri * config_bytes_per_row;
+            dev_address = address_offset + m_devdata->flash_config_base_address;   // top bit set means ECC/config address space
+
+            if (config_ahb)
+                pconfig.assign(array_config.begin() + address_offset, array_config.begin() + address_offset + config_bytes_per_row);
+            else
+            {
+                pconfig.assign(config_bytes_per_row, 0);
+                bool rc = NV_read_multi_bytes(ai, dev_address, pconfig.data(), pconfig.size());
+                if (!rc)
+                {
+                    progress_phase_end();
+                    return false;
+                }
+            }
+
+            // FIXME: this ain't right. is config == program or is config == data ?
+            appdata->config->add(HexFileFormat::CONFIG_ADDRESS + address_offset, pconfig);
+        } // ri
+    } // ai
+    progress_phase_end();
+
+    if (trim)
+    {
+        if (debug) fprintf(stderr,"Untrimmed code len:%d\n",appdata->code->length());
+        appdata->code->trim();
+        appdata->config->trim();
+        if (debug) fprintf(stderr,"Trimmed code len:%d\n",appdata->code->length());
+    }
+
+    return true;
+}
+
+
+int Programmer::NV_flash_row_length(const AppData *appdata) const
+{
+    // if reading device data then it should be based on contents of ECC field in device Device Config (USER NVL) !?
+    // if writing a program then it should be based on program Device Config field
+
+    assert(appdata);
+
+    return m_devdata->flash_code_bytes_per_row
+           + (appdata->extra_flash_used_for_config() ? m_devdata->flash_config_bytes_per_row : 0);
+}
+
+
+bool Programmer::NV_flash_checksum_covers_image(const AppData *appdata) const
+{
+    // GET_CHECKSUM sums the whole row, config bytes included. With ECC enabled those are ECC
+    // the device generated and the image doesn't have, so no host sum can match.
+    return NV_flash_row_length(appdata) == m_devdata->flash_code_bytes_per_row + m_devdata->flash_config_bytes_per_row;
+}
+
+
+const uint8_t *Programmer::NV_flash_row_data(const AppData *appdata, int row, uint8_t *row_data, int row_len)
+{
+    // Code (and config if used) bytes of one row of the whole image. Either the row prepared
+    // once (gang mode) or extracted into row_data.
+
+    int code_bytes = m_devdata->flash_code_bytes_per_row;
+    int config_bytes = row_len - code_bytes;
+
+    const uint8_t *encoded = appdata->encoded_row(row, code_bytes, config_bytes);
+    if (encoded)
+        return encoded;
+
+    memset(row_data, 0, row_len);
+
+    if (appdata->code && appdata->code->length()) // optimisation only
+    {
+        // fill up 256 bytes in buffer. If no code for this area we get back a zeroed buffer
+        uint32_t hexdata_address = HexFileFormat::FLASH_CODE_ADDRESS + row * code_bytes;
+        appdata->code->extract2bin(hexdata_address, code_bytes, row_data);
+    }
+
+    if (config_bytes && appdata->config && appdata->config->length()) // optimisation only.
+    {
+        // fill up extra 32 bytes in buffer. If no code for this area we get back a zeroed buffer
+        uint32_t hexdata_address = HexFileFormat::CONFIG_ADDRESS + row * m_devdata->flash_config_bytes_per_row;
+        appdata->config->extract2bin(hexdata_address, m_devdata->flash_config_bytes_per_row, row_data + code_bytes);
+    }
+
+    return row_data;
+}
+
+
+bool Programmer::NV_flash_write(const AppData *appdata, uint32_t flags)
+{
+    // FIXME: don't write checksum that is stored at address 0x90300000 (MSB) and 0001 (LSB)
+    fprintf(stderr,"FLASH WRITE\n");
+
+    assert(appdata);
+
+    int code_len = 0;
+    if (appdata->code)
+        code_len = appdata->code->length();
+
+    int config_len = 0;
+    if (appdata->config)
+        config_len = appdata->config->length();
+
+    if (code_len == 0)
+    {
+        if (config_len == 0)
+        {
+            fprintf(stderr, "flash_write: code and config both empty. nothing to do\n");
+            return true;
+        }
+    }
+
+    // FIXME: Also need to ensure device is in correct state to receive any extra config data. ie ECCEN must be correct first)
+   // read devconfig and  check ECCEN bit
+
+    if (code_len > m_devdata->flash_code_max_size)
+    {
+        fprintf(stderr, "flash_write: too much data. Have %d expected no more than %d bytes\n", appdata->code->length(), m_devdata->flash_code_max_size);
+        return false;
+    }
+
+    if (config_len > 0 && appdata->extra_flash_used_for_config() == false)
+    {
+        fprintf(stderr,"Config data len:%d, extra_flash_used_for_config:%d\n", config_len, appdata->extra_flash_used_for_config());
+        assert("Mismatch between config usage and config data");
+    }
+
+    // assume that if we have config data it's able to be written (ie not ECC flash mode)
+
+    int num_code_rows = code_len / m_devdata->flash_code_bytes_per_row;
+    if (code_len % m_devdata->flash_code_bytes_per_row != 0) num_code_rows++;
+    
+    int num_config_rows = config_len / m_devdata->flash_config_bytes_per_row;
+    if (code_len % m_devdata->flash_config_bytes_per_row != 0) num_config_rows++;
+
+    // We have to program up to the last row with data. Counted by address, not from the byte
+    // counts above: a sparse image (bootloader at the bottom, app at the top) spans more rows
+    // than its bytes fill. The map also says which rows are blank, without extracting them.
+    std::vector<uint8_t> row_map;
+    appdata->map_rows(m_devdata->flash_code_bytes_per_row,
+        appdata->extra_flash_used_for_config() ? m_devdata->flash_config_bytes_per_row : 0, row_map);
+    int num_rows = row_map.size();
+
+#if 0
+    if (!send_c1d4_recv_ok(APACC_CTRLSTAT_WRITE, 0x22000002)) return false; // 4byte access to SRAM (only for SRAM Version for write_row)
+#endif
+
+#if 0
+#if 1
+    int narrays, remainder_rows;
+    PSoC5::program_geom(devdata->geom, code_len, &narrays, &remainder_rows);
+#else
+    int array_size = m_devdata->flash_rows_per_array * m_devdata->flash_code_bytes_per_row;
+    int narrays = code_len / array_size;
+
+    int remainder = code_len % array_size;
+    if (remainder) narrays++;
+    int remainder_rows = remainder / m_devdata->flash_code_bytes_per_row;
+    if (remainder % m_devdata->flash_code_bytes_per_row) remainder_rows++;
+#endif
+#endif
+
+    int narrays = num_rows / m_devdata->flash_rows_per_array;  // CHECK flash_rows_per_array same for main and ECC (would have to be!!)
+    int remainder_rows = num_rows % m_devdata->flash_rows_per_array;
+    if (remainder_rows) narrays++;
+
+// FIXME const int row_len = NV_flash_row_length(appdata);
+// it was defaulting to 256 but device is configured for no ECC so SPC subsystem timed out.
+    int row_len = m_devdata->flash_code_bytes_per_row;
+
+   if (appdata->extra_flash_used_for_config())
+        row_len += m_devdata->flash_config_bytes_per_row;
+
+
+    fprintf(stderr,"code_len:%d, n_code_rows:%d, config_len:%d, n_config_rows:%d, narrays:%d, remainder_rows:%d, row_len:%d\n",
+                code_len, num_code_rows, config_len, num_config_rows, narrays, remainder_rows, row_len);
+
+    assert(narrays <= m_devdata->flash_num_arrays);
+
+    uint8_t *row_data = (uint8_t *)malloc(row_len);
+    assert(row_data);
+
+    // Image rows that need writing. Differential: only those whose flash checksum differs.
+    bool differential = (flags & WR_DIFFERENTIAL) != 0;
+    if (differential && !NV_flash_checksum_covers_image(appdata))
+    {
+        fprintf(stderr, "NV_flash_write: ECC enabled, flash checksums include ECC bytes - writing all rows\n");
+        differential = false;
+    }
+    FlashPlan plan(m_devdata->flash_num_arrays, m_devdata->flash_rows_per_array, num_rows);
+    if (differential)
+    {
+        std::vector<int> changed;
+        progress_phase(PROGRESS_CHECKSUM, num_rows, 0);
+        bool ok = NV_flash_changed_rows(appdata, row_map, row_len, row_data, changed);
+        progress_phase_end();
+        if (!ok)
+        {
+            fprintf(stderr, "NV_flash_write: failed reading flash checksums\n");
+            free(row_data);
+            return false;
+        }
+
+        fprintf(stderr, "NV_flash_write: %d of %d rows differ\n", (int)changed.size(), num_rows);
+
+        // finds rows already written without a journal: one left by an earlier run is stale
+        if (m_flash_journal_file.length() > 0 && !(flags & WR_PLAN_ONLY))
+            FlashJournal::remove(m_flash_journal_file);
+
+        if (changed.empty() && !(flags & WR_PLAN_ONLY))
+        {
+            free(row_data);
+            return true;
+        }
+
+        int row;
+        size_t i;
+        for (row = 0; row < num_rows; row++)
+            plan.set_wanted(row, false);
+        for (i = 0; i < changed.size(); i++)
+            plan.set_wanted(changed[i], true);
+    }
+
+    // Rows confirmed by an earlier, interrupted run of this image aren't wanted again, once
+    // their flash checksums show they are still there (another board may have been fitted
+    // since). That run wrote into flash the plan now finds isn't blank so this one may plan
+    // differently: the journal counts image rows, not rows of a plan. A differential write
+    // finds rows already written anyway.
+    FlashJournal journal;
+    int resume_row = 0;
+    if (m_flash_journal_file.length() > 0 && !differential && !(flags & WR_PLAN_ONLY))
+    {
+        uint32_t image_id = FlashJournal::hash_init();
+        int row;
+        for (row = 0; row < num_rows; row++)
+            image_id = FlashJournal::hash(image_id, NV_flash_row_data(appdata, row, row_data, row_len), row_len);
+
+        int prev_done = journal.begin(m_flash_journal_file, image_id, num_rows, row_len);
+        if (prev_done > 0)
+        {
+            fprintf(stderr, "NV_flash_write: journal has %d of %d rows written by an earlier run\n", prev_done, num_rows);
+            if (NV_flash_rows_match(appdata, 0, prev_done, row_data, row_len))
+            {
+                for (row = 0; row < prev_done; row++)
+                    plan.set_wanted(row, false);
+                resume_row = prev_done;
+            }
+            else
+                fprintf(stderr, "NV_flash_write: flash doesn't match the journal - writing all rows\n");
+        }
+    }
+
+    // How: erases and WRITE_ROW/PROG_ROW per row (FlashPlan.h)
+    if (!NV_flash_plan(row_map, plan))
+    {
+        fprintf(stderr, "NV_flash_write: failed reading flash state\n");
+        free(row_data);
+        return false;
+    }
+
+    if (flags & WR_PLAN_ONLY)
+    {
+        plan.print(stdout);
+        free(row_data);
+        return true;
+    }
+
+    if (m_debug & DEBUG_SPC) plan.print(stderr);
+    fprintf(stderr, "NV_flash_write: %s plan, %d rows to program\n", FlashPlan::name(plan.plan()), (int)plan.rows().size());
+
+    const std::vector<int> &rows = plan.rows();
+
+    // an erase may take rows the journal had: they are in rows again and counted from 0
+    if (!plan.has_erases())
+        journal.accept(resume_row);
+
+    if (!NV_flash_erase_planned(plan))
+    {
+        fprintf(stderr, "NV_flash_write: erase failed\n");
+        free(row_data);
+        return false;
+    }
+
+    if (rows.empty())
+    {
+        // all done by an earlier run
+        free(row_data);
+        journal.finish();
+        return true;
+    }
+
+    int die_temp = get_die_temperature(); // first value post reset is wrong - discard
+    die_temp = get_die_temperature();
+
+    // A USB stall or fault part way through doesn't lose what was written: the target is
+    // acquired again, the last row confirmed is checked and writing carries on after it.
+    int nrows = rows.size();
+    progress_phase(PROGRESS_WRITE, nrows, (uint64_t)nrows * row_len);
+
+    int first = 0;
+    int attempt;
+    for (attempt = 0; ; attempt++)
+    {
+        int done = first;
+        bool ok = NV_flash_write_rows(appdata, plan, first, row_len, die_temp, row_data, &journal, &done);
+        journal.confirmed(plan.rows_done(done), true);
+        if (ok)
+            break;
+
+        if (attempt >= m_flash_write_retries || usb_deadline_passed())
+        {
+            fprintf(stderr, "NV_flash_write: failed after %d of %d rows\n", done, nrows);
+            progress_phase_end();
+            free(row_data);
+            return false; // journal kept: a rerun resumes
+        }
+
+        fprintf(stderr, "NV_flash_write: failed after %d of %d rows - recovering (retry %d of %d)\n",
+            done, nrows, attempt + 1, m_flash_write_retries);
+        trace_mark("write_flash_recover");
+
+        first = done;
+        if (!reacquire_target())
+            continue;
+
+        // the row before the failure is normally done, but check: the fault may have hit it
+        if (first > 0 && !NV_flash_rows_match(appdata, rows[first - 1], 1, row_data, row_len))
+            first--;
+
+        die_temp = get_die_temperature();
+        die_temp = get_die_temperature();
+    }
+    progress_phase_end();
+
+    free(row_data);
+    journal.finish();
+    return true;
+}
+
+
+bool Programmer::NV_flash_write_rows(const AppData *appdata, const FlashPlan &plan, int first, int row_len, int die_temp,
+                                     uint8_t *row_data, FlashJournal *journal, int *done)
+{
+    // Writes the plan's image rows rows[first..]. *done (and the journal) follow how many of rows are
+    // known to be programmed: up to where a failure happened.
+
+    // Double buffered: while the SPC programs row N, row N+1 is extracted and its LOAD_ROW
+    // encoded into a second queue. It can only be sent once the SPC is idle again (there is
+    // one row latch) but is then ready to go, and the idle poll after the load is folded into
+    // the load exchange (SPC_send_load_row).
+    const std::vector<int> &rows = plan.rows();
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    int nrows = rows.size();
+
+    *done = first;
+
+    // Preferably the CPU does all that from SRAM (NV_flash_write_loader). Whatever it didn't
+    // get done is written from here.
+    if (m_flash_loader)
+    {
+        if (NV_flash_write_loader(appdata, plan, first, row_len, die_temp, journal, done))
+            return true;
+
+        fprintf(stderr, "NV_flash_write: SRAM loader stopped after %d of %d rows, continuing through SPC\n", *done, nrows);
+        first = *done;
+    }
+
+    SPC_prepare_load_row(rows[first] / rows_per_array, NV_flash_row_data(appdata, rows[first], row_data, row_len), row_len);
+
+    int i;
+    for (i = first; i < nrows; i++)
+    {
+        OpTimer timer(m_priv->transport, LATENCY_NV_WRITE_ROW); // row to row, including the wait for the previous one
+
+        int row = rows[i]; // in the whole image
+        int ai = row / rows_per_array; // array index
+        int ri = row % rows_per_array; // row index
+
+        if (m_debug & DEBUG_SPC) fprintf(stderr, "NV_write_row: ai:%d, ri:%d, len:%d\n", ai, ri, row_len);
+
+        if (!NV_write_row_start(ai, ri, die_temp, plan.erase_first(i)))
+        {
+            fprintf(stderr, "NV_flash_write: failed writing flash data - write row failed\n");
+            return false;
+        }
+
+        // the load for this row waited for the SPC to go idle: the previous row is done
+        *done = i;
+        journal->confirmed(plan.rows_done(i), ri == 0);
+        progress_rows(i, (uint64_t)i * row_len);
+
+        if (i + 1 < nrows)
+        {
+            int next = rows[i + 1];
+            SPC_prepare_load_row(next / rows_per_array, NV_flash_row_data(appdata, next, row_data, row_len), row_len);
+        }
+    }
+
+    if (!SPC_is_idle())
+    {
+        fprintf(stderr, "NV_flash_write: failed writing flash data - not idle\n");
+        return false;
+    }
+
+    *done = nrows;
+    progress_rows(nrows, (uint64_t)nrows * row_len);
+    return true;
+}
+
+
+bool Programmer::NV_flash_changed_rows(const AppData *appdata, const std::vector<uint8_t> &row_map, int row_len, uint8_t *row_data,
+                                       std::vector<int> &rows)
+{
+    // Finds the image rows that differ from flash by comparing the checksum of each row (sum
+    // of its bytes, as GET_CHECKSUM) with the device's. Ranges are checksummed whole and split
+    // in two only where they differ, so a few changed rows cost a few commands per array.
+    //
+    // A sum can't see bytes swapped within a range: verify after a differential write if
+    // that matters. Only meaningful when the image has every byte the device sums
+    // (NV_flash_checksum_covers_image): callers check first.
+    int num_rows = row_map.size();
+    std::vector<uint32_t> sums(num_rows, 0);
+    int row, i;
+
+    for (row = 0; row < num_rows; row++)
+    {
+        if (!(row_map[row] & ROW_NONZERO))
+            continue;
+
+        const uint8_t *data = NV_flash_row_data(appdata, row, row_data, row_len);
+        uint32_t sum = 0;
+        for (i=0; i<row_len; i++)
+            sum += data[i];
+        sums[row] = sum;
+    }
+
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    for (row = 0; row < num_rows; row += rows_per_array)
+    {
+        if (!NV_flash_diff_range(sums, row, MIN(rows_per_array, num_rows - row), false, rows))
+            return false;
+    }
+
+    return true;
+}
+
+
+bool Programmer::NV_flash_diff_range(const std::vector<uint32_t> &sums, int first_row, int nrows, bool differs,
+                                     std::vector<int> &rows)
+{
+    // first_row.. (image rows, all in one array) to rows if they differ. differs: already known.
+    if (!differs)
+    {
+        uint32_t expected = 0;
+        int i;
+        for (i=0; i<nrows; i++)
+            expected += sums[first_row + i];
+
+        int rows_per_array = m_devdata->flash_rows_per_array;
+        uint32_t checksum;
+        if (!NV_checksum_rows(first_row / rows_per_array, first_row % rows_per_array, nrows, &checksum))
+            return false;
+
+        if (checksum == expected)
+            return true;
+    }
+
+    if (nrows == 1)
+    {
+        rows.push_back(first_row);
+        return true;
+    }
+
+    // sums add up: if the first half matches the second can't
+    int half = nrows / 2;
+    size_t nchanged = rows.size();
+
+    if (!NV_flash_diff_range(sums, first_row, half, false, rows))
+        return false;
+
+    return NV_flash_diff_range(sums, first_row + half, nrows - half, rows.size() == nchanged, rows);
+}
+
+
+bool Programmer::NV_flash_plan(const std::vector<uint8_t> &row_map, FlashPlan &plan)
+{
+    // Gives the plan the image, what operations cost here and what is in flash, and has it
+    // choose. Flash state is a checksum per sector, split where the image ends in it: a
+    // range sums to 0 only if blank. Arrays the image doesn't reach are one checksum each.
+    // Not read at all when too few rows are to be written for an erase to pay.
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    int num_rows = row_map.size();
+    int row, s;
+
+    for (row = 0; row < num_rows; row++)
+        plan.set_image_blank(row, !(row_map[row] & ROW_NONZERO));
+
+    plan.load_costs(m_priv->spc_timing);
+    if (!plan.state_matters())
+    {
+        plan.choose();
+        return true;
+    }
+
+    bool outside_blank = true;
+    int array_checked = -1;
+    bool array_blank = false;
+    for (s = 0; s < plan.num_sectors(); s++)
+    {
+        int ai = plan.sector_array(s);
+        int ri = plan.sector_in_array(s) * FLASH_ROWS_PER_SECTOR;
+        int nrows = MIN(FLASH_ROWS_PER_SECTOR, rows_per_array - ri);
+        int nin = plan.sector_rows(s);
+        uint32_t checksum;
+        bool blank = true;
+        bool out_blank = true;
+
+        if (ai * rows_per_array >= num_rows)
+        {
+            if (array_checked != ai)
+            {
+                if (!NV_checksum_rows(ai, 0, rows_per_array, &checksum))
+                    return false;
+                array_checked = ai;
+                array_blank = checksum == 0;
+            }
+            out_blank = array_blank;
+        }
+        else
+        {
+            if (nin > 0)
+            {
+                if (!NV_checksum_rows(ai, ri, nin, &checksum))
+                    return false;
+                blank = checksum == 0;
+            }
+            if (nin < nrows)
+            {
+                if (!NV_checksum_rows(ai, ri + nin, nrows - nin, &checksum))
+                    return false;
+                out_blank = checksum == 0;
+            }
+        }
+
+        plan.set_sector_state(s, blank, out_blank);
+        outside_blank = outside_blank && out_blank;
+    }
+
+    // ERASE_ALL also clears protection, which writes here leave alone: only if there is none
+    bool protected_rows = true;
+    if (outside_blank && !NV_flash_protected(&protected_rows))
+        return false;
+    plan.set_keep_protection(protected_rows);
+
+    plan.choose();
+    return true;
+}
+
+
+bool Programmer::NV_flash_protected(bool *protected_rows)
+{
+    // any protection bits set, in any array
+    int row_len = m_devdata->flash_code_bytes_per_row;
+    int num_protection_bytes_per_array = m_devdata->flash_rows_per_array / m_devdata->flash_rows_per_protection_byte;
+    v_uint8_t data(row_len);
+
+    *protected_rows = false;
+
+    int ai, i;
+    for (ai = 0; ai < m_devdata->flash_num_arrays; ai++)
+    {
+        data.assign(row_len, 0);
+        if (!SPC_cmd_read(data.data(), row_len, SPC_CMD_READ_HIDDEN_ROW, ai, 0 /* row_id */))
+        {
+            fprintf(stderr, "Failed reading protection data\n");
+            return false;
+        }
+
+        for (i=0; i<num_protection_bytes_per_array && i<row_len; i++)
+        {
+            if (data[i])
+                *protected_rows = true;
+        }
+    }
+    return true;
+}
+
 
-    if (appdata->code) delete appdata->code;
-    if (appdata->config) delete appdata->config;
+bool Programmer::NV_flash_erase_planned(const FlashPlan &plan)
+{
+    if (!plan.has_erases())
+        return true;
 
-    appdata->code = new HexData();
-    appdata->config = new HexData();
+    if (plan.erase_all())
+    {
+        trace_mark("write_flash_erase_all");
+        progress_phase(PROGRESS_ERASE, 1, 0);
+        bool rc = NV_erase_flash();
+        if (rc) progress_rows(1, 0);
+        progress_phase_end();
+        return rc;
+    }
 
-    v_uint8_t pcode(m_devdata->flash_code_bytes_per_row); // local buffer
-    v_uint8_t pconfig(m_devdata->flash_config_bytes_per_row); // local buffer
+    int nerases = 0;
+    int s;
+    for (s = 0; s < plan.num_sectors(); s++)
+    {
+        if (plan.erase_sector(s))
+            nerases++;
+    }
 
-    uint8_t ai; // array index
-    for(ai = 0; ai < m_devdata->flash_num_arrays; ai++)
+    progress_phase(PROGRESS_ERASE, nerases, 0);
+    int done = 0;
+    for (s = 0; s < plan.num_sectors(); s++)
     {
-        int ri; // row index
-        for(ri = 0; ri < m_devdata->flash_rows_per_array; ri++)
+        if (!plan.erase_sector(s))
+            continue;
+
+        trace_mark("write_flash_erase_sector");
+        if (!NV_erase_sector(plan.sector_array(s), plan.sector_in_array(s)))
         {
-            // Code region address
-            uint32_t address_offset = ri * m_devdata->flash_code_bytes_per_row;
-            uint32_t dev_address = address_offset + m_devdata->flash_code_base_address;
+            progress_phase_end();
+            return false;
+        }
+        progress_rows(++done, 0);
+    }
+    progress_phase_end();
+    return true;
+}
 
-            //std::fill(pcode.begin(), pcode.end(), 0); // I prefer memset !!
-            pcode.assign(m_devdata->flash_code_bytes_per_row, 0);
 
-            bool rc = NV_read_multi_bytes(ai, dev_address, pcode.data(), pcode.size());
-            if (!rc) return false;
-            appdata->code->add(HexFileFormat::FLASH_CODE_ADDRESS + address_offset, pcode);
+bool Programmer::NV_flash_rows_match(const AppData *appdata, int first_row, int nrows, uint8_t *row_data, int row_len)
+{
+    // Compares the flash checksum of image rows first_row.. (one GET_CHECKSUM per array) with
+    // the sum of the bytes written to them.
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    int row = first_row;
+    int end_row = first_row + nrows;
 
+    while (row < end_row)
+    {
+        int ai = row / rows_per_array;
+        int ri = row % rows_per_array;
+        int n = MIN(rows_per_array - ri, end_row - row);
 
-            // Config region address
-            address_offset = ri * m_devdata->flash_config_bytes_per_row;
-            dev_address = address_offset + m_devdata->flash_config_base_address;   // top bit set means ECC/config address space
+        uint32_t expected = 0;
+        int i, j;
+        for (i=0; i<n; i++)
+        {
+            const uint8_t *data = NV_flash_row_data(appdata, row + i, row_data, row_len);
+            for (j=0; j<row_len; j++)
+                expected += data[j];
+        }
 
-            //std::fill(pconfig.begin(), pconfig.end(), 0); // I prefer memset !!
-            pconfig.assign(m_devdata->flash_config_bytes_per_row, 0);
+        uint32_t checksum;
+        if (!NV_checksum_rows(ai, ri, n, &checksum))
+            return false;
 
-            rc = NV_read_multi_bytes(ai, dev_address, pconfig.data(), pconfig.size());
-            if (!rc) return false;
+        if (checksum != expected)
+        {
+            fprintf(stderr, "NV_flash_write: rows %d..%d checksum 0x%08x, expected 0x%08x\n", row, row + n - 1, checksum, expected);
+            return false;
+        }
 
-            // FIXME: this ain't right. is config == program or is config == data ?
-            //if (devdata->geom->config_used_for_code)
-            if (appdata->extra_flash_used_for_config())
-                appdata->config->add(HexFileFormat::CONFIG_ADDRESS + address_offset, pconfig);
-        } // ri
-    } // ai
-    
-    if (trim)
-    {
-        if (debug) fprintf(stderr,"Untrimmed code len:%d\n",appdata->code->length());
-        appdata->code->trim();
-        appdata->config->trim();
-        if (debug) fprintf(stderr,"Trimmed code len:%d\n",appdata->code->length());
+        row += n;
     }
 
     return true;
 }
 
 
-int Programmer::NV_flash_row_length(const AppData *appdata) const
+bool Programmer::reacquire_target(void)
 {
-    // if reading device data then it should be based on contents of ECC field in device Device Config (USER NVL) !?
-    // if writing a program then it should be based on program Device Config field
+    // After a stall or transfer failure: clear the endpoints and put the target back in
+    // programming mode. Row latch, SPC and CPU state are all assumed lost.
+    usb_clear_stall();
+    m_priv->queue.reset();
+    m_priv->row_queue.reset();
 
-    assert(appdata);
+    if (!enter_programming_mode())
+        return false;
 
-    return m_devdata->flash_code_bytes_per_row
-           + (appdata->extra_flash_used_for_config() ? m_devdata->flash_config_bytes_per_row : 0);
+    if (get_jtag_id() == 0)
+    {
+        fprintf(stderr, "reacquire_target: no target\n");
+        return false;
+    }
+
+    return true;
 }
 
 
-bool Programmer::NV_flash_write(const AppData *appdata)
+bool Programmer::NV_flash_write_loader(const AppData *appdata, const FlashPlan &plan, int first, int row_len, int die_temp,
+                                       FlashJournal *journal, int *done)
 {
-    // FIXME: don't write checksum that is stored at address 0x90300000 (MSB) and 0001 (LSB)
-    fprintf(stderr,"FLASH WRITE\n");
+    // Rows are streamed into the SRAM ring with packed word writes (a quarter of the SWD
+    // traffic of LOAD_ROW's byte per write) while the loader has the SPC load and program
+    // them, so the host isn't between one row and the next.
+    // Writes rows[first..]. On failure *done is how many of rows are known to be programmed.
 
-    assert(appdata);
+    *done = first;
+    if (!loader_start())
+        return false;
 
-    int code_len = 0;
-    if (appdata->code)
-        code_len = appdata->code->length();
+    const std::vector<int> &rows = plan.rows();
+    int rows_per_array = m_devdata->flash_rows_per_array;
+    int die_temp_mag = abs(die_temp);
+    int die_temp_sign = die_temp < 0 ? 0 : 1; // as NV_write_row_start
+    uint8_t cmd = plan.erase_first(first) ? SPC_CMD_WRITE_ROW : SPC_CMD_PROG_ROW;
 
-    int config_len = 0;
-    if (appdata->config)
-        config_len = appdata->config->length();
+    // once the ring is full there is nothing to do until the next row is done
+    uint32_t key = SpcTiming::key(cmd, NULL, 0);
+    uint64_t poll_ns = m_priv->spc_timing.known(key) ? m_priv->spc_timing.likely_done_ns(key) : (uint64_t)LOADER_DEFAULT_POLL_US * 1000;
+    uint64_t timeout_ns = m_priv->spc_timing.timeout_ns(key);
 
-    if (code_len == 0)
-    {
-        if (config_len == 0)
-        {
-            fprintf(stderr, "flash_write: code and config both empty. nothing to do\n");
-            return true;
-        }
-    }
+    uint8_t *row_data = (uint8_t *)malloc(row_len);
+    assert(row_data);
 
-    // FIXME: Also need to ensure device is in correct state to receive any extra config data. ie ECCEN must be correct first)
-   // read devconfig and  check ECCEN bit
+    uint8_t slot[LOADER_SLOT_STRIDE];
+    uint8_t tail_data[4];
+    uint8_t error_data[4];
+    int nrows = rows.size() - first;
+    int head = 0;   // counted from first
+    int tail = 0;
+    uint64_t progress_ns = m_priv->transport->clock_ns();
+    bool ok = true;
 
-    if (code_len > m_devdata->flash_code_max_size)
-    {
-        fprintf(stderr, "flash_write: too much data. Have %d expected no more than %d bytes\n", appdata->code->length(), m_devdata->flash_code_max_size);
-        return false;
-    }
+    assert(row_len <= LOADER_SLOT_MAX_DATA);
 
-    if (config_len > 0 && appdata->extra_flash_used_for_config() == false)
+    while (tail < nrows)
     {
-        fprintf(stderr,"Config data len:%d, extra_flash_used_for_config:%d\n", config_len, appdata->extra_flash_used_for_config());
-        assert("Mismatch between config usage and config data");
-    }
-
-    // assume that if we have config data it's able to be written (ie not ECC flash mode)
+        // top up the ring, publish the new head and read back progress, all in one flush
+        m_priv->queue.reset();
+        if (head < nrows && head - tail < LOADER_NUM_SLOTS)
+        {
+            m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+            for (; head < nrows && head - tail < LOADER_NUM_SLOTS; head++)
+            {
+                int row = rows[first + head];
+                int ri = row % rows_per_array;
+
+                memset(slot, 0, sizeof(slot));
+                slot[0] = plan.erase_first(first + head) ? SPC_CMD_WRITE_ROW : SPC_CMD_PROG_ROW;
+                slot[1] = row / rows_per_array;
+                slot[2] = (ri >> 8) & 0xFF;
+                slot[3] = ri & 0xFF;
+                slot[4] = die_temp_sign;
+                slot[5] = die_temp_mag;
+                uint16_to_b2_LE(row_len, &slot[6]);
+                memcpy(&slot[LOADER_SLOT_HEADER_LEN], NV_flash_row_data(appdata, row, row_data, row_len), row_len);
+
+                uint32_t address = LOADER_RING + (head % LOADER_NUM_SLOTS) * LOADER_SLOT_STRIDE;
+                m_priv->queue.ap_write_block(address, slot, (LOADER_SLOT_HEADER_LEN + row_len + 3) / 4);
+            }
+            m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+            m_priv->queue.ap_write(LOADER_CTL_HEAD, head);
+        }
+        m_priv->queue.ap_read(LOADER_CTL_TAIL, tail_data);
+        m_priv->queue.ap_read(LOADER_CTL_ERROR, error_data);
 
-    int num_code_rows = code_len / m_devdata->flash_code_bytes_per_row;
-    if (code_len % m_devdata->flash_code_bytes_per_row != 0) num_code_rows++;
-    
-    int num_config_rows = config_len / m_devdata->flash_config_bytes_per_row;
-    if (code_len % m_devdata->flash_config_bytes_per_row != 0) num_config_rows++;
+        if (!m_priv->queue.flush(m_priv->transport))
+        {
+            ok = false;
+            break;
+        }
 
-    // we have to program:  num_rows = MAX(num_code_rows, num_config_rows)
-    int num_rows = MAX(num_code_rows, num_config_rows);
+        int new_tail = (int)B4LE_to_U32(tail_data);
+        uint32_t error = B4LE_to_U32(error_data);
+        if (error || new_tail < tail || new_tail > head)
+        {
+            fprintf(stderr, "NV_flash_write: SRAM loader failed at row %d (tail %d, SPC status 0x%02x)\n", rows[first + tail], new_tail, error);
+            ok = false;
+            break;
+        }
 
-#if 0
-    if (!send_c1d4_recv_ok(APACC_CTRLSTAT_WRITE, 0x22000002)) return false; // 4byte access to SRAM (only for SRAM Version for write_row)
-#endif
+        uint64_t now_ns = m_priv->transport->clock_ns();
+        if (new_tail > tail)
+        {
+            int i;
+            for (i=tail; i<new_tail; i++)
+                latency_record(LATENCY_NV_WRITE_ROW, (now_ns - progress_ns) / (new_tail - tail));
+            if (m_debug & DEBUG_SPC) fprintf(stderr, "NV_flash_write: rows %d..%d done\n", rows[first + tail], rows[first + new_tail - 1]);
+
+            tail = new_tail;
+            journal->confirmed(plan.rows_done(first + tail));
+            progress_rows(first + tail, (uint64_t)(first + tail) * row_len);
+            progress_ns = now_ns;
+            continue;
+        }
 
-#if 0
-#if 1
-    int narrays, remainder_rows;
-    PSoC5::program_geom(devdata->geom, code_len, &narrays, &remainder_rows);
-#else
-    int array_size = m_devdata->flash_rows_per_array * m_devdata->flash_code_bytes_per_row;
-    int narrays = code_len / array_size;
+        if (now_ns - progress_ns > timeout_ns || usb_deadline_passed())
+        {
+            fprintf(stderr, "NV_flash_write: SRAM loader stuck at row %d\n", rows[first + tail]);
+            ok = false;
+            break;
+        }
 
-    int remainder = code_len % array_size;
-    if (remainder) narrays++;
-    int remainder_rows = remainder / m_devdata->flash_code_bytes_per_row;
-    if (remainder % m_devdata->flash_code_bytes_per_row) remainder_rows++;
-#endif
-#endif
+        if (head == nrows || head - tail == LOADER_NUM_SLOTS)
+            m_priv->transport->sleep_ns(poll_ns);
+    }
 
-    int narrays = num_rows / m_devdata->flash_rows_per_array;  // CHECK flash_rows_per_array same for main and ECC (would have to be!!)
-    int remainder_rows = num_rows % m_devdata->flash_rows_per_array;
-    if (remainder_rows) narrays++;
+    free(row_data);
+    loader_stop();
 
-// FIXME const int row_len = NV_flash_row_length(appdata);
-// it was defaulting to 256 but device is configured for no ECC so SPC subsystem timed out.
-    int row_len = m_devdata->flash_code_bytes_per_row;
+    *done = first + tail;
+    return ok;
+}
 
-   if (appdata->extra_flash_used_for_config())
-        row_len += m_devdata->flash_config_bytes_per_row;
 
+bool Programmer::loader_start(void)
+{
+    // Copies the loader into SRAM, empties the ring and runs the (halted) CPU on it with
+    // interrupts masked. Fails if the loader doesn't report in.
 
-    fprintf(stderr,"code_len:%d, n_code_rows:%d, config_len:%d, n_config_rows:%d, narrays:%d, remainder_rows:%d, row_len:%d\n",
-                code_len, num_code_rows, config_len, num_config_rows, narrays, remainder_rows, row_len);
+    fprintf(stderr, "Starting SRAM flash loader\n");
 
-    assert(narrays <= m_devdata->flash_num_arrays);
+    m_priv->queue.reset();
+    m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+    m_priv->queue.ap_write_block(LOADER_ENTRY, psoc_loader_image, sizeof(psoc_loader_image) / 4);
+    m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    m_priv->queue.ap_write(LOADER_CTL_HEAD, 0);
+    m_priv->queue.ap_write(LOADER_CTL_TAIL, LOADER_NOT_STARTED);
+    m_priv->queue.ap_write(LOADER_CTL_NSLOTS, LOADER_NUM_SLOTS);
 
-    uint8_t *row_data = (uint8_t *)malloc(row_len);
-    assert(row_data);
+    // PC, SP and xPSR (Thumb bit) can only be set while halted
+    m_priv->queue.ap_write(CM3_DHCSR, CM3_DHCSR_KEY | CM3_DHCSR_C_MASKINTS | CM3_DHCSR_C_HALT | CM3_DHCSR_C_DEBUGEN);
+    m_priv->queue.ap_write(CM3_DCRDR, LOADER_ENTRY);
+    m_priv->queue.ap_write(CM3_DCRSR, CM3_DCRSR_REGWNR | 15);
+    m_priv->queue.ap_write(CM3_DCRDR, LOADER_STACK_TOP);
+    m_priv->queue.ap_write(CM3_DCRSR, CM3_DCRSR_REGWNR | 13);
+    m_priv->queue.ap_write(CM3_DCRDR, 0x01000000);
+    m_priv->queue.ap_write(CM3_DCRSR, CM3_DCRSR_REGWNR | 16);
+    m_priv->queue.ap_write(CM3_DHCSR, CM3_DHCSR_KEY | CM3_DHCSR_C_MASKINTS | CM3_DHCSR_C_DEBUGEN); // run
 
-    int die_temp = get_die_temperature(); // first value post reset is wrong - discard
-    die_temp = get_die_temperature();
+    // the loader drives the SPC from now on
+    m_priv->spc_idle = false;
+    m_priv->spc_pending = false;
 
-    int ai; // array index
-    for(ai = 0; ai < narrays; ai++)
+    if (!m_priv->queue.flush(m_priv->transport))
     {
-        //int rows_in_array = num_rows_in_array(prog_geom-> ai);
-        int rows_in_array = (remainder_rows && ai==narrays-1) ? remainder_rows : m_devdata->flash_rows_per_array;
-        uint32_t hexdata_address;
-        
-        int ri; // row index
-        for(ri = 0; ri < rows_in_array; ri++)
-        {
-            memset(row_data, 0, row_len);
+        fprintf(stderr, "loader_start: failed loading SRAM loader\n");
+        return false;
+    }
 
-            if (code_len) // optimisation only
-            {
-                // fill up 256 bytes in buffer. If no code for this area we get back a zeroed buffer
-                hexdata_address = HexFileFormat::FLASH_CODE_ADDRESS + ri * m_devdata->flash_code_bytes_per_row;
-                appdata->code->extract2bin(hexdata_address, m_devdata->flash_code_bytes_per_row, row_data);
-            }
+    uint64_t start_ns = m_priv->transport->clock_ns();
+    do
+    {
+        uint32_t tail;
+        if (!ap_register_read(LOADER_CTL_TAIL, &tail))
+            break;
+        if (tail != LOADER_NOT_STARTED)
+            return true;
+    }
+    while (m_priv->transport->clock_ns() - start_ns < (uint64_t)LOADER_START_TIMEOUT_MS * 1000000 && !usb_deadline_passed());
 
-            if (config_len) // optimisation only.
-            {
-                // fill up extra 32 bytes in buffer. If no code for this area we get back a zeroed buffer
-                hexdata_address = HexFileFormat::CONFIG_ADDRESS + ri * m_devdata->flash_config_bytes_per_row;
-                appdata->config->extract2bin(hexdata_address, 
-                        m_devdata->flash_config_bytes_per_row, row_data + m_devdata->flash_code_bytes_per_row);
-                dump_data(stderr, row_data + m_devdata->flash_code_bytes_per_row, m_devdata->flash_config_bytes_per_row, "CONFIG");
-            }
+    fprintf(stderr, "loader_start: SRAM loader didn't start\n");
+    loader_stop();
+    return false;
+}
 
-            if (!NV_write_row(ai, ri, die_temp, row_data, row_len))
-            {
-                assert(0 && "failed writing flash data - write row failed");
-                free(row_data);
-                return false;
-            }
-        }
-    } // ai
-    
-    free(row_data);
 
-    if (!SPC_is_idle())
-    {
-        assert(0 && "failed writing flash data - not idle");
-        return false;    
-    }
+void Programmer::loader_stop(void)
+{
+    // Halt the CPU (leaving it as enter_programming_mode did). Interrupt masking may only be
+    // changed once halted, hence two writes.
+    m_priv->queue.reset();
+    m_priv->queue.ap_write(CM3_DHCSR, CM3_DHCSR_KEY | CM3_DHCSR_C_MASKINTS | CM3_DHCSR_C_HALT | CM3_DHCSR_C_DEBUGEN);
+    m_priv->queue.ap_write(CM3_DHCSR, CM3_DHCSR_KEY | CM3_DHCSR_C_HALT | CM3_DHCSR_C_DEBUGEN);
+    if (!m_priv->queue.flush(m_priv->transport))
+        fprintf(stderr, "loader_stop: failed halting CPU\n");
 
-    return true;     
+    m_priv->spc_idle = false;
+    m_priv->spc_pending = false;
 }
 
 
@@ -1196,30 +2428,22 @@ bool Programmer::NV_eeprom_read(AppData *appdata, bool trim)
     appdata->eeprom = new HexData();
 
     int nrows = m_devdata->eeprom_size / m_devdata->eeprom_bytes_per_row;
-    int nreads = m_devdata->eeprom_bytes_per_row / 4; // 4 bytes per read
 
-    v_uint8_t vdata(m_devdata->eeprom_bytes_per_row);
+    v_uint8_t eeprom_data(m_devdata->eeprom_size, 0);
+
+    if (!ahb_read(m_devdata->eeprom_base_address, eeprom_data.data(), eeprom_data.size()))
+    {
+        fprintf(stderr, "Failed reading EEPROM data\n");
+        return false;
+    }
 
-    int address_offset = 0;
     int ri;
     for(ri = 0; ri < nrows; ri++)
     {
-        uint32_t dev_address = m_devdata->eeprom_base_address + address_offset;
+        int address_offset = ri * m_devdata->eeprom_bytes_per_row;
         uint32_t hexdata_address = HexFileFormat::EEPROM_ADDRESS + address_offset;
 
-        //std::fill(vdata.begin(), vdata.end(), 0);
-        vdata.assign(m_devdata->eeprom_bytes_per_row, 0);
-
-        uint8_t *dp = vdata.data();
-        int count;
-        for (count=0; count < nreads; count++)
-        {
-            ap_register_read(dev_address, dp);
-
-            address_offset += 4;
-            dp += 4;
-        }
-
+        v_uint8_t vdata(eeprom_data.begin() + address_offset, eeprom_data.begin() + address_offset + m_devdata->eeprom_bytes_per_row);
         appdata->eeprom->add(hexdata_address, vdata);
     }
 
@@ -1467,7 +2691,6 @@ bool Programmer::NV_checksum_all(uint32_t *checksum)
 
     uint8_t cksum[4];
     if (!SPC_read_data_b0(cksum, 4)) return false;
-    bool rc = SPC_cmd(SPC_CMD_GET_CHECKSUM, args, 5);
 
     // Note: PSoC TRM Ch 44.3.1.1 Checksum Data is MSB first
     *checksum = B4BE_to_U32(cksum);
@@ -1512,40 +2735,23 @@ bool Programmer::NV_read_multi_bytes(uint8_t array_id, uint32_t address, uint8_t
 
     assert(len <= 256);
 
-    fprintf(stderr, "NV_read_multi_bytes: aid:%d, addr:0x%0x, len:%d\n", array_id, address, len);
+    if (m_debug & DEBUG_SPC) fprintf(stderr, "NV_read_multi_bytes: aid:%d, addr:0x%0x, len:%d\n", array_id, address, len);
+    OpTimer timer(m_priv->transport, LATENCY_NV_READ_MULTI_BYTES);
 
-    // note: interface is only one byte wide so all data, args are serialised into bottom byte
+    uint8_t args[5];
+    args[0] = array_id;
+    args[1] = (address >> 16) & 0xFF;
+    args[2] = (address >> 8) & 0xFF;
+    args[3] = address & 0xFF;
+    args[4] = len - 1; // to read n bytes pass n-1 (because max is 256)
 
-#if 1
-    if (!SPC_is_idle())
+    if (!SPC_cmd_read_fused(data, len, SPC_CMD_READ_MULTI_BYTE, args, 5))
     {
-        fprintf(stderr,"NV_read_multi_bytes: SPC not Idle!\n");
-        return false; 
-    }
-#endif
-
-    uint8_t cmd = SPC_CMD_READ_MULTI_BYTE;
-
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(REG_SPC_CPU_DATA);
-    m_priv->request.apacc_data_write((uint32_t)SPC_KEY1);
-    m_priv->request.apacc_data_write((uint32_t)(SPC_KEY2 + cmd));
-    m_priv->request.apacc_data_write((uint32_t)cmd);
-    m_priv->request.apacc_data_write((uint32_t)array_id);
-    m_priv->request.apacc_data_write((uint32_t)((address >> 16) & 0xFF));
-    m_priv->request.apacc_data_write((uint32_t)((address >> 8) & 0xFF));
-    m_priv->request.apacc_data_write((uint32_t)(address & 0xFF));
-    m_priv->request.apacc_data_write((uint32_t)(len - 1)); // to read n bytes pass n-1 (because max is 256)
-
-    if (!send_receive())
-    {
-        fprintf(stderr, "NV_read_multi_bytes: send_receive failed\n");
+        fprintf(stderr, "NV_read_multi_bytes: read failed\n");
         return false;
     }
 
-    if (!m_priv->reply.pop_ok(-1)) return false; // FIXME: what value
-
-    return SPC_read_data_b0(data, len);
+    return true;
 }
 
 
@@ -1554,146 +2760,51 @@ bool Programmer::NV_write_row(uint8_t array_id, uint16_t row_num, int die_temp,
     // works for Flash 255, 288, EEPROM 16
     //assert(vdata.size() <= 288);
     assert(len <= 288);
-    fprintf(stderr, "NV_write_row: ai:%d, ri:%d, len:%d\n", array_id, row_num, len);
-
-    int die_temp_mag = abs(die_temp);
-    int die_temp_sign = die_temp < 0 ? 0 : 1; // assume 1 is positive !?  Ch 36
-
-    bool rc = SPC_cmd_load_row(array_id, data, len);
-    assert(rc); // TEMP
-    if (!rc) return false;
-
-#if 1
-    if (!SPC_is_idle()) // FIXME one is needed in this func - not sure if this one is needed
-    {
-        assert(0 && "failed writing flash/eeprom data - not idle");
-        return false;    
-    }
-#endif
+    if (m_debug & DEBUG_SPC) fprintf(stderr, "NV_write_row: ai:%d, ri:%d, len:%d\n", array_id, row_num, len);
+    OpTimer timer(m_priv->transport, LATENCY_NV_WRITE_ROW);
 
-    uint8_t args[5];
-    args[0] = array_id;
-    args[1] = (row_num >> 8) & 0xFF;
-    args[2] = row_num & 0xFF;
-    args[3] = die_temp_sign;
-    args[4] = die_temp_mag;
-
-    uint8_t cmd = erase_first ? SPC_CMD_WRITE_ROW : SPC_CMD_PROG_ROW;
-    rc = SPC_cmd(cmd, args, 5);
-    // FIXME: program row less documented. Not clear if prog row needs temp. Possible benefit is to save double erase...
-
-    assert(rc); // TEMP
-    if (!rc) return false;
+    SPC_prepare_load_row(array_id, data, len);
 
-    // possibly don't need to wait for programming to end before loading next row...
+    if (!NV_write_row_start(array_id, row_num, die_temp, erase_first))
+        return false;
 
-    if (!SPC_is_idle()) // FIXME one is needed in this func - not sure if this one is needed
+    if (!SPC_is_idle())
     {
-        assert(0 && "failed writing flash/eeprom data - not idle 2");
+        fprintf(stderr, "NV_write_row: failed writing flash/eeprom data - not idle 2\n");
         return false;    
     }
     return true;
 }
 
 
-#if 0
-bool Programmer::NV_flash_write_row(uint8_t array_num, uint8_t row_num, int die_temp, const uint8_t *data, int row_len)
+bool Programmer::NV_write_row_start(uint8_t array_id, uint16_t row_num, int die_temp, bool erase_first)
 {
-    // THIS DOESN'T SEEM TO WORK. NOT SURE WHY. Maybe ARM isn't running !? Should work faster than SPC version
-    // FIXME: Uses CMD 7 however that doesn't appear to take die temp. Even if not may be harmless !?
-    assert(row_len <= 288);
+    // Loads the row prepared by SPC_prepare_load_row and starts programming it. Doesn't wait
+    // for programming to finish: the next SPC command will (SPC_is_idle).
 
     int die_temp_mag = abs(die_temp);
-    int die_temp_sign = die_temp < 0 ? 0 : 1; // assume 1 is positive !? Ch 36
-    bool even = row_num % 2 == 0;
-
-
-    // Note: Len is typically <= CODE_BYTES_PER_ROW or ECC_BYBTES_PER_ROW
-    // Starting address of the flash row first byte
-    //fprintf(stderr, "write_flash_row: array:%d, row:%d, addr: 0x%0x, row_len:%d, die_temp:%d\n", array_num, row_num, address, row_len, die_temp);
-    fprintf(stderr, "write_flash_row: array:%d, row:%d, row_len:%d, die_temp:%d (%d:%d), even:%d\n", array_num, row_num, row_len, die_temp, die_temp_sign, die_temp_mag, even);
-
-// FIXME: TEMP
-dump_data(stderr, data, row_len, NULL);
-//return true;
-
-    // Store data and "program row (0x07) command in memory
-    // Store the following in memory:
-    //  @SRAM base (for odd row):
-    //  CMD 2: LOAD ROW                                   CMD 7: PROGRAM
-    //  b6 d5 02 AID, DD[0] .... DD[rowlen-1] :: 00 00 00 b6, (d3 + 07) 07 AID RIDh=0, RIDl temp_sign temp_mag 00,
-    // Note the 00 00 00 are noted as "3 NOPs for a short delay" (valid commands start with a b6)
-    // Total length of fata = rowlen + 15
-
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(0x20000000 + even ? 0x0 : 0x200);
-    m_priv->request.apacc_data_write(0x0002d5b6 | ((array_num & 0xFF)<<24));
-    if (!send_receive()) { fprintf(stderr,"flash write row early failure\n"); exit(1); }
-    m_priv->reply.pop_ok(2);
-
-    int eo_offset = even ? 0x0 : 0x200;
-
-    int i;
-    //for (i=0; i< PSoC5::CODE_BYTES_PER_FLASH_ROW; i+=4) 
-    for (i=0; i< row_len; i+=4) 
-    {
-        m_priv->request.reset();
-        m_priv->request.apacc_addr_write(0x20000000 | i + 0x04 + eo_offset); // xx xx HI LO   // FIXME: ODD + 0x204  L 1106
-        m_priv->request.apacc_data_write(B4LE_to_U32(data + i));
-        if (!send_receive()) { fprintf(stderr,"flash write row early failure 2\n"); exit(1); }
-        m_priv->reply.pop_ok(2);
-    }
-        fprintf(stderr,"\n");
-
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(0x20000000 | ((row_len - 1 + 0x05 + eo_offset) & 0xffff)); // BIGENDIAN_2  // ODD + 0x205  L1131
-    m_priv->request.apacc_data_write(0xb6000000);                               // 00 00 00 b6
-
-    m_priv->request.apacc_addr_write(0x20000000 | ((row_len - 1 + 0x09 + eo_offset) & 0xffff)); // BIGENDIAN_2  // ODD + 0x209
-    m_priv->request.apacc_data_write(0x000007da | ((array_num & 0xff) << 16));  // da 7d 00 00
-
-    m_priv->request.apacc_addr_write(0x20000000 | ((row_len - 1 + 0x0d + eo_offset) & 0xffff)); // BIGENDIAN_2  // ODD + 0x209
-    m_priv->request.apacc_data_write(0x00000000 | (die_temp_mag << 16) | (die_temp_sign << 8) | (row_num & 0xFF)); // 0x00 is row_count high byte
-
-    m_priv->request.apacc_addr_write(0x40007018 + even?0:0x10); // 7028 ODD     PHUB_CH0_BASIC_STATUS, PHUB_CH1_BASIC_STATUS
-    m_priv->request.apacc_data_write(0x00000000 + even?0:0x100); // 0100 ODD    Address of the current CHn_ORIG_TD0/1 in the chain, Use TDMEM1_PROG+TD0
-
-    m_priv->request.apacc_addr_write(0x40007010 + even?0:0x10); // 7020         ODD PHUB_CH0_BASIC_CFG, PHUB_CH1_BASIC_CFG
-    m_priv->request.apacc_data_write(0x00000021); // Enable DMA Ch 0
-
-    m_priv->request.apacc_addr_write(0x40007600 + even?0:0x08); // 7608 ODD     PHUB_CFGMEM0_CFG0, PHUB_CFGMEM1_CFG0
-    m_priv->request.apacc_data_write(0x00000080); // DMA rquest needed for each burst
-
-    m_priv->request.apacc_addr_write(0x40007604 + even?0:0x08); // 760C ODD     PHUB_CFGMEM0_CFG1, PHUB_CFGMEM1_CFG1
-    m_priv->request.apacc_data_write(0x40002000); // upper 16 bits of source/dest
-
-    m_priv->request.apacc_addr_write(0x40007800 + even?0:0x08); // 7808 ODD     PHUB_TDMEM0_ORIG_TD0, PHUB_TDMEM1_ORIG_TD0
-    m_priv->request.apacc_data_write(0x01ff0000 + 15 + row_len); // request length
-
-    m_priv->request.apacc_addr_write(0x40007804 + even?0:0x08); // 780C ODD     PHUB_TDMEM0_ORIG_TD1, PHUB_TDMEM1_ORIG_TD1
-    m_priv->request.apacc_data_write(0x47200000 + eo_offset);  // 47200200 ODD  lower 16 bits of source/dest
-
-    send_receive();
-    m_priv->reply.m_debug = 1; // TEMP
-    m_priv->reply.pop_ok(-1);
-    m_priv->reply.m_debug = 0; // TEMP
+    int die_temp_sign = die_temp < 0 ? 0 : 1; // assume 1 is positive !?  Ch 36
 
-    if (!SPC_is_idle())
+    // Failures return rather than assert: a wedged programmer or bad board (or the job
+    // deadline passing) must be reported, not crash the station.
+    if (!SPC_send_load_row())
     {
-        assert(0 && "failed writing flash data - not idle");
-        return false;    
+        fprintf(stderr, "NV_write_row: failed writing flash/eeprom data - load failed\n");
+        return false;
     }
 
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(0x40007014 + even?0:0x10); // 7024 ODD     PHUB_CH0_ACTION
-    m_priv->request.apacc_data_write(0x00000001); // Create DMA request for CH 0
+    uint8_t args[5];
+    args[0] = array_id;
+    args[1] = (row_num >> 8) & 0xFF;
+    args[2] = row_num & 0xFF;
+    args[3] = die_temp_sign;
+    args[4] = die_temp_mag;
 
-    send_receive();
-    m_priv->reply.pop_ok(-1);
+    uint8_t cmd = erase_first ? SPC_CMD_WRITE_ROW : SPC_CMD_PROG_ROW;
+    // FIXME: program row less documented. Not clear if prog row needs temp. Possible benefit is to save double erase...
 
-    return true;    
+    return SPC_cmd(cmd, args, 5);
 }
-#endif
 
 
 bool Programmer::NV_protect(uint8_t array_id, const uint8_t *data, int len)
@@ -1796,14 +2907,12 @@ uint32_t Programmer::get_jtag_id(void)
 {
     uint32_t idcode = 0;
 
-    m_priv->request.reset();
-//    m_priv->request.dpacc_idcode_read();
-    m_priv->request.c1(DPACC_IDOCDE_READ);
+    uint8_t idcode_bytes[4];
 
-    if (!send_receive()) return idcode;
+    m_priv->queue.reset();
+    m_priv->queue.dpacc_idcode_read(idcode_bytes);
 
-    uint8_t idcode_bytes[4];
-    if (m_priv->reply.pop_b4_ok(idcode_bytes))
+    if (m_priv->queue.flush(m_priv->transport))
     {
         idcode = B4LE_to_U32(idcode_bytes);
     }
@@ -1827,34 +2936,48 @@ bool Programmer::ap_register_read(uint32_t address, uint8_t *data, bool dummy_pr
     // I think dummy_preread is always true !?
     // Assumes uint8_t data[4]
 
-    int nreads = 1;
-    if (dummy_preread) nreads = 2;
-
     memset(data, 0, 4*sizeof(uint8_t));
 
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(address);
-    m_priv->request.apacc_data_read(nreads);
+    m_priv->queue.reset();
+    m_priv->queue.ap_read(address, data, dummy_preread);
 
-    if (!send_receive()) return false;
+    return m_priv->queue.flush(m_priv->transport);
+}
 
-    if (!m_priv->reply.pop_ok()) return false;
-    if (dummy_preread)
-        m_priv->reply.pop_b4_ok(NULL);
 
-    return m_priv->reply.pop_b4_ok(data);
+bool Programmer::ahb_read(uint32_t address, uint8_t *data, int len)
+{
+    // Memory mapped block read (flash, ECC, EEPROM) with TAR auto increment: each word costs one
+    // header byte out and 5 bytes back, against 5 bytes back per byte (and an SPC command per
+    // row) for READ_MULTI_BYTE. data is little endian ie byte for byte as in the device.
+
+    assert((address & 3) == 0 && (len & 3) == 0);
+    OpTimer timer(m_priv->transport, LATENCY_AHB_READ);
+
+    m_priv->queue.reset();
+    m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+    m_priv->queue.ap_read_block(address, data, len / 4);
+    m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+
+    if (m_priv->queue.flush(m_priv->transport))
+        return true;
+
+    // don't leave auto increment on: SPC access writes CPU_DATA repeatedly
+    m_priv->queue.reset();
+    m_priv->queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    m_priv->queue.flush(m_priv->transport);
+
+    fprintf(stderr, "ahb_read: read failed at 0x%08x\n", address);
+    return false;
 }
 
 
 bool Programmer::ap_register_write(uint32_t address, uint32_t value)
 {
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(address);
-    m_priv->request.apacc_data_write(value);
-
-    if (!send_receive()) return false;
+    m_priv->queue.reset();
+    m_priv->queue.ap_write(address, value);
 
-    m_priv->reply.pop_ok(2);
+    return m_priv->queue.flush(m_priv->transport);
 }
 
 
@@ -1878,36 +3001,76 @@ bool Programmer::send_receive(void)
 {
     bool ok = true;
 
-    ok = m_priv->request.send(m_priv->dev_handle);
+    if (m_priv->transport->max_inflight() > 1)
+    {
+        int ticket = submit_exchange(&m_priv->request, &m_priv->reply);
+        if (ticket < 0) return false;
+        return complete_exchange(ticket, &m_priv->reply);
+    }
+
+    ok = m_priv->request.send(m_priv->transport);
     if (!ok) return false;
-    ok = m_priv->reply.receive(m_priv->dev_handle);
+    ok = m_priv->reply.receive(m_priv->transport);
 
     return ok;
 }
 
 
+int Programmer::submit_exchange(Request *request, Reply *reply)
+{
+    // Queue request and its reply on the transport. Returns ticket or < 0 on failure.
+    // request and reply must not be touched until complete_exchange() for this ticket.
+
+    assert(m_priv->transport);
+
+    if (request->m_debug) dump_data(stderr, request->data(), request->length(), "send bulk");
+
+    int ticket = m_priv->transport->submit(request->data(), request->length(),
+                    reply->buffer(), reply->capacity(), usb_timeout_ms(USB_TIMEOUT_BULK));
+    if (ticket < 0)
+        fprintf(stderr, "submit_exchange failed: %d\n", ticket);
+
+    return ticket;
+}
+
+
+bool Programmer::complete_exchange(int ticket, Reply *reply)
+{
+    int len = 0;
+    int rc = m_priv->transport->wait(ticket, &len);
+    if (rc != 0)
+    {
+        fprintf(stderr,"Reply::receive failed: %d\n", rc);
+        return false;
+    }
+
+    reply->received(len);
+    return true;
+}
+
+
 #if 0
 void * Programmer::get_device_handle(void)
 {
     // TEMPORARY
-    return m_priv ? m_priv->dev_handle : NULL;
+    return m_priv ? m_priv->transport : NULL;
 }
 #endif
 
 
 void Programmer::usb_print_info(void)
 {
-    if (m_priv->dev_handle)
-        print_device_info2(m_priv->dev_handle);
+    if (m_priv->transport)
+        m_priv->transport->print_info();
 }
 
 
 void Programmer::usb_clear_stall(void)
 {
     bool rc;
-    rc = m_priv->request.clear_stall(m_priv->dev_handle);
+    rc = m_priv->request.clear_stall(m_priv->transport);
 //    fprintf(stderr,"REQ clear stall -> %d (0 = fail)\n", rc);
-    rc = m_priv->reply.clear_stall(m_priv->dev_handle);
+    rc = m_priv->reply.clear_stall(m_priv->transport);
 //    fprintf(stderr,"REPLY clear stall -> %d (0 = fail)\n", rc);
 }
 
@@ -1925,9 +3088,15 @@ void Programmer::dostuff(void)
 
 bool Programmer::SPC_is_idle(bool wait)
 {
-    // Polls SPC Status register till it is idle or a timeout occurs
+    // Polls SPC Status register till it is idle or a timeout occurs.
+    // The SPC only goes busy when sent a command so no poll is needed if it was
+    // idle last time we looked and nothing has been sent since.
+
+    if (m_priv->spc_idle)
+        return true;
 
-    return SPC_wait_for_status(SPC_STATUS_IDLE, wait);
+    m_priv->spc_idle = SPC_wait_for_status(SPC_STATUS_IDLE, wait);
+    return m_priv->spc_idle;
 }
 
 
@@ -1945,20 +3114,32 @@ uint8_t Programmer::SPC_status(void)
     // Flash read, NV read to check if SPC Data register has data to be read.
     // The PSoC SPC status register value is present in the third least significant
 
-    // NOTE: First time this function is called data must be discarded but subsequent values are valid
+    // The dummy read in the request makes the result current (AP reads are posted: without it
+    // each poll returned the status sampled by the previous one and the first was stale).
+
+    build_status_request(&m_priv->request);
+    send_receive();
+
+    return decode_status_reply(&m_priv->reply);
+}
+
+
+void Programmer::build_status_request(Request *request)
+{
+    request->reset();
+    request->frame(FRAME_SPC_STATUS.bytes, FRAME_SPC_STATUS.len); // addr_write(REG_SPC_STATUS), dummy + read
+}
+
+
+uint8_t Programmer::decode_status_reply(Reply *reply)
+{
     uint8_t data[4];
 
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(REG_SPC_STATUS /* 0x40004722 */);
-    m_priv->request.apacc_data_read(1);
-    m_priv->request.send(m_priv->dev_handle);
-    
-//    send_receive();
+    memset(data, 0, sizeof(data));
 
-    m_priv->reply.receive(m_priv->dev_handle);
-    m_priv->reply.pop_ok();        // reply to addr_write
-//    m_priv->reply.pop_b4_ok(NULL); // first read - discard
-    m_priv->reply.pop_b4_ok(data); // second read
+    reply->pop_ok();        // reply to addr_write
+    reply->pop_b4_ok(NULL); // dummy read - previous result
+    reply->pop_b4_ok(data); // second read
 
     // FIXME: note pop_data must reverse data bytes, so LSB is in data[0]
 
@@ -1968,26 +3149,133 @@ uint8_t Programmer::SPC_status(void)
 
 bool Programmer::SPC_wait_for_status(uint8_t status, bool wait)
 {
-    // if not wait then just do twice, else until ready or timeout
+    // If not wait just poll once, else until the status is seen or the command has taken
+    // much longer than it normally does. A command with a known completion time (SpcTiming)
+    // is slept through until it is likely to be done rather than polled all the way.
 
-    int i;
-    uint8_t data = 0;
-    int loop_max = wait ? SPC_POLL_TIMEOUT : 1;
+    int npolls = 0;
+    int nbusy = 0;
+    bool found = false;
+    OpTimer timer(m_priv->transport, LATENCY_SPC_WAIT);
 
     if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: waiting for status %d\n", status);
-    SPC_status(); // discard first value
 
-    for (i=0; i < loop_max; i++)
+    bool pending = m_priv->spc_pending;
+    uint32_t key = m_priv->spc_pending_key;
+    uint64_t start_ns = m_priv->spc_start_ns;
+    uint64_t now_ns = m_priv->transport->clock_ns();
+    uint64_t timeout_at_ns = now_ns + (uint64_t)SPC_TIMING_DEFAULT_TIMEOUT_MS * 1000000;
+
+    if (pending)
     {
-        data = SPC_status();
-        if (data == status)
+        timeout_at_ns = start_ns + m_priv->spc_timing.timeout_ns(key);
+
+        uint64_t likely_ns = start_ns + m_priv->spc_timing.likely_done_ns(key);
+        if (wait && now_ns < likely_ns)
         {
-            if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: got status %d\n", status);
-            return true;
+            if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: sleeping %.3f ms\n", (likely_ns - now_ns) / 1e6);
+            m_priv->transport->sleep_ns(likely_ns - now_ns);
+        }
+    }
+
+    if (wait && m_priv->transport->max_inflight() > 1)
+    {
+        found = SPC_wait_for_status_pipelined(status, timeout_at_ns, &npolls, &nbusy);
+    }
+    else
+    {
+        do
+        {
+            if (usb_deadline_passed())
+                break;
+
+            found = SPC_status() == status;
+            npolls++;
+            if (!found) nbusy++;
+        }
+        while (wait && !found && m_priv->transport->clock_ns() < timeout_at_ns);
+    }
+    latency_record(LATENCY_SPC_POLLS, npolls);
+
+    if (found)
+    {
+        if (pending)
+        {
+            // only a poll that saw it busy pins down when it finished
+            uint64_t elapsed_ns = m_priv->transport->clock_ns() - start_ns;
+            if (nbusy > 0)
+                m_priv->spc_timing.sample(key, elapsed_ns);
+            else
+                m_priv->spc_timing.bound(key, elapsed_ns);
+            m_priv->spc_pending = false;
+        }
+
+        if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: got status %d\n", status);
+        return true;
+    }
+
+    if (wait)
+        fprintf(stderr, "SPC: TIMEOUT waiting for status %d\n", status);
+    return false;
+}
+
+
+bool Programmer::SPC_wait_for_status_pipelined(uint8_t status, uint64_t timeout_at_ns, int *npolls, int *nbusy)
+{
+    // Same as the blocking poll loop but keeps SPC_POLL_DEPTH status reads in flight so
+    // the bus is never idle between polls. Polls already in flight when the status
+    // matches are drained and ignored (they are plain reads so are harmless).
+    // *npolls is set to the number of status reads sent (including drained ones),
+    // *nbusy to the number that didn't match before the one that did.
+
+    int tickets[SPC_POLL_DEPTH];
+    int submitted = 0;
+    int completed = 0;
+    bool found = false;
+    bool ok = true;
+
+    *nbusy = 0;
+    build_status_request(&m_priv->status_request);
+
+    while (true)
+    {
+        while (ok && !found && submitted - completed < SPC_POLL_DEPTH &&
+               m_priv->transport->clock_ns() < timeout_at_ns && !usb_deadline_passed())
+        {
+            int ticket = submit_exchange(&m_priv->status_request, &m_priv->poll_replies[submitted % SPC_POLL_DEPTH]);
+            if (ticket < 0) { ok = false; break; }
+            tickets[submitted % SPC_POLL_DEPTH] = ticket;
+            submitted++;
         }
+
+        if (completed == submitted)
+            break;
+
+        Reply *reply = &m_priv->poll_replies[completed % SPC_POLL_DEPTH];
+        if (!complete_exchange(tickets[completed % SPC_POLL_DEPTH], reply))
+            ok = false;
+        completed++;
+
+        if (!ok || found)
+            continue; // drain
+
+        if (decode_status_reply(reply) == status)
+            found = true;
+        else
+            (*nbusy)++;
+    }
+
+    *npolls = submitted;
+
+    if (found)
+    {
+        if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: got status %d\n", status);
+        return true;
     }
 
-    fprintf(stderr, "SPC: TIMEOUT waiting for status %d\n", status);
+    if (ok)
+        fprintf(stderr, "SPC: TIMEOUT waiting for status %d\n", status);
+
     return false;
 }
 
@@ -2004,39 +3292,200 @@ bool Programmer::SPC_cmd_idle(uint8_t cmd, int arg1, int arg2, int arg3)
 bool Programmer::SPC_cmd_read(uint8_t *data, int len, uint8_t cmd, int arg1, int arg2, int arg3)
 {
     // convenience method
-    bool rc = SPC_cmd(cmd, arg1, arg2, arg3);
-    if (!rc) return false;
+    uint8_t args[3];
+    int nargs = 0;
 
-    rc = SPC_read_data_b0(data, len);
-    return rc;
+    args[0] = arg1;
+    args[1] = arg2;
+    args[2] = arg3;
+
+    if (arg3 >= 0) nargs = 3;
+    else if (arg2 >= 0) nargs = 2;
+    else if (arg1 >= 0) nargs = 1;
+
+    return SPC_cmd_read_fused(data, len, cmd, args, nargs);
 }
 
 
-bool Programmer::SPC_cmd_load_row(uint8_t array_id, const uint8_t *data, int len)
+bool Programmer::SPC_cmd_read_fused(uint8_t *data, int len, uint8_t cmd, const uint8_t *args, int nargs)
 {
-    uint8_t cmd = SPC_CMD_LOAD_ROW;
+    // Command, data reads and a closing status read in one exchange, instead of the
+    // separate idle poll, command, data ready poll, data read and idle poll exchanges.
+    //
+    // The data reads are speculative. Every CPU_DATA read also returns the SPC status (byte 2)
+    // so bytes read while the SPC was still busy executing the command are recognised, and
+    // the remainder is read the long way (poll for data ready, read) only in that case.
+    // To make that rare the data reads are preceded by status reads (the "pad") covering the
+    // time the command took last time.
 
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(REG_SPC_CPU_DATA);
-    m_priv->request.apacc_data_write((uint32_t)SPC_KEY1);
-    m_priv->request.apacc_data_write((uint32_t)(SPC_KEY2 + cmd));
-    m_priv->request.apacc_data_write((uint32_t)cmd);
-    m_priv->request.apacc_data_write((uint32_t)array_id);
+    assert(len > 0 && len <= SPC_MAX_READ_LEN);
+    assert(nargs <= 5);
 
+    uint8_t words[SPC_MAX_READ_LEN][4];
+    uint8_t pad_words[SPC_MAX_READ_PAD + 1][4];
+    uint8_t status[4];
     int i;
+
+    uint32_t key = (cmd << 16) | len;
+    int npad = m_priv->spc_read_pad.count(key) ? m_priv->spc_read_pad[key] : 0;
+
+    if (!SPC_is_idle()) return false;
+
+    m_priv->queue.reset();
+    SPC_queue_cmd(cmd, args, nargs);
+
+    // AP reads are posted (each returns the previous one): the read after the TAR change to
+    // CPU_DATA returns the last pad status and starts the first data read. TAR is moved back
+    // to STATUS before collecting the last byte so no extra CPU_DATA read is started (it
+    // would consume a byte if the data wasn't ready yet).
+    if (npad > 0)
+    {
+        m_priv->queue.apacc_addr_write(REG_SPC_STATUS);
+        m_priv->queue.apacc_dummy_read();
+        for (i=0; i<npad; i++)
+            m_priv->queue.apacc_data_read(pad_words[i]);
+        m_priv->queue.apacc_addr_write(REG_SPC_CPU_DATA);
+        m_priv->queue.apacc_data_read(pad_words[npad]);
+    }
+    else
+    {
+        m_priv->queue.apacc_addr_write(REG_SPC_CPU_DATA);
+        m_priv->queue.apacc_dummy_read();
+    }
+    for (i=0; i<len-1; i++)
+        m_priv->queue.apacc_data_read(words[i]);
+    m_priv->queue.apacc_addr_write(REG_SPC_STATUS);
+    m_priv->queue.apacc_data_read(words[len-1]);
+    m_priv->queue.apacc_data_read(status);
+
+    m_priv->spc_sent(SpcTiming::key(cmd, args, nargs), m_priv->transport->clock_ns());
+
+    if (!m_priv->queue.flush(m_priv->transport))
+    {
+        fprintf(stderr, "SPC_cmd_read_fused: send failed\n");
+        return false;
+    }
+
+    // SPC is busy (status 0) for the first reads if at all, then returns bytes in order
+    int nbusy = 0;
+    for (i=0; npad > 0 && i<=npad; i++)
+    {
+        if ((pad_words[i][2] & (SPC_STATUS_IDLE | SPC_STATUS_DATA_READY)) == 0)
+            nbusy++;
+    }
+
+    // A read that finds the SPC busy doesn't consume a byte, so busy words part way through
+    // (the SPC stalling between bytes) are skipped too and the rest comes after a poll below.
+    // Only the leading ones count towards the pad.
+    int nready = 0;
     for (i=0; i<len; i++)
     {
-        m_priv->request.apacc_data_write((uint32_t)data[i]);
+        bool busy = (words[i][2] & (SPC_STATUS_IDLE | SPC_STATUS_DATA_READY)) == 0;
+        if (!busy)
+            data[nready++] = words[i][0];
+        else if (nready == 0)
+            nbusy++;
+    }
+
+    // next time pad just enough to cover the busy time (plus one)
+    npad = nbusy + 1;
+    m_priv->spc_read_pad[key] = npad < SPC_MAX_READ_PAD ? npad : SPC_MAX_READ_PAD;
+
+    if (nready < len)
+    {
+        if (m_debug & DEBUG_SPC) fprintf(stderr, "SPC: %d of %d bytes ready - polling\n", nready, len);
+        return SPC_read_data_b0(data + nready, len - nready);
+    }
+
+    m_priv->spc_pending = false;
+    m_priv->spc_idle = status[2] == SPC_STATUS_IDLE;
+    return true;
+}
+
+
+bool Programmer::SPC_cmd_load_row(uint8_t array_id, const uint8_t *data, int len)
+{
+    SPC_prepare_load_row(array_id, data, len);
+    return SPC_send_load_row();
+}
+
+
+void Programmer::SPC_prepare_load_row(uint8_t array_id, const uint8_t *data, int len)
+{
+    // Encodes LOAD_ROW into row_queue. Safe to do while the SPC is busy: nothing is sent.
+    uint8_t cmd = SPC_CMD_LOAD_ROW;
+    SwdQueue *queue = &m_priv->row_queue;
+
+    queue->reset();
+
+    if (len <= SWD_FRAME_MAX_ROW_LEN)
+    {
+        SpcLoadRowFrame::encode(queue->frame(SpcLoadRowFrame::length(len)), array_id, data, len);
+    }
+    else
+    {
+        queue->apacc_addr_write(REG_SPC_CPU_DATA);
+        queue->apacc_data_write((uint32_t)SPC_KEY1);
+        queue->apacc_data_write((uint32_t)(SPC_KEY2 + cmd));
+        queue->apacc_data_write((uint32_t)cmd);
+        queue->apacc_data_write((uint32_t)array_id);
+
+        int i;
+        for (i=0; i<len; i++)
+        {
+            queue->apacc_data_write((uint32_t)data[i]);
+        }
     }
 
-    if (!send_receive())
+    m_priv->row_queue_len = len;
+}
+
+
+bool Programmer::SPC_send_load_row(void)
+{
+    // Sends the LOAD_ROW from SPC_prepare_load_row once the SPC is idle, followed in the same
+    // exchange by enough status reads to see the load finish (learned as for SPC_cmd_read_fused)
+    // so the command that uses the row normally needs no idle poll of its own.
+
+    uint8_t pad_words[SPC_MAX_READ_PAD][4];
+    int i;
+
+    uint32_t key = (SPC_CMD_LOAD_ROW << 16) | m_priv->row_queue_len;
+    int npad = m_priv->spc_read_pad.count(key) ? m_priv->spc_read_pad[key] : 1;
+
+    if (!SPC_is_idle()) return false; // single row latch: previous row must be finished
+
+    m_priv->queue.reset();
+    m_priv->queue.swap_ops(m_priv->row_queue);
+
+    // posted reads: the dummy read samples the first status, each read returns the previous sample
+    m_priv->queue.apacc_addr_write(REG_SPC_STATUS);
+    m_priv->queue.apacc_dummy_read();
+    for (i=0; i<npad; i++)
+        m_priv->queue.apacc_data_read(pad_words[i]);
+
+    m_priv->spc_sent(SpcTiming::key(SPC_CMD_LOAD_ROW, NULL, 0), m_priv->transport->clock_ns());
+
+    if (!m_priv->queue.flush(m_priv->transport))
     {
-        fprintf(stderr, "SPC_cmd_load_row: send_receive failed\n");
+        fprintf(stderr, "SPC_cmd_load_row: send failed\n");
         return false;
     }
 
-    //fprintf(stderr, "SPC_cmd_load_row\n");
-    return m_priv->reply.pop_ok(-1); // FIXME: what value
+    int nbusy = 0;
+    for (i=0; i<npad; i++)
+    {
+        if ((pad_words[i][2] & (SPC_STATUS_IDLE | SPC_STATUS_DATA_READY)) == 0)
+            nbusy++;
+    }
+
+    m_priv->spc_idle = pad_words[npad - 1][2] == SPC_STATUS_IDLE;
+    m_priv->spc_pending = !m_priv->spc_idle;
+
+    npad = nbusy + 1;
+    m_priv->spc_read_pad[key] = npad < SPC_MAX_READ_PAD ? npad : SPC_MAX_READ_PAD;
+
+    return true;
 }
 
 
@@ -2072,26 +3521,47 @@ bool Programmer::SPC_cmd(uint8_t cmd, uint8_t *args, int nargs)
     if (!SPC_is_idle()) return false;    
 #endif
 
-    // note: interface is only one byte wide so all data, args are serialised into bottom byte
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(REG_SPC_CPU_DATA);
-    m_priv->request.apacc_data_write((uint32_t)SPC_KEY1);
-    m_priv->request.apacc_data_write((uint32_t)(SPC_KEY2 + cmd));
-    m_priv->request.apacc_data_write((uint32_t)cmd);
+    m_priv->queue.reset();
+    SPC_queue_cmd(cmd, args, nargs);
+    m_priv->spc_sent(SpcTiming::key(cmd, args, nargs), m_priv->transport->clock_ns());
 
-    int i;
-    for(i=0; i<nargs; i++)
+    if (!m_priv->queue.flush(m_priv->transport))
     {
-        m_priv->request.apacc_data_write((uint32_t)args[i]);
+        fprintf(stderr, "SPC_cmd: send failed\n");
+        return false;
     }
 
-    if (!send_receive())
+    return true;
+}
+
+
+void Programmer::SPC_queue_cmd(uint8_t cmd, const uint8_t *args, int nargs)
+{
+    // note: interface is only one byte wide so all data, args are serialised into bottom byte
+    SwdQueue *queue = &m_priv->queue;
+
+    // precomputed frame for each argument count the SPC commands use
+    switch (nargs)
     {
-        fprintf(stderr, "SPC_cmd: send_receive failed\n");
-        return false;
+    case 0: SpcCmdFrame<0>::encode(queue->frame(SpcCmdFrame<0>::LEN), cmd, args); return;
+    case 1: SpcCmdFrame<1>::encode(queue->frame(SpcCmdFrame<1>::LEN), cmd, args); return;
+    case 2: SpcCmdFrame<2>::encode(queue->frame(SpcCmdFrame<2>::LEN), cmd, args); return;
+    case 3: SpcCmdFrame<3>::encode(queue->frame(SpcCmdFrame<3>::LEN), cmd, args); return;
+    case 4: SpcCmdFrame<4>::encode(queue->frame(SpcCmdFrame<4>::LEN), cmd, args); return;
+    case 5: SpcCmdFrame<5>::encode(queue->frame(SpcCmdFrame<5>::LEN), cmd, args); return;
+    default: break;
     }
 
-    return m_priv->reply.pop_ok(-1); // FIXME: what value
+    m_priv->queue.apacc_addr_write(REG_SPC_CPU_DATA);
+    m_priv->queue.apacc_data_write((uint32_t)SPC_KEY1);
+    m_priv->queue.apacc_data_write((uint32_t)(SPC_KEY2 + cmd));
+    m_priv->queue.apacc_data_write((uint32_t)cmd);
+
+    int i;
+    for(i=0; i<nargs; i++)
+    {
+        m_priv->queue.apacc_data_write((uint32_t)args[i]);
+    }
 }
 
 
@@ -2106,21 +3576,22 @@ bool Programmer::SPC_read_data_b0(uint8_t *data, int len)
         return false;    
     }
 
-    m_priv->request.reset();
-    m_priv->request.apacc_addr_write(REG_SPC_CPU_DATA);
-    m_priv->request.apacc_data_read(len + 1); // one dummy read, plus real reads
+    // Data reply is  21 (for addr_write), ddxxxxxx 21  ddxxxxxx 21 ...
+    m_priv->spc_idle = false;
+    m_priv->queue.reset();
+    m_priv->queue.apacc_addr_write(REG_SPC_CPU_DATA);
+    m_priv->queue.apacc_dummy_read(); // one dummy read, plus real reads
 
-    if (!send_receive())
+    int i;
+    for (i=0; i<len; i++)
+        m_priv->queue.apacc_data_read_b0(data + i);
+
+    if (!m_priv->queue.flush(m_priv->transport))
     {
-        fprintf(stderr, "SPC_read_data_b0: send_receive failed\n");
+        fprintf(stderr, "SPC_read_data_b0: send failed\n");
         return false;
     }
 
-    // Data reply is  21 (for addr_write), ddxxxxxx 21  ddxxxxxx 21 ...
-    m_priv->reply.pop_ok(); // cmd
-    m_priv->reply.pop_nb0_ok(NULL, 1); // discard dummy
-    m_priv->reply.pop_nb0_ok(data, len);
-
     if (m_debug & DEBUG_SPC) fprintf(stderr,"SPC_read_data_b0() - END\n", len);
 
     return SPC_is_idle();
@@ -2132,9 +3603,27 @@ bool Programmer::SPC_read_data_b0(uint8_t *data, int len)
 Request::Request(uint8_t ep_addr)
     : m_len(0)
     , m_ep_addr(ep_addr)
+    , m_data(NULL)
     , m_debug(0)
 {
-    memset(m_data, 0, REQUEST_MAX_LEN); // Much be big enough
+}
+
+
+bool Request::attach(Transport *transport)
+{
+    assert(REQUEST_MAX_LEN <= TRANSPORT_BUFFER_LEN);
+
+    if (!m_data) m_data = transport->get_buffer();
+    m_len = 0;
+    return m_data != NULL;
+}
+
+
+void Request::detach(Transport *transport)
+{
+    if (m_data) transport->put_buffer(m_data);
+    m_data = NULL;
+    m_len = 0;
 }
 
 
@@ -2158,6 +3647,16 @@ void Request::raw_hex(const char *hexstr)
 }
 
 
+void Request::frame(const uint8_t *bytes, int len)
+{
+    // precomputed (SwdFrame.h): appends
+    assert(REQUEST_MAX_LEN - m_len >= len);
+
+    memcpy(m_data + m_len, bytes, len);
+    m_len += len;
+}
+
+
 void Request::c1(uint8_t cmd)
 {
     m_data[m_len++] = cmd;
@@ -2185,9 +3684,10 @@ void Request::apacc_data_read(int n_reads=1)
 }
 
 
-bool Request::send(libusb_device_handle *dev_handle)
+bool Request::send(Transport *transport)
 {
-    int rc = send_bulk_data(dev_handle, m_ep_addr, m_data, m_len);
+    assert(m_data);
+    int rc = transport->bulk_out(m_ep_addr, m_data, m_len);
     if (m_debug)
     {
         dump_data(stderr, m_data, m_len, "send bulk");
@@ -2198,9 +3698,9 @@ bool Request::send(libusb_device_handle *dev_handle)
 }
 
 
-bool Request::clear_stall(libusb_device_handle *dev_handle)
+bool Request::clear_stall(Transport *transport)
 {
-    int rc = clear_endpoint_stall(dev_handle, m_ep_addr);
+    int rc = transport->clear_stall(m_ep_addr);
     return (rc == 0);
 }
 
@@ -2221,13 +3721,12 @@ Reply::Reply(uint8_t ep_addr)
     , m_head(0)
     , m_debug(0)
 {
-    m_data = (uint8_t *) calloc(REPLY_MAX_LEN, 1);
 }
 
 
 Reply::~Reply()
 {
-    if (m_data) free(m_data);
+    // buffer belongs to the transport pool, see detach()
     m_data = NULL;
     m_len = 0;
     m_ep_addr = 0;
@@ -2235,13 +3734,34 @@ Reply::~Reply()
 }
 
 
-bool Reply::receive(libusb_device_handle *dev_handle)
+bool Reply::attach(Transport *transport)
+{
+    assert(REPLY_MAX_LEN <= TRANSPORT_BUFFER_LEN);
+
+    if (!m_data) m_data = transport->get_buffer();
+    m_len = 0;
+    m_head = 0;
+    return m_data != NULL;
+}
+
+
+void Reply::detach(Transport *transport)
+{
+    if (m_data) transport->put_buffer(m_data);
+    m_data = NULL;
+    m_len = 0;
+    m_head = 0;
+}
+
+
+bool Reply::receive(Transport *transport)
 {
-    memset(m_data, 0, REPLY_MAX_LEN); // paranoia
+    // No clearing: only the first m_len bytes are ever read back
+    assert(m_data);
     m_head = 0;
 
     int max_length = REPLY_MAX_LEN;
-    int actual_len = recv_bulk_data(dev_handle, m_ep_addr, m_data, max_length);
+    int actual_len = transport->bulk_in(m_ep_addr, m_data, max_length);
     if (actual_len < 0)
     {
         fprintf(stderr,"Reply::receive failed: %d\n", actual_len);
@@ -2254,9 +3774,19 @@ bool Reply::receive(libusb_device_handle *dev_handle)
 }
 
 
-bool Reply::clear_stall(libusb_device_handle *dev_handle)
+void Reply::received(int len)
+{
+    // reply data has been placed directly in buffer() (eg by the async engine)
+    m_head = 0;
+    m_len = len;
+
+    if (m_debug) { dump_data(stderr, m_data, len, "Reply:receive"); }
+}
+
+
+bool Reply::clear_stall(Transport *transport)
 {
-    int rc = clear_endpoint_stall(dev_handle, m_ep_addr);
+    int rc = transport->clear_stall(m_ep_addr);
     return (rc == 0);
 }
 
@@ -2265,7 +3795,6 @@ bool Reply::pop_ok(int n)
 {
     // pop n items off stack. If all of them were REPLY_OK, return true
 
-    int data = -1;
     bool ok = true;
 
     if (n<0)
@@ -2274,29 +3803,35 @@ bool Reply::pop_ok(int n)
     assert( n >= 0 );
 
     //DEBUG_REPLY_MSG(fprintf(stderr, "pop_ok(%d) ", n));
-    if (m_debug) fprintf(stderr, "pop_ok(%d) ", n);
-
-    while (n--)
+    if (m_debug)
     {
-        if (m_head > m_len )
-           assert(0 && "unexpected pop_ok");
+        fprintf(stderr, "pop_ok(%d) ", n);
+        for (int i=0; i<n && m_head + i < m_len; i++)
+            fprintf(stderr, "P[%x] ", m_data[m_head + i]);
+    }
 
-        data = m_data[m_head++];
-        //DEBUG_REPLY_MSG(fprintf(stderr, "P[%x] ", data));
-        if (m_debug) fprintf(stderr, "P[%x] ", data);
+    int avail = m_len - m_head;
+    int bad = swd_reply_check_acks(m_data + m_head, 1, n < avail ? n : avail);
+    if (bad < 0 && n > avail)
+        bad = avail;    // short reply: first missing item
 
-        if (data != REPLY_OK && data != REPLY_JTAGID_MATCHED)
-            ok = false;
-    }
+    if (bad >= 0)
+        ok = false;
 
     //DEBUG_REPLY_MSG(fprintf(stderr,"%s\n", ok ? "OK" : "FAILED"));
     if (!ok || m_debug)
     {
         fprintf(stderr, "\npop_ok %s ", ok ? "OK" : "Failed");
-        fprintf(stderr, "Expected 0x%x found 0x%x.\nData (%d): ", REPLY_OK , data, m_len);
+        if (!ok && bad < avail)
+            fprintf(stderr, "Expected 0x%x found 0x%x at reply byte %d.\nData (%d): ", REPLY_OK , m_data[m_head + bad], m_head + bad, m_len);
+        else if (!ok)
+            fprintf(stderr, "Expected 0x%x at reply byte %d: past end.\nData (%d): ", REPLY_OK , m_head + bad, m_len);
+        else
+            fprintf(stderr, "Data (%d): ", m_len);
         dump_data(stderr, m_data, m_len, NULL);
     }
 
+    m_head += n < avail ? n : avail;
     return ok;
 }
 
@@ -2337,20 +3872,20 @@ bool Reply::pop_nb0_ok(uint8_t *data, int length)
 
     // FIXME: pop data regardless of status !?
 
-    uint8_t *dp = data;
-    uint8_t data_item[4];
-    bool ok = true;
-
     assert (length >= 0);
 
-    while (length--)
-    {
-        if (!pop_b4_ok(data_item))
-            ok = false;
+    if (m_head + SWD_REPLY_READ_LEN * length > m_len)
+       assert(0 && "unexpected pop_nb0_ok insufficient data left");
 
-        if (data)
-            *dp++ = data_item[0];
+    int bad = swd_reply_decode_b0(m_data + m_head, length, data);
+    if (bad >= 0)
+    {
+        int ack_pos = m_head + SWD_REPLY_READ_LEN * bad + SWD_REPLY_READ_LEN - 1;
+        fprintf(stderr, "\npop_nb0_ok Failed item %d of %d. Expected 0x%x found 0x%x at reply byte %d.\nData (%d): ",
+            bad, length, REPLY_OK, m_data[ack_pos], ack_pos, m_len);
+        dump_data(stderr, m_data, m_len, NULL);
     }
 
-    return ok;
+    m_head += SWD_REPLY_READ_LEN * length;
+    return bad < 0;
 }
@@ -26,6 +26,7 @@
 
 #include "AppData.h"
 #include "DeviceData.h"
+#include "progress.h"
 
 //#define SUCCESS   true
 //#define FAILURE   false
@@ -41,6 +42,16 @@
 #define RD_TRIM_EEPROM  0x02
 #define RD_TRIM_ALL     (RD_TRIM_FLASH | RD_TRIM_EEPROM)
 
+// write flags
+#define WR_DIFFERENTIAL 0x01    // only write flash rows whose checksum differs from the image (not with ECC)
+#define WR_PLAN_ONLY    0x02    // print the flash write plan (FlashPlan.h), write nothing
+
+#define FLASH_WRITE_DEFAULT_RETRIES     3   // recoveries from USB stalls/faults in one flash write
+
+// verify flags
+#define VR_STRICT       0x01    // read back and compare every flash row, not just those whose checksum differs
+#define VR_CONTINUE     0x02    // compare everything, don't stop at the first mismatch
+
 
 // verify device return code
 #define VERIFY_MATCH                    0x00
@@ -55,9 +66,25 @@
 #define VERIFY_MISSING_FILE_DATA         0x1000
 #define VERIFY_DEVICE_READ_FAILED        0x2000
 
+#define VERIFY_REPORT_BYTES             8   // mismatched bytes printed per row
+#define VERIFY_STREAM_ROWS              16  // rows read back (and compared) at a time
+
+// one byte of the device that doesn't match the file (verify_device)
+struct verify_mismatch_s
+{
+    uint32_t what;      // VERIFY_MISMATCH_CODE, _CONFIG, _PROTECTION or _EEPROM
+    int row;            // flash: in the whole image (array = row / rows per array). protection: array. EEPROM: row
+    int offset;         // in the row. flash: code bytes then config bytes
+    uint8_t expected;
+    uint8_t actual;
+};
 
 
 struct programmer_priv_s;
+class Request;
+class Reply;
+class FlashJournal;
+class FlashPlan;
 
 
 class Programmer
@@ -69,6 +96,16 @@ class Programmer
 
     // config
     std::string m_fx2_config_file;
+    std::string m_config_filepath;
+    std::string m_transport_name;   // "usb" or "sim"
+    std::string m_trace_file;       // USB transaction trace (usbtrace.h), empty: none
+    uint32_t m_job_timeout_ms;      // whole job deadline (usbtimeout.h), 0: none
+    std::string m_device_id;        // which programmer (Transport::enumerate), empty: first found
+    std::string m_spc_timing_file;  // learned SPC command times (SpcTiming.h), empty: none
+    bool m_flash_loader;            // program flash through the SRAM loader (psoc_loader.h). Experimental: off by default
+    bool m_flash_journal;           // journal flash writes so they can resume (FlashJournal.h)
+    std::string m_flash_journal_file;
+    int m_flash_write_retries;      // recoveries from a failed flash write before giving up
     uint32_t m_debug;
     uint16_t m_vid_unconfigured;
     uint16_t m_pid_unconfigured;
@@ -79,16 +116,23 @@ class Programmer
     bool SPC_is_idle(bool wait=true);
     bool SPC_is_data_ready(bool wait=true);
     uint8_t SPC_status(void);
+    void build_status_request(Request *request);
+    uint8_t decode_status_reply(Reply *reply);
     bool SPC_wait_for_status(uint8_t status, bool wait);
+    bool SPC_wait_for_status_pipelined(uint8_t status, uint64_t timeout_at_ns, int *npolls, int *nbusy);
     bool SPC_cmd(uint8_t cmd, int arg1 = -1, int arg2 = -1, int arg3 = -1);
     bool SPC_cmd(uint8_t cmd, uint8_t *args, int nargs);
     bool SPC_cmd_idle(uint8_t cmd, int arg1 = -1, int arg2 = -1, int arg3 = -1);
     bool SPC_cmd_read(uint8_t *data, int len, uint8_t cmd, int arg1 = -1, int arg2 = -1, int arg3 = -1);
+    bool SPC_cmd_read_fused(uint8_t *data, int len, uint8_t cmd, const uint8_t *args, int nargs);
+    void SPC_queue_cmd(uint8_t cmd, const uint8_t *args, int nargs);
     bool SPC_cmd_addr24(uint8_t cmd, uint8_t aid, uint32_t addr, int len);
     bool SPC_read_data_b0(uint8_t *data, int len);
     bool SPC_cmd_write(const uint8_t *data, int len, uint8_t cmd, int arg1 = -1, int arg2 = -1, int arg3 = -1);
     bool SPC_read_data_b4(uint32_t address, uint32_t *data, int len);
     bool SPC_cmd_load_row(uint8_t array_id, const uint8_t *data, int len);
+    void SPC_prepare_load_row(uint8_t array_id, const uint8_t *data, int len);
+    bool SPC_send_load_row(void);
 
     bool NV_WOL_read(AppData *appdata);
     bool NV_WOL_write(const AppData *appdata);
@@ -100,9 +144,32 @@ class Programmer
 
     bool NV_flash_read(AppData *appdata, bool trim);
     bool NV_flash_read_row(v_uint8_t &vdata, uint8_t array_num, uint32_t address);
-    bool NV_flash_write(const AppData *appdata);
-    bool NV_flash_write_row(const uint8_t *data, int len, uint8_t array_num, uint32_t address, int even);
+    bool NV_flash_write(const AppData *appdata, uint32_t flags=0);
+    const uint8_t *NV_flash_row_data(const AppData *appdata, int row, uint8_t *row_data, int row_len);
+    bool NV_flash_write_rows(const AppData *appdata, const FlashPlan &plan, int first, int row_len, int die_temp,
+                             uint8_t *row_data, FlashJournal *journal, int *done);
+    bool NV_flash_write_loader(const AppData *appdata, const FlashPlan &plan, int first, int row_len, int die_temp,
+                               FlashJournal *journal, int *done);
+    bool NV_flash_rows_match(const AppData *appdata, int first_row, int nrows, uint8_t *row_data, int row_len);
+    bool NV_flash_changed_rows(const AppData *appdata, const std::vector<uint8_t> &row_map, int row_len, uint8_t *row_data,
+                               std::vector<int> &rows);
+    bool NV_flash_diff_range(const std::vector<uint32_t> &sums, int first_row, int nrows, bool differs, std::vector<int> &rows);
+    bool NV_flash_plan(const std::vector<uint8_t> &row_map, FlashPlan &plan);
+    bool NV_flash_protected(bool *protected_rows);
+    bool NV_flash_erase_planned(const FlashPlan &plan);
+    uint32_t NV_flash_verify(const AppData *appdata, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches);
+    bool NV_flash_read_image_rows(int first_row, int nrows, int row_len, uint8_t *code, uint8_t *config);
+    uint32_t NV_protection_verify(const HexData *file_protection, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches);
+    uint32_t NV_eeprom_verify(const HexData *file_eeprom, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches);
+    static int verify_bytes(uint32_t what, int row, int offset, const uint8_t *expected, const uint8_t *actual, int len,
+                            const char *label, int label_offset, std::vector<struct verify_mismatch_s> *mismatches);
+    static int verify_hexdata(uint32_t what, int row, const HexData *file_data, uint32_t address, const uint8_t *actual, int len,
+                              const char *label, std::vector<struct verify_mismatch_s> *mismatches);
+    static bool hexdata_overlaps(const HexData *file_data, uint32_t address, int len);
+    bool loader_start(void);
+    void loader_stop(void);
     int NV_flash_row_length(const AppData *appdata) const;
+    bool NV_flash_checksum_covers_image(const AppData *appdata) const;
 
     bool NV_protection_read(AppData *appdata);
     bool NV_protection_write(const AppData *appdata);
@@ -119,6 +186,7 @@ class Programmer
 
     bool NV_read_multi_bytes(uint8_t array_id, uint32_t address, uint8_t *data, int len);
     bool NV_write_row(uint8_t array_id, uint16_t row_num, int die_temp, const uint8_t *data, int len, bool erase_first=true);
+    bool NV_write_row_start(uint8_t array_id, uint16_t row_num, int die_temp, bool erase_first=true);
     bool NV_protect(uint8_t array_id, const uint8_t *data, int len);
     bool NV_read_b4(uint8_t array_id, uint32_t *value);
     bool NV_write_b4(uint8_t array_id, uint32_t value);
@@ -127,16 +195,24 @@ class Programmer
     bool configure_usb_programmer(void);
     bool switch_to_swd(void);
     bool send_receive(void);
+    int submit_exchange(Request *request, Reply *reply);
+    bool complete_exchange(int ticket, Reply *reply);
     bool send_c1d4_recv_ok(uint8_t cmd, uint32_t data);
     bool jtag_to_swd(void);
     bool acquire_target_device(void);
+    bool reacquire_target(void);
     bool release_target_device(void);
 
     bool ap_register_read(uint32_t address, uint32_t *value, bool dummy_preread=true);
     bool ap_register_read(uint32_t address, uint8_t *data, bool dummy_preread=true);
+    bool ahb_read(uint32_t address, uint8_t *data, int len);
     bool ap_register_write(uint32_t address, uint32_t value);
 
     void set_debug(uint32_t flags) { m_debug = flags; }
+    void trace_mark(const char *phase);
+    void progress_phase(int phase, int rows_total, uint64_t bytes_total);
+    void progress_rows(int rows_done, uint64_t bytes_done);
+    void progress_phase_end(void);
 //    bool verify_checksum(uint16_t reference_checksum);
 
     void program_geom(int code_len, int *num_arrays, int *row_remainder);
@@ -146,6 +222,14 @@ class Programmer
     Programmer();
     ~Programmer();
 
+    void set_transport(std::string transport_name) { m_transport_name = transport_name; } // overrides config file
+    void set_trace_file(std::string trace_file) { m_trace_file = trace_file; } // overrides config file
+    void set_job_timeout(uint32_t ms) { m_job_timeout_ms = ms; } // overrides config file
+    void set_device(std::string device_id) { m_device_id = device_id; }
+    // reports progress of erase/write/read/verify to fn (progress.h). fn NULL: none
+    void set_progress(progress_fn fn, void *ctx, unsigned int interval_ms=PROGRESS_DEFAULT_INTERVAL_MS);
+    uint32_t job_timeout(void) const { return m_job_timeout_ms; } // valid after open()
+    int find_programmers(std::string config_dir, std::string config_filename, std::vector<std::string> &ids);
     int open(std::string config_dir, std::string config_filename, DeviceData *devdata);
     void close();
 
@@ -157,9 +241,9 @@ class Programmer
     bool NV_read_checksum(int code_len, uint32_t *checksum);
 
     bool read_device(AppData *appdata, uint32_t flags);
-    bool write_device(const AppData *appdata);
+    bool write_device(const AppData *appdata, uint32_t flags=0);
     bool write_hexfile(const char *filename, const AppData *appdata);
-    uint32_t verify_device(const AppData *appdata, uint32_t flags);
+    uint32_t verify_device(const AppData *appdata, uint32_t flags, std::vector<struct verify_mismatch_s> *mismatches=NULL);
     void dump_flash_data(const AppData *appdata, bool shortform, const char *filename=NULL);
     bool erase_flash(void);
     void reset_cpu(void);
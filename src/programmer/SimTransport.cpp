@@ -0,0 +1,1405 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "SimTransport.h"
+#include "SwdProtocol.h"
+#include "DeviceData.h"
+#include "HierINIReader.h"
+#include "psoc_loader.h"
+
+
+#define SIM_CONFIG_SECTION          "Simulator"
+#define SIM_STATE_MAGIC             "PSOCSIM1"
+
+#define SIM_DEFAULT_JTAG_ID         0x2BA01477
+#define SIM_DEFAULT_DEVICE_CONFIG   0x00000000  // ECCEN=0, ie extra flash holds config data
+
+#define SIM_SRAM_BASE               0x1FFF8000
+#define SIM_SRAM_SIZE               0x10000
+
+// SRAM loader model (loader_run)
+#define LOADER_STATE_WAIT           0   // for a slot
+#define LOADER_STATE_LOADED         1   // LOAD_ROW sent
+#define LOADER_STATE_PROG           2   // program command sent
+#define LOADER_STATE_FAILED         3
+
+#define SIM_ROWS_PER_SECTOR         64
+
+// DP CTRL/STAT: power up requests (bits 30, 28) are acked in bits 31, 29
+#define DP_CTRLSTAT_PWRUPREQ_MASK   0x50000000
+
+// FX2 vendor control requests (see Programmer)
+#define FX2_REQ_JTAG_TO_SWD         95
+#define FX2_REQ_RESET               100
+
+// SPC command sequencer states
+#define SPC_STATE_IDLE              0
+#define SPC_STATE_KEY1              1
+#define SPC_STATE_CMD               2
+#define SPC_STATE_ARGS              3
+#define SPC_STATE_LOAD_DATA         4
+
+
+static uint64_t wall_clock_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+SimTransport::SimTransport(uint8_t ep_out, uint8_t ep_in, const DeviceData *devdata)
+    : Transport(ep_out, ep_in)
+    , m_spc_busy_until(0)
+    , m_host_us(0)
+    , m_device_us(0)
+    , m_wall_start_us(0)
+    , m_usb_latency_us(SIM_DEFAULT_USB_LATENCY_US)
+    , m_swd_op_us(SIM_DEFAULT_SWD_OP_US)
+    , m_realtime(false)
+    , m_jtag_id(SIM_DEFAULT_JTAG_ID)
+    , m_state_file()
+    , m_debug(0)
+    , m_gang_size(1)
+    , m_device_id()
+    , m_stall_at(0)
+    , m_stalled(false)
+    , m_open(false)
+    , m_pending_done_us(0)
+    , m_reply_pending(false)
+    , m_next_ticket(0)
+    , m_pending(0)
+    , m_n_exchanges(0)
+    , m_n_swd_ops(0)
+    , m_n_spc_cmds(0)
+    , m_bytes_out(0)
+    , m_bytes_in(0)
+{
+    if (devdata)
+    {
+        m_num_arrays = devdata->flash_num_arrays;
+        m_rows_per_array = devdata->flash_rows_per_array;
+        m_code_bytes_per_row = devdata->flash_code_bytes_per_row;
+        m_config_bytes_per_row = devdata->flash_config_bytes_per_row;
+        m_rows_per_protection_byte = devdata->flash_rows_per_protection_byte;
+        m_flash_code_base_address = devdata->flash_code_base_address;
+        m_flash_config_base_address = devdata->flash_config_base_address;
+        m_flash_config_ahb_address = devdata->flash_config_ahb_address;
+        m_eeprom_size = devdata->eeprom_size;
+        m_eeprom_bytes_per_row = devdata->eeprom_bytes_per_row;
+        m_eeprom_base_address = devdata->eeprom_base_address;
+    }
+    else
+    {
+        // commands that don't need a device (id, reset, erase). Same as PSOC5LP-xxx in devices.dat
+        m_num_arrays = 4;
+        m_rows_per_array = 256;
+        m_code_bytes_per_row = 256;
+        m_config_bytes_per_row = 32;
+        m_rows_per_protection_byte = 4;
+        m_flash_code_base_address = 0x000000;
+        m_flash_config_base_address = 0x800000;
+        m_flash_config_ahb_address = 0;
+        m_eeprom_size = 2048;
+        m_eeprom_bytes_per_row = 16;
+        m_eeprom_base_address = 0x40008000;
+    }
+
+    m_flash.assign(m_num_arrays * m_rows_per_array * row_stride(), 0);
+    m_protection.assign(m_num_arrays * (m_rows_per_array / m_rows_per_protection_byte), 0);
+    m_eeprom.assign(m_eeprom_size, 0);
+    m_sram.assign(SIM_SRAM_SIZE, 0);
+    m_latch.assign(row_stride() > m_eeprom_bytes_per_row ? row_stride() : m_eeprom_bytes_per_row, 0);
+
+    uint32_to_nvl(SIM_DEFAULT_DEVICE_CONFIG, m_nvl_user);
+    memset(m_nvl_wol, 0, sizeof(m_nvl_wol));
+
+    memset(m_exchanges, 0, sizeof(m_exchanges));
+
+    reset_target();
+}
+
+
+SimTransport::~SimTransport()
+{
+    close();
+}
+
+
+void SimTransport::uint32_to_nvl(uint32_t value, uint8_t *nvl)
+{
+    // NVL bytes are LSB first (byte 0 == LSB), same as NV_read_b4()
+    nvl[0] = value & 0xFF;
+    nvl[1] = (value >> 8) & 0xFF;
+    nvl[2] = (value >> 16) & 0xFF;
+    nvl[3] = (value >> 24) & 0xFF;
+}
+
+
+bool SimTransport::read_config(const std::string &config_filepath)
+{
+    HierINIReader reader(config_filepath);
+
+    if (reader.ParseError() < 0)
+    {
+        fprintf(stderr, "sim: can't read '%s' - using defaults\n", config_filepath.c_str());
+        return false;
+    }
+
+    std::string section = SIM_CONFIG_SECTION;
+
+    m_state_file = reader.Get(section, "state_file", "");
+    m_realtime = reader.GetBoolean(section, "realtime", false);
+    m_jtag_id = reader.GetUint32(section, "jtag_id", SIM_DEFAULT_JTAG_ID);
+    m_usb_latency_us = reader.GetInteger(section, "usb_latency_us", SIM_DEFAULT_USB_LATENCY_US);
+    m_swd_op_us = reader.GetInteger(section, "swd_op_us", SIM_DEFAULT_SWD_OP_US);
+    m_debug = reader.GetInteger(section, "debug", 0);
+    m_gang_size = reader.GetInteger(section, "gang_size", 1);
+    if (m_gang_size < 1) m_gang_size = 1;
+    if (m_gang_size > SIM_MAX_GANG_SIZE) m_gang_size = SIM_MAX_GANG_SIZE;
+    m_stall_at = reader.GetInteger(section, "stall_at_exchange", 0);
+
+    // initial NVL contents (a state file, if present, overrides this)
+    uint32_to_nvl(reader.GetUint32(section, "device_config", SIM_DEFAULT_DEVICE_CONFIG), m_nvl_user);
+
+    return true;
+}
+
+
+bool SimTransport::open(uint16_t vid, uint16_t pid)
+{
+    if (m_open)
+        return true;
+
+    if (m_state_file.length() > 0)
+        load_state();
+
+    reset_target();
+
+    m_host_us = 0;
+    m_device_us = 0;
+    m_wall_start_us = wall_clock_us();
+    m_open = true;
+
+    fprintf(stderr, "sim: simulated programmer %s0x[%04x:%04x], jtag id 0x%08x%s\n",
+        m_device_id.length() ? (m_device_id + " ").c_str() : "", vid, pid, m_jtag_id, m_realtime ? " (realtime)" : "");
+
+    return true;
+}
+
+
+void SimTransport::close(void)
+{
+    if (!m_open)
+        return;
+
+    release_buffers();
+
+    if (m_state_file.length() > 0)
+        save_state();
+
+    fprintf(stderr, "sim: %llu exchanges, %llu SWD ops, %llu SPC cmds, %llu bytes out, %llu bytes in, %.3f ms\n",
+        (unsigned long long)m_n_exchanges, (unsigned long long)m_n_swd_ops, (unsigned long long)m_n_spc_cmds,
+        (unsigned long long)m_bytes_out, (unsigned long long)m_bytes_in, m_host_us / 1000.0);
+
+    m_open = false;
+}
+
+
+int SimTransport::enumerate(uint16_t vid, uint16_t pid, uint16_t vid_unconfigured, uint16_t pid_unconfigured,
+                            std::vector<std::string> &ids)
+{
+    int i;
+    for (i=0; i<m_gang_size; i++)
+    {
+        char id[16];
+        snprintf(id, sizeof(id), "sim%d", i);
+        ids.push_back(id);
+    }
+    return ids.size();
+}
+
+
+bool SimTransport::select_device(const std::string &id)
+{
+    // each simulated programmer + target keeps its own state file
+    if (id.compare(0, 3, "sim") != 0 || atoi(id.c_str() + 3) >= m_gang_size)
+    {
+        fprintf(stderr, "sim: no simulated programmer '%s' (gang_size %d)\n", id.c_str(), m_gang_size);
+        return false;
+    }
+
+    m_device_id = id;
+    if (m_state_file.length() > 0)
+        m_state_file += "." + id;
+
+    return true;
+}
+
+
+bool SimTransport::configure_programmer(uint16_t vid, uint16_t pid, const std::string &fx2_config_file)
+{
+    // simulated FX2 always runs the programmer firmware
+    return true;
+}
+
+
+void SimTransport::print_info(void)
+{
+    fprintf(stderr, "sim: %d arrays x %d rows x (%d + %d) bytes, EEPROM %d bytes, device_config 0x%02x%02x%02x%02x\n",
+        m_num_arrays, m_rows_per_array, m_code_bytes_per_row, m_config_bytes_per_row, m_eeprom_size,
+        m_nvl_user[3], m_nvl_user[2], m_nvl_user[1], m_nvl_user[0]);
+}
+
+
+// USB interface
+// -------------
+
+uint64_t SimTransport::exchange(const uint8_t *data, int len, std::vector<uint8_t> &reply)
+{
+    // Runs one request on the simulated FX2. Returns the (virtual) time the reply reaches the host.
+    // The FX2 handles requests one at a time so a request queued behind others starts when they finish.
+
+    uint64_t arrival_us = m_host_us + m_usb_latency_us;
+    if (m_device_us < arrival_us)
+        m_device_us = arrival_us;
+
+    reply.clear();
+    execute(data, len, reply);
+
+    m_n_exchanges++;
+    m_bytes_out += len;
+    m_bytes_in += reply.size();
+
+    return m_device_us + m_usb_latency_us;
+}
+
+
+void SimTransport::record_transfer(struct usbtrace_rec_s *rec, uint64_t start_us, const uint8_t *out_data, const uint8_t *in_data)
+{
+    // Latency histograms and trace (if enabled) in virtual time so they are identical run to run
+    rec->t_start_ns = start_us * 1000;
+    if (rec->t_end_ns == 0)
+        rec->t_end_ns = m_host_us * 1000;
+
+    uint64_t elapsed_ns = rec->t_end_ns - rec->t_start_ns;
+    switch (rec->type)
+    {
+        case USBTRACE_BULK_OUT: latency_record(LATENCY_BULK_OUT, elapsed_ns); break;
+        case USBTRACE_BULK_IN:  latency_record(LATENCY_BULK_IN, elapsed_ns); break;
+        case USBTRACE_EXCHANGE: latency_record(LATENCY_EXCHANGE, elapsed_ns); break;
+        default:                latency_record(LATENCY_CONTROL, elapsed_ns); break;
+    }
+
+    if (usbtrace_enabled())
+        usbtrace_record(rec, out_data, in_data);
+}
+
+
+void SimTransport::sync_wall_clock(void)
+{
+    if (!m_realtime)
+        return;
+
+    uint64_t wall_us = wall_clock_us() - m_wall_start_us;
+    if (m_host_us > wall_us)
+        usleep(m_host_us - wall_us);
+}
+
+
+void SimTransport::sleep_ns(uint64_t ns)
+{
+    m_host_us += ns / 1000;
+    sync_wall_clock();
+}
+
+
+int SimTransport::bulk_out(uint8_t epaddr, const uint8_t *data, int len)
+{
+    if (!m_open || epaddr != m_ep_out)
+        return LIBUSB_ERROR_PIPE;
+
+    if (usb_deadline_passed())
+        return LIBUSB_ERROR_TIMEOUT;
+
+    if (stalled())
+        return LIBUSB_ERROR_PIPE;
+
+    uint64_t start_us = m_host_us;
+    m_pending_done_us = exchange(data, len, m_pending_reply);
+    m_reply_pending = true;
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_BULK_OUT;
+    rec.ep = epaddr;
+    rec.req_len = len;
+    rec.out_len = len;
+    record_transfer(&rec, start_us, data, NULL);
+
+    return 0;
+}
+
+
+int SimTransport::bulk_in(uint8_t epaddr, uint8_t *data, int max_len)
+{
+    if (!m_open || epaddr != m_ep_in)
+        return LIBUSB_ERROR_PIPE;
+
+    if (!m_reply_pending)
+        return LIBUSB_ERROR_TIMEOUT; // real FX2 has nothing to say either
+
+    uint64_t start_us = m_host_us;
+    if (m_host_us < m_pending_done_us)
+        m_host_us = m_pending_done_us;
+    sync_wall_clock();
+
+    m_reply_pending = false;
+
+    int len = m_pending_reply.size();
+    if (len > max_len)
+        return LIBUSB_ERROR_OVERFLOW;
+
+    memcpy(data, m_pending_reply.data(), len);
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_BULK_IN;
+    rec.ep = epaddr;
+    rec.req_len = max_len;
+    rec.in_len = len;
+    record_transfer(&rec, start_us, NULL, data);
+
+    return len;
+}
+
+
+int SimTransport::submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    if (m_pending >= TRANSPORT_MAX_TICKETS)
+        return LIBUSB_ERROR_BUSY;
+
+    if (usb_deadline_passed())
+        return LIBUSB_ERROR_TIMEOUT;
+
+    if (stalled())
+        return LIBUSB_ERROR_PIPE;
+
+    struct sim_exchange_s *ex = &m_exchanges[m_next_ticket % TRANSPORT_MAX_TICKETS];
+
+    std::vector<uint8_t> reply;
+    ex->done_us = exchange(out_data, out_len, reply);
+    ex->rc = 0;
+    ex->in_len = reply.size();
+
+    if (ex->in_len > in_max_len)
+    {
+        ex->rc = LIBUSB_ERROR_OVERFLOW;
+        ex->in_len = in_max_len;
+    }
+    memcpy(in_data, reply.data(), ex->in_len);
+
+    ex->out_data = out_data;
+    ex->out_len = out_len;
+    ex->in_data = in_data;
+    ex->in_max_len = in_max_len;
+    ex->depth = m_pending + 1;
+    ex->submit_us = m_host_us;
+
+    m_pending++;
+    return m_next_ticket++;
+}
+
+
+int SimTransport::wait(int ticket, int *in_len)
+{
+    if (m_pending == 0 || ticket < m_next_ticket - m_pending || ticket >= m_next_ticket)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    struct sim_exchange_s *ex = &m_exchanges[ticket % TRANSPORT_MAX_TICKETS];
+
+    if (m_host_us < ex->done_us)
+        m_host_us = ex->done_us;
+    sync_wall_clock();
+
+    m_pending--;
+    if (in_len) *in_len = ex->in_len;
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_EXCHANGE;
+    rec.ep = m_ep_out;
+    rec.aux = ex->depth;
+    rec.rc = ex->rc;
+    rec.req_len = ex->in_max_len;
+    rec.out_len = ex->out_len;
+    rec.in_len = ex->in_len;
+    rec.t_end_ns = ex->done_us * 1000;
+    record_transfer(&rec, ex->submit_us, ex->out_data, ex->in_data);
+
+    return ex->rc;
+}
+
+
+int SimTransport::control_in(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                             uint8_t *data, uint16_t *reply_length, uint16_t max_length)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    uint64_t start_us = m_host_us;
+    m_host_us += 2 * m_usb_latency_us;
+    sync_wall_clock();
+
+    if (reply_length) *reply_length = 0;
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_CTRL_IN;
+    rec.ep = bmRequestType;
+    rec.aux = bRequest;
+    rec.wValue = wValue;
+    rec.wIndex = wIndex;
+    rec.req_len = max_length;
+    record_transfer(&rec, start_us, NULL, NULL);
+
+    switch (bRequest)
+    {
+        case FX2_REQ_JTAG_TO_SWD:
+            // line reset etc - nothing to model
+            return 0;
+
+        case FX2_REQ_RESET:
+            if (wValue) // asserted
+                reset_target();
+            return 0;
+
+        default:
+            if (m_debug) fprintf(stderr, "sim: unsupported control request %d\n", bRequest);
+            return LIBUSB_ERROR_PIPE;
+    }
+}
+
+
+int SimTransport::control_out(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                              const uint8_t *data, int len)
+{
+    if (!m_open)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    uint64_t start_us = m_host_us;
+    m_host_us += 2 * m_usb_latency_us;
+    sync_wall_clock();
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_CTRL_OUT;
+    rec.ep = bmRequestType;
+    rec.aux = bRequest;
+    rec.wValue = wValue;
+    rec.wIndex = wIndex;
+    rec.req_len = len;
+    rec.out_len = len;
+    record_transfer(&rec, start_us, data, NULL);
+
+    return len;
+}
+
+
+bool SimTransport::stalled(void)
+{
+    // the exchange that hits stall_at_exchange (and all after it) fail until clear_stall()
+    if (m_stall_at && m_n_exchanges + 1 >= m_stall_at)
+    {
+        if (m_debug) fprintf(stderr, "sim: bulk endpoints stalled at exchange %llu\n", (unsigned long long)m_n_exchanges + 1);
+        m_stall_at = 0;
+        m_stalled = true;
+    }
+    return m_stalled;
+}
+
+
+int SimTransport::clear_stall(uint8_t epaddr)
+{
+    m_reply_pending = false;
+    m_stalled = false;
+
+    struct usbtrace_rec_s rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_CTRL_OUT;
+    rec.ep = LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT;
+    rec.aux = LIBUSB_REQUEST_CLEAR_FEATURE;
+    rec.wIndex = epaddr;
+    record_transfer(&rec, m_host_us, NULL, NULL);
+
+    return 0;
+}
+
+
+// SWD
+// ---
+
+void SimTransport::reset_target(void)
+{
+    m_regs.clear();
+    m_sram.assign(SIM_SRAM_SIZE, 0);
+
+    m_tar = 0;
+    m_csw = 0;
+    m_rdbuff = 0;
+    m_dp_ctrlstat = 0;
+    m_dp_select = 0;
+
+    m_spc_state = SPC_STATE_IDLE;
+    m_spc_nargs = 0;
+    m_spc_out.clear();
+    m_spc_busy_until = 0;
+    m_latch_len = 0;
+    m_latch_max = 0;
+    m_latch_aid = 0;
+    m_latch.assign(m_latch.size(), 0);
+    memcpy(m_nvl_latch, m_nvl_user, sizeof(m_nvl_latch));
+
+    m_cpu_pc = 0;
+    m_loader_running = false;
+    m_loader_state = LOADER_STATE_WAIT;
+    m_loader_tail = 0;
+    m_loader_us = 0;
+}
+
+
+void SimTransport::reply_b4(std::vector<uint8_t> &reply, uint32_t value)
+{
+    // LSB first then ACK
+    reply.push_back(value & 0xFF);
+    reply.push_back((value >> 8) & 0xFF);
+    reply.push_back((value >> 16) & 0xFF);
+    reply.push_back((value >> 24) & 0xFF);
+    reply.push_back(REPLY_OK);
+}
+
+
+void SimTransport::execute(const uint8_t *data, int len, std::vector<uint8_t> &reply)
+{
+    // Request is a sequence of SWD packets: header byte (+ 4 data bytes LSB first for writes).
+    // Anything that isn't a well formed header (eg line reset/idle bit patterns) is clocked out and ignored.
+
+    int i = 0;
+    while (i < len)
+    {
+        uint8_t hdr = data[i];
+
+        int parity = __builtin_popcount(hdr & 0x1E) & 1;
+        bool valid = (hdr & SWD_HDR_START) && !(hdr & 0x40) && (hdr & SWD_HDR_PARK)
+                        && parity == ((hdr >> 5) & 1);
+        if (!valid)
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t wdata = 0;
+        if (hdr & SWD_HDR_RNW)
+        {
+            i++;
+        }
+        else
+        {
+            if (i + 5 > len)
+            {
+                if (m_debug) fprintf(stderr, "sim: truncated SWD write 0x%02x\n", hdr);
+                break;
+            }
+            wdata = data[i+1] | (data[i+2] << 8) | (data[i+3] << 16) | ((uint32_t)data[i+4] << 24);
+            i += 5;
+        }
+
+        if (m_loader_running)
+            loader_run(); // catch up before the host looks at (or changes) anything
+
+        if (hdr & SWD_HDR_APNDP)
+            ap_access(hdr, wdata, reply);
+        else
+            dp_access(hdr, wdata, reply);
+
+        m_device_us += m_swd_op_us;
+        m_n_swd_ops++;
+    }
+}
+
+
+void SimTransport::dp_access(uint8_t hdr, uint32_t wdata, std::vector<uint8_t> &reply)
+{
+    int addr = SWD_HDR_ADDR(hdr);
+
+    if (hdr & SWD_HDR_RNW)
+    {
+        switch (addr)
+        {
+            case 0x0: reply_b4(reply, m_jtag_id); break;                                                    // IDCODE
+            case 0x4: reply_b4(reply, m_dp_ctrlstat | ((m_dp_ctrlstat & DP_CTRLSTAT_PWRUPREQ_MASK) << 1)); break; // CTRL/STAT
+            case 0xC: reply_b4(reply, m_rdbuff); break;                                                     // RDBUFF
+            default:  reply_b4(reply, 0); break;
+        }
+        return;
+    }
+
+    switch (addr)
+    {
+        case 0x4: m_dp_ctrlstat = wdata; break;
+        case 0x8: m_dp_select = wdata; break;
+        default: break;
+    }
+    reply.push_back(REPLY_OK);
+}
+
+
+void SimTransport::ap_access(uint8_t hdr, uint32_t wdata, std::vector<uint8_t> &reply)
+{
+    int addr = SWD_HDR_ADDR(hdr);
+
+    if (hdr & SWD_HDR_RNW)
+    {
+        // AP reads are posted: return the previous result and start this one
+        reply_b4(reply, m_rdbuff);
+
+        switch (addr)
+        {
+            case AP_REG_CSW: m_rdbuff = m_csw; break;
+            case AP_REG_TAR: m_rdbuff = m_tar; break;
+            case AP_REG_DRW: m_rdbuff = mem_read(m_tar); tar_increment(); break;
+            default:         m_rdbuff = 0; break;
+        }
+        return;
+    }
+
+    switch (addr)
+    {
+        case AP_REG_CSW: m_csw = wdata; break;
+        case AP_REG_TAR: m_tar = wdata; break;
+        case AP_REG_DRW: mem_write(m_tar, wdata); tar_increment(); break;
+        default: break;
+    }
+    reply.push_back(REPLY_OK);
+}
+
+
+void SimTransport::tar_increment(void)
+{
+    // auto increment only wraps within a 1KB block
+    if ((m_csw & AP_CSW_ADDRINC_MASK) == AP_CSW_ADDRINC_SINGLE)
+        m_tar = (m_tar & ~0x3FF) | ((m_tar + 4) & 0x3FF);
+}
+
+
+uint32_t SimTransport::mem_read(uint32_t address)
+{
+    uint32_t aligned = address & ~3;
+    uint32_t value = 0;
+    int i;
+
+    if (aligned == REG_SPC_CPU_DATA)
+    {
+        // CPU_DATA in byte lane 0, STATUS in byte lane 2
+        if (address == REG_SPC_STATUS && m_spc_state == SPC_STATE_LOAD_DATA)
+            spc_finish_load(); // short row load (eg 256 bytes when 288 expected)
+
+        if (address == REG_SPC_CPU_DATA)
+            value = spc_read_data();
+
+        return value | (spc_status() << 16);
+    }
+
+    uint32_t flash_code_size = m_num_arrays * m_rows_per_array * m_code_bytes_per_row;
+    if (aligned >= m_flash_code_base_address && aligned - m_flash_code_base_address < flash_code_size)
+    {
+        // flash code bytes are mapped contiguously, array after array
+        uint32_t offset = aligned - m_flash_code_base_address;
+        for (i=0; i<4; i++, offset++)
+        {
+            int row = offset / m_code_bytes_per_row; // across all arrays
+            value |= m_flash[row * row_stride() + offset % m_code_bytes_per_row] << (8*i);
+        }
+        return value;
+    }
+
+    uint32_t flash_config_size = m_num_arrays * m_rows_per_array * m_config_bytes_per_row;
+    if (m_flash_config_ahb_address && aligned >= m_flash_config_ahb_address &&
+        aligned - m_flash_config_ahb_address < flash_config_size)
+    {
+        // config/ECC bytes likewise, packed
+        uint32_t offset = aligned - m_flash_config_ahb_address;
+        for (i=0; i<4; i++, offset++)
+        {
+            int row = offset / m_config_bytes_per_row;
+            value |= m_flash[row * row_stride() + m_code_bytes_per_row + offset % m_config_bytes_per_row] << (8*i);
+        }
+        return value;
+    }
+
+    if (aligned >= SIM_SRAM_BASE && aligned - SIM_SRAM_BASE < SIM_SRAM_SIZE)
+    {
+        uint8_t *p = &m_sram[aligned - SIM_SRAM_BASE];
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    if (aligned >= m_eeprom_base_address && aligned - m_eeprom_base_address < (uint32_t)m_eeprom_size)
+    {
+        uint8_t *p = &m_eeprom[aligned - m_eeprom_base_address];
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    std::map<uint32_t, uint32_t>::const_iterator it = m_regs.find(aligned);
+    if (it != m_regs.end())
+        value = it->second;
+
+    return value;
+}
+
+
+void SimTransport::mem_write(uint32_t address, uint32_t value)
+{
+    uint32_t aligned = address & ~3;
+
+    if (aligned == REG_SPC_CPU_DATA)
+    {
+        if (address == REG_SPC_CPU_DATA)
+            spc_write(value & 0xFF);
+        return;
+    }
+
+    if (aligned >= SIM_SRAM_BASE && aligned - SIM_SRAM_BASE < SIM_SRAM_SIZE)
+    {
+        uint8_t *p = &m_sram[aligned - SIM_SRAM_BASE];
+        p[0] = value & 0xFF;
+        p[1] = (value >> 8) & 0xFF;
+        p[2] = (value >> 16) & 0xFF;
+        p[3] = (value >> 24) & 0xFF;
+        return;
+    }
+
+    if (aligned >= CM3_DHCSR && aligned <= CM3_DCRDR)
+        debug_write(aligned, value);
+
+    // flash and EEPROM are read only on the bus. Everything else is just remembered.
+    m_regs[aligned] = value;
+}
+
+
+void SimTransport::debug_write(uint32_t address, uint32_t value)
+{
+    // Core debug registers: enough to see the host start the CPU on the SRAM loader (PC via
+    // DCRSR/DCRDR, then DHCSR with C_HALT clear) and halt it again.
+    if (address == CM3_DCRSR)
+    {
+        if ((value & CM3_DCRSR_REGWNR) && (value & CM3_DCRSR_REGSEL_MASK) == 15)
+            m_cpu_pc = m_regs[CM3_DCRDR];
+        return;
+    }
+
+    if (address != CM3_DHCSR || (value & 0xFFFF0000) != CM3_DHCSR_KEY)
+        return;
+
+    bool run = (value & CM3_DHCSR_C_DEBUGEN) && !(value & CM3_DHCSR_C_HALT);
+    if (!run)
+    {
+        m_loader_running = false;
+        return;
+    }
+
+    if (m_loader_running)
+        return;
+
+    uint32_t offset = LOADER_ENTRY - SIM_SRAM_BASE;
+    if ((m_cpu_pc & ~1) != LOADER_ENTRY || memcmp(&m_sram[offset], psoc_loader_image, sizeof(psoc_loader_image)) != 0)
+    {
+        fprintf(stderr, "sim: CPU started at 0x%08x on unknown code - not simulated\n", m_cpu_pc);
+        return;
+    }
+
+    if (m_debug) fprintf(stderr, "sim: SRAM loader running\n");
+
+    // loader start up
+    m_loader_running = true;
+    m_loader_state = LOADER_STATE_WAIT;
+    m_loader_tail = 0;
+    m_loader_us = m_device_us;
+    set_sram_word(LOADER_CTL_ERROR, 0);
+    set_sram_word(LOADER_CTL_TAIL, 0);
+}
+
+
+uint32_t SimTransport::sram_word(uint32_t address) const
+{
+    const uint8_t *p = &m_sram[address - SIM_SRAM_BASE];
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+void SimTransport::set_sram_word(uint32_t address, uint32_t value)
+{
+    uint8_t *p = &m_sram[address - SIM_SRAM_BASE];
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+
+void SimTransport::loader_run(void)
+{
+    // Plays psoc_loader.S against the SPC model up to the current device time. The loader has
+    // its own clock (m_loader_us): each step happens once the SPC is idle, which may be well
+    // before now if the host was away (eg sleeping), so several rows can complete per call.
+
+    uint64_t now_us = m_device_us;
+
+    while (m_loader_running && m_loader_state != LOADER_STATE_FAILED)
+    {
+        uint64_t t_us = m_loader_us;
+        if (m_loader_state != LOADER_STATE_WAIT && t_us < m_spc_busy_until)
+            t_us = m_spc_busy_until; // wait_idle
+
+        if (m_loader_state == LOADER_STATE_WAIT && sram_word(LOADER_CTL_HEAD) == m_loader_tail)
+        {
+            m_loader_us = now_us; // spinning on an empty ring
+            break;
+        }
+
+        if (t_us > now_us)
+            break;
+
+        m_device_us = t_us; // SPC sees the loader's writes at the loader's time
+
+        uint32_t nslots = sram_word(LOADER_CTL_NSLOTS);
+        uint32_t slot = LOADER_RING + (nslots ? m_loader_tail % nslots : 0) * LOADER_SLOT_STRIDE;
+        uint8_t *p = &m_sram[slot - SIM_SRAM_BASE];
+        int i;
+
+        switch (m_loader_state)
+        {
+            case LOADER_STATE_WAIT:
+                if (spc_busy())
+                {
+                    m_loader_us = m_spc_busy_until;
+                    continue;
+                }
+                spc_write(SPC_KEY1);
+                spc_write(SPC_KEY2 + SPC_CMD_LOAD_ROW);
+                spc_write(SPC_CMD_LOAD_ROW);
+                spc_write(p[1]);
+                for (i=0; i < (p[6] | (p[7] << 8)); i++)
+                    spc_write(p[LOADER_SLOT_HEADER_LEN + i]);
+                m_loader_us = t_us + SIM_T_LOADER_ROW_US;
+                m_loader_state = LOADER_STATE_LOADED;
+                break;
+
+            case LOADER_STATE_LOADED:
+                mem_read(REG_SPC_STATUS); // wait_idle (completes a short load)
+                if (spc_busy())
+                    continue;
+                spc_write(SPC_KEY1);
+                spc_write(SPC_KEY2 + p[0]);
+                for (i=0; i<6; i++)
+                    spc_write(p[i]);
+                m_loader_us = t_us;
+                m_loader_state = LOADER_STATE_PROG;
+                break;
+
+            case LOADER_STATE_PROG:
+            {
+                uint8_t status = spc_status();
+                if (status >> 2)
+                {
+                    set_sram_word(LOADER_CTL_ERROR, status);
+                    m_loader_state = LOADER_STATE_FAILED;
+                    break;
+                }
+                m_loader_tail++;
+                set_sram_word(LOADER_CTL_TAIL, m_loader_tail);
+                m_loader_us = t_us;
+                m_loader_state = LOADER_STATE_WAIT;
+                break;
+            }
+        }
+    }
+
+    m_device_us = now_us;
+}
+
+
+// SPC
+// ---
+
+uint8_t SimTransport::spc_status(void)
+{
+    if (spc_busy())
+        return 0x00;
+
+    if (!m_spc_out.empty())
+        return SPC_STATUS_DATA_READY;
+
+    return SPC_STATUS_IDLE;
+}
+
+
+uint8_t SimTransport::spc_read_data(void)
+{
+    if (spc_busy() || m_spc_out.empty())
+        return 0;
+
+    uint8_t value = m_spc_out.front();
+    m_spc_out.pop_front();
+    return value;
+}
+
+
+int SimTransport::spc_nargs(uint8_t cmd) const
+{
+    switch (cmd)
+    {
+        case SPC_CMD_LOAD_BYTE:         return 3;
+        case SPC_CMD_LOAD_ROW:          return 1; // followed by row data
+        case SPC_CMD_READ_BYTE:         return 2;
+        case SPC_CMD_READ_MULTI_BYTE:   return 5;
+        case SPC_CMD_WRITE_ROW:         return 5;
+        case SPC_CMD_WRITE_NVL:         return 1;
+        case SPC_CMD_PROG_ROW:          return 5;
+        case SPC_CMD_ERASE_SECTOR:      return 2;
+        case SPC_CMD_ERASE_ALL:         return 0;
+        case SPC_CMD_READ_HIDDEN_ROW:   return 2;
+        case SPC_CMD_PROTECT:           return 2;
+        case SPC_CMD_GET_CHECKSUM:      return 5;
+        case SPC_CMD_GET_TEMPERATURE:   return 2;
+        case SPC_CMD_READ_NVL_VOL_BYTE: return 2;
+        default:                        return -1; // not modelled (eg LOAD_MULTI_BYTE)
+    }
+}
+
+
+void SimTransport::spc_write(uint8_t value)
+{
+    if (spc_busy())
+    {
+        if (m_debug) fprintf(stderr, "sim: SPC write 0x%02x while busy - ignored\n", value);
+        return;
+    }
+
+    switch (m_spc_state)
+    {
+        case SPC_STATE_IDLE:
+            if (value == SPC_KEY1)
+            {
+                m_spc_out.clear(); // unread data from previous command is lost
+                m_spc_state = SPC_STATE_KEY1;
+            }
+            break;
+
+        case SPC_STATE_KEY1:
+            m_spc_key2 = value;
+            m_spc_state = SPC_STATE_CMD;
+            break;
+
+        case SPC_STATE_CMD:
+            m_spc_cmd = value;
+            m_spc_nargs = 0;
+            if (m_spc_key2 != (uint8_t)(SPC_KEY2 + m_spc_cmd) || spc_nargs(m_spc_cmd) < 0)
+            {
+                fprintf(stderr, "sim: bad SPC command 0x%02x (key2 0x%02x)\n", m_spc_cmd, m_spc_key2);
+                m_spc_state = SPC_STATE_IDLE;
+            }
+            else if (spc_nargs(m_spc_cmd) == 0)
+                spc_execute();
+            else
+                m_spc_state = SPC_STATE_ARGS;
+            break;
+
+        case SPC_STATE_ARGS:
+            m_spc_args[m_spc_nargs++] = value;
+            if (m_spc_nargs < spc_nargs(m_spc_cmd))
+                break;
+
+            if (m_spc_cmd == SPC_CMD_LOAD_ROW)
+            {
+                m_latch_aid = m_spc_args[0];
+                m_latch_len = 0;
+                if (m_latch_aid == SPC_NV_AID_EEPROM)
+                    m_latch_max = m_eeprom_bytes_per_row;
+                else
+                    m_latch_max = ecc_enabled() ? m_code_bytes_per_row : row_stride();
+                m_latch.assign(m_latch.size(), 0);
+                m_spc_state = SPC_STATE_LOAD_DATA;
+            }
+            else
+                spc_execute();
+            break;
+
+        case SPC_STATE_LOAD_DATA:
+            m_latch[m_latch_len++] = value;
+            if (m_latch_len == m_latch_max)
+                spc_finish_load();
+            break;
+    }
+}
+
+
+void SimTransport::spc_finish_load(void)
+{
+    if (m_debug) fprintf(stderr, "sim: LOAD_ROW aid:%d, %d of %d bytes\n", m_latch_aid, m_latch_len, m_latch_max);
+
+    m_n_spc_cmds++;
+    m_spc_state = SPC_STATE_IDLE;
+    m_spc_busy_until = m_device_us + SIM_T_SPC_CMD_US;
+}
+
+
+bool SimTransport::ecc_enabled(void) const
+{
+    // device_config ECCEN is bit 27
+    return (m_nvl_user[3] & 0x08) != 0;
+}
+
+
+void SimTransport::ecc_generate(uint8_t *row)
+{
+    // The device fills the config bytes of a row with ECC when ECCEN is set. Not the real
+    // code, just something that depends on the code bytes and (like ECC) isn't in the image:
+    // each config byte folds its share of the code bytes.
+    if (m_config_bytes_per_row == 0)
+        return;
+
+    int group = m_code_bytes_per_row / m_config_bytes_per_row;
+    int i, j;
+
+    for (i=0; i<m_config_bytes_per_row; i++)
+    {
+        uint8_t ecc = 0;
+        for (j=0; j<group; j++)
+            ecc = ((ecc << 1) | (ecc >> 7)) ^ row[i * group + j];
+        row[m_code_bytes_per_row + i] = ecc;
+    }
+}
+
+
+uint8_t *SimTransport::flash_row(int array_id, int row)
+{
+    if (array_id < 0 || array_id >= m_num_arrays || row < 0 || row >= m_rows_per_array)
+        return NULL;
+
+    return &m_flash[(array_id * m_rows_per_array + row) * row_stride()];
+}
+
+
+uint8_t SimTransport::nv_read_byte(uint8_t array_id, uint32_t address)
+{
+    if (array_id == SPC_NV_AID_CONFIG)
+        return m_nvl_user[address & 3];
+
+    if (array_id == SPC_NV_AID_WOL)
+        return m_nvl_wol[address & 3];
+
+    if (array_id == SPC_NV_AID_EEPROM)
+        return m_eeprom[address % m_eeprom_size];
+
+    // flash: code bytes are below flash_config_base_address, config bytes above it. Address is within the array.
+    uint8_t *p;
+    if (address >= m_flash_config_base_address)
+    {
+        uint32_t offset = address - m_flash_config_base_address;
+        p = flash_row(array_id, offset / m_config_bytes_per_row);
+        return p ? p[m_code_bytes_per_row + offset % m_config_bytes_per_row] : 0;
+    }
+
+    uint32_t offset = address - m_flash_code_base_address;
+    p = flash_row(array_id, offset / m_code_bytes_per_row);
+    return p ? p[offset % m_code_bytes_per_row] : 0;
+}
+
+
+uint32_t SimTransport::checksum_rows(int array_id, int start_row, int nrows)
+{
+    // sum of every byte in the row (code and config/ECC)
+    uint32_t checksum = 0;
+
+    int ri;
+    for (ri = start_row; ri < start_row + nrows; ri++)
+    {
+        const uint8_t *p = flash_row(array_id, ri);
+        if (!p) break;
+
+        int i;
+        for (i=0; i<row_stride(); i++)
+            checksum += p[i];
+    }
+
+    return checksum;
+}
+
+
+void SimTransport::spc_execute(void)
+{
+    uint8_t *a = m_spc_args;
+    uint64_t t_us = SIM_T_SPC_CMD_US;
+    int protection_bytes_per_array = m_rows_per_array / m_rows_per_protection_byte;
+    int i;
+
+    if (m_debug) fprintf(stderr, "sim: SPC cmd 0x%02x\n", m_spc_cmd);
+
+    m_n_spc_cmds++;
+    m_spc_state = SPC_STATE_IDLE;
+
+    switch (m_spc_cmd)
+    {
+        case SPC_CMD_LOAD_BYTE:
+            if (a[0] == SPC_NV_AID_CONFIG || a[0] == SPC_NV_AID_WOL)
+                m_nvl_latch[a[1] & 3] = a[2];
+            else
+                m_latch[a[1] % m_latch.size()] = a[2];
+            break;
+
+        case SPC_CMD_READ_BYTE:
+        case SPC_CMD_READ_NVL_VOL_BYTE:
+            m_spc_out.push_back(nv_read_byte(a[0], a[1]));
+            break;
+
+        case SPC_CMD_READ_MULTI_BYTE:
+        {
+            uint32_t address = (a[1] << 16) | (a[2] << 8) | a[3];
+            int n = a[4] + 1;
+            for (i=0; i<n; i++)
+                m_spc_out.push_back(nv_read_byte(a[0], address + i));
+            t_us += n;
+            break;
+        }
+
+        case SPC_CMD_WRITE_ROW:
+        case SPC_CMD_PROG_ROW:
+        {
+            int row = (a[1] << 8) | a[2];
+            bool erase_first = (m_spc_cmd == SPC_CMD_WRITE_ROW);
+
+            if (a[0] != m_latch_aid)
+                fprintf(stderr, "sim: write row aid %d but latch loaded for aid %d\n", a[0], m_latch_aid);
+
+            if (a[0] == SPC_NV_AID_EEPROM)
+            {
+                if ((row + 1) * m_eeprom_bytes_per_row <= m_eeprom_size)
+                    memcpy(&m_eeprom[row * m_eeprom_bytes_per_row], m_latch.data(), m_eeprom_bytes_per_row);
+            }
+            else
+            {
+                uint8_t *p = flash_row(a[0], row);
+                if (!p)
+                {
+                    fprintf(stderr, "sim: write row - bad array %d row %d\n", a[0], row);
+                    break;
+                }
+
+                if (erase_first)
+                    memset(p, 0, row_stride());
+
+                for (i=0; i<m_latch_max && i<row_stride(); i++)
+                    p[i] = erase_first ? m_latch[i] : (p[i] | m_latch[i]);
+
+                if (ecc_enabled())
+                    ecc_generate(p);
+            }
+            t_us = erase_first ? SIM_T_WRITE_ROW_US : SIM_T_PROG_ROW_US;
+            break;
+        }
+
+        case SPC_CMD_WRITE_NVL:
+            if (a[0] == SPC_NV_AID_CONFIG)
+                memcpy(m_nvl_user, m_nvl_latch, sizeof(m_nvl_user));
+            else if (a[0] == SPC_NV_AID_WOL)
+                memcpy(m_nvl_wol, m_nvl_latch, sizeof(m_nvl_wol));
+            t_us = SIM_T_WRITE_NVL_US;
+            break;
+
+        case SPC_CMD_ERASE_SECTOR:
+            if (a[0] == SPC_NV_AID_EEPROM)
+            {
+                int start = a[1] * SIM_ROWS_PER_SECTOR * m_eeprom_bytes_per_row;
+                for (i=start; i<start + SIM_ROWS_PER_SECTOR * m_eeprom_bytes_per_row && i<m_eeprom_size; i++)
+                    m_eeprom[i] = 0;
+            }
+            else
+            {
+                for (i=a[1] * SIM_ROWS_PER_SECTOR; i<(a[1]+1) * SIM_ROWS_PER_SECTOR; i++)
+                {
+                    uint8_t *p = flash_row(a[0], i);
+                    if (p) memset(p, 0, row_stride());
+                }
+            }
+            t_us = SIM_T_ERASE_SECTOR_US;
+            break;
+
+        case SPC_CMD_ERASE_ALL:
+            // all flash (code + config) and protection. Not EEPROM or NVLs.
+            m_flash.assign(m_flash.size(), 0);
+            m_protection.assign(m_protection.size(), 0);
+            t_us = SIM_T_ERASE_ALL_US;
+            break;
+
+        case SPC_CMD_READ_HIDDEN_ROW:
+            for (i=0; i<m_code_bytes_per_row; i++)
+            {
+                bool valid = a[0] < m_num_arrays && i < protection_bytes_per_array;
+                m_spc_out.push_back(valid ? m_protection[a[0] * protection_bytes_per_array + i] : 0);
+            }
+            break;
+
+        case SPC_CMD_PROTECT:
+        {
+            int ai;
+            for (ai=0; ai<m_num_arrays; ai++)
+            {
+                if (a[0] != ai && a[0] != SPC_NV_AID_FLASH_ALL) continue;
+                memcpy(&m_protection[ai * protection_bytes_per_array], m_latch.data(), protection_bytes_per_array);
+            }
+            t_us = SIM_T_PROTECT_US;
+            break;
+        }
+
+        case SPC_CMD_GET_CHECKSUM:
+        {
+            uint32_t checksum = 0;
+            int nrows = 0;
+            if (a[0] == SPC_NV_AID_FLASH_ALL)
+            {
+                int ai;
+                for (ai=0; ai<m_num_arrays; ai++)
+                    checksum += checksum_rows(ai, 0, m_rows_per_array);
+                nrows = m_num_arrays * m_rows_per_array;
+            }
+            else
+            {
+                nrows = ((a[3] << 8) | a[4]) + 1;
+                checksum = checksum_rows(a[0], (a[1] << 8) | a[2], nrows);
+            }
+
+            // MSB first
+            m_spc_out.push_back((checksum >> 24) & 0xFF);
+            m_spc_out.push_back((checksum >> 16) & 0xFF);
+            m_spc_out.push_back((checksum >> 8) & 0xFF);
+            m_spc_out.push_back(checksum & 0xFF);
+            t_us = nrows * SIM_T_CHECKSUM_ROW_US;
+            break;
+        }
+
+        case SPC_CMD_GET_TEMPERATURE:
+            m_spc_out.push_back(1);  // sign: positive
+            m_spc_out.push_back(25); // magnitude
+            t_us = SIM_T_TEMPERATURE_US;
+            break;
+    }
+
+    m_spc_busy_until = m_device_us + t_us;
+}
+
+
+// Persistent state
+// ----------------
+
+bool SimTransport::load_state(void)
+{
+    FILE *fp = fopen(m_state_file.c_str(), "rb");
+    if (!fp)
+        return false; // first run - blank device
+
+    char magic[8];
+    int32_t geom[5];
+    int32_t expected_geom[5] = { m_num_arrays, m_rows_per_array, m_code_bytes_per_row, m_config_bytes_per_row, m_eeprom_size };
+
+    bool ok = fread(magic, sizeof(magic), 1, fp) == 1
+                && memcmp(magic, SIM_STATE_MAGIC, sizeof(magic)) == 0
+                && fread(geom, sizeof(geom), 1, fp) == 1
+                && memcmp(geom, expected_geom, sizeof(geom)) == 0;
+
+    if (!ok)
+    {
+        fprintf(stderr, "sim: state file '%s' does not match device geometry - ignored\n", m_state_file.c_str());
+        fclose(fp);
+        return false;
+    }
+
+    std::vector<uint8_t> flash(m_flash.size()), protection(m_protection.size()), eeprom(m_eeprom.size());
+    uint8_t nvl_user[4], nvl_wol[4];
+
+    ok = fread(flash.data(), flash.size(), 1, fp) == 1
+            && fread(protection.data(), protection.size(), 1, fp) == 1
+            && fread(eeprom.data(), eeprom.size(), 1, fp) == 1
+            && fread(nvl_user, sizeof(nvl_user), 1, fp) == 1
+            && fread(nvl_wol, sizeof(nvl_wol), 1, fp) == 1;
+    fclose(fp);
+
+    if (!ok)
+    {
+        fprintf(stderr, "sim: state file '%s' is truncated - ignored\n", m_state_file.c_str());
+        return false;
+    }
+
+    m_flash = flash;
+    m_protection = protection;
+    m_eeprom = eeprom;
+    memcpy(m_nvl_user, nvl_user, sizeof(m_nvl_user));
+    memcpy(m_nvl_wol, nvl_wol, sizeof(m_nvl_wol));
+
+    return true;
+}
+
+
+bool SimTransport::save_state(void)
+{
+    FILE *fp = fopen(m_state_file.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "sim: can't write state file '%s'\n", m_state_file.c_str());
+        return false;
+    }
+
+    int32_t geom[5] = { m_num_arrays, m_rows_per_array, m_code_bytes_per_row, m_config_bytes_per_row, m_eeprom_size };
+
+    bool ok = fwrite(SIM_STATE_MAGIC, 8, 1, fp) == 1
+                && fwrite(geom, sizeof(geom), 1, fp) == 1
+                && fwrite(m_flash.data(), m_flash.size(), 1, fp) == 1
+                && fwrite(m_protection.data(), m_protection.size(), 1, fp) == 1
+                && fwrite(m_eeprom.data(), m_eeprom.size(), 1, fp) == 1
+                && fwrite(m_nvl_user, sizeof(m_nvl_user), 1, fp) == 1
+                && fwrite(m_nvl_wol, sizeof(m_nvl_wol), 1, fp) == 1;
+
+    if (fclose(fp) != 0) ok = false;
+
+    if (!ok)
+        fprintf(stderr, "sim: failed writing state file '%s'\n", m_state_file.c_str());
+
+    return ok;
+}
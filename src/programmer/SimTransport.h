@@ -0,0 +1,241 @@
+#ifndef _SIMTRANSPORT_H
+#define _SIMTRANSPORT_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "Transport.h"
+#include "usbtrace.h"
+#include "latency.h"
+#include "usbtimeout.h"
+
+
+// Default timings (micro seconds). USB/SWD figures are rough FX2 numbers,
+// SPC figures are PSoC 5LP datasheet typicals. All can be overridden in the
+// [Simulator] section of the config file.
+#define SIM_DEFAULT_USB_LATENCY_US      125     // one way, host <-> FX2
+#define SIM_DEFAULT_SWD_OP_US           10      // one SWD transaction on the wire
+#define SIM_MAX_GANG_SIZE               32
+
+#define SIM_T_SPC_CMD_US                10      // fast commands (load/read byte etc)
+#define SIM_T_WRITE_ROW_US              20000   // erase + program
+#define SIM_T_PROG_ROW_US               10000
+#define SIM_T_ERASE_SECTOR_US           15000
+#define SIM_T_ERASE_ALL_US              35000
+#define SIM_T_WRITE_NVL_US              20000
+#define SIM_T_PROTECT_US                20000
+#define SIM_T_CHECKSUM_ROW_US           50      // per row summed
+#define SIM_T_TEMPERATURE_US            3000
+#define SIM_T_LOADER_ROW_US             5       // SRAM loader: LOAD_ROW stores from SRAM
+
+
+// In-process model of the FX2 programmer and a PSoC5 target.
+//
+// Decodes the SWD byte stream the Request builder emits (DPACC/APACC headers,
+// posted AP reads, TAR/CSW), the SPC key/command sequences written to
+// REG_SPC_CPU_DATA, and models the flash arrays (code + config bytes),
+// protection rows, EEPROM, NVL (user and WOL) and SPC busy time.
+// There is no CPU model: if the host runs the SRAM flash loader (psoc_loader.h)
+// its behaviour is played against the SPC model instead (loader_run).
+//
+// Time is virtual so runs are deterministic: each exchange costs USB latency plus
+// SWD time and overlaps with other exchanges in flight the same way a real
+// pipelined FX2 would. Set realtime=1 to also sleep so wall clock matches.
+
+class SimTransport : public Transport
+{
+    // geometry
+    int m_num_arrays;
+    int m_rows_per_array;
+    int m_code_bytes_per_row;
+    int m_config_bytes_per_row;
+    int m_rows_per_protection_byte;
+    uint32_t m_flash_code_base_address;
+    uint32_t m_flash_config_base_address;
+    uint32_t m_flash_config_ahb_address;    // 0: config bytes not on the bus
+    int m_eeprom_size;
+    int m_eeprom_bytes_per_row;
+    uint32_t m_eeprom_base_address;
+
+    // non volatile state
+    std::vector<uint8_t> m_flash;       // array, row, (code bytes, config bytes)
+    std::vector<uint8_t> m_protection;  // array, protection bytes
+    std::vector<uint8_t> m_eeprom;
+    uint8_t m_nvl_user[4];
+    uint8_t m_nvl_wol[4];
+
+    // volatile state
+    std::map<uint32_t, uint32_t> m_regs;
+    std::vector<uint8_t> m_sram;
+
+    // debug port
+    uint32_t m_tar;
+    uint32_t m_csw;
+    uint32_t m_rdbuff;  // result of last AP read (returned by the next one)
+    uint32_t m_dp_ctrlstat;
+    uint32_t m_dp_select;
+
+    // SPC
+    int m_spc_state;
+    uint8_t m_spc_key2;
+    uint8_t m_spc_cmd;
+    uint8_t m_spc_args[8];
+    int m_spc_nargs;
+    std::vector<uint8_t> m_latch;
+    int m_latch_len;
+    int m_latch_max;
+    uint8_t m_latch_aid;
+    uint8_t m_nvl_latch[4];
+    std::deque<uint8_t> m_spc_out;
+    uint64_t m_spc_busy_until;
+
+    // CPU (halted, or running the SRAM loader)
+    uint32_t m_cpu_pc;          // written through DCRSR/DCRDR
+    bool m_loader_running;
+    int m_loader_state;
+    uint32_t m_loader_tail;
+    uint64_t m_loader_us;       // device time the loader has got to
+
+    // timing (virtual micro seconds)
+    uint64_t m_host_us;
+    uint64_t m_device_us;
+    uint64_t m_wall_start_us;
+    int m_usb_latency_us;
+    int m_swd_op_us;
+    bool m_realtime;
+
+    // config
+    uint32_t m_jtag_id;
+    std::string m_state_file;
+    int m_debug;
+    int m_gang_size;            // simulated programmers enumerate() reports
+    std::string m_device_id;    // selected one (own state file)
+    uint64_t m_stall_at;        // fault injection: exchange number the bulk endpoints stall at, 0: never
+    bool m_stalled;             // until clear_stall()
+    bool m_open;
+
+    // reply waiting for bulk_in
+    std::vector<uint8_t> m_pending_reply;
+    uint64_t m_pending_done_us;
+    bool m_reply_pending;
+
+    struct sim_exchange_s
+    {
+        int rc;
+        int in_len;
+        uint64_t done_us;
+        // for the trace
+        const uint8_t *out_data;
+        int out_len;
+        uint8_t *in_data;
+        int in_max_len;
+        int depth;
+        uint64_t submit_us;
+    };
+    struct sim_exchange_s m_exchanges[TRANSPORT_MAX_TICKETS];
+    int m_next_ticket;
+    int m_pending;
+
+    // stats
+    uint64_t m_n_exchanges;
+    uint64_t m_n_swd_ops;
+    uint64_t m_n_spc_cmds;
+    uint64_t m_bytes_out;
+    uint64_t m_bytes_in;
+
+    static void uint32_to_nvl(uint32_t value, uint8_t *nvl);
+    void reset_target(void);
+    uint64_t exchange(const uint8_t *data, int len, std::vector<uint8_t> &reply);
+    bool stalled(void);
+    void execute(const uint8_t *data, int len, std::vector<uint8_t> &reply);
+    void reply_b4(std::vector<uint8_t> &reply, uint32_t value);
+    void ap_access(uint8_t hdr, uint32_t wdata, std::vector<uint8_t> &reply);
+    void dp_access(uint8_t hdr, uint32_t wdata, std::vector<uint8_t> &reply);
+    uint32_t mem_read(uint32_t address);
+    void mem_write(uint32_t address, uint32_t value);
+    void tar_increment(void);
+    void debug_write(uint32_t address, uint32_t value);
+    uint32_t sram_word(uint32_t address) const;
+    void set_sram_word(uint32_t address, uint32_t value);
+    void loader_run(void);
+
+    bool spc_busy(void) const { return m_device_us < m_spc_busy_until; }
+    uint8_t spc_status(void);
+    uint8_t spc_read_data(void);
+    void spc_write(uint8_t value);
+    void spc_finish_load(void);
+    void spc_execute(void);
+    int spc_nargs(uint8_t cmd) const;
+    int row_stride(void) const { return m_code_bytes_per_row + m_config_bytes_per_row; }
+    uint8_t *flash_row(int array_id, int row);
+    bool ecc_enabled(void) const;
+    void ecc_generate(uint8_t *row);
+    uint8_t nv_read_byte(uint8_t array_id, uint32_t address);
+    uint32_t checksum_rows(int array_id, int start_row, int nrows);
+
+    void sync_wall_clock(void);
+    void record_transfer(struct usbtrace_rec_s *rec, uint64_t start_us, const uint8_t *out_data, const uint8_t *in_data);
+    bool load_state(void);
+    bool save_state(void);
+
+  public:
+    SimTransport(uint8_t ep_out, uint8_t ep_in, const DeviceData *devdata);
+    virtual ~SimTransport();
+
+    bool read_config(const std::string &config_filepath);
+
+    virtual const char *name(void) const { return "sim"; }
+
+    virtual bool open(uint16_t vid, uint16_t pid);
+    virtual void close(void);
+    virtual bool is_open(void) const { return m_open; }
+
+    virtual int enumerate(uint16_t vid, uint16_t pid, uint16_t vid_unconfigured, uint16_t pid_unconfigured,
+                          std::vector<std::string> &ids);
+    virtual bool select_device(const std::string &id);
+
+    virtual bool configure_programmer(uint16_t vid, uint16_t pid, const std::string &fx2_config_file);
+
+    virtual int bulk_out(uint8_t epaddr, const uint8_t *data, int len);
+    virtual int bulk_in(uint8_t epaddr, uint8_t *data, int max_len);
+    virtual int control_in(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                           uint8_t *data, uint16_t *reply_length, uint16_t max_length);
+    virtual int control_out(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            const uint8_t *data, int len);
+    virtual int clear_stall(uint8_t epaddr);
+
+    virtual void print_info(void);
+
+    virtual int submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms);
+    virtual int wait(int ticket, int *in_len);
+    virtual int max_inflight(void) const { return TRANSPORT_MAX_TICKETS; }
+
+    virtual uint64_t clock_ns(void) const { return m_host_us * 1000; }   // virtual time
+    virtual void sleep_ns(uint64_t ns);
+
+    uint64_t elapsed_us(void) const { return m_host_us; }
+};
+
+#endif
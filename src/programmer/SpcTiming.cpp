@@ -0,0 +1,213 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "SpcTiming.h"
+#include "SwdProtocol.h"
+
+
+SpcTiming::SpcTiming()
+    : m_estimates()
+    , m_dirty(false)
+{
+}
+
+
+uint32_t SpcTiming::key(uint8_t cmd, const uint8_t *args, int nargs)
+{
+    // GET_CHECKSUM args: aid (0x3F: all flash), start row (2), nrows - 1 (2)
+    if (cmd == SPC_CMD_GET_CHECKSUM && nargs >= 5)
+        return cmd | (((args[3] << 8) | args[4]) << 8) | (args[0] == 0x3F ? 0x1000000 : 0);
+
+    return cmd;
+}
+
+
+bool SpcTiming::load(const std::string &filename)
+{
+    FILE *fp = fopen(filename.c_str(), "r");
+    if (!fp)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (line[0] == '#')
+            continue;
+
+        unsigned long key;
+        unsigned long n;
+        unsigned long long mean_ns, dev_ns, min_ns, max_ns;
+        if (sscanf(line, "%lx %lu %llu %llu %llu %llu", &key, &n, &mean_ns, &dev_ns, &min_ns, &max_ns) != 6)
+            continue;
+
+        struct estimate_s est = { (uint32_t)n, mean_ns, dev_ns, min_ns, max_ns };
+        m_estimates[key] = est;
+    }
+
+    fclose(fp);
+    m_dirty = false;
+    return true;
+}
+
+
+bool SpcTiming::save(const std::string &filename)
+{
+    // write to a temporary and rename: several programmers (gang mode) may save at once
+    std::string tmp_file = filename + ".XXXXXX";
+    int fd = mkstemp(&tmp_file[0]);
+    if (fd < 0)
+        return false;
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp)
+    {
+        close(fd);
+        unlink(tmp_file.c_str());
+        return false;
+    }
+
+    fprintf(fp, "# SPC command completion times (ns): key nsamples mean dev min max\n");
+
+    std::map<uint32_t, struct estimate_s>::const_iterator it;
+    for (it = m_estimates.begin(); it != m_estimates.end(); ++it)
+    {
+        const struct estimate_s *est = &it->second;
+        fprintf(fp, "%lx %lu %llu %llu %llu %llu\n", (unsigned long)it->first, (unsigned long)est->nsamples,
+            (unsigned long long)est->mean_ns, (unsigned long long)est->dev_ns,
+            (unsigned long long)est->min_ns, (unsigned long long)est->max_ns);
+    }
+
+    bool ok = fclose(fp) == 0 && rename(tmp_file.c_str(), filename.c_str()) == 0;
+    if (!ok)
+        unlink(tmp_file.c_str());
+    else
+        m_dirty = false;
+
+    return ok;
+}
+
+
+void SpcTiming::sample(uint32_t key, uint64_t ns)
+{
+    std::map<uint32_t, struct estimate_s>::iterator it = m_estimates.find(key);
+
+    if (it == m_estimates.end())
+    {
+        struct estimate_s est = { 1, ns, ns / 4, ns, ns };
+        m_estimates[key] = est;
+    }
+    else
+    {
+        // Jacobson/Karels, as usbtimeout.c
+        struct estimate_s *est = &it->second;
+        int64_t err = (int64_t)ns - (int64_t)est->mean_ns;
+        uint64_t abs_err = err < 0 ? -err : err;
+        est->dev_ns = est->dev_ns + ((int64_t)abs_err - (int64_t)est->dev_ns) / 4;
+        est->mean_ns = est->mean_ns + err / 8;
+        if (ns < est->min_ns) est->min_ns = ns;
+        if (ns > est->max_ns) est->max_ns = ns;
+        est->nsamples++;
+    }
+
+    m_dirty = true;
+}
+
+
+void SpcTiming::bound(uint32_t key, uint64_t ns)
+{
+    // Only lowers the minimum: otherwise a waiter that sleeps too long would never see a
+    // busy poll and never learn the command got quicker.
+    std::map<uint32_t, struct estimate_s>::iterator it = m_estimates.find(key);
+
+    if (it != m_estimates.end() && ns < it->second.min_ns)
+    {
+        it->second.min_ns = ns;
+        m_dirty = true;
+    }
+}
+
+
+bool SpcTiming::known(uint32_t key) const
+{
+    std::map<uint32_t, struct estimate_s>::const_iterator it = m_estimates.find(key);
+    return it != m_estimates.end() && it->second.nsamples >= SPC_TIMING_MIN_SAMPLES;
+}
+
+
+uint64_t SpcTiming::likely_done_ns(uint32_t key) const
+{
+    std::map<uint32_t, struct estimate_s>::const_iterator it = m_estimates.find(key);
+    if (it == m_estimates.end() || it->second.nsamples < SPC_TIMING_MIN_SAMPLES)
+        return 0;
+
+    // two deviations under the mean, never later than the quickest seen, less a margin
+    const struct estimate_s *est = &it->second;
+    uint64_t ns = est->mean_ns > 2 * est->dev_ns ? est->mean_ns - 2 * est->dev_ns : 0;
+    if (ns > est->min_ns) ns = est->min_ns;
+
+    return ns - ns / 16;
+}
+
+
+uint64_t SpcTiming::timeout_ns(uint32_t key) const
+{
+    std::map<uint32_t, struct estimate_s>::const_iterator it = m_estimates.find(key);
+    if (it == m_estimates.end() || it->second.nsamples < SPC_TIMING_MIN_SAMPLES)
+        return (uint64_t)SPC_TIMING_DEFAULT_TIMEOUT_MS * 1000000;
+
+    const struct estimate_s *est = &it->second;
+    uint64_t ns = est->mean_ns + 4 * est->dev_ns;
+    if (ns < est->max_ns) ns = est->max_ns;
+    ns *= 4;
+
+    if (ns < (uint64_t)SPC_TIMING_MIN_TIMEOUT_MS * 1000000)
+        ns = (uint64_t)SPC_TIMING_MIN_TIMEOUT_MS * 1000000;
+
+    return ns;
+}
+
+
+uint64_t SpcTiming::mean_ns(uint32_t key) const
+{
+    std::map<uint32_t, struct estimate_s>::const_iterator it = m_estimates.find(key);
+    if (it == m_estimates.end() || it->second.nsamples < SPC_TIMING_MIN_SAMPLES)
+        return 0;
+
+    return it->second.mean_ns;
+}
+
+
+void SpcTiming::dump(FILE *fp) const
+{
+    fprintf(fp, "SPC timing (us):\n  %-10s %8s %10s %10s %10s %10s\n", "key", "n", "mean", "dev", "min", "max");
+
+    std::map<uint32_t, struct estimate_s>::const_iterator it;
+    for (it = m_estimates.begin(); it != m_estimates.end(); ++it)
+    {
+        const struct estimate_s *est = &it->second;
+        fprintf(fp, "  0x%08x %8u %10.1f %10.1f %10.1f %10.1f\n", it->first, est->nsamples,
+            est->mean_ns / 1e3, est->dev_ns / 1e3, est->min_ns / 1e3, est->max_ns / 1e3);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _SPCTIMING_H
+#define _SPCTIMING_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string>
+#include <map>
+
+
+// How long SPC commands take to complete, learned from the status polls that see them finish.
+//
+// Used by the SPC waiter to sleep through most of a long command (erase, write row, checksum)
+// instead of polling it over USB, and to time out relative to what the command normally takes
+// rather than after a fixed number of polls.
+//
+// Times are measured from just before the command is sent to the poll that saw it complete,
+// so include USB latency: they are for the transport and device type they were measured on.
+// Saved per device type and transport (<config dir>/<device>.<transport>.spc_timing, text)
+// and reloaded next run.
+
+#define SPC_TIMING_MIN_SAMPLES          3       // before estimates are used
+#define SPC_TIMING_MIN_TIMEOUT_MS       250
+#define SPC_TIMING_DEFAULT_TIMEOUT_MS   2000    // unknown command (about the old 8404 polls)
+
+
+class SpcTiming
+{
+    struct estimate_s
+    {
+        uint32_t nsamples;
+        uint64_t mean_ns;       // smoothed (gain 1/8)
+        uint64_t dev_ns;        // smoothed mean deviation (gain 1/4)
+        uint64_t min_ns;        // shortest seen (or upper bound on it, see bound())
+        uint64_t max_ns;
+    };
+
+    std::map<uint32_t, struct estimate_s> m_estimates;
+    bool m_dirty;
+
+  public:
+    SpcTiming();
+
+    // key: the command, plus row count for GET_CHECKSUM (time is proportional to it)
+    static uint32_t key(uint8_t cmd, const uint8_t *args, int nargs);
+
+    void clear(void) { m_estimates.clear(); m_dirty = false; }
+    bool load(const std::string &filename);
+    bool save(const std::string &filename);
+    bool dirty(void) const { return m_dirty; }
+
+    // completion seen after at least one busy poll: ns is accurate to a poll interval
+    void sample(uint32_t key, uint64_t ns);
+    // completion seen on the first poll: it took no longer than ns
+    void bound(uint32_t key, uint64_t ns);
+
+    bool known(uint32_t key) const;
+    uint64_t likely_done_ns(uint32_t key) const;    // rarely finished before this: no point polling
+    uint64_t timeout_ns(uint32_t key) const;        // give up after this
+    uint64_t mean_ns(uint32_t key) const;           // typical time, 0 if not known
+
+    void dump(FILE *fp) const;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef _SWDFRAME_H
+#define _SWDFRAME_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "SwdProtocol.h"
+
+
+// SWD request frames built at compile time.
+//
+// A frame is the bytes the FX2 is sent for a fixed run of DPACC/APACC operations: the header
+// byte, plus 4 data bytes (LSB first) for a write. Sequences that never change (line reset,
+// DAP setup, SPC status read) and the fixed parts of SPC commands are constexpr, so sending
+// one is a memcpy. The variable fields are then patched in place (swd_frame_patch_b0()).
+//
+// Frames with only writes can be queued whole on a SwdQueue (SwdQueue::frame()): their reply
+// is one ACK per write.
+
+#define SWD_FRAME_WRITE_LEN     5
+#define SWD_FRAME_READ_LEN      1
+
+#define SWD_FRAME_MAX_ROW_LEN   288     // largest SPC LOAD_ROW: 256 bytes + 32 ECC/config
+
+
+template <int N>
+struct SwdFrame
+{
+    uint8_t bytes[N];
+    int len;
+    int nwrites;
+    int nreads;
+
+    constexpr SwdFrame() : bytes(), len(0), nwrites(0), nreads(0) {}
+
+    constexpr void write(uint8_t hdr, uint32_t data)
+    {
+        bytes[len++] = hdr;
+        bytes[len++] = data & 0xff;
+        bytes[len++] = (data >> 8) & 0xff;
+        bytes[len++] = (data >> 16) & 0xff;
+        bytes[len++] = (data >> 24) & 0xff;
+        nwrites++;
+    }
+
+    constexpr void read(uint8_t hdr)
+    {
+        bytes[len++] = hdr;
+        nreads++;
+    }
+
+    // raw bytes that are not SWD operations (line reset): no reply
+    constexpr void raw(uint8_t b)
+    {
+        bytes[len++] = b;
+    }
+};
+
+
+// Offset of the data field of write op n in a frame of writes only
+constexpr int swd_frame_write_data(int n) { return n * SWD_FRAME_WRITE_LEN + 1; }
+
+// SPC data is one byte wide: only byte 0 of a write changes, the rest stay 0
+inline void swd_frame_patch_b0(uint8_t *frame, int n, uint8_t value) { frame[swd_frame_write_data(n)] = value; }
+
+
+// JTAG to SWD switch sequence, as sent by Programmer::jtag_to_swd(). Raw: the reply is not
+// one ACK per byte.
+constexpr SwdFrame<30> swd_frame_line_reset(void)
+{
+    SwdFrame<30> f;
+    f.raw(0xF0);
+    f.raw(0xF0);
+    while (f.len < 30)
+        f.raw(0x00);
+    return f;
+}
+
+
+// DAP setup after the IDCODE read: debug port power up, AP bank 0, 32 bit AP transfers
+// (no auto increment), then halt the CPU, release its reset, enable the chip subsystems
+// and run the IMO at 24MHz. Writes only.
+constexpr SwdFrame<11 * SWD_FRAME_WRITE_LEN> swd_frame_dap_setup(void)
+{
+    SwdFrame<11 * SWD_FRAME_WRITE_LEN> f;
+    f.write(DPACC_CTRLSTAT_WRITE, 0x50000000);
+    f.write(DPACC_SELECT_WRITE, 0x00000000);
+    f.write(APACC_CTRLSTAT_WRITE, AP_CSW_PSOC_32BIT);
+    f.write(APACC_ADDR_WRITE, CM3_DHCSR);
+    f.write(APACC_DATA_WRITE, CM3_DHCSR_KEY | CM3_DHCSR_C_HALT | CM3_DHCSR_C_DEBUGEN);
+    f.write(APACC_ADDR_WRITE, 0x4008000C);
+    f.write(APACC_DATA_WRITE, 0x00000002);
+    f.write(APACC_ADDR_WRITE, 0x400043A0);
+    f.write(APACC_DATA_WRITE, 0x000000BF);
+    f.write(APACC_ADDR_WRITE, 0x40004200);
+    f.write(APACC_DATA_WRITE, 0x00000002);
+    return f;
+}
+
+
+// SPC status: address, dummy read (starts the access), read (returns it)
+constexpr SwdFrame<SWD_FRAME_WRITE_LEN + 2 * SWD_FRAME_READ_LEN> swd_frame_spc_status(void)
+{
+    SwdFrame<SWD_FRAME_WRITE_LEN + 2 * SWD_FRAME_READ_LEN> f;
+    f.write(APACC_ADDR_WRITE, REG_SPC_STATUS);
+    f.read(APACC_DATA_READ);
+    f.read(APACC_DATA_READ);
+    return f;
+}
+
+
+// SPC command with NARGS argument bytes: CPU_DATA address, KEY1, KEY2 + cmd, cmd, args.
+// The command and argument bytes are patched by SpcCmdFrame::encode().
+template <int NARGS>
+constexpr SwdFrame<(4 + NARGS) * SWD_FRAME_WRITE_LEN> swd_frame_spc_cmd(void)
+{
+    SwdFrame<(4 + NARGS) * SWD_FRAME_WRITE_LEN> f;
+    f.write(APACC_ADDR_WRITE, REG_SPC_CPU_DATA);
+    f.write(APACC_DATA_WRITE, SPC_KEY1);
+    for (int i=0; i<2 + NARGS; i++)
+        f.write(APACC_DATA_WRITE, 0);   // key2 + cmd, cmd, args
+    return f;
+}
+
+
+template <int NARGS>
+struct SpcCmdFrame
+{
+    static constexpr int LEN = (4 + NARGS) * SWD_FRAME_WRITE_LEN;
+    static constexpr SwdFrame<LEN> frame = swd_frame_spc_cmd<NARGS>();
+
+    static void encode(uint8_t *p, uint8_t cmd, const uint8_t *args)
+    {
+        memcpy(p, frame.bytes, LEN);
+        swd_frame_patch_b0(p, 2, SPC_KEY2 + cmd);
+        swd_frame_patch_b0(p, 3, cmd);
+        for (int i=0; i<NARGS; i++)
+            swd_frame_patch_b0(p, 4 + i, args[i]);
+    }
+};
+
+
+// SPC LOAD_ROW: a 1 argument command (array id) followed by the row bytes. One frame sized
+// for the largest row; a shorter row copies only the part it needs.
+#define SPC_LOAD_ROW_FRAME_MAX_LEN  ((5 + SWD_FRAME_MAX_ROW_LEN) * SWD_FRAME_WRITE_LEN)
+
+constexpr SwdFrame<SPC_LOAD_ROW_FRAME_MAX_LEN> swd_frame_spc_load_row(void)
+{
+    SwdFrame<SPC_LOAD_ROW_FRAME_MAX_LEN> f;
+    f.write(APACC_ADDR_WRITE, REG_SPC_CPU_DATA);
+    f.write(APACC_DATA_WRITE, SPC_KEY1);
+    f.write(APACC_DATA_WRITE, SPC_KEY2 + SPC_CMD_LOAD_ROW);
+    f.write(APACC_DATA_WRITE, SPC_CMD_LOAD_ROW);
+    while (f.len < SPC_LOAD_ROW_FRAME_MAX_LEN)
+        f.write(APACC_DATA_WRITE, 0);   // array id, data
+    return f;
+}
+
+
+struct SpcLoadRowFrame
+{
+    static constexpr SwdFrame<SPC_LOAD_ROW_FRAME_MAX_LEN> frame = swd_frame_spc_load_row();
+
+    static int length(int len) { return (5 + len) * SWD_FRAME_WRITE_LEN; }
+
+    // p must have room for length(len). len <= SWD_FRAME_MAX_ROW_LEN.
+    static void encode(uint8_t *p, uint8_t array_id, const uint8_t *data, int len)
+    {
+        memcpy(p, frame.bytes, length(len));
+        swd_frame_patch_b0(p, 4, array_id);
+        for (int i=0; i<len; i++)
+            swd_frame_patch_b0(p, 5 + i, data[i]);
+    }
+};
+
+#endif
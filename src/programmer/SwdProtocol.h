@@ -0,0 +1,130 @@
+#ifndef _SWDPROTOCOL_H
+#define _SWDPROTOCOL_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SWD packet, SPC and FX2 reply definitions shared by the Programmer and the simulator.
+// REFERENCE: Use PSoC5 Device Progamming Specifications 001-64359
+
+// SWD Packet Header definitions
+#define APACC_ADDR_WRITE         0x8B
+#define APACC_DATA_READ          0x9F
+#define APACC_CTRLSTAT_WRITE     0xA3
+#define APACC_DATA_WRITE         0xBB
+
+#define DPACC_READBUFF_WRITE     0x99
+#define DPACC_IDOCDE_READ        0xA5
+#define DPACC_CTRLSTAT_WRITE     0xA9
+#define DPACC_SELECT_WRITE       0xB1
+#define DPACC_RDBUFF_READ        0xBD
+
+// Header byte layout (LSB first on the wire): Start, APnDP, RnW, A[2:3], Parity, Stop, Park
+#define SWD_HDR_START            0x01
+#define SWD_HDR_APNDP            0x02
+#define SWD_HDR_RNW              0x04
+#define SWD_HDR_ADDR(hdr)        (((hdr) >> 1) & 0x0C)   // register address 0x0, 0x4, 0x8 or 0xC
+#define SWD_HDR_PARK             0x80
+
+// AP register addresses (bank 0)
+#define AP_REG_CSW               0x00
+#define AP_REG_TAR               0x04
+#define AP_REG_DRW               0x0C
+
+#define AP_CSW_PSOC_32BIT        0x22000002  // 32 bit transfers, TAR fixed (normal setting, SPC access relies on it)
+#define AP_CSW_SIZE_32           0x00000002
+#define AP_CSW_ADDRINC_SINGLE    0x00000010
+#define AP_CSW_ADDRINC_MASK      0x00000030
+
+// Cortex-M3 core debug registers
+#define CM3_DHCSR                0xE000EDF0
+#define CM3_DCRSR                0xE000EDF4
+#define CM3_DCRDR                0xE000EDF8
+
+#define CM3_DHCSR_KEY            0xA05F0000  // write key (bits 31:16)
+#define CM3_DHCSR_C_DEBUGEN      0x00000001
+#define CM3_DHCSR_C_HALT         0x00000002
+#define CM3_DHCSR_C_MASKINTS     0x00000008  // can only be changed while halted
+
+#define CM3_DCRSR_REGWNR         0x00010000
+#define CM3_DCRSR_REGSEL_MASK    0x0000001F  // 13 SP, 15 PC (debug return address), 16 xPSR
+
+#if 0
+#define PORT_ACQUIRE_KEY_HEADER  0x99
+#define TESTMODE_ADDRESS_HEADER  0x8B
+#define TESTMODE_KEY_HEADER      0xBB
+#endif
+
+
+// System Performance Controller (SPC)
+
+#define REG_SPC_CPU_DATA        0x40004720
+#define REG_SPC_DMA_DATA        0x40004721
+#define REG_SPC_STATUS          0x40004722
+
+#define SPC_STATUS_DATA_READY   0x01
+#define SPC_STATUS_IDLE         0x02
+
+#define SPC_CMD_LOAD_BYTE           0x00
+#define SPC_CMD_LOAD_MULTI_BYTE     0x01
+#define SPC_CMD_LOAD_ROW            0x02
+#define SPC_CMD_READ_BYTE           0x03
+#define SPC_CMD_READ_MULTI_BYTE     0x04
+#define SPC_CMD_WRITE_ROW           0x05
+#define SPC_CMD_WRITE_NVL           0x06
+// PSoC TRM 50235 Ch 44.3 suggest 0x05 erases first then writes but 0x07 only writes
+#define SPC_CMD_PROG_ROW            0x07
+#define SPC_CMD_ERASE_SECTOR        0x08
+#define SPC_CMD_ERASE_ALL           0x09
+#define SPC_CMD_READ_HIDDEN_ROW     0x0A
+#define SPC_CMD_PROTECT             0x0B
+#define SPC_CMD_GET_CHECKSUM        0x0C
+#define SPC_CMD_GET_TEMPERATURE     0x0E
+#define SPC_CMD_READ_NVL_VOL_BYTE   0x10
+
+#define SPC_KEY1                0xb6
+#define SPC_KEY2                0xd3
+
+#define SPC_NV_AID_FLASH_START  0x00
+#define SPC_NV_AID_FLASH_END    0x3E
+#define SPC_NV_AID_FLASH_ALL    0x3F
+#define SPC_NV_AID_EEPROM       0x40
+#define SPC_NV_AID_CONFIG       0x80
+#define SPC_NV_AID_WOL          0xF8
+
+
+#define TEST_MODE_KEY_REGISTER  0x40050210
+#define TEST_MODE_KEY           0xEA7E30A9
+
+
+//#define CONFIG_ADDRESS_OFFSET   0x00800000
+
+// ACK response is stored as a byte. Possible ACK values are:
+//  0x01 - SWD_OK_ACK (SUCCESS)
+//  0x02 - SWD_WAIT_ACK
+//  0x04 - SWD_FAULT_ACK
+//  0x1x - Timeout (T_testmode exceeded) - treat same as FAULT_ACK
+// reply returned by USB interface. ACK may be LSbit. What are bits 5,6
+#define REPLY_OK                    0x21
+#define REPLY_XX1                   0x24
+
+#define REPLY_JTAGID_MATCHED        0x31
+#define REPLY_JTAGID_NOMATCH        0x27
+// also get 0x31, 0x37
+
+#endif
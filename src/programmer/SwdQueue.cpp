@@ -0,0 +1,429 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "SwdQueue.h"
+#include "SwdFrame.h"
+#include "swdreply.h"
+#include "utils.h"
+#include "usbtimeout.h"
+
+
+SwdQueue::SwdQueue()
+    : m_segments(NULL)
+    , m_debug(0)
+{
+    m_segments = new struct segment_s[TRANSPORT_MAX_TICKETS];
+    for (int i=0; i<TRANSPORT_MAX_TICKETS; i++)
+    {
+        m_segments[i].out = NULL;
+        m_segments[i].in = NULL;
+    }
+}
+
+
+SwdQueue::~SwdQueue()
+{
+    delete [] m_segments;
+    m_segments = NULL;
+}
+
+
+bool SwdQueue::attach(Transport *transport)
+{
+    assert(transport);
+    assert(TRANSPORT_BUFFER_LEN >= SWD_QUEUE_MAX_REQUEST_LEN && TRANSPORT_BUFFER_LEN >= SWD_QUEUE_MAX_REPLY_LEN);
+
+    for (int i=0; i<TRANSPORT_MAX_TICKETS; i++)
+    {
+        if (!m_segments[i].out) m_segments[i].out = transport->get_buffer();
+        if (!m_segments[i].in) m_segments[i].in = transport->get_buffer();
+
+        if (!m_segments[i].out || !m_segments[i].in)
+        {
+            fprintf(stderr, "SwdQueue: failed to get transfer buffers\n");
+            detach(transport);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void SwdQueue::detach(Transport *transport)
+{
+    assert(transport);
+
+    for (int i=0; i<TRANSPORT_MAX_TICKETS; i++)
+    {
+        if (m_segments[i].out) transport->put_buffer(m_segments[i].out);
+        if (m_segments[i].in) transport->put_buffer(m_segments[i].in);
+        m_segments[i].out = NULL;
+        m_segments[i].in = NULL;
+    }
+}
+
+
+void SwdQueue::push(uint8_t hdr, uint32_t wdata, uint8_t *rdata, int rdata_len, bool check_ack)
+{
+    struct swd_op_s op;
+
+    op.hdr = hdr;
+    op.wdata = wdata;
+    op.rdata = rdata;
+    op.rdata_len = rdata_len;
+    op.check_ack = check_ack;
+    op.frame_len = 0;
+
+    m_ops.push_back(op);
+}
+
+
+uint8_t *SwdQueue::frame(int len)
+{
+    // must fit one transfer each way; pack() doesn't split frames
+    assert(len > 0 && len % SWD_FRAME_WRITE_LEN == 0);
+    assert(len <= SWD_QUEUE_MAX_REQUEST_LEN && len / SWD_FRAME_WRITE_LEN <= SWD_QUEUE_MAX_REPLY_LEN);
+
+    struct swd_op_s op;
+
+    op.hdr = 0;
+    op.wdata = m_frame_bytes.size();
+    op.rdata = NULL;
+    op.rdata_len = 0;
+    op.check_ack = true;
+    op.frame_len = len;
+
+    m_ops.push_back(op);
+    m_frame_bytes.resize(op.wdata + len);
+    return &m_frame_bytes[op.wdata];
+}
+
+
+void SwdQueue::ap_read(uint32_t address, uint8_t *data, bool dummy_preread)
+{
+    // Same sequence as a single ap_register_read: the dummy read starts the access, the next returns it.
+    apacc_addr_write(address);
+    if (dummy_preread)
+        apacc_dummy_read();
+    apacc_data_read(data);
+}
+
+
+void SwdQueue::ap_write(uint32_t address, uint32_t value)
+{
+    apacc_addr_write(address);
+    apacc_data_write(value);
+}
+
+
+void SwdQueue::ap_read_block(uint32_t address, uint8_t *data, int nwords)
+{
+    // TAR only auto increments within a 1KB block so it is rewritten for each one. In a block
+    // the first read starts the first access and every read returns the previous word. The
+    // last word is collected from RDBUFF, which starts no access (past the end of the region).
+    while (nwords > 0)
+    {
+        int n = (0x400 - (address & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+
+        apacc_addr_write(address);
+        apacc_dummy_read();
+
+        int i;
+        for (i=0; i<n-1; i++)
+            apacc_data_read(data + 4*i);
+        dpacc_rdbuff_read(data + 4*(n-1));
+
+        address += 4*n;
+        data += 4*n;
+        nwords -= n;
+    }
+}
+
+
+void SwdQueue::ap_write_block(uint32_t address, const uint8_t *data, int nwords)
+{
+    // As ap_read_block: TAR rewritten per 1KB block, then one DRW write per word
+    while (nwords > 0)
+    {
+        int n = (0x400 - (address & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+
+        apacc_addr_write(address);
+
+        int i;
+        for (i=0; i<n; i++)
+            apacc_data_write(b4_LE_to_uint32(data + 4*i));
+
+        address += 4*n;
+        data += 4*n;
+        nwords -= n;
+    }
+}
+
+
+int SwdQueue::pack(struct segment_s *seg, int first_op)
+{
+    // Fill seg with as many ops as fit in one request/reply pair. Returns number packed.
+
+    int nops = m_ops.size();
+    int i;
+
+    seg->first_op = first_op;
+    seg->out_len = 0;
+    seg->in_len = 0;
+
+    for (i=first_op; i<nops; i++)
+    {
+        const struct swd_op_s *op = &m_ops[i];
+        bool is_read = op->hdr & SWD_HDR_RNW;
+        int out_len = is_read ? 1 : 5;
+        int in_len = is_read ? 5 : 1;
+
+        if (op->frame_len)
+        {
+            out_len = op->frame_len;
+            in_len = op->frame_len / SWD_FRAME_WRITE_LEN;
+        }
+
+        if (seg->out_len + out_len > SWD_QUEUE_MAX_REQUEST_LEN || seg->in_len + in_len > SWD_QUEUE_MAX_REPLY_LEN)
+            break;
+
+        uint8_t *p = seg->out + seg->out_len;
+        if (op->frame_len)
+            memcpy(p, &m_frame_bytes[op->wdata], op->frame_len);
+        else
+            p[0] = op->hdr;
+
+        if (!is_read && !op->frame_len)
+        {
+            // LSB first
+            p[1] = op->wdata & 0xff;
+            p[2] = (op->wdata >> 8) & 0xff;
+            p[3] = (op->wdata >> 16) & 0xff;
+            p[4] = (op->wdata >> 24) & 0xff;
+        }
+
+        seg->out_len += out_len;
+        seg->in_len += in_len;
+    }
+
+    seg->nops = i - first_op;
+    return seg->nops;
+}
+
+
+int SwdQueue::run_length(int first_op, int end_op) const
+{
+    // Number of ops from first_op that can be decoded as one run: all ACK checked writes, or
+    // all ACK checked reads of the same width into consecutive destinations (or none).
+    const struct swd_op_s *first = &m_ops[first_op];
+    bool is_read = first->hdr & SWD_HDR_RNW;
+    int i;
+
+    if (first->frame_len || !first->check_ack)
+        return 1;
+
+    for (i=first_op + 1; i<end_op; i++)
+    {
+        const struct swd_op_s *op = &m_ops[i];
+
+        if (op->frame_len || !op->check_ack || (bool)(op->hdr & SWD_HDR_RNW) != is_read)
+            break;
+
+        if (is_read)
+        {
+            int k = i - first_op;
+            if (op->rdata_len != first->rdata_len)
+                break;
+            if (first->rdata ? op->rdata != first->rdata + k * first->rdata_len : op->rdata != NULL)
+                break;
+        }
+    }
+
+    return i - first_op;
+}
+
+
+bool SwdQueue::decode(const struct segment_s *seg, int actual_len)
+{
+    // Reply is ACK for each write and 4 data bytes (LSB first) + ACK for each read.
+    // Runs of like ops are checked and copied in one pass each (swdreply.h).
+
+    bool ok = true;
+    int pos = 0;
+    int end_op = seg->first_op + seg->nops;
+    int i;
+
+    if (m_debug) dump_data(stderr, seg->in, actual_len, "SwdQueue reply");
+
+    if (actual_len < seg->in_len)
+    {
+        fprintf(stderr, "SwdQueue: short reply. Expected %d bytes, got %d\n", seg->in_len, actual_len);
+        ok = false;
+    }
+
+    for (i=seg->first_op; i<end_op; )
+    {
+        const struct swd_op_s *op = &m_ops[i];
+        bool is_read = op->hdr & SWD_HDR_RNW;
+        int len = is_read ? SWD_REPLY_READ_LEN : 1;
+        int n = 1;
+        int bad = -1;   // first bad ACK in the run
+        int bad_write = -1;
+
+        if (op->frame_len)
+        {
+            // an ACK per write in the frame
+            int nwrites = op->frame_len / SWD_FRAME_WRITE_LEN;
+
+            if (pos + nwrites > actual_len)
+                break;
+
+            bad_write = swd_reply_check_acks(seg->in + pos, 1, nwrites);
+            if (bad_write >= 0)
+                bad = 0;
+            pos += nwrites;
+        }
+        else
+        {
+            n = run_length(i, end_op);
+            if (n > (actual_len - pos) / len)
+                n = (actual_len - pos) / len;
+            if (n == 0)
+                break;
+
+            if (!op->check_ack)
+            {
+                if (is_read && op->rdata)
+                    memcpy(op->rdata, seg->in + pos, op->rdata_len);
+            }
+            else if (!is_read)
+                bad = swd_reply_check_acks(seg->in + pos, 1, n);
+            else if (op->rdata_len == 1)
+                bad = swd_reply_decode_b0(seg->in + pos, n, op->rdata);
+            else if (op->rdata_len == 4)
+                bad = swd_reply_decode_b4(seg->in + pos, n, op->rdata);
+            else
+            {
+                int k;
+                for (k=0; k<n; k++)
+                {
+                    if (op->rdata)
+                        memcpy(op->rdata + k * op->rdata_len, seg->in + pos + k * len, op->rdata_len);
+                }
+                bad = swd_reply_check_acks(seg->in + pos, len, n);
+            }
+            pos += n * len;
+        }
+
+        if (bad >= 0)
+        {
+            if (ok)
+            {
+                const struct swd_op_s *bad_op = &m_ops[i + bad];
+                int ack_pos = bad_write >= 0 ? pos - op->frame_len / SWD_FRAME_WRITE_LEN + bad_write
+                                             : pos - (n - bad) * len + len - 1;
+
+                if (bad_write >= 0)
+                    fprintf(stderr, "SwdQueue: op %d (frame write %d)", i, bad_write);
+                else
+                    fprintf(stderr, "SwdQueue: op %d (hdr 0x%02x)", i + bad, bad_op->hdr);
+                fprintf(stderr, " expected ACK 0x%x found 0x%x at reply byte %d.\nData (%d): ",
+                    REPLY_OK, seg->in[ack_pos], ack_pos, actual_len);
+                dump_data(stderr, seg->in, actual_len, NULL);
+            }
+            ok = false;
+        }
+
+        i += n;
+    }
+
+    return ok;
+}
+
+
+bool SwdQueue::flush(Transport *transport)
+{
+    // Sends all queued ops. Returns true if every transfer succeeded and every checked ACK was OK.
+    // The queue is empty afterwards either way.
+
+    assert(transport);
+    assert(m_segments[0].out);  // attach() not called
+
+    int nops = m_ops.size();
+    int max_inflight = transport->max_inflight();
+    if (max_inflight > TRANSPORT_MAX_TICKETS) max_inflight = TRANSPORT_MAX_TICKETS;
+
+    int next_op = 0;
+    int submitted = 0;
+    int completed = 0;
+    bool ok = true;
+
+    while (completed < submitted || (ok && next_op < nops))
+    {
+        while (ok && next_op < nops && submitted - completed < max_inflight)
+        {
+            struct segment_s *seg = &m_segments[submitted % TRANSPORT_MAX_TICKETS];
+            next_op += pack(seg, next_op);
+
+            if (m_debug) dump_data(stderr, seg->out, seg->out_len, "SwdQueue send");
+
+            seg->ticket = transport->submit(seg->out, seg->out_len, seg->in, SWD_QUEUE_MAX_REPLY_LEN, usb_timeout_ms(USB_TIMEOUT_BULK));
+            if (seg->ticket < 0)
+            {
+                fprintf(stderr, "SwdQueue: submit failed: %d\n", seg->ticket);
+                ok = false;
+                break;
+            }
+            submitted++;
+        }
+
+        if (completed == submitted)
+            break;
+
+        // drain in order even after a failure so nothing is left referencing the buffers
+        struct segment_s *seg = &m_segments[completed % TRANSPORT_MAX_TICKETS];
+        int len = 0;
+        int rc = transport->wait(seg->ticket, &len);
+        completed++;
+
+        if (rc != 0)
+        {
+            fprintf(stderr, "SwdQueue: transfer failed: %d\n", rc);
+            ok = false;
+            continue;
+        }
+
+        if (!decode(seg, len))
+            ok = false;
+    }
+
+    m_ops.clear();
+    m_frame_bytes.clear();
+    return ok;
+}
@@ -0,0 +1,126 @@
+#ifndef _SWDQUEUE_H
+#define _SWDQUEUE_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <vector>
+
+#include "SwdProtocol.h"
+#include "Transport.h"
+
+
+// FX2 firmware buffer sizes - one bulk transfer each way
+#define SWD_QUEUE_MAX_REQUEST_LEN   2048
+#define SWD_QUEUE_MAX_REPLY_LEN     2048
+
+
+// Queue of SWD operations sent with as few bulk transfers as possible.
+//
+// Callers queue DPACC/APACC reads and writes then flush(). flush() packs the operations
+// into bulk transfers (splitting wherever a request or its reply would exceed the FX2
+// buffers), keeps up to max_inflight() of them in flight, and checks every ACK and stores
+// read data in queue order.
+//
+// Reads are stored as they come back from the FX2 ie AP reads are still posted (each one
+// returns the result of the previous AP read). ap_read() hides this for single registers.
+//
+// Pointers passed for read data must remain valid until flush() returns.
+
+class SwdQueue
+{
+    struct swd_op_s
+    {
+        uint8_t hdr;
+        uint32_t wdata;
+        uint8_t *rdata;     // read data destination (may be NULL)
+        int rdata_len;      // 4 = whole word (LSB first), 1 = byte 0 only
+        bool check_ack;     // false: ACK ignored (eg dummy reads)
+        int frame_len;      // > 0: precomputed frame of writes, m_frame_bytes[wdata..] (see frame())
+    };
+
+    struct segment_s
+    {
+        int first_op;
+        int nops;
+        int out_len;
+        int in_len;         // expected
+        int ticket;
+        uint8_t *out;       // transport pool buffers (see attach())
+        uint8_t *in;
+    };
+
+    std::vector<struct swd_op_s> m_ops;
+    std::vector<uint8_t> m_frame_bytes;
+    struct segment_s *m_segments;   // TRANSPORT_MAX_TICKETS of them
+
+    void push(uint8_t hdr, uint32_t wdata, uint8_t *rdata, int rdata_len, bool check_ack);
+    int pack(struct segment_s *seg, int first_op);
+    int run_length(int first_op, int end_op) const;
+    bool decode(const struct segment_s *seg, int actual_len);
+
+  public:
+    uint32_t m_debug;
+
+  public:
+    SwdQueue();
+    ~SwdQueue();
+
+    // Borrow/return transfer buffers from the transport pool. attach() after the transport is
+    // opened, detach() before it is closed.
+    bool attach(Transport *transport);
+    void detach(Transport *transport);
+
+    void reset(void) { m_ops.clear(); m_frame_bytes.clear(); }
+    int length(void) const { return m_ops.size(); }
+    void swap_ops(SwdQueue &other) { m_ops.swap(other.m_ops); m_frame_bytes.swap(other.m_frame_bytes); } // ops built in one queue, sent by another
+
+    void write(uint8_t hdr, uint32_t data) { push(hdr, data, NULL, 0, true); }
+    void read(uint8_t hdr, uint8_t *data, int data_len=4, bool check_ack=true) { push(hdr, 0, data, data_len, check_ack); }
+
+    inline void apacc_addr_write(uint32_t addr) { write(APACC_ADDR_WRITE, addr); }
+    inline void apacc_data_write(uint32_t data) { write(APACC_DATA_WRITE, data); }
+    inline void apacc_ctrl_write(uint32_t reg) { write(APACC_CTRLSTAT_WRITE, reg); }
+    inline void dpacc_ctrl_write(uint32_t reg) { write(DPACC_CTRLSTAT_WRITE, reg); }
+    inline void dpacc_select_write(uint32_t reg) { write(DPACC_SELECT_WRITE, reg); }
+    inline void dpacc_idcode_read(uint8_t *data) { read(DPACC_IDOCDE_READ, data); }
+    inline void dpacc_rdbuff_read(uint8_t *data) { read(DPACC_RDBUFF_READ, data); }
+    inline void apacc_data_read(uint8_t *data) { read(APACC_DATA_READ, data); }
+    inline void apacc_data_read_b0(uint8_t *data) { read(APACC_DATA_READ, data, 1); }
+    inline void apacc_dummy_read(void) { read(APACC_DATA_READ, NULL, 0, false); }
+
+    // Precomputed frame of writes (see SwdFrame.h), sent as is. frame(len) returns the space for
+    // the caller to fill; it is valid until the next frame() call. Checked as len / 5 ACKs.
+    uint8_t *frame(int len);
+    void frame(const uint8_t *bytes, int len) { memcpy(frame(len), bytes, len); }
+
+    // Single register helpers. ap_read data is uint8_t[4], LSB first.
+    void ap_read(uint32_t address, uint8_t *data, bool dummy_preread=true);
+    void ap_write(uint32_t address, uint32_t value);
+
+    // Consecutive words from/to address (word aligned, data LSB first). CSW must have auto increment set.
+    void ap_read_block(uint32_t address, uint8_t *data, int nwords);
+    void ap_write_block(uint32_t address, const uint8_t *data, int nwords);
+
+    bool flush(Transport *transport);
+};
+
+#endif
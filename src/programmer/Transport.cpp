@@ -0,0 +1,205 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "Transport.h"
+#include "UsbTransport.h"
+#include "SimTransport.h"
+#include "usbtrace.h"
+
+
+Transport::Transport(uint8_t ep_out, uint8_t ep_in)
+    : m_next_ticket(0)
+    , m_pending(0)
+    , m_pool_mem(NULL)
+    , m_ep_out(ep_out)
+    , m_ep_in(ep_in)
+{
+    memset(m_sync_results, 0, sizeof(m_sync_results));
+}
+
+
+Transport::~Transport()
+{
+    // Note: too late for a subclass's free_buffer_memory - subclasses call release_buffers() on close
+    if (m_pool_mem)
+        fprintf(stderr, "Transport: buffer pool not released\n");
+}
+
+
+Transport *Transport::create(const std::string &name, uint8_t ep_out, uint8_t ep_in,
+                             const DeviceData *devdata, const std::string &config_filepath)
+{
+    if (name == "usb")
+        return new UsbTransport(ep_out, ep_in);
+
+    if (name == "sim")
+    {
+        SimTransport *sim = new SimTransport(ep_out, ep_in, devdata);
+        sim->read_config(config_filepath);
+        return sim;
+    }
+
+    fprintf(stderr, "Unknown transport '%s' (expected usb or sim)\n", name.c_str());
+    return NULL;
+}
+
+
+int Transport::submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms)
+{
+    if (m_pending >= TRANSPORT_MAX_TICKETS)
+        return LIBUSB_ERROR_BUSY;
+
+    struct sync_result_s *result = &m_sync_results[m_next_ticket % TRANSPORT_MAX_TICKETS];
+
+    result->in_len = 0;
+    result->rc = bulk_out(m_ep_out, out_data, out_len);
+    if (result->rc == 0)
+    {
+        int len = bulk_in(m_ep_in, in_data, in_max_len);
+        if (len < 0)
+            result->rc = len;
+        else
+            result->in_len = len;
+    }
+
+    m_pending++;
+    return m_next_ticket++;
+}
+
+
+int Transport::wait(int ticket, int *in_len)
+{
+    if (m_pending == 0 || ticket < m_next_ticket - m_pending || ticket >= m_next_ticket)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    struct sync_result_s *result = &m_sync_results[ticket % TRANSPORT_MAX_TICKETS];
+
+    m_pending--;
+    if (in_len) *in_len = result->in_len;
+
+    return result->rc;
+}
+
+
+uint64_t Transport::clock_ns(void) const
+{
+    return usbtrace_now_ns();
+}
+
+
+void Transport::sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+
+// Buffer pool
+// -----------
+
+uint8_t *Transport::alloc_buffer_memory(int len)
+{
+    void *mem = NULL;
+    if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), len) != 0)
+        return NULL;
+    return (uint8_t *)mem;
+}
+
+
+void Transport::free_buffer_memory(uint8_t *mem, int len)
+{
+    free(mem);
+}
+
+
+bool Transport::in_pool(const uint8_t *buf) const
+{
+    return m_pool_mem && buf >= m_pool_mem && buf < m_pool_mem + TRANSPORT_POOL_BUFFERS * TRANSPORT_BUFFER_LEN;
+}
+
+
+uint8_t *Transport::get_buffer(void)
+{
+    if (!m_pool_mem)
+    {
+        // allocated on first use as device memory needs an open device
+        m_pool_mem = alloc_buffer_memory(TRANSPORT_POOL_BUFFERS * TRANSPORT_BUFFER_LEN);
+        if (m_pool_mem)
+        {
+            int i;
+            for (i=TRANSPORT_POOL_BUFFERS-1; i>=0; i--)
+                m_pool_free.push_back(m_pool_mem + i * TRANSPORT_BUFFER_LEN);
+        }
+    }
+
+    if (m_pool_free.empty())
+    {
+        // pool exhausted (or unavailable) - still works, just not pooled
+        fprintf(stderr, "Transport: buffer pool empty - allocating\n");
+        return Transport::alloc_buffer_memory(TRANSPORT_BUFFER_LEN);
+    }
+
+    uint8_t *buf = m_pool_free.back();
+    m_pool_free.pop_back();
+    return buf;
+}
+
+
+void Transport::put_buffer(uint8_t *buf)
+{
+    if (!buf)
+        return;
+
+    if (in_pool(buf))
+        m_pool_free.push_back(buf);
+    else
+        Transport::free_buffer_memory(buf, TRANSPORT_BUFFER_LEN);
+}
+
+
+void Transport::release_buffers(void)
+{
+    if (!m_pool_mem)
+        return;
+
+    // a buffer still checked out would be freed under its holder (and may be device memory,
+    // which can't outlive the device): a programming error, not something to carry on from
+    if (m_pool_free.size() != TRANSPORT_POOL_BUFFERS)
+        fprintf(stderr, "Transport: %d buffers still in use at close\n", (int)(TRANSPORT_POOL_BUFFERS - m_pool_free.size()));
+    assert(m_pool_free.size() == TRANSPORT_POOL_BUFFERS);
+
+    free_buffer_memory(m_pool_mem, TRANSPORT_POOL_BUFFERS * TRANSPORT_BUFFER_LEN);
+    m_pool_mem = NULL;
+    m_pool_free.clear();
+}
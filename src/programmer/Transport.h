@@ -0,0 +1,123 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string>
+#include <vector>
+
+struct DeviceData;
+
+
+#define TRANSPORT_MAX_TICKETS   8
+
+// Transfer buffer pool. Every Request/Reply buffer is one of these (FX2 bulk buffer size).
+#define TRANSPORT_BUFFER_LEN    2048
+#define TRANSPORT_POOL_BUFFERS  32
+
+
+// Everything the Programmer says to the FX2 goes through a Transport.
+//  "usb" - a real FX2 programmer via libusb (UsbTransport)
+//  "sim" - an in-process simulated FX2 + PSoC5 target (SimTransport)
+//
+// Return codes follow usb.c: 0 (or a length) on success, < 0 (libusb error code) on failure.
+
+class Transport
+{
+    // blocking fallback for transports without their own exchange engine
+    struct sync_result_s
+    {
+        int rc;
+        int in_len;
+    };
+
+    struct sync_result_s m_sync_results[TRANSPORT_MAX_TICKETS];
+    int m_next_ticket;
+    int m_pending;
+
+    // buffer pool: one slab cut into TRANSPORT_POOL_BUFFERS buffers
+    uint8_t *m_pool_mem;
+    std::vector<uint8_t *> m_pool_free;
+
+    bool in_pool(const uint8_t *buf) const;
+
+  protected:
+    uint8_t m_ep_out;
+    uint8_t m_ep_in;
+
+    // Memory for the buffer pool. Default is page aligned heap memory.
+    // UsbTransport uses device mappable memory where the platform has it.
+    virtual uint8_t *alloc_buffer_memory(int len);
+    virtual void free_buffer_memory(uint8_t *mem, int len);
+    void release_buffers(void); // call before the device is closed, every buffer put back
+
+  public:
+    Transport(uint8_t ep_out, uint8_t ep_in);
+    virtual ~Transport();
+
+    static Transport *create(const std::string &name, uint8_t ep_out, uint8_t ep_in,
+                             const DeviceData *devdata, const std::string &config_filepath);
+
+    virtual const char *name(void) const = 0;
+
+    virtual bool open(uint16_t vid, uint16_t pid) = 0;
+    virtual void close(void) = 0;
+    virtual bool is_open(void) const = 0;
+
+    // Programmers attached, configured or not, by id (usb: bus-port path). Call before open().
+    // select_device() picks one for open(); otherwise open() takes the first it finds.
+    virtual int enumerate(uint16_t vid, uint16_t pid, uint16_t vid_unconfigured, uint16_t pid_unconfigured,
+                          std::vector<std::string> &ids) = 0;
+    virtual bool select_device(const std::string &id) = 0;
+
+    // load FX2 firmware into an unconfigured programmer (it then re-enumerates)
+    virtual bool configure_programmer(uint16_t vid, uint16_t pid, const std::string &fx2_config_file) = 0;
+
+    virtual int bulk_out(uint8_t epaddr, const uint8_t *data, int len) = 0;
+    virtual int bulk_in(uint8_t epaddr, uint8_t *data, int max_len) = 0; // returns length received
+    virtual int control_in(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                           uint8_t *data, uint16_t *reply_length, uint16_t max_length) = 0;
+    virtual int control_out(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            const uint8_t *data, int len) = 0;
+    virtual int clear_stall(uint8_t epaddr) = 0;
+
+    virtual void print_info(void) {}
+
+    // Time base for trace records (usbtrace.h). Monotonic wall clock unless the transport
+    // has its own notion of time (the simulator).
+    virtual uint64_t clock_ns(void) const;
+
+    // Wait without touching the bus (eg while the target is known to be busy)
+    virtual void sleep_ns(uint64_t ns);
+
+    // Transfer buffers (TRANSPORT_BUFFER_LEN bytes) handed straight to the transport with no
+    // copying. Get them after open() and put them back before close(). Not cleared.
+    uint8_t *get_buffer(void);
+    void put_buffer(uint8_t *buf);
+
+    // Request/reply exchanges on (ep_out, ep_in). See UsbAsync for the ticket rules.
+    // The default implementation is blocking: submit() does the whole exchange.
+    virtual int submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms);
+    virtual int wait(int ticket, int *in_len);
+    virtual int max_inflight(void) const { return 1; }
+};
+
+#endif
@@ -0,0 +1,372 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "UsbAsync.h"
+#include "usb.h"
+#include "usbtrace.h"
+#include "latency.h"
+#include "usbtimeout.h"
+
+
+// how often the event thread wakes to check whether it should exit
+#define EVENT_LOOP_POLL_MS  50
+
+
+UsbAsync::UsbAsync(uint8_t ep_out, uint8_t ep_in, int max_inflight)
+    : m_dev_handle(NULL)
+    , m_ctx(NULL)
+    , m_ep_out(ep_out)
+    , m_ep_in(ep_in)
+    , m_max_inflight(max_inflight)
+    , m_next_ticket(0)
+    , m_inflight(0)
+    , m_last_done_ns(0)
+    , m_resync(false)
+    , m_running(false)
+{
+    assert(max_inflight > 0 && max_inflight <= USB_ASYNC_MAX_INFLIGHT);
+    memset(m_slots, 0, sizeof(m_slots));
+}
+
+
+UsbAsync::~UsbAsync()
+{
+    stop();
+}
+
+
+bool UsbAsync::start(libusb_device_handle *dev_handle)
+{
+    if (m_running)
+        return true;
+
+    assert(dev_handle);
+
+    int i;
+    for (i=0; i<m_max_inflight; i++)
+    {
+        m_slots[i].out_xfer = libusb_alloc_transfer(0);
+        m_slots[i].in_xfer = libusb_alloc_transfer(0);
+        if (!m_slots[i].out_xfer || !m_slots[i].in_xfer)
+        {
+            fprintf(stderr, "UsbAsync: failed to allocate transfers\n");
+            m_running = true; // so stop() frees what we have
+            stop();
+            return false;
+        }
+        m_slots[i].busy = false;
+    }
+
+    m_dev_handle = dev_handle;
+    m_ctx = usb_context(); // the event thread must handle events for the opening thread's context
+    m_next_ticket = 0;
+    m_inflight = 0;
+    m_resync = false;
+    m_running = true;
+
+    m_event_thread = std::thread(&UsbAsync::event_loop, this);
+
+    return true;
+}
+
+
+void UsbAsync::stop(void)
+{
+    if (!m_running)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // cancel anything still outstanding and wait for the callbacks so libusb is
+        // no longer referencing the transfers (or the caller's buffers)
+        cancel_inflight(NULL);
+
+        int i;
+        for (i=0; i<m_max_inflight; i++)
+        {
+            struct slot_s *slot = &m_slots[i];
+            if (!slot->busy) continue;
+            if (m_event_thread.joinable())
+                m_cond.wait(lock, [slot]{ return slot->out_done && slot->in_done; });
+            slot->busy = false;
+        }
+
+        m_inflight = 0;
+        m_running = false;
+    }
+
+    if (m_event_thread.joinable())
+        m_event_thread.join();
+
+    int i;
+    for (i=0; i<m_max_inflight; i++)
+    {
+        if (m_slots[i].out_xfer) libusb_free_transfer(m_slots[i].out_xfer);
+        if (m_slots[i].in_xfer) libusb_free_transfer(m_slots[i].in_xfer);
+        m_slots[i].out_xfer = NULL;
+        m_slots[i].in_xfer = NULL;
+    }
+
+    m_dev_handle = NULL;
+}
+
+
+void UsbAsync::event_loop(void)
+{
+    // Note: m_ctx is the context usb.c opened the device in (default unless per thread)
+
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running) break;
+        }
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = EVENT_LOOP_POLL_MS * 1000;
+
+        int rc = libusb_handle_events_timeout_completed(m_ctx, &tv, NULL);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED)
+            fprintf(stderr, "UsbAsync: event handling failed: %d %s\n", rc, libusb_strerror((enum libusb_error)rc));
+    }
+}
+
+
+void LIBUSB_CALL UsbAsync::transfer_cb(struct libusb_transfer *xfer)
+{
+    UsbAsync *self = (UsbAsync *)xfer->user_data;
+
+    std::lock_guard<std::mutex> lock(self->m_mutex);
+
+    int i;
+    for (i=0; i<self->m_max_inflight; i++)
+    {
+        struct slot_s *slot = &self->m_slots[i];
+        if (xfer == slot->out_xfer) { slot->out_done = true; break; }
+        if (xfer == slot->in_xfer) { slot->in_done = true; slot->t_done_ns = usbtrace_now_ns(); break; }
+    }
+
+    self->m_cond.notify_all();
+}
+
+
+int UsbAsync::status_to_error(enum libusb_transfer_status status) const
+{
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+        case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+        case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+        default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
+
+void UsbAsync::cancel_inflight(const struct slot_s *except)
+{
+    // call with m_mutex held. Completion still comes through transfer_cb.
+    int i;
+    for (i=0; i<m_max_inflight; i++)
+    {
+        struct slot_s *slot = &m_slots[i];
+        if (!slot->busy || slot == except) continue;
+        if (!slot->out_done) libusb_cancel_transfer(slot->out_xfer);
+        if (!slot->in_done) libusb_cancel_transfer(slot->in_xfer);
+    }
+}
+
+
+void UsbAsync::drain_in(void)
+{
+    // Nothing in flight: anything that turns up on the IN endpoint now is a reply to an
+    // exchange that was failed or cancelled.
+    uint8_t buf[4096];
+    int n;
+    for (n = 0; n < USB_ASYNC_DRAIN_MAX; n++)
+    {
+        int len = 0;
+        int rc = libusb_bulk_transfer(m_dev_handle, m_ep_in, buf, sizeof(buf), &len, USB_ASYNC_DRAIN_MS);
+        if (rc != 0 && len == 0)
+            break;
+        fprintf(stderr, "UsbAsync: dropped a stale reply (%d bytes)\n", len);
+    }
+}
+
+
+int UsbAsync::submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms)
+{
+    // Returns a ticket (>= 0) or a libusb error code (< 0).
+    // out_data and in_data must remain valid until wait() returns for this ticket.
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (!m_running)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    if (m_inflight >= m_max_inflight)
+        return LIBUSB_ERROR_BUSY; // caller must wait() on earlier tickets first
+
+    if (m_resync)
+    {
+        if (m_inflight > 0)
+            return LIBUSB_ERROR_IO; // exchanges behind a failed one: wait() them (they fail) first
+
+        drain_in();
+        m_resync = false;
+    }
+
+    if (usb_deadline_passed())
+    {
+        fprintf(stderr, "UsbAsync: job deadline passed\n");
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    int ticket = m_next_ticket;
+    struct slot_s *slot = &m_slots[ticket % m_max_inflight];
+    assert(!slot->busy);
+
+    // The IN transfer sits behind every exchange already in flight so give it
+    // proportionally longer before it is considered to have timed out.
+    int in_timeout_ms = timeout_ms * (m_inflight + 1);
+
+    libusb_fill_bulk_transfer(slot->out_xfer, m_dev_handle, m_ep_out, (unsigned char *)out_data, out_len,
+        transfer_cb, this, timeout_ms);
+    libusb_fill_bulk_transfer(slot->in_xfer, m_dev_handle, m_ep_in, in_data, in_max_len,
+        transfer_cb, this, in_timeout_ms);
+
+    slot->out_done = false;
+    slot->in_done = false;
+    slot->ticket = ticket;
+    slot->depth = m_inflight + 1;
+    slot->t_submit_ns = usbtrace_now_ns();
+
+    int rc = libusb_submit_transfer(slot->out_xfer);
+    if (rc < 0)
+    {
+        fprintf(stderr, "UsbAsync: submit OUT failed: %d %s\n", rc, libusb_strerror((enum libusb_error)rc));
+        return rc;
+    }
+
+    rc = libusb_submit_transfer(slot->in_xfer);
+    if (rc < 0)
+    {
+        fprintf(stderr, "UsbAsync: submit IN failed: %d %s\n", rc, libusb_strerror((enum libusb_error)rc));
+        libusb_cancel_transfer(slot->out_xfer);
+        m_cond.wait(lock, [slot]{ return slot->out_done; });
+        return rc;
+    }
+
+    slot->busy = true;
+    m_inflight++;
+    m_next_ticket++;
+
+    return ticket;
+}
+
+
+int UsbAsync::wait(int ticket, int *in_len)
+{
+    // Waits for both halves of the exchange. Returns 0 or a libusb error code.
+    // *in_len is set to the number of reply bytes received.
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    struct slot_s *slot = &m_slots[ticket % m_max_inflight];
+    if (!slot->busy || slot->ticket != ticket)
+    {
+        fprintf(stderr, "UsbAsync: wait on unknown ticket %d\n", ticket);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    // an exchange ahead of this one failed: its reply, if it came, can't be told from ours
+    bool stale = m_resync;
+
+    m_cond.wait(lock, [slot]{ return slot->out_done; });
+
+    int rc = status_to_error(slot->out_xfer->status);
+    if (rc != 0 && !slot->in_done)
+    {
+        // no request went out so no reply is coming
+        libusb_cancel_transfer(slot->in_xfer);
+    }
+
+    m_cond.wait(lock, [slot]{ return slot->in_done; });
+
+    if (rc == 0)
+        rc = status_to_error(slot->in_xfer->status);
+
+    if (stale && rc == 0)
+        rc = LIBUSB_ERROR_IO;
+
+    if (rc != 0 && !m_resync)
+    {
+        m_resync = true;
+        cancel_inflight(slot);
+    }
+
+    if (rc != 0)
+        fprintf(stderr, "UsbAsync: exchange %d failed: %d %s%s\n", ticket, rc, libusb_strerror((enum libusb_error)rc),
+            stale ? " (behind a failed exchange)" : "");
+
+    if (in_len)
+        *in_len = slot->in_xfer->actual_length;
+
+    latency_record(LATENCY_EXCHANGE, slot->t_done_ns - slot->t_submit_ns);
+
+    // Round trip for the timeout policy is the exchange's own service time: from when it
+    // was submitted or the one ahead of it finished, whichever is later.
+    uint64_t service_start = slot->t_submit_ns > m_last_done_ns ? slot->t_submit_ns : m_last_done_ns;
+    if (rc == 0 && slot->t_done_ns > service_start)
+        usb_timeout_sample(USB_TIMEOUT_BULK, slot->t_done_ns - service_start);
+    if (rc == LIBUSB_ERROR_TIMEOUT)
+        usb_timeout_expired(USB_TIMEOUT_BULK);
+    m_last_done_ns = slot->t_done_ns;
+
+    if (usbtrace_enabled())
+    {
+        struct usbtrace_rec_s rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = USBTRACE_EXCHANGE;
+        rec.ep = m_ep_out;
+        rec.aux = slot->depth;
+        rec.rc = rc;
+        rec.req_len = slot->in_xfer->length;
+        rec.out_len = slot->out_xfer->length;
+        rec.in_len = slot->in_xfer->actual_length;
+        rec.t_start_ns = slot->t_submit_ns;
+        rec.t_end_ns = slot->t_done_ns;
+        usbtrace_record(&rec, slot->out_xfer->buffer, slot->in_xfer->buffer);
+    }
+
+    slot->busy = false;
+    m_inflight--;
+
+    return rc;
+}
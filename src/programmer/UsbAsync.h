@@ -0,0 +1,108 @@
+#ifndef _USBASYNC_H
+#define _USBASYNC_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include <libusb-1.0/libusb.h>
+
+
+#define USB_ASYNC_MAX_INFLIGHT  8
+#define USB_ASYNC_DRAIN_MS      20      // a late reply still to come after a failure
+#define USB_ASYNC_DRAIN_MAX     16      // stale replies read (and dropped) at most
+
+
+// Keeps several bulk OUT/IN exchanges in flight on a pair of endpoints.
+//
+// An exchange is one OUT transfer (the request) followed by one IN transfer (its reply).
+// Both are submitted together so the FX2 always has the next request queued while the
+// host is still processing the previous reply.
+// The FX2 answers requests in order on a single IN endpoint so replies are matched to
+// exchanges by submission order (the ticket).
+//
+// Usage:  t = submit(...); ...; wait(t, &len);
+// Tickets must be waited on in the order they were issued. submit() doesn't block: it
+// returns LIBUSB_ERROR_BUSY while max_inflight exchanges are outstanding (ie submitted but
+// not yet waited on), the caller waits on its oldest ticket first.
+//
+// Once an exchange fails (eg its reply timed out) replies can no longer be matched by
+// order: the late reply would be taken for the next exchange's. So every exchange still in
+// flight is cancelled and fails when waited on, submit() refuses new ones until they all
+// have been, then reads and drops whatever is left on the IN endpoint before carrying on.
+
+class UsbAsync
+{
+    struct slot_s
+    {
+        struct libusb_transfer *out_xfer;
+        struct libusb_transfer *in_xfer;
+        bool out_done;
+        bool in_done;
+        int ticket;
+        bool busy;
+        int depth;              // exchanges in flight when submitted (incl this one)
+        uint64_t t_submit_ns;   // for the trace (usbtrace.h) and latency histograms
+        uint64_t t_done_ns;
+    };
+
+    libusb_device_handle *m_dev_handle;
+    libusb_context *m_ctx;
+    uint8_t m_ep_out;
+    uint8_t m_ep_in;
+    int m_max_inflight;
+
+    struct slot_s m_slots[USB_ASYNC_MAX_INFLIGHT];
+    int m_next_ticket;
+    int m_inflight;
+    uint64_t m_last_done_ns;    // completion of the previous exchange (RTT sampling)
+    bool m_resync;              // an exchange failed: fail those behind it, then drain
+
+    std::atomic<bool> m_running;
+    std::thread m_event_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    void event_loop(void);
+    static void LIBUSB_CALL transfer_cb(struct libusb_transfer *xfer);
+    int status_to_error(enum libusb_transfer_status status) const;
+    void cancel_inflight(const struct slot_s *except);
+    void drain_in(void);
+
+  public:
+    UsbAsync(uint8_t ep_out, uint8_t ep_in, int max_inflight=USB_ASYNC_MAX_INFLIGHT);
+    ~UsbAsync();
+
+    bool start(libusb_device_handle *dev_handle);
+    void stop(void);
+    bool running(void) const { return m_running; }
+
+    int submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms);
+    int wait(int ticket, int *in_len);
+
+    int inflight(void) const { return m_inflight; }
+    int max_inflight(void) const { return m_max_inflight; }
+};
+
+#endif
@@ -0,0 +1,297 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+
+#include "UsbTransport.h"
+
+#include "Fx2Firmware.h"
+#include "usb.h"
+#include "fx2.h"
+
+
+static int debug = 1;
+
+
+// libusb_dev_mem_alloc() appeared in libusb 1.0.21 (API 0x01000105)
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
+
+
+UsbTransport::UsbTransport(uint8_t ep_out, uint8_t ep_in)
+    : Transport(ep_out, ep_in)
+    , m_dev_handle(NULL)
+    , m_usb_async(ep_out, ep_in)
+    , m_dev_mem(false)
+    , m_reenumerating(false)
+{
+    memset(&m_programmer_path, 0, sizeof(m_programmer_path));
+    memset(&m_select_path, 0, sizeof(m_select_path));
+}
+
+
+UsbTransport::~UsbTransport()
+{
+    close();
+}
+
+
+bool UsbTransport::open(uint16_t vid, uint16_t pid)
+{
+    if (m_dev_handle)
+        return true;
+
+    if (m_reenumerating)
+    {
+        // Just loaded firmware: open as soon as the programmer reappears on the same port
+        m_reenumerating = false;
+        if (!wait_for_device(vid, pid, &m_programmer_path, USB_REENUMERATE_TIMEOUT_MS))
+        {
+            fprintf(stderr, "Programmer 0x%04x.%04x did not re-enumerate within %d ms\n", vid, pid, USB_REENUMERATE_TIMEOUT_MS);
+            return false;
+        }
+
+        int waited_ms;
+        for (waited_ms = 0; !m_dev_handle && waited_ms < USB_OPEN_RETRY_MS; waited_ms += USB_WAIT_POLL_MS)
+        {
+            m_dev_handle = open_device_path(&m_programmer_path, vid, pid, 1, 0, 0);
+            if (!m_dev_handle)
+                usleep(USB_WAIT_POLL_MS * 1000);
+        }
+    }
+    else
+        m_dev_handle = open_device_path(selected(), vid, pid, 1, 0, 0); // path, vid, pic, config, interface, alternate
+
+    if (!m_dev_handle)
+        return false;
+
+    if (!m_usb_async.start(m_dev_handle))
+        fprintf(stderr, "Async USB transfers unavailable - using blocking transfers\n");
+
+    return true;
+}
+
+
+void UsbTransport::close(void)
+{
+    m_usb_async.stop();
+    release_buffers();
+
+    if (m_dev_handle)
+        close_device(m_dev_handle, 0);
+
+    m_dev_handle = NULL;
+}
+
+
+int UsbTransport::enumerate(uint16_t vid, uint16_t pid, uint16_t vid_unconfigured, uint16_t pid_unconfigured,
+                            std::vector<std::string> &ids)
+{
+    struct usb_port_path_s paths[USB_MAX_PROGRAMMERS];
+
+    int n = usb_find_devices(vid, pid, paths, USB_MAX_PROGRAMMERS);
+    n += usb_find_devices(vid_unconfigured, pid_unconfigured, paths + n, USB_MAX_PROGRAMMERS - n);
+
+    int i;
+    for (i=0; i<n; i++)
+    {
+        char str[4 * (USB_MAX_PORT_DEPTH + 1)];
+        usb_port_path_str(&paths[i], str, sizeof(str));
+
+        // a programmer mid re-enumeration could show up twice
+        if (std::find(ids.begin(), ids.end(), str) == ids.end())
+            ids.push_back(str);
+    }
+
+    return ids.size();
+}
+
+
+bool UsbTransport::select_device(const std::string &id)
+{
+    if (!usb_parse_port_path(id.c_str(), &m_select_path))
+    {
+        fprintf(stderr, "Bad programmer id '%s' (expected bus-port[.port...], eg 1-2.3)\n", id.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool UsbTransport::configure_programmer(uint16_t vid, uint16_t pid, const std::string &fx2_config_file)
+{
+    Fx2Firmware firmware;
+    if (!firmware.load(fx2_config_file))
+        return false;
+
+    // Unconfigured device handle (not same as m_dev_handle)
+    fprintf(stderr, "Opening unconfigured device 0x[%04x:%04x]...\n", vid, pid);
+    libusb_device_handle *dev_handle = open_device_path(selected(), vid, pid, 1, 0, 0); // path, vid, pic, config, interface, alternate
+    if (!dev_handle)
+    {
+        fprintf(stderr, "Failed to find unconfigured programmer 0x%04x.%04x\n", vid, pid);
+        return false;
+    }
+
+    fprintf(stderr, "Configuring USB programmer\n");
+
+    // FX2 drops off the bus and comes back with the new firmware's ids on the same port
+    usb_port_path(dev_handle, &m_programmer_path); // on failure depth 0: match on ids only
+
+    int rc;
+
+    if (fx2_firmware_in_ram(dev_handle, firmware))
+    {
+        // e.g. bus reset without power loss: RAM survived, just restart the 8051
+        fprintf(stderr, "FX2 firmware already loaded - restarting\n");
+        rc = fx2_cmd_8051_enable(dev_handle, false);
+    }
+    else
+    {
+//        rc = fx2_cmd_rw_ram(dev_handle, FX2_REG_CTRLSTATUS, "01"); // FX2  force 8051 into reset
+        rc = fx2_cmd_8051_enable(dev_handle, false);
+
+        if (debug)
+            fprintf(stderr, "Configuring (%d chunks)\n", firmware.nchunks());
+
+        rc = fx2_load_firmware(dev_handle, firmware);
+        if (rc < 0)
+        {
+            close_device(dev_handle, 0);
+            return false;
+        }
+    }
+
+    // Re-enable CPU
+//    rc = fx2_cmd_rw_ram(dev_handle, FX2_REG_CTRLSTATUS, "00"); // FX2  run 8051
+    rc = fx2_cmd_8051_enable(dev_handle, true);
+
+
+//    libusb_reset_device(dev_handle);
+    close_device(dev_handle, 0);
+    m_reenumerating = true; // next open() waits for the programmer to reappear
+
+    return true;
+}
+
+
+uint8_t *UsbTransport::alloc_buffer_memory(int len)
+{
+    // Device memory lets usbfs DMA straight from/to our buffers (no kernel bounce copy).
+    // Not available on all platforms/kernels so fall back to ordinary memory.
+    m_dev_mem = false;
+
+#ifdef HAVE_LIBUSB_DEV_MEM
+    if (m_dev_handle)
+    {
+        uint8_t *mem = libusb_dev_mem_alloc(m_dev_handle, len);
+        if (mem)
+        {
+            m_dev_mem = true;
+            return mem;
+        }
+    }
+#endif
+
+    return Transport::alloc_buffer_memory(len);
+}
+
+
+void UsbTransport::free_buffer_memory(uint8_t *mem, int len)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+    if (m_dev_mem)
+    {
+        libusb_dev_mem_free(m_dev_handle, mem, len);
+        m_dev_mem = false;
+        return;
+    }
+#endif
+
+    Transport::free_buffer_memory(mem, len);
+}
+
+
+int UsbTransport::bulk_out(uint8_t epaddr, const uint8_t *data, int len)
+{
+    return send_bulk_data(m_dev_handle, epaddr, (uint8_t *)data, len);
+}
+
+
+int UsbTransport::bulk_in(uint8_t epaddr, uint8_t *data, int max_len)
+{
+    return recv_bulk_data(m_dev_handle, epaddr, data, max_len);
+}
+
+
+int UsbTransport::control_in(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                             uint8_t *data, uint16_t *reply_length, uint16_t max_length)
+{
+    return control_transfer(m_dev_handle, bmRequestType, bRequest, wValue, wIndex, data, reply_length, max_length);
+}
+
+
+int UsbTransport::control_out(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                              const uint8_t *data, int len)
+{
+    return control_transfer_out(m_dev_handle, bmRequestType, bRequest, wValue, wIndex, data, len);
+}
+
+
+int UsbTransport::clear_stall(uint8_t epaddr)
+{
+    return clear_endpoint_stall(m_dev_handle, epaddr);
+}
+
+
+void UsbTransport::print_info(void)
+{
+    if (m_dev_handle)
+        print_device_info2(m_dev_handle);
+}
+
+
+int UsbTransport::submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms)
+{
+    if (!m_usb_async.running())
+        return Transport::submit(out_data, out_len, in_data, in_max_len, timeout_ms);
+
+    return m_usb_async.submit(out_data, out_len, in_data, in_max_len, timeout_ms);
+}
+
+
+int UsbTransport::wait(int ticket, int *in_len)
+{
+    if (!m_usb_async.running())
+        return Transport::wait(ticket, in_len);
+
+    return m_usb_async.wait(ticket, in_len);
+}
+
+
+int UsbTransport::max_inflight(void) const
+{
+    return m_usb_async.running() ? m_usb_async.max_inflight() : 1;
+}
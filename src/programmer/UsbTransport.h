@@ -0,0 +1,84 @@
+#ifndef _USBTRANSPORT_H
+#define _USBTRANSPORT_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "Transport.h"
+#include "usb.h"
+#include "UsbAsync.h"
+
+
+// Real FX2 programmer (CY8CKIT) via libusb. Thin wrapper around usb.c and UsbAsync.
+
+#define USB_REENUMERATE_TIMEOUT_MS  5000    // FX2 renumeration normally takes well under a second
+#define USB_OPEN_RETRY_MS           1000    // udev may not have set permissions on arrival
+#define USB_MAX_PROGRAMMERS         32      // enumerate() limit
+
+class UsbTransport : public Transport
+{
+    libusb_device_handle *m_dev_handle;
+    UsbAsync m_usb_async;
+    bool m_dev_mem; // buffer pool is in device (kernel mappable) memory
+    bool m_reenumerating; // firmware loaded, programmer yet to reappear
+    struct usb_port_path_s m_programmer_path; // where the unconfigured programmer was
+    struct usb_port_path_s m_select_path;     // depth 0: any
+
+    const struct usb_port_path_s *selected(void) const { return m_select_path.depth ? &m_select_path : NULL; }
+
+  protected:
+    virtual uint8_t *alloc_buffer_memory(int len);
+    virtual void free_buffer_memory(uint8_t *mem, int len);
+
+  public:
+    UsbTransport(uint8_t ep_out, uint8_t ep_in);
+    virtual ~UsbTransport();
+
+    virtual const char *name(void) const { return "usb"; }
+
+    virtual bool open(uint16_t vid, uint16_t pid);
+    virtual void close(void);
+    virtual bool is_open(void) const { return m_dev_handle != NULL; }
+
+    virtual int enumerate(uint16_t vid, uint16_t pid, uint16_t vid_unconfigured, uint16_t pid_unconfigured,
+                          std::vector<std::string> &ids);
+    virtual bool select_device(const std::string &id);
+
+    virtual bool configure_programmer(uint16_t vid, uint16_t pid, const std::string &fx2_config_file);
+
+    virtual int bulk_out(uint8_t epaddr, const uint8_t *data, int len);
+    virtual int bulk_in(uint8_t epaddr, uint8_t *data, int max_len);
+    virtual int control_in(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                           uint8_t *data, uint16_t *reply_length, uint16_t max_length);
+    virtual int control_out(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            const uint8_t *data, int len);
+    virtual int clear_stall(uint8_t epaddr);
+
+    virtual void print_info(void);
+
+    virtual int submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms);
+    virtual int wait(int ticket, int *in_len);
+    virtual int max_inflight(void) const;
+};
+
+#endif
@@ -16,8 +16,14 @@
     along with this Program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+#include <assert.h>
+
 #include "fx2.h"
 #include "usb.h"
+#include "usbtrace.h"
+#include "latency.h"
+#include "usbtimeout.h"
 
 
 #define FX2_RW_RAM      0xA0
@@ -69,3 +75,193 @@ int fx2_cmd_8051_enable(libusb_device_handle *dev_handle, bool enable)
     return control_transfer_out(dev_handle, bmRequestType, bRequest, FX2_REG_CPUCS, wIndex, &data, 1);
 }
 
+
+
+int fx2_cmd_read_ram(libusb_device_handle *dev_handle, uint16_t addr, uint8_t *data, int len)
+{
+    uint8_t bmRequestType = 0xC0; // VENDOR 0x40 | EP_IN 0x80
+    uint8_t bRequest = FX2_RW_RAM;
+    uint16_t wIndex = 0;
+    uint16_t reply_length = 0;
+
+    int rc = control_transfer(dev_handle, bmRequestType, bRequest, addr, wIndex, data, &reply_length, len);
+    if (rc < 0)
+        return rc;
+
+    return reply_length;
+}
+
+
+bool fx2_firmware_in_ram(libusb_device_handle *dev_handle, const Fx2Firmware &firmware)
+{
+    // Firmware Load is handled by the FX2 core so RAM can be read whether or not the 8051 runs.
+    // Only sampled regions are compared (Fx2Firmware::signature), a few per chunk: a build that
+    // differs from the loaded one only between them would be run as if it were that one.
+
+    if (firmware.nsignatures() == 0)
+        return false;
+
+    int i;
+    for (i=0; i<firmware.nsignatures(); i++)
+    {
+        const Fx2Chunk &sig = firmware.signature(i);
+        uint8_t ram[FX2_SIGNATURE_LEN + 32];
+        int len = sig.data.size();
+        assert(len <= (int)sizeof(ram));
+
+        if (fx2_cmd_read_ram(dev_handle, sig.address, ram, len) != len)
+            return false;
+        if (memcmp(ram, sig.data.data(), len) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+
+struct fx2_load_s
+{
+    int status;     // first error
+    int completed;  // a transfer finished since last cleared
+};
+
+
+struct fx2_load_slot_s
+{
+    struct libusb_transfer *xfer;
+    uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + FX2_LOAD_CHUNK];
+    bool busy;
+    uint64_t t_submit_ns;
+    struct fx2_load_s *load;
+};
+
+
+static void LIBUSB_CALL fx2_load_done(struct libusb_transfer *xfer)
+{
+    struct fx2_load_slot_s *slot = (struct fx2_load_slot_s *)xfer->user_data;
+
+    latency_record(LATENCY_CONTROL, usbtrace_now_ns() - slot->t_submit_ns);
+
+    if (xfer->status != LIBUSB_TRANSFER_COMPLETED && slot->load->status == 0)
+        slot->load->status = xfer->status == LIBUSB_TRANSFER_TIMED_OUT ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+
+    slot->busy = false;
+    slot->load->completed = 1;
+}
+
+
+static int fx2_load_firmware_blocking(libusb_device_handle *dev_handle, const Fx2Firmware &firmware, int first)
+{
+    int i;
+    for (i=first; i<firmware.nchunks(); i++)
+    {
+        const Fx2Chunk &chunk = firmware.chunk(i);
+        int rc = control_transfer_out(dev_handle, 0x40, FX2_RW_RAM, chunk.address, 0, chunk.data.data(), chunk.data.size());
+        if (rc < 0)
+            return rc;
+    }
+    return 0;
+}
+
+
+int fx2_load_firmware(libusb_device_handle *dev_handle, const Fx2Firmware &firmware)
+{
+    // Default control pipe requests complete in submission order, so keeping a few queued
+    // removes the per request round trip. Events are handled here: the async transfer
+    // thread isn't running while the programmer is being configured.
+
+    struct fx2_load_slot_s *slots = new struct fx2_load_slot_s[FX2_LOAD_DEPTH];
+    struct fx2_load_s load = { 0, 0 };
+    int nbusy = 0;
+    int next = 0;
+    int i;
+
+    for (i=0; i<FX2_LOAD_DEPTH; i++)
+    {
+        slots[i].xfer = libusb_alloc_transfer(0);
+        slots[i].busy = false;
+        slots[i].load = &load;
+    }
+
+    if (!slots[0].xfer)
+        next = firmware.nchunks(); // nothing to pipeline with
+
+    while (load.status == 0 && (next < firmware.nchunks() || nbusy > 0))
+    {
+        // fill free slots
+        for (i=0; i<FX2_LOAD_DEPTH && next < firmware.nchunks() && load.status == 0; i++)
+        {
+            struct fx2_load_slot_s *slot = &slots[i];
+            if (slot->busy || !slot->xfer)
+                continue;
+
+            const Fx2Chunk &chunk = firmware.chunk(next);
+            libusb_fill_control_setup(slot->buffer, 0x40, FX2_RW_RAM, chunk.address, 0, chunk.data.size());
+            memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, chunk.data.data(), chunk.data.size());
+            libusb_fill_control_transfer(slot->xfer, dev_handle, slot->buffer, fx2_load_done, slot,
+                usb_timeout_ms(USB_TIMEOUT_CONTROL));
+
+            slot->t_submit_ns = usbtrace_now_ns();
+            int rc = libusb_submit_transfer(slot->xfer);
+            if (rc < 0)
+            {
+                if (next == 0 && nbusy == 0)
+                {
+                    // async control transfers unavailable: do it the slow way
+                    fprintf(stderr, "FX2 pipelined load unavailable (%s) - using blocking transfers\n",
+                        libusb_strerror((enum libusb_error)rc));
+                    load.status = fx2_load_firmware_blocking(dev_handle, firmware, 0);
+                    next = firmware.nchunks();
+                    break;
+                }
+                load.status = rc;
+                break;
+            }
+
+            slot->busy = true;
+            nbusy++;
+            next++;
+        }
+
+        if (nbusy == 0)
+            break;
+
+        // wait for at least one completion
+        load.completed = 0;
+        libusb_handle_events_completed(usb_context(), &load.completed);
+
+        nbusy = 0;
+        for (i=0; i<FX2_LOAD_DEPTH; i++)
+            if (slots[i].busy) nbusy++;
+    }
+
+    // error: cancel and drain whatever is still queued
+    for (i=0; i<FX2_LOAD_DEPTH; i++)
+        if (slots[i].busy) libusb_cancel_transfer(slots[i].xfer);
+
+    while (nbusy > 0)
+    {
+        load.completed = 0;
+        libusb_handle_events_completed(usb_context(), &load.completed);
+        nbusy = 0;
+        for (i=0; i<FX2_LOAD_DEPTH; i++)
+            if (slots[i].busy) nbusy++;
+    }
+
+    for (i=0; i<FX2_LOAD_DEPTH; i++)
+        if (slots[i].xfer) libusb_free_transfer(slots[i].xfer);
+
+    bool pipelined = slots[0].xfer != NULL;
+    delete [] slots;
+
+    if (!pipelined)
+    {
+        fprintf(stderr, "FX2 pipelined load unavailable - using blocking transfers\n");
+        load.status = fx2_load_firmware_blocking(dev_handle, firmware, 0);
+    }
+
+    if (load.status < 0)
+        fprintf(stderr, "FX2 firmware load failed: %d %s\n", load.status, libusb_strerror((enum libusb_error)load.status));
+
+    return load.status;
+}
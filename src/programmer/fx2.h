@@ -23,11 +23,21 @@
 #include <libusb-1.0/libusb.h>
 
 #include "HexData.h"
+#include "Fx2Firmware.h"
+
+#define FX2_LOAD_DEPTH  4   // Firmware Load requests in flight
 
 
 int fx2_cmd_rw_ram(libusb_device_handle *dev_handle, uint16_t addr, const char *hex_data_str);
 int fx2_cmd_rw_ram(libusb_device_handle *dev_handle, const Block *block);
 
+int fx2_cmd_read_ram(libusb_device_handle *dev_handle, uint16_t addr, uint8_t *data, int len);
+
 int fx2_cmd_8051_enable(libusb_device_handle *dev_handle, bool enable);
 
+// Load firmware into RAM (8051 must be held in reset). Pipelined, falls back to blocking writes.
+int fx2_load_firmware(libusb_device_handle *dev_handle, const Fx2Firmware &firmware);
+// Firmware's signature regions read back from RAM match (firmware already loaded)
+bool fx2_firmware_in_ram(libusb_device_handle *dev_handle, const Fx2Firmware &firmware);
+
 #endif
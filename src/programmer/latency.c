@@ -0,0 +1,182 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "latency.h"
+
+
+static __thread struct latency_hist_s histograms[LATENCY_NUM_OPS];
+
+static const char *op_names[LATENCY_NUM_OPS] = {
+    "bulk_out",
+    "bulk_in",
+    "control",
+    "exchange",
+    "spc_wait",
+    "spc_polls",
+    "nv_write_row",
+    "nv_read_multi_bytes",
+    "ahb_read",
+    "enter_programming_mode",
+};
+
+
+static int bucket_index(uint64_t value)
+{
+    if (value < (1 << LATENCY_SUB_BITS))
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (LATENCY_SUB_BITS - 1);
+
+    // (value >> shift) is in [SUB_HALF, 2 * SUB_HALF)
+    return shift * LATENCY_SUB_HALF + (int)(value >> shift);
+}
+
+
+static uint64_t bucket_upper(int index)
+{
+    // largest value that lands in bucket index
+
+    if (index < (1 << LATENCY_SUB_BITS))
+        return index;
+
+    int shift = index / LATENCY_SUB_HALF - 1;
+    uint64_t sub = index - shift * LATENCY_SUB_HALF;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+
+void latency_record(int op, uint64_t value)
+{
+    if (op < 0 || op >= LATENCY_NUM_OPS)
+        return;
+
+    struct latency_hist_s *hist = &histograms[op];
+
+    if (hist->n == 0 || value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+    hist->n++;
+    hist->sum += value;
+    hist->counts[bucket_index(value)]++;
+}
+
+
+void latency_reset(void)
+{
+    memset(histograms, 0, sizeof(histograms));
+}
+
+
+const struct latency_hist_s *latency_get(int op)
+{
+    if (op < 0 || op >= LATENCY_NUM_OPS)
+        return NULL;
+    return &histograms[op];
+}
+
+
+const char *latency_name(int op)
+{
+    if (op < 0 || op >= LATENCY_NUM_OPS)
+        return "?";
+    return op_names[op];
+}
+
+
+bool latency_is_count(int op)
+{
+    return op == LATENCY_SPC_POLLS;
+}
+
+
+uint64_t latency_percentile(const struct latency_hist_s *hist, double percentile)
+{
+    if (!hist || hist->n == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(hist->n * percentile / 100.0 + 0.5);
+    if (target < 1) target = 1;
+
+    uint64_t seen = 0;
+    int i;
+    for (i=0; i<LATENCY_NUM_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= target)
+        {
+            uint64_t upper = bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+
+static void print_value(FILE *fp, int op, uint64_t value)
+{
+    if (latency_is_count(op))
+        fprintf(fp, " %10llu", (unsigned long long)value);
+    else
+        fprintf(fp, " %10.1f", value / 1000.0); // us
+}
+
+
+void latency_dump(FILE *fp, bool buckets)
+{
+    fprintf(fp, "Latency (us, spc_polls in polls):\n");
+    fprintf(fp, "  %-24s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+        "op", "n", "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+
+    int op;
+    for (op=0; op<LATENCY_NUM_OPS; op++)
+    {
+        const struct latency_hist_s *hist = &histograms[op];
+        if (hist->n == 0)
+            continue;
+
+        fprintf(fp, "  %-24s %10llu", op_names[op], (unsigned long long)hist->n);
+        print_value(fp, op, hist->min);
+        print_value(fp, op, latency_percentile(hist, 50));
+        print_value(fp, op, latency_percentile(hist, 90));
+        print_value(fp, op, latency_percentile(hist, 99));
+        print_value(fp, op, latency_percentile(hist, 99.9));
+        print_value(fp, op, hist->max);
+        print_value(fp, op, hist->sum / hist->n);
+        fprintf(fp, "\n");
+
+        if (!buckets)
+            continue;
+
+        int i;
+        for (i=0; i<LATENCY_NUM_BUCKETS; i++)
+        {
+            if (hist->counts[i] == 0)
+                continue;
+            fprintf(fp, "    <=");
+            print_value(fp, op, bucket_upper(i));
+            fprintf(fp, " %10llu\n", (unsigned long long)hist->counts[i]);
+        }
+    }
+}
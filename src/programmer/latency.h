@@ -0,0 +1,85 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Always on latency histograms, one per operation class.
+//
+// HDR style log-linear buckets: values below 2^LATENCY_SUB_BITS have their own bucket,
+// above that each power of two is split into 2^(LATENCY_SUB_BITS-1) buckets, so any
+// value is within ~3% of its bucket's bounds over the full 64 bit range.
+// Recording is a few integer ops (no allocation, no locking): record from the thread
+// doing the transfers. Histograms are per thread (gang mode: one set per programmer).
+//
+// Durations are in ns (wall clock, or the simulator's virtual clock), poll counts are counts.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define LATENCY_SUB_BITS        5
+#define LATENCY_SUB_HALF        (1 << (LATENCY_SUB_BITS - 1))
+#define LATENCY_NUM_BUCKETS     ((64 - LATENCY_SUB_BITS + 2) * LATENCY_SUB_HALF)
+
+enum latency_op_e
+{
+    LATENCY_BULK_OUT = 0,
+    LATENCY_BULK_IN,
+    LATENCY_CONTROL,
+    LATENCY_EXCHANGE,           // pipelined OUT + IN pair (submit to reply)
+    LATENCY_SPC_WAIT,           // SPC_wait_for_status duration
+    LATENCY_SPC_POLLS,          // SPC_wait_for_status status reads (count)
+    LATENCY_NV_WRITE_ROW,
+    LATENCY_NV_READ_MULTI_BYTES,
+    LATENCY_AHB_READ,           // memory mapped block read (flash array, EEPROM)
+    LATENCY_ENTER_PROG_MODE,
+    LATENCY_NUM_OPS
+};
+
+struct latency_hist_s
+{
+    uint64_t n;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t counts[LATENCY_NUM_BUCKETS];
+};
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void latency_record(int op, uint64_t value);
+void latency_reset(void);
+
+const struct latency_hist_s *latency_get(int op);
+const char *latency_name(int op);
+bool latency_is_count(int op);  // value is a count rather than ns
+
+uint64_t latency_percentile(const struct latency_hist_s *hist, double percentile); // upper bound of bucket
+
+// summary line per op (n, min, p50, p90, p99, p99.9, max, mean). buckets: also list non empty buckets
+void latency_dump(FILE *fp, bool buckets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,7 +22,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
 
 #include "usb.h"
 #include "utils.h"
@@ -30,6 +36,10 @@
 #include "AppData.h"
 #include "DeviceData.h"
 #include "version.h"
+#include "latency.h"
+#include "usbtrace.h"
+#include "usbtimeout.h"
+#include "progd_proto.h"
 
 
 // FIXME: put into a siteconfig.h file (and other defaults ?)
@@ -37,6 +47,20 @@
 #define DEFAULT_CONFIG_FILE     "config.ini"
 #define DEFAULT_DEVICE_FILE     "devices.dat"
 
+enum progress_show_e
+{
+    PROGRESS_SHOW_AUTO = 0,     // a line if stderr is a terminal
+    PROGRESS_SHOW_NONE,
+    PROGRESS_SHOW_LINE,         // single updating line on stderr
+    PROGRESS_SHOW_EVENTS        // machine readable lines on stdout (progress_print_event)
+};
+
+struct progress_out_s
+{
+    int show;                   // PROGRESS_SHOW_xxx
+    const char *source;         // programmer, for events
+};
+
 
 struct config_s
 {
@@ -45,13 +69,27 @@ struct config_s
     std::string device_filename;
 
     std::string device_name;
+    std::string transport_name; // empty: use config file
+    std::string trace_file;     // empty: use config file
+    int latency_report;         // 0 none, 1 summary, 2 summary + histogram buckets
+    uint32_t job_timeout_ms;    // 0: use config file
+    std::string device_id;      // programmer to use (bus-port path, or simN). empty: first found
+    bool gang;                  // program every attached programmer at once
+    std::string socket_path;    // send the job to progd on this socket. empty: run it here
+    uint32_t write_flags;       // WR_xxx
+    uint32_t verify_flags;      // VR_xxx
+    struct progress_out_s progress;
 
     DeviceData *devdata;
     Programmer *programmer;
 
     // from config file:
     // ...
-    config_s() : devdata(0), programmer(0) {};
+    config_s() : latency_report(0), job_timeout_ms(0), gang(false), write_flags(0), verify_flags(0), devdata(0), programmer(0)
+    {
+        progress.show = PROGRESS_SHOW_AUTO;
+        progress.source = "prog";
+    };
 };
 
 typedef int (*cmd_func)(struct config_s *config, int argc, char **argv);
@@ -66,6 +104,9 @@ int cmd_upload(struct config_s *config, int argc, char **argv);
 int cmd_help(struct config_s *config, int argc, char **argv);
 int cmd_erase(struct config_s *config, int argc, char **argv);
 
+int program_gang(struct config_s *config, AppData *appdata);
+int run_remote(struct config_s *config, const char *cmd_str, int argc, char **argv);
+
 //int parse_commands(struct config_s *config, int argc, char **argv);
 
 
@@ -99,7 +140,16 @@ void usage(void)
 {
     fprintf(stderr, "PSoC Programmer, v%s\n"
         "Copyright (C) 2014 Kim Lester, http://www.dfusion.com.au/\n\n"
-        "Usage: %s CMD\n  where CMD is:\n", VERSION_STR, Progname);
+        "Usage: %s [-C config_dir] [-d device] [-t usb|sim] [-T trace_file] [-D job_timeout_ms] [-L[L]] [-P programmer | -G] [-S socket] [-i] [--plan] [--strict] [--all] [--events | --quiet] CMD\n"
+        "  -P bus-port[.port..]  use this programmer (-G: program on all attached programmers at once)\n"
+        "  -S socket             run the command in progd listening on socket\n"
+        "  -i                    program only flash rows that differ from the device (by checksum)\n"
+        "  --plan                program: print how flash would be erased and written, write nothing\n"
+        "  --strict              verify: compare every flash row byte for byte, not by checksum\n"
+        "  --all                 verify: report every mismatch, don't stop at the first\n"
+        "  --events              report progress as machine readable lines on stdout\n"
+        "  --quiet               no progress line\n"
+        "  where CMD is:\n", VERSION_STR, Progname);
     int i;
     for (i=0; i<NCmds; i++)
     {
@@ -141,21 +191,48 @@ bool read_device_config(struct config_s *config)
 }
 
 
-Programmer *programmer_open(const struct config_s *config)
+static void show_progress(const struct progress_s *report, void *ctx)
+{
+    const struct progress_out_s *out = (const struct progress_out_s *)ctx;
+
+    if (out->show == PROGRESS_SHOW_EVENTS)
+        progress_print_event(stdout, out->source, report);
+    else if (out->show == PROGRESS_SHOW_LINE)
+        progress_print_line(stderr, report);
+}
+
+
+Programmer *programmer_open(const struct config_s *config, const std::string &device_id, struct progress_out_s *progress)
 {
     Programmer *programmer = new Programmer;
 
+    if (config->transport_name.length() > 0)
+        programmer->set_transport(config->transport_name);
+
+    if (config->trace_file.length() > 0)
+        programmer->set_trace_file(config->trace_file);
+
+    if (config->job_timeout_ms > 0)
+        programmer->set_job_timeout(config->job_timeout_ms);
+
+    if (device_id.length() > 0)
+        programmer->set_device(device_id);
+
 //    std::string config_filepath = config->config_dir + std::string("/") + config->config_filename; // FIXME: pathcat
 
 //    fprintf(stderr,"programmer open: config_path:%s\n", config_filepath.c_str());
     if (programmer->open(config->config_dir, config->config_filename, config->devdata) != SUCCESS)
     {
         fprintf(stderr, "Failed to open device\n");
+        delete programmer;
         return NULL;
     }
 
     programmer->usb_print_info();
 
+    if (progress && progress->show != PROGRESS_SHOW_NONE)
+        programmer->set_progress(show_progress, progress);
+
     return programmer;
 }
 
@@ -166,8 +243,17 @@ void parse_args(int *argc, char ***argv, struct config_s *config)
     config->config_filename = DEFAULT_CONFIG_FILE;
     config->device_filename = DEFAULT_DEVICE_FILE;
 
+    static const struct option long_options[] = {
+        {"plan", no_argument, NULL, 'p'},
+        {"strict", no_argument, NULL, 's'},
+        {"all", no_argument, NULL, 'a'},
+        {"events", no_argument, NULL, 'e'},
+        {"quiet", no_argument, NULL, 'q'},
+        {NULL, 0, NULL, 0}
+    };
+
     int ch;
-    while ((ch = getopt(*argc, *argv, "hC:d:")) != -1)
+    while ((ch = getopt_long(*argc, *argv, "hC:d:t:T:D:LP:GS:i", long_options, NULL)) != -1)
     {
         switch (ch)
         {
@@ -179,6 +265,58 @@ void parse_args(int *argc, char ***argv, struct config_s *config)
                 config->device_name = optarg;
                 break;
 
+            case 't':
+                config->transport_name = optarg;
+                break;
+
+            case 'T':
+                config->trace_file = optarg;
+                break;
+
+            case 'D':
+                config->job_timeout_ms = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'L':
+                config->latency_report++;
+                break;
+
+            case 'P':
+                config->device_id = optarg;
+                break;
+
+            case 'G':
+                config->gang = true;
+                break;
+
+            case 'S':
+                config->socket_path = optarg;
+                break;
+
+            case 'i':
+                config->write_flags |= WR_DIFFERENTIAL;
+                break;
+
+            case 'p':
+                config->write_flags |= WR_PLAN_ONLY;
+                break;
+
+            case 's':
+                config->verify_flags |= VR_STRICT;
+                break;
+
+            case 'a':
+                config->verify_flags |= VR_CONTINUE;
+                break;
+
+            case 'e':
+                config->progress.show = PROGRESS_SHOW_EVENTS;
+                break;
+
+            case 'q':
+                config->progress.show = PROGRESS_SHOW_NONE;
+                break;
+
             case 'h':
             default:
                 usage();
@@ -188,6 +326,11 @@ void parse_args(int *argc, char ***argv, struct config_s *config)
 
     *argc -= optind;
     *argv += optind;
+
+    if (config->progress.show == PROGRESS_SHOW_AUTO)
+        config->progress.show = isatty(STDERR_FILENO) ? PROGRESS_SHOW_LINE : PROGRESS_SHOW_NONE;
+    if (config->device_id.length() > 0)
+        config->progress.source = config->device_id.c_str();
 }
 
 
@@ -208,6 +351,21 @@ int parse_commands(struct config_s *config, int argc, char **argv)
 
         // found command
 
+        if ((config->write_flags & WR_PLAN_ONLY) && (config->socket_path.length() > 0 || config->gang))
+        {
+            fprintf(stderr, "--plan can't be used with -S or -G\n");
+            return -1;
+        }
+
+        if (config->socket_path.length() > 0 && cmd->func != cmd_help)
+            return run_remote(config, cmd->cmd, argc, ++argv);
+
+        if (config->gang && cmd->func != cmd_program)
+        {
+            fprintf(stderr, "Gang mode (-G) only supports the program command\n");
+            return -1;
+        }
+
         if (cmd->device_specific && !read_device_config(config))
         {
             fprintf(stderr, "Failed to read device config\n");
@@ -217,7 +375,7 @@ int parse_commands(struct config_s *config, int argc, char **argv)
         if (cmd->do_connect)
         {
             // FIMXE: messy. maybe create a class.
-            config->programmer = programmer_open(config);
+            config->programmer = programmer_open(config, config->device_id, &config->progress);
 
             if (config->programmer == NULL) return -1;
 
@@ -267,10 +425,13 @@ int cmd_program(struct config_s *config, int nargs, char **argv)
         return -1;
     }
 
+    if (config->gang)
+        return program_gang(config, &appdata);
+
     // open programmer
 
     if (!config->programmer)
-        config->programmer = programmer_open(config);
+        config->programmer = programmer_open(config, config->device_id, &config->progress);
 
     if (config->programmer == NULL) return -1;
 
@@ -293,7 +454,7 @@ int cmd_program(struct config_s *config, int nargs, char **argv)
         return -1;
     }
 
-    if (!config->programmer->write_device(&appdata))
+    if (!config->programmer->write_device(&appdata, config->write_flags))
     {
         fprintf(stderr, "* WRITE FAILED!\n");
         config->programmer->close();
@@ -306,6 +467,241 @@ int cmd_program(struct config_s *config, int nargs, char **argv)
 
 
 
+// Gang mode: one thread per attached programmer, each with its own Programmer and libusb
+// context. The image is read and encoded into rows once and shared read only.
+
+struct gang_job_s
+{
+    std::string id;
+    bool ok;
+    std::string error;
+    uint64_t elapsed_ns;
+};
+
+static std::mutex gang_report_mutex; // keeps per programmer latency reports whole
+
+
+static void gang_program_one(const struct config_s *config, const AppData *appdata, struct gang_job_s *job)
+{
+    uint64_t t_start = usbtrace_now_ns();
+    job->ok = false;
+
+    if (!usb_init_thread())
+    {
+        job->error = "usb init failed";
+        return;
+    }
+
+    // one line can't show several programmers: events only
+    struct progress_out_s progress = config->progress;
+    progress.source = job->id.c_str();
+    if (progress.show == PROGRESS_SHOW_LINE)
+        progress.show = PROGRESS_SHOW_NONE;
+
+    Programmer *programmer = programmer_open(config, job->id, &progress);
+    if (programmer == NULL)
+        job->error = "open failed";
+    else
+    {
+        uint32_t idcode = 0;
+        if (!programmer->enter_programming_mode())
+            job->error = "failed to enter programming mode";
+        else if ((idcode = programmer->get_jtag_id()) == 0)
+            job->error = "no device id";
+        else if (idcode != appdata->device_id)
+            job->error = "device id mismatch";
+        else if (!programmer->write_device(appdata, config->write_flags))
+            job->error = "write failed";
+        else
+            job->ok = true;
+
+        if (usb_deadline_passed())
+            job->error += job->error.length() ? ", deadline exceeded" : "deadline exceeded";
+
+        programmer->close();
+        delete programmer;
+    }
+
+    job->elapsed_ns = usbtrace_now_ns() - t_start;
+
+    if (config->latency_report)
+    {
+        std::lock_guard<std::mutex> lock(gang_report_mutex);
+        fprintf(stderr, "Programmer %s ", job->id.c_str());
+        latency_dump(stderr, config->latency_report > 1);
+    }
+
+    usb_finalise_thread();
+}
+
+
+int program_gang(struct config_s *config, AppData *appdata)
+{
+    if (config->device_id.length() > 0)
+    {
+        fprintf(stderr, "-P and -G can't be used together\n");
+        return -1;
+    }
+
+    // rows are the same for every target: build them once
+    const DeviceData *devdata = config->devdata;
+    appdata->encode_rows(devdata->flash_code_bytes_per_row,
+        appdata->extra_flash_used_for_config() ? devdata->flash_config_bytes_per_row : 0);
+
+    std::vector<std::string> ids;
+    Programmer probe;
+    if (config->transport_name.length() > 0)
+        probe.set_transport(config->transport_name);
+    if (probe.find_programmers(config->config_dir, config->config_filename, ids) <= 0)
+    {
+        fprintf(stderr, "No programmers found\n");
+        return -1;
+    }
+
+    fprintf(stderr, "Gang programming %d programmers\n", (int)ids.size());
+
+    std::vector<struct gang_job_s> jobs(ids.size());
+    std::vector<std::thread> threads;
+
+    uint64_t t_start = usbtrace_now_ns();
+
+    size_t i;
+    for (i=0; i<ids.size(); i++)
+    {
+        jobs[i].id = ids[i];
+        threads.push_back(std::thread(gang_program_one, config, appdata, &jobs[i]));
+    }
+
+    for (i=0; i<threads.size(); i++)
+        threads[i].join();
+
+    uint64_t elapsed_ns = usbtrace_now_ns() - t_start;
+
+    int nok = 0;
+    fprintf(stderr, "\nGang results:\n");
+    for (i=0; i<jobs.size(); i++)
+    {
+        fprintf(stderr, "  %-16s %-6s %8.1f ms  %s\n", jobs[i].id.c_str(), jobs[i].ok ? "OK" : "FAILED",
+            jobs[i].elapsed_ns / 1e6, jobs[i].error.c_str());
+        if (jobs[i].ok) nok++;
+    }
+    fprintf(stderr, "%d/%d programmed in %.1f ms\n", nok, (int)jobs.size(), elapsed_ns / 1e6);
+
+    return nok == (int)jobs.size() ? 0 : -1;
+}
+
+
+// Client side of progd: the daemon already has the programmer open and the target in
+// programming mode, it runs the job and streams progress back.
+
+int run_remote(struct config_s *config, const char *cmd_str, int argc, char **argv)
+{
+    struct progd_job_s job;
+    memset(&job, 0, sizeof(job));
+
+    if (strcasecmp(cmd_str, "program") == 0)     job.cmd = PROGD_CMD_PROGRAM;
+    else if (strcasecmp(cmd_str, "upload") == 0) job.cmd = PROGD_CMD_UPLOAD;
+    else if (strcasecmp(cmd_str, "verify") == 0) job.cmd = PROGD_CMD_VERIFY;
+    else if (strcasecmp(cmd_str, "erase") == 0)  job.cmd = PROGD_CMD_ERASE;
+    else if (strcasecmp(cmd_str, "reset") == 0)  job.cmd = PROGD_CMD_RESET;
+    else if (strcasecmp(cmd_str, "id") == 0)     job.cmd = PROGD_CMD_ID;
+    else
+    {
+        fprintf(stderr, "%s is not supported by progd\n", cmd_str);
+        return -1;
+    }
+
+    if (config->device_name.length() > PROGD_MAX_NAME)
+    {
+        fprintf(stderr, "Device name too long\n");
+        return -1;
+    }
+    strcpy(job.device_name, config->device_name.c_str());
+
+    if (config->write_flags & WR_DIFFERENTIAL)
+        job.flags |= PROGD_JOB_DIFFERENTIAL;
+    if (config->verify_flags & VR_STRICT)
+        job.flags |= PROGD_JOB_STRICT;
+    if (config->verify_flags & VR_CONTINUE)
+        job.flags |= PROGD_JOB_CONTINUE;
+
+    if (argc > 0)
+    {
+        // the daemon has its own working directory
+        char path[PATH_MAX];
+        if (argv[0][0] == '/')
+            snprintf(path, sizeof(path), "%s", argv[0]);
+        else if (getcwd(path, sizeof(path)) != NULL)
+            snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", argv[0]);
+        else
+        {
+            perror("getcwd");
+            return -1;
+        }
+
+        if (strlen(path) > PROGD_MAX_PATH)
+        {
+            fprintf(stderr, "Path too long: %s\n", path);
+            return -1;
+        }
+        strcpy(job.path, path);
+    }
+
+    int fd = progd_connect(config->socket_path.c_str());
+    if (fd < 0)
+        return -1;
+
+    if (!progd_send_job(fd, &job))
+    {
+        fprintf(stderr, "Failed to send job to progd\n");
+        close(fd);
+        return -1;
+    }
+
+    int rc = -1;
+    uint8_t payload[PROGD_MAX_PAYLOAD];
+
+    while (true)
+    {
+        uint8_t type;
+        int len = progd_recv(fd, &type, payload, sizeof(payload));
+        if (len < 0)
+        {
+            fprintf(stderr, "progd closed the connection\n");
+            break;
+        }
+
+        if (type == PROGD_PROGRESS)
+        {
+            fprintf(stderr, "progd: %.*s\n", len, (const char *)payload);
+            continue;
+        }
+
+        struct progress_s report;
+        if (type == PROGD_EVENT && progd_decode_event(payload, len, &report))
+        {
+            show_progress(&report, &config->progress);
+            continue;
+        }
+
+        int32_t result;
+        uint32_t elapsed_us;
+        char text[PROGD_MAX_PAYLOAD];
+        if (type == PROGD_RESULT && progd_decode_result(payload, len, &result, &elapsed_us, text, sizeof(text)))
+        {
+            fprintf(stderr, "progd: %s %s in %.1f ms %s\n", cmd_str, result == 0 ? "OK" : "FAILED", elapsed_us / 1e3, text);
+            rc = result;
+        }
+        else
+            fprintf(stderr, "Bad reply from progd\n");
+        break;
+    }
+
+    close(fd);
+    return rc;
+}
+
+
 int cmd_upload(struct config_s *config, int nargs, char **argv)
 {
     const char *filename = argv[0];
@@ -327,11 +723,28 @@ int cmd_upload(struct config_s *config, int nargs, char **argv)
 
 int cmd_verify(struct config_s *config, int nargs, char **argv)
 {
-    assert(config && config->programmer);
+    const char *filename = argv[0];
+    fprintf(stderr, "verify %s\n", filename);
 
-    assert(0 && "TO DO");
+    AppData appdata;
+    if (!appdata.read_hex_file(filename))
+    {
+        fprintf(stderr,"failed to read file [%s]\n", filename);
+        return -1;
+    }
 
-    return 0;
+    if (!config->programmer)
+        config->programmer = programmer_open(config, config->device_id, &config->progress);
+
+    if (config->programmer == NULL) return -1;
+
+    config->programmer->enter_programming_mode();
+
+    uint32_t match_status = config->programmer->verify_device(&appdata, config->verify_flags);
+    fprintf(stderr, "Verify: %s\n", config->programmer->verify_status_string(match_status).c_str());
+
+    config->programmer->close();
+    return match_status == VERIFY_MATCH ? 0 : -1;
 }
 
 
@@ -421,6 +834,9 @@ int main(int argc, char **argv)
     // process commands
     rc =  parse_commands(&config, argc, argv);
 
+    if (config.latency_report && !config.gang) // gang: reported per programmer
+        latency_dump(stderr, config.latency_report > 1);
+
     usb_finalise();
 
     return rc;
@@ -0,0 +1,558 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Replays a USB transaction trace (written by prog -T) and reports timing per phase.
+//
+//   prog_replay [-C config_dir] [-d device] [-t usb|sim] [-l percent] trace_file
+//       replay against a programmer (or the simulator) and compare with the recording
+//   prog_replay -i trace_file
+//       just summarise the recorded phases
+//   prog_replay -c base_trace trace_file
+//       compare the recorded phases of two traces (eg two hosts, hubs or firmware images)
+//
+// Replies are compared with the recording and differences counted. A real target is only
+// expected to reproduce a trace exactly if it started in the same state and ran at the same
+// speed (SPC status polls are timing dependent). The simulator is deterministic.
+//
+// Exit status: 0 ok, 1 error, 2 replies differed or a phase was more than -l percent slower.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "HierINIReader.h"
+#include "DeviceData.h"
+#include "Transport.h"
+#include "usb.h"
+#include "usbtrace.h"
+#include "usbtimeout.h"
+#include "utils.h"
+
+
+#define DEFAULT_CONFIG_DIR      "config"
+#define DEFAULT_CONFIG_FILE     "config.ini"
+#define DEFAULT_DEVICE_FILE     "devices.dat"
+
+// same defaults as Programmer
+#define DEFAULT_VID             0x04B4
+#define DEFAULT_PID             0xF132
+#define EPADDR_BULK_OUT         0x02
+#define EPADDR_BULK_IN          0x84
+
+
+struct phase_s
+{
+    std::string name;
+    int n_transfers;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t latency_ns;    // sum over transfers of (end - start)
+    int mismatches;
+    int errors;
+
+    phase_s(const std::string &phase_name, uint64_t t_ns)
+        : name(phase_name), n_transfers(0), bytes_out(0), bytes_in(0), start_ns(t_ns), end_ns(t_ns)
+        , latency_ns(0), mismatches(0), errors(0) {}
+
+    double duration_ms(void) const { return (end_ns - start_ns) / 1e6; }
+    double mean_latency_us(void) const { return n_transfers ? latency_ns / 1e3 / n_transfers : 0; }
+};
+
+typedef std::vector<struct phase_s> v_phase_t;
+
+
+struct replay_config_s
+{
+    std::string config_dir;
+    std::string config_filename;
+    std::string device_filename;
+    std::string device_name;
+    std::string transport_name;
+    double slower_limit_pct;    // < 0: not checked
+};
+
+
+char *Progname = NULL;
+
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: %s [-C config_dir] [-d device] [-t usb|sim] [-l percent] trace_file\n"
+        "       %s -i trace_file\n"
+        "       %s -c base_trace trace_file\n"
+        "  replay a USB trace (prog -T) and report per phase timing\n"
+        "    -i  summarise the trace only\n"
+        "    -c  compare the recorded phase timing of two traces\n"
+        "    -l  exit status 2 if any phase replays more than percent slower than recorded\n",
+        Progname, Progname, Progname);
+    exit(1);
+}
+
+
+static void add_transfer(struct phase_s *phase, const struct usbtrace_rec_s *rec, uint64_t t_start, uint64_t t_end)
+{
+    phase->n_transfers++;
+    phase->bytes_out += rec->out_len;
+    phase->bytes_in += rec->in_len;
+    phase->latency_ns += t_end - t_start;
+    if (t_end > phase->end_ns)
+        phase->end_ns = t_end;
+}
+
+
+FILE *open_trace(const char *filepath, char *source)
+{
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open trace file: %s\n", filepath);
+        return NULL;
+    }
+
+    if (!usbtrace_read_header(fp, source))
+    {
+        fprintf(stderr, "Bad trace file: %s\n", filepath);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+
+bool read_phases(const char *filepath, v_phase_t &phases, char *source)
+{
+    // Recorded timing. Each MARK starts a new phase which runs until the next one.
+
+    FILE *fp = open_trace(filepath, source);
+    if (!fp)
+        return false;
+
+    std::vector<uint8_t> out_data(USBTRACE_MAX_PAYLOAD);
+    std::vector<uint8_t> in_data(USBTRACE_MAX_PAYLOAD);
+    struct usbtrace_rec_s rec;
+    int rc;
+
+    while ((rc = usbtrace_read_record(fp, &rec, out_data.data(), in_data.data())) > 0)
+    {
+        if (rec.type == USBTRACE_MARK)
+        {
+            if (!phases.empty())
+                phases.back().end_ns = rec.t_start_ns;
+            phases.push_back(phase_s(std::string((const char *)out_data.data(), rec.out_len), rec.t_start_ns));
+            continue;
+        }
+
+        if (phases.empty())
+            phases.push_back(phase_s("start", rec.t_start_ns));
+
+        add_transfer(&phases.back(), &rec, rec.t_start_ns, rec.t_end_ns);
+        if (rec.rc < 0)
+            phases.back().errors++;
+    }
+
+    fclose(fp);
+
+    if (rc < 0)
+    {
+        fprintf(stderr, "Truncated or corrupt trace: %s\n", filepath);
+        return false;
+    }
+    return true;
+}
+
+
+// Replay
+// ======
+
+struct replay_exchange_s
+{
+    int ticket;
+    struct usbtrace_rec_s rec;
+    std::vector<uint8_t> expected;
+    uint8_t *out_buf;
+    uint8_t *in_buf;
+    uint64_t t_submit;
+};
+
+
+static bool reply_matches(const struct usbtrace_rec_s *rec, int rc, const uint8_t *data, int len, const uint8_t *expected)
+{
+    if ((rc < 0) != (rec->rc < 0))
+        return false;
+    if (len != (int)rec->in_len)
+        return false;
+    return len == 0 || memcmp(data, expected, len) == 0;
+}
+
+
+static void complete_exchange(Transport *transport, std::deque<struct replay_exchange_s> &pending, struct phase_s *phase)
+{
+    struct replay_exchange_s *ex = &pending.front();
+    int len = 0;
+
+    int rc = transport->wait(ex->ticket, &len);
+    uint64_t t_end = transport->clock_ns();
+
+    add_transfer(phase, &ex->rec, ex->t_submit, t_end);
+    if (rc < 0) phase->errors++;
+    if (!reply_matches(&ex->rec, rc, ex->in_buf, len, ex->expected.data())) phase->mismatches++;
+
+    transport->put_buffer(ex->out_buf);
+    transport->put_buffer(ex->in_buf);
+    pending.pop_front();
+}
+
+
+bool replay(const char *filepath, Transport *transport, v_phase_t &phases)
+{
+    FILE *fp = open_trace(filepath, NULL);
+    if (!fp)
+        return false;
+
+    std::vector<uint8_t> out_data(USBTRACE_MAX_PAYLOAD);
+    std::vector<uint8_t> in_data(USBTRACE_MAX_PAYLOAD);
+    std::vector<uint8_t> buf(USBTRACE_MAX_PAYLOAD);
+    std::deque<struct replay_exchange_s> pending;
+    struct usbtrace_rec_s rec;
+    int max_inflight = transport->max_inflight();
+    int rc;
+
+    phases.push_back(phase_s("start", transport->clock_ns()));
+
+    while ((rc = usbtrace_read_record(fp, &rec, out_data.data(), in_data.data())) > 0)
+    {
+        struct phase_s *phase = &phases.back();
+
+        // Exchanges are kept in flight to the depth they were recorded at. Anything else is
+        // a synchronous transfer so the pipeline is drained first.
+        int depth = (rec.type == USBTRACE_EXCHANGE) ? rec.aux : 1;
+        if (depth > max_inflight) depth = max_inflight;
+        if (depth < 1) depth = 1;
+
+        while (!pending.empty() && (int)pending.size() >= depth)
+            complete_exchange(transport, pending, phase);
+        while (rec.type != USBTRACE_EXCHANGE && !pending.empty())
+            complete_exchange(transport, pending, phase);
+
+        uint64_t t_start = transport->clock_ns();
+        int xrc = 0;
+        int len = 0;
+
+        switch (rec.type)
+        {
+            case USBTRACE_MARK:
+                phase->end_ns = t_start;
+                phases.push_back(phase_s(std::string((const char *)out_data.data(), rec.out_len), t_start));
+                continue;
+
+            case USBTRACE_BULK_OUT:
+                xrc = transport->bulk_out(rec.ep, out_data.data(), rec.out_len);
+                break;
+
+            case USBTRACE_BULK_IN:
+                len = transport->bulk_in(rec.ep, buf.data(), rec.req_len);
+                xrc = len < 0 ? len : 0;
+                if (!reply_matches(&rec, xrc, buf.data(), len < 0 ? 0 : len, in_data.data())) phase->mismatches++;
+                break;
+
+            case USBTRACE_CTRL_OUT:
+                if (rec.aux == LIBUSB_REQUEST_CLEAR_FEATURE && (rec.ep & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT)
+                    xrc = transport->clear_stall(rec.wIndex);
+                else
+                    xrc = transport->control_out(rec.ep, rec.aux, rec.wValue, rec.wIndex, out_data.data(), rec.out_len);
+                break;
+
+            case USBTRACE_CTRL_IN:
+            {
+                uint16_t reply_length = 0;
+                xrc = transport->control_in(rec.ep, rec.aux, rec.wValue, rec.wIndex, buf.data(), &reply_length, rec.req_len);
+                if (!reply_matches(&rec, xrc, buf.data(), xrc < 0 ? 0 : reply_length, in_data.data())) phase->mismatches++;
+                break;
+            }
+
+            case USBTRACE_EXCHANGE:
+            {
+                if (rec.out_len > TRANSPORT_BUFFER_LEN || rec.req_len > TRANSPORT_BUFFER_LEN)
+                {
+                    fprintf(stderr, "Exchange too large for transport buffers (%u/%u)\n", rec.out_len, rec.req_len);
+                    xrc = -1;
+                    break;
+                }
+
+                struct replay_exchange_s ex;
+                ex.rec = rec;
+                ex.expected.assign(in_data.begin(), in_data.begin() + rec.in_len);
+                ex.out_buf = transport->get_buffer();
+                ex.in_buf = transport->get_buffer();
+                memcpy(ex.out_buf, out_data.data(), rec.out_len);
+                ex.t_submit = t_start;
+                ex.ticket = transport->submit(ex.out_buf, rec.out_len, ex.in_buf, rec.req_len, usb_timeout_ms(USB_TIMEOUT_BULK));
+                if (ex.ticket < 0)
+                {
+                    transport->put_buffer(ex.out_buf);
+                    transport->put_buffer(ex.in_buf);
+                    xrc = ex.ticket;
+                    break;
+                }
+                pending.push_back(ex);
+                continue;
+            }
+
+            default:
+                fprintf(stderr, "Unknown trace record type %d - skipped\n", rec.type);
+                continue;
+        }
+
+        add_transfer(phase, &rec, t_start, transport->clock_ns());
+        if (xrc < 0) phase->errors++;
+    }
+
+    while (!pending.empty())
+        complete_exchange(transport, pending, &phases.back());
+
+    fclose(fp);
+
+    if (phases.front().n_transfers == 0 && phases.size() > 1)
+        phases.erase(phases.begin());
+
+    if (rc < 0)
+    {
+        fprintf(stderr, "Truncated or corrupt trace: %s\n", filepath);
+        return false;
+    }
+    return true;
+}
+
+
+Transport *open_transport(const struct replay_config_s *config, const char *trace_source)
+{
+    std::string config_filepath = config->config_dir + std::string("/") + config->config_filename; // FIXME: pathcat
+    HierINIReader reader(config_filepath);
+    if (reader.ParseError() < 0)
+    {
+        fprintf(stderr, "Failed to read/parse config file: '%s'\n", config_filepath.c_str());
+        return NULL;
+    }
+
+    // default to whatever the trace was recorded on
+    std::string transport_name = config->transport_name;
+    if (transport_name.length() == 0)
+        transport_name = trace_source;
+
+    DeviceData *devdata = NULL;
+    if (config->device_name.length() > 0)
+    {
+        devdata = new DeviceData;
+        devdata->read_file(config->config_dir + std::string("/") + config->device_filename, config->device_name);
+        if (!devdata->validate())
+        {
+            fprintf(stderr, "Device %s failed basic validity checks\n", config->device_name.c_str());
+            delete devdata;
+            return NULL;
+        }
+    }
+
+    Transport *transport = Transport::create(transport_name, EPADDR_BULK_OUT, EPADDR_BULK_IN, devdata, config_filepath);
+    delete devdata;
+    if (!transport)
+        return NULL;
+
+    uint16_t vid = reader.GetInteger("Programmer", "VID", DEFAULT_VID);
+    uint16_t pid = reader.GetInteger("Programmer", "PID", DEFAULT_PID);
+
+    if (!transport->open(vid, pid))
+    {
+        fprintf(stderr, "Failed to open programmer 0x%04x:%04x (run prog once so its firmware is loaded)\n", vid, pid);
+        delete transport;
+        return NULL;
+    }
+
+    return transport;
+}
+
+
+void print_phases(const char *title, const v_phase_t &phases)
+{
+    fprintf(stderr, "%s\n", title);
+    fprintf(stderr, "  %-24s %8s %10s %10s %12s %12s %6s\n", "phase", "xfers", "out", "in", "ms", "us/xfer", "errors");
+
+    double total_ms = 0;
+    for (size_t i=0; i<phases.size(); i++)
+    {
+        const struct phase_s *p = &phases[i];
+        fprintf(stderr, "  %-24s %8d %10llu %10llu %12.3f %12.1f %6d\n", p->name.c_str(), p->n_transfers,
+            (unsigned long long)p->bytes_out, (unsigned long long)p->bytes_in, p->duration_ms(), p->mean_latency_us(), p->errors);
+        total_ms += p->duration_ms();
+    }
+    fprintf(stderr, "  %-24s %8s %10s %10s %12.3f\n", "total", "", "", "", total_ms);
+}
+
+
+int compare_phases(const char *title, const v_phase_t &base, const v_phase_t &other, double slower_limit_pct, bool show_mismatches)
+{
+    // Phases are matched by position and name. Returns 0 or 2 (a phase was over the limit)
+
+    int status = 0;
+
+    fprintf(stderr, "%s\n", title);
+    fprintf(stderr, "  %-24s %12s %12s %12s %8s %10s %10s%s\n", "phase", "base ms", "ms", "delta ms", "delta%",
+        "base us/x", "us/xfer", show_mismatches ? "   differ" : "");
+
+    size_t n = MAX(base.size(), other.size());
+    double base_total = 0, other_total = 0;
+    int total_mismatches = 0;
+
+    for (size_t i=0; i<n; i++)
+    {
+        const struct phase_s *b = i < base.size() ? &base[i] : NULL;
+        const struct phase_s *o = i < other.size() ? &other[i] : NULL;
+
+        if (!b || !o || b->name != o->name)
+        {
+            fprintf(stderr, "  %-24s (phase missing or out of order: %s / %s)\n", b ? b->name.c_str() : o->name.c_str(),
+                b ? b->name.c_str() : "-", o ? o->name.c_str() : "-");
+            status = 2;
+            continue;
+        }
+
+        double delta = o->duration_ms() - b->duration_ms();
+        double pct = b->duration_ms() > 0 ? 100.0 * delta / b->duration_ms() : 0;
+        bool slow = slower_limit_pct >= 0 && pct > slower_limit_pct;
+
+        fprintf(stderr, "  %-24s %12.3f %12.3f %+12.3f %+7.1f%% %10.1f %10.1f", o->name.c_str(), b->duration_ms(),
+            o->duration_ms(), delta, pct, b->mean_latency_us(), o->mean_latency_us());
+        if (show_mismatches)
+            fprintf(stderr, " %8d", o->mismatches);
+        fprintf(stderr, "%s\n", slow ? "  SLOWER" : "");
+
+        if (slow) status = 2;
+        base_total += b->duration_ms();
+        other_total += o->duration_ms();
+        total_mismatches += o->mismatches;
+    }
+
+    double total_delta = other_total - base_total;
+    fprintf(stderr, "  %-24s %12.3f %12.3f %+12.3f %+7.1f%%\n", "total", base_total, other_total, total_delta,
+        base_total > 0 ? 100.0 * total_delta / base_total : 0);
+
+    if (show_mismatches && total_mismatches)
+    {
+        fprintf(stderr, "%d replies differed from the recording\n", total_mismatches);
+        status = 2;
+    }
+
+    return status;
+}
+
+
+int main(int argc, char **argv)
+{
+    Progname = argv[0];
+
+    struct replay_config_s config;
+    config.config_dir = DEFAULT_CONFIG_DIR;
+    config.config_filename = DEFAULT_CONFIG_FILE;
+    config.device_filename = DEFAULT_DEVICE_FILE;
+    config.slower_limit_pct = -1;
+
+    bool info_only = false;
+    const char *base_trace = NULL;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "hC:d:t:l:ic:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'C': config.config_dir = optarg; break;
+            case 'd': config.device_name = optarg; break;
+            case 't': config.transport_name = optarg; break;
+            case 'l': config.slower_limit_pct = atof(optarg); break;
+            case 'i': info_only = true; break;
+            case 'c': base_trace = optarg; break;
+            case 'h':
+            default:
+                usage();
+                break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1)
+        usage();
+
+    const char *trace_file = argv[0];
+    char source[USBTRACE_SOURCE_LEN];
+    v_phase_t recorded;
+
+    if (!read_phases(trace_file, recorded, source))
+        return 1;
+
+    if (info_only)
+    {
+        std::string title = std::string(trace_file) + " (" + source + ")";
+        print_phases(title.c_str(), recorded);
+        return 0;
+    }
+
+    if (base_trace)
+    {
+        char base_source[USBTRACE_SOURCE_LEN];
+        v_phase_t base;
+        if (!read_phases(base_trace, base, base_source))
+            return 1;
+
+        std::string title = std::string(base_trace) + " (" + base_source + ") -> " + trace_file + " (" + source + ")";
+        return compare_phases(title.c_str(), base, recorded, config.slower_limit_pct, false);
+    }
+
+    if (!usb_init())
+        return 1;
+
+    Transport *transport = open_transport(&config, source);
+    if (!transport)
+    {
+        usb_finalise();
+        return 1;
+    }
+
+    fprintf(stderr, "Replaying %s (recorded on %s) via %s\n", trace_file, source, transport->name());
+
+    v_phase_t replayed;
+    bool ok = replay(trace_file, transport, replayed);
+
+    transport->close();
+    delete transport;
+    usb_finalise();
+
+    if (!ok)
+        return 1;
+
+    std::string title = std::string("recorded (") + source + ") -> replayed";
+    return compare_phases(title.c_str(), recorded, replayed, config.slower_limit_pct, true);
+}
@@ -0,0 +1,557 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// progd - programmer daemon.
+//
+// Keeps the programmer open (FX2 firmware loaded, transfer buffers allocated, timeout
+// estimates warm) and the target in programming mode between jobs, so a job only costs
+// the flash work itself. Jobs come from prog -S over a Unix domain socket (progd_proto.h)
+// and are run one at a time. One client is served at a time: one that goes quiet for
+// PROGD_CLIENT_TIMEOUT_MS is dropped so it can't keep the others out.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string>
+
+#include "usb.h"
+#include "Programmer.h"
+#include "AppData.h"
+#include "DeviceData.h"
+#include "version.h"
+#include "latency.h"
+#include "usbtrace.h"
+#include "usbtimeout.h"
+#include "progd_proto.h"
+
+
+// FIXME: shared with prog.cpp - put into a siteconfig.h file
+#define DEFAULT_CONFIG_DIR      "config"
+#define DEFAULT_CONFIG_FILE     "config.ini"
+#define DEFAULT_DEVICE_FILE     "devices.dat"
+
+
+struct daemon_s
+{
+    std::string config_dir;
+    std::string config_filename;
+    std::string device_filename;
+    std::string socket_path;
+
+    std::string transport_name; // empty: use config file
+    std::string trace_file;     // empty: use config file
+    uint32_t job_timeout_ms;    // 0: use config file
+    std::string device_id;      // empty: first found
+    int latency_report;
+
+    daemon_s() : job_timeout_ms(0), latency_report(0) {};
+};
+
+
+// open programmer + target state carried from one job to the next
+struct session_s
+{
+    std::string device_name;
+    DeviceData *devdata;
+    Programmer *programmer;
+    bool acquired;              // target was put in programming mode by an earlier job
+
+    session_s() : devdata(0), programmer(0), acquired(false) {};
+};
+
+
+static volatile sig_atomic_t Stop = 0;
+char *Progname = NULL;
+
+
+static void on_signal(int sig)
+{
+    Stop = 1;
+}
+
+
+void usage(void)
+{
+    fprintf(stderr, "PSoC Programmer daemon, v%s\n"
+        "Copyright (C) 2014 Kim Lester, http://www.dfusion.com.au/\n\n"
+        "Usage: %s [-C config_dir] [-t usb|sim] [-T trace_file] [-D job_timeout_ms] [-P programmer] [-L[L]] [-s socket]\n"
+        "  -s socket  listen on this Unix domain socket (default %s)\n",
+        VERSION_STR, Progname, PROGD_DEFAULT_SOCKET);
+    exit(1);
+}
+
+
+static void session_close(struct session_s *session)
+{
+    if (session->programmer)
+    {
+        session->programmer->close();
+        delete session->programmer;
+    }
+
+    delete session->devdata;
+
+    session->programmer = NULL;
+    session->devdata = NULL;
+    session->device_name.clear();
+    session->acquired = false;
+}
+
+
+static bool session_open(const struct daemon_s *daemon, struct session_s *session, const std::string &device_name, int fd)
+{
+    if (device_name.length() > 0)
+    {
+        std::string device_filepath = daemon->config_dir + std::string("/") + daemon->device_filename;
+
+        session->devdata = new DeviceData;
+        session->devdata->read_file(device_filepath, device_name);
+        if (!session->devdata->validate())
+        {
+            fprintf(stderr, "Device %s (File: %s) failed basic validity checks\n",
+                device_name.c_str(), device_filepath.c_str());
+            delete session->devdata;
+            session->devdata = NULL;
+            return false;
+        }
+    }
+
+    progd_send_progress(fd, "opening programmer");
+
+    Programmer *programmer = new Programmer;
+
+    if (daemon->transport_name.length() > 0)
+        programmer->set_transport(daemon->transport_name);
+
+    if (daemon->trace_file.length() > 0)
+        programmer->set_trace_file(daemon->trace_file);
+
+    if (daemon->job_timeout_ms > 0)
+        programmer->set_job_timeout(daemon->job_timeout_ms);
+
+    if (daemon->device_id.length() > 0)
+        programmer->set_device(daemon->device_id);
+
+    if (programmer->open(daemon->config_dir, daemon->config_filename, session->devdata) != SUCCESS)
+    {
+        fprintf(stderr, "Failed to open device\n");
+        delete programmer;
+        delete session->devdata;
+        session->devdata = NULL;
+        return false;
+    }
+
+    // open() armed the job deadline for the whole session - it is armed per job instead
+    usb_deadline_clear();
+
+    programmer->usb_print_info();
+
+    session->programmer = programmer;
+    session->device_name = device_name;
+    session->acquired = false;
+    return true;
+}
+
+
+static bool session_acquire(struct session_s *session, int fd)
+{
+    // Still in programming mode from the previous job if the target answers IDCODE.
+    // A new board (or a power cycle) needs the SWD switch sequence first and won't.
+    if (session->acquired && session->programmer->get_jtag_id() != 0)
+        return true;
+
+    progd_send_progress(fd, "entering programming mode");
+    session->acquired = session->programmer->enter_programming_mode();
+    return session->acquired;
+}
+
+
+static int job_program(struct session_s *session, const struct progd_job_s *job, int fd, std::string &msg)
+{
+    AppData appdata;
+    if (!appdata.read_hex_file(job->path))
+    {
+        msg = std::string("failed to read file ") + job->path;
+        return -1;
+    }
+
+    uint32_t idcode = session->programmer->get_jtag_id();
+    if (idcode == 0)
+    {
+        msg = "failed to obtain device id";
+        return -1;
+    }
+
+    if (appdata.device_id != idcode)
+    {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "device ids mismatch (file: 0x%08x, device: 0x%08x)", appdata.device_id, idcode);
+        msg = buf;
+        return -1;
+    }
+
+    progd_send_progress(fd, "writing");
+
+    uint32_t flags = 0;
+    if (job->flags & PROGD_JOB_DIFFERENTIAL)
+        flags |= WR_DIFFERENTIAL;
+
+    if (!session->programmer->write_device(&appdata, flags))
+    {
+        msg = "write failed";
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int job_upload(struct session_s *session, const struct progd_job_s *job, int fd, std::string &msg)
+{
+    AppData appdata;
+
+    // only ever a new or plain file: not a device, a fifo or (through a link) somewhere else
+    struct stat st;
+    if (lstat(job->path, &st) == 0 && !S_ISREG(st.st_mode))
+    {
+        msg = std::string("not a regular file ") + job->path;
+        return -1;
+    }
+
+    progd_send_progress(fd, "reading");
+
+    if (!session->programmer->read_device(&appdata, RD_TRIM_ALL)) // FIXME flags from job
+    {
+        msg = "read failed";
+        return -1;
+    }
+
+    if (!appdata.write_hex_file(job->path))
+    {
+        msg = std::string("failed to write file ") + job->path;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int job_verify(struct session_s *session, const struct progd_job_s *job, int fd, std::string &msg)
+{
+    AppData appdata;
+    if (!appdata.read_hex_file(job->path))
+    {
+        msg = std::string("failed to read file ") + job->path;
+        return -1;
+    }
+
+    progd_send_progress(fd, "verifying");
+
+    uint32_t flags = 0;
+    if (job->flags & PROGD_JOB_STRICT)
+        flags |= VR_STRICT;
+    if (job->flags & PROGD_JOB_CONTINUE)
+        flags |= VR_CONTINUE;
+
+    uint32_t match_status = session->programmer->verify_device(&appdata, flags);
+    msg = session->programmer->verify_status_string(match_status);
+
+    return match_status == VERIFY_MATCH ? 0 : -1;
+}
+
+
+static void send_event(const struct progress_s *report, void *ctx)
+{
+    // job progress to the client, as it happens
+    progd_send_event(*(const int *)ctx, report);
+}
+
+
+static int run_job(const struct daemon_s *daemon, struct session_s *session, const struct progd_job_s *job, int fd)
+{
+    uint64_t t_start = usbtrace_now_ns();
+    std::string device_name = job->device_name;
+    std::string msg;
+    int rc = -1;
+
+    fprintf(stderr, "progd: job %s %s %s\n", progd_cmd_name(job->cmd), job->device_name, job->path);
+
+    bool need_device = job->cmd == PROGD_CMD_PROGRAM || job->cmd == PROGD_CMD_UPLOAD || job->cmd == PROGD_CMD_VERIFY;
+
+    if (need_device && device_name.length() == 0)
+    {
+        progd_send_result(fd, -1, 0, "device name not specified");
+        return -1;
+    }
+
+    // device specific commands need the session opened for that device
+    if (session->programmer && device_name.length() > 0 && device_name != session->device_name)
+        session_close(session);
+
+    if (!session->programmer && !session_open(daemon, session, device_name, fd))
+    {
+        progd_send_result(fd, -1, (usbtrace_now_ns() - t_start) / 1000, "failed to open programmer");
+        return -1;
+    }
+
+    usb_deadline_set(session->programmer->job_timeout());
+    session->programmer->set_progress(send_event, &fd);
+
+    if (!session_acquire(session, fd))
+        msg = "failed to enter programming mode";
+    else
+    {
+        switch (job->cmd)
+        {
+        case PROGD_CMD_PROGRAM:
+            rc = job_program(session, job, fd, msg);
+            break;
+
+        case PROGD_CMD_UPLOAD:
+            rc = job_upload(session, job, fd, msg);
+            break;
+
+        case PROGD_CMD_VERIFY:
+            rc = job_verify(session, job, fd, msg);
+            break;
+
+        case PROGD_CMD_ERASE:
+            progd_send_progress(fd, "erasing");
+            rc = session->programmer->erase_flash() ? 0 : -1;
+            if (rc) msg = "erase failed";
+            break;
+
+        case PROGD_CMD_RESET:
+            session->programmer->reset_cpu();
+            session->acquired = false; // target is running again
+            rc = 0;
+            break;
+
+        case PROGD_CMD_ID:
+        {
+            uint32_t idcode = session->programmer->get_jtag_id();
+            char buf[32];
+            snprintf(buf, sizeof(buf), "Silicon ID: 0x%08x", idcode);
+            msg = buf;
+            rc = idcode ? 0 : -1;
+            break;
+        }
+
+        default:
+            msg = "unknown command";
+            break;
+        }
+    }
+
+    if (usb_deadline_passed())
+    {
+        msg += msg.length() ? ", deadline exceeded" : "deadline exceeded";
+        rc = -1;
+    }
+    usb_deadline_clear();
+
+    if (session->programmer)
+        session->programmer->set_progress(NULL, NULL);
+
+    // don't carry state of unknown quality into the next job
+    if (rc != 0 && job->cmd != PROGD_CMD_VERIFY)
+        session_close(session);
+
+    uint32_t elapsed_us = (usbtrace_now_ns() - t_start) / 1000;
+
+    if (daemon->latency_report)
+        latency_dump(stderr, daemon->latency_report > 1);
+
+    fprintf(stderr, "progd: job %s %s in %.1f ms %s\n", progd_cmd_name(job->cmd), rc == 0 ? "OK" : "FAILED",
+        elapsed_us / 1e3, msg.c_str());
+
+    progd_send_result(fd, rc, elapsed_us, msg.c_str());
+    return rc;
+}
+
+
+static bool wait_readable(int fd, int timeout_ms)
+{
+    // false on a stop signal or timeout (timeout_ms -1: none)
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (!Stop)
+    {
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n > 0)
+            return true;
+        if (n == 0 || errno != EINTR)
+            return false;
+    }
+    return false;
+}
+
+
+static void serve_client(const struct daemon_s *daemon, struct session_s *session, int fd)
+{
+    uint8_t payload[PROGD_MAX_PAYLOAD];
+
+    // reads and writes part way through a frame are bounded too
+    struct timeval tv;
+    tv.tv_sec = PROGD_CLIENT_TIMEOUT_MS / 1000;
+    tv.tv_usec = (PROGD_CLIENT_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (true)
+    {
+        if (!wait_readable(fd, PROGD_CLIENT_TIMEOUT_MS))
+        {
+            if (!Stop)
+                fprintf(stderr, "progd: client idle for %d ms - dropped\n", PROGD_CLIENT_TIMEOUT_MS);
+            break;
+        }
+
+        uint8_t type;
+        int len = progd_recv(fd, &type, payload, sizeof(payload));
+        if (len < 0)
+            break; // client done
+
+        struct progd_job_s job;
+        if (type != PROGD_JOB || !progd_decode_job(payload, len, &job))
+        {
+            progd_send_result(fd, -1, 0, "bad request");
+            break;
+        }
+
+        run_job(daemon, session, &job, fd);
+    }
+}
+
+
+void parse_args(int *argc, char ***argv, struct daemon_s *daemon)
+{
+    daemon->config_dir = DEFAULT_CONFIG_DIR;
+    daemon->config_filename = DEFAULT_CONFIG_FILE;
+    daemon->device_filename = DEFAULT_DEVICE_FILE;
+    daemon->socket_path = PROGD_DEFAULT_SOCKET;
+
+    int ch;
+    while ((ch = getopt(*argc, *argv, "hC:t:T:D:P:Ls:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'C':
+                daemon->config_dir = optarg;
+                break;
+
+            case 't':
+                daemon->transport_name = optarg;
+                break;
+
+            case 'T':
+                daemon->trace_file = optarg;
+                break;
+
+            case 'D':
+                daemon->job_timeout_ms = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'P':
+                daemon->device_id = optarg;
+                break;
+
+            case 'L':
+                daemon->latency_report++;
+                break;
+
+            case 's':
+                daemon->socket_path = optarg;
+                break;
+
+            case 'h':
+            default:
+                usage();
+                break;
+        }
+    }
+
+    *argc -= optind;
+    *argv += optind;
+}
+
+
+int main(int argc, char **argv)
+{
+    Progname = argv[0];
+
+    struct daemon_s daemon;
+    parse_args(&argc, &argv, &daemon);
+
+    if (argc > 0) usage();
+
+    // no SA_RESTART: poll() must return so the session can be closed cleanly
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!usb_init())
+    {
+        fprintf(stderr, "Failed to initialise usb interface");
+        return -1;
+    }
+
+    int listen_fd = progd_listen(daemon.socket_path.c_str());
+    if (listen_fd < 0)
+    {
+        usb_finalise();
+        return -1;
+    }
+
+    fprintf(stderr, "progd: listening on %s\n", daemon.socket_path.c_str());
+
+    struct session_s session;
+
+    while (wait_readable(listen_fd, -1))
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        serve_client(&daemon, &session, fd);
+        close(fd);
+    }
+
+    fprintf(stderr, "progd: shutting down\n");
+
+    session_close(&session); // sim transport saves its state here
+    close(listen_fd);
+    unlink(daemon.socket_path.c_str());
+
+    usb_finalise();
+    return 0;
+}
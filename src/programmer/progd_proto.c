@@ -0,0 +1,330 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "progd_proto.h"
+#include "utils.h"
+
+
+static bool make_address(const char *socket_path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return false;
+    }
+
+    strcpy(addr->sun_path, socket_path);
+    return true;
+}
+
+
+int progd_listen(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(socket_path, &addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(socket_path); // stale socket from a previous daemon
+
+    // jobs run as this user (an upload writes any path it is given): nobody else may connect.
+    // Created 0600 rather than chmod()ed afterwards so there is no window where it isn't.
+    mode_t old_mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+
+    if (rc < 0 || listen(fd, 4) < 0)
+    {
+        fprintf(stderr, "Can't listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int progd_connect(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(socket_path, &addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Can't connect to progd on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static bool write_all(int fd, const uint8_t *buf, int len)
+{
+    while (len > 0)
+    {
+        // MSG_NOSIGNAL: a client that went away is an error return, not SIGPIPE
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+static bool read_all(int fd, uint8_t *buf, int len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+bool progd_send(int fd, uint8_t type, const uint8_t *payload, int len)
+{
+    uint8_t frame[PROGD_HEADER_LEN + PROGD_MAX_PAYLOAD];
+
+    if (len > PROGD_MAX_PAYLOAD)
+        return false;
+
+    // one write per frame so progress and result frames never interleave
+    uint16_to_b2_LE(PROGD_MAGIC, &frame[0]);
+    frame[2] = PROGD_VERSION;
+    frame[3] = type;
+    uint32_to_b4_LE(len, &frame[4]);
+    if (len)
+        memcpy(&frame[PROGD_HEADER_LEN], payload, len);
+
+    return write_all(fd, frame, PROGD_HEADER_LEN + len);
+}
+
+
+int progd_recv(int fd, uint8_t *type, uint8_t *payload, int max_len)
+{
+    uint8_t header[PROGD_HEADER_LEN];
+
+    if (!read_all(fd, header, sizeof(header)))
+        return -1;
+
+    uint16_t magic = header[0] | (header[1] << 8);
+    uint32_t len = b4_LE_to_uint32(&header[4]);
+
+    if (magic != PROGD_MAGIC || header[2] != PROGD_VERSION || len > (uint32_t)max_len)
+    {
+        fprintf(stderr, "progd: bad frame (magic 0x%04x version %d len %u)\n", magic, header[2], len);
+        return -1;
+    }
+
+    if (!read_all(fd, payload, len))
+        return -1;
+
+    *type = header[3];
+    return len;
+}
+
+
+bool progd_send_job(int fd, const struct progd_job_s *job)
+{
+    uint8_t payload[6 + PROGD_MAX_NAME + PROGD_MAX_PATH];
+    int device_len = strlen(job->device_name);
+    int path_len = strlen(job->path);
+
+    if (device_len > PROGD_MAX_NAME || path_len > PROGD_MAX_PATH)
+        return false;
+
+    payload[0] = job->cmd;
+    payload[1] = job->flags;
+    uint16_to_b2_LE(device_len, &payload[2]);
+    uint16_to_b2_LE(path_len, &payload[4]);
+    memcpy(&payload[6], job->device_name, device_len);
+    memcpy(&payload[6 + device_len], job->path, path_len);
+
+    return progd_send(fd, PROGD_JOB, payload, 6 + device_len + path_len);
+}
+
+
+bool progd_decode_job(const uint8_t *payload, int len, struct progd_job_s *job)
+{
+    if (len < 6)
+        return false;
+
+    int device_len = payload[2] | (payload[3] << 8);
+    int path_len = payload[4] | (payload[5] << 8);
+
+    if (device_len > PROGD_MAX_NAME || path_len > PROGD_MAX_PATH || 6 + device_len + path_len != len)
+        return false;
+
+    job->cmd = payload[0];
+    job->flags = payload[1];
+    memcpy(job->device_name, &payload[6], device_len);
+    job->device_name[device_len] = '\0';
+    memcpy(job->path, &payload[6 + device_len], path_len);
+    job->path[path_len] = '\0';
+
+    return true;
+}
+
+
+bool progd_send_progress(int fd, const char *text)
+{
+    int len = strlen(text);
+    if (len > PROGD_MAX_PAYLOAD)
+        len = PROGD_MAX_PAYLOAD;
+
+    return progd_send(fd, PROGD_PROGRESS, (const uint8_t *)text, len);
+}
+
+
+static uint32_t clamp_u32(uint64_t v)
+{
+    return v > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)v;
+}
+
+
+bool progd_send_event(int fd, const struct progress_s *report)
+{
+    uint8_t payload[PROGD_EVENT_LEN];
+
+    payload[0] = report->phase;
+    payload[1] = report->done ? 1 : 0;
+    payload[2] = 0;
+    payload[3] = 0;
+    uint32_to_b4_LE(report->rows_done, &payload[4]);
+    uint32_to_b4_LE(report->rows_total, &payload[8]);
+    uint32_to_b4_LE(clamp_u32(report->bytes_done), &payload[12]);
+    uint32_to_b4_LE(clamp_u32(report->bytes_total), &payload[16]);
+    uint32_to_b4_LE(clamp_u32(report->elapsed_ns / 1000000), &payload[20]);
+    uint32_to_b4_LE(clamp_u32(report->rate_Bps), &payload[24]);
+    uint32_to_b4_LE(clamp_u32(report->avg_Bps), &payload[28]);
+    uint32_to_b4_LE(report->eta_ns < 0 ? 0xFFFFFFFF : clamp_u32(report->eta_ns / 1000000), &payload[32]);
+
+    return progd_send(fd, PROGD_EVENT, payload, PROGD_EVENT_LEN);
+}
+
+
+bool progd_decode_event(const uint8_t *payload, int len, struct progress_s *report)
+{
+    if (len < PROGD_EVENT_LEN)
+        return false;
+
+    memset(report, 0, sizeof(*report));
+    report->phase = payload[0];
+    report->done = payload[1] != 0;
+    report->rows_done = b4_LE_to_uint32(&payload[4]);
+    report->rows_total = b4_LE_to_uint32(&payload[8]);
+    report->bytes_done = b4_LE_to_uint32(&payload[12]);
+    report->bytes_total = b4_LE_to_uint32(&payload[16]);
+    report->elapsed_ns = (uint64_t)b4_LE_to_uint32(&payload[20]) * 1000000;
+    report->rate_Bps = b4_LE_to_uint32(&payload[24]);
+    report->avg_Bps = b4_LE_to_uint32(&payload[28]);
+
+    uint32_t eta_ms = b4_LE_to_uint32(&payload[32]);
+    report->eta_ns = eta_ms == 0xFFFFFFFF ? -1 : (int64_t)eta_ms * 1000000;
+
+    return true;
+}
+
+
+bool progd_send_result(int fd, int32_t rc, uint32_t elapsed_us, const char *text)
+{
+    uint8_t payload[PROGD_MAX_PAYLOAD];
+    int len = strlen(text);
+    if (len > PROGD_MAX_PAYLOAD - 8)
+        len = PROGD_MAX_PAYLOAD - 8;
+
+    uint32_to_b4_LE((uint32_t)rc, &payload[0]);
+    uint32_to_b4_LE(elapsed_us, &payload[4]);
+    memcpy(&payload[8], text, len);
+
+    return progd_send(fd, PROGD_RESULT, payload, 8 + len);
+}
+
+
+bool progd_decode_result(const uint8_t *payload, int len, int32_t *rc, uint32_t *elapsed_us, char *text, int text_max)
+{
+    if (len < 8 || text_max < 1)
+        return false;
+
+    *rc = (int32_t)b4_LE_to_uint32(&payload[0]);
+    *elapsed_us = b4_LE_to_uint32(&payload[4]);
+
+    int text_len = len - 8;
+    if (text_len > text_max - 1)
+        text_len = text_max - 1;
+    memcpy(text, &payload[8], text_len);
+    text[text_len] = '\0';
+
+    return true;
+}
+
+
+const char *progd_cmd_name(int cmd)
+{
+    switch (cmd)
+    {
+    case PROGD_CMD_PROGRAM: return "program";
+    case PROGD_CMD_VERIFY:  return "verify";
+    case PROGD_CMD_UPLOAD:  return "upload";
+    case PROGD_CMD_ERASE:   return "erase";
+    case PROGD_CMD_RESET:   return "reset";
+    case PROGD_CMD_ID:      return "id";
+    default:                return "?";
+    }
+}
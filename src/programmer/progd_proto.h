@@ -0,0 +1,109 @@
+#ifndef _PROGD_PROTO_H
+#define _PROGD_PROTO_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// progd protocol: prog (client) <-> progd (daemon) over a Unix domain stream socket.
+//
+// Frame:   u16 magic "PD", u8 version, u8 type, u32 payload length, payload.
+// Client sends JOB frames, one at a time. For each the daemon sends any number of
+// PROGRESS and EVENT frames and then one RESULT frame. A connection may carry several jobs.
+//
+//  JOB:      u8 cmd, u8 flags (PROGD_JOB_xxx), u16 device_len, u16 path_len, device name, file path
+//            (path is absolute; the daemon reads/writes the file itself)
+//  PROGRESS: text
+//  EVENT:    u8 phase, u8 done, u16 0, u32 rows_done, u32 rows_total, u32 bytes_done, u32 bytes_total,
+//            u32 elapsed_ms, u32 rate_Bps, u32 avg_Bps, i32 eta_ms (-1 unknown)  (progress.h)
+//  RESULT:   i32 rc (0 ok), u32 elapsed_us (job time in the daemon), text
+// All integers little endian.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "progress.h"
+
+#define PROGD_MAGIC             0x4450  // "PD"
+#define PROGD_VERSION           2
+#define PROGD_HEADER_LEN        8
+#define PROGD_MAX_PAYLOAD       4096
+#define PROGD_MAX_NAME          64
+#define PROGD_MAX_PATH          1024
+#define PROGD_EVENT_LEN         36
+
+#define PROGD_DEFAULT_SOCKET    "/tmp/progd.sock"
+#define PROGD_CLIENT_TIMEOUT_MS 30000   // a client idle (or stuck part way through a frame) this long is dropped
+
+enum progd_msg_e
+{
+    PROGD_JOB = 1,
+    PROGD_PROGRESS,
+    PROGD_RESULT,
+    PROGD_EVENT
+};
+
+enum progd_cmd_e
+{
+    PROGD_CMD_PROGRAM = 1,
+    PROGD_CMD_VERIFY,
+    PROGD_CMD_UPLOAD,
+    PROGD_CMD_ERASE,
+    PROGD_CMD_RESET,
+    PROGD_CMD_ID
+};
+
+// job flags
+#define PROGD_JOB_DIFFERENTIAL  0x01    // program: only flash rows that differ (WR_DIFFERENTIAL)
+#define PROGD_JOB_STRICT        0x02    // verify: every flash row byte for byte (VR_STRICT)
+#define PROGD_JOB_CONTINUE      0x04    // verify: don't stop at the first mismatch (VR_CONTINUE)
+
+struct progd_job_s
+{
+    uint8_t cmd;
+    uint8_t flags;
+    char device_name[PROGD_MAX_NAME + 1];
+    char path[PROGD_MAX_PATH + 1];
+};
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int progd_listen(const char *socket_path);     // returns fd (socket mode 0600), -1 on error
+int progd_connect(const char *socket_path);
+
+bool progd_send(int fd, uint8_t type, const uint8_t *payload, int len);
+int progd_recv(int fd, uint8_t *type, uint8_t *payload, int max_len); // payload length, -1 on EOF/error
+
+bool progd_send_job(int fd, const struct progd_job_s *job);
+bool progd_decode_job(const uint8_t *payload, int len, struct progd_job_s *job);
+
+bool progd_send_progress(int fd, const char *text);
+bool progd_send_event(int fd, const struct progress_s *report);
+bool progd_decode_event(const uint8_t *payload, int len, struct progress_s *report);
+bool progd_send_result(int fd, int32_t rc, uint32_t elapsed_us, const char *text);
+bool progd_decode_result(const uint8_t *payload, int len, int32_t *rc, uint32_t *elapsed_us, char *text, int text_max);
+
+const char *progd_cmd_name(int cmd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
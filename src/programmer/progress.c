@@ -0,0 +1,160 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "progress.h"
+
+
+static const char *phase_names[PROGRESS_NUM_PHASES] = {
+    "erase", "checksum", "write", "read", "verify"
+};
+
+
+void progress_init(struct progress_meter_s *meter, progress_fn fn, void *ctx, unsigned int interval_ms)
+{
+    memset(meter, 0, sizeof(*meter));
+    meter->fn = fn;
+    meter->ctx = ctx;
+    meter->interval_ns = (uint64_t)interval_ms * 1000000;
+}
+
+
+static void report(struct progress_meter_s *meter, uint64_t now_ns)
+{
+    struct progress_s *r = &meter->report;
+
+    r->elapsed_ns = now_ns - meter->start_ns;
+
+    uint64_t dt_ns = now_ns - meter->last_ns;
+    if (dt_ns > 0 && r->bytes_done > meter->last_bytes)
+    {
+        uint64_t sample = (r->bytes_done - meter->last_bytes) * 1000000000ULL / dt_ns;
+        if (r->rate_Bps == 0)
+            r->rate_Bps = sample;
+        else
+            r->rate_Bps = (int64_t)r->rate_Bps + (((int64_t)sample - (int64_t)r->rate_Bps) >> PROGRESS_RATE_SHIFT);
+    }
+
+    r->avg_Bps = r->elapsed_ns ? r->bytes_done * 1000000000ULL / r->elapsed_ns : 0;
+
+    // time to go: at the recent byte rate, else pro rata by rows
+    if (r->done)
+        r->eta_ns = 0;
+    else if (r->bytes_total && r->rate_Bps)
+        r->eta_ns = (r->bytes_total - r->bytes_done) * 1000000000ULL / r->rate_Bps;
+    else if (r->rows_done > 0 && r->rows_total >= r->rows_done)
+        r->eta_ns = r->elapsed_ns * (r->rows_total - r->rows_done) / r->rows_done;
+    else
+        r->eta_ns = -1;
+
+    meter->last_ns = now_ns;
+    meter->last_bytes = r->bytes_done;
+
+    meter->fn(r, meter->ctx);
+}
+
+
+void progress_begin(struct progress_meter_s *meter, int phase, int rows_total, uint64_t bytes_total, uint64_t now_ns)
+{
+    struct progress_s *r = &meter->report;
+
+    memset(r, 0, sizeof(*r));
+    r->phase = phase;
+    r->rows_total = rows_total;
+    r->bytes_total = bytes_total;
+    r->eta_ns = -1;
+
+    meter->start_ns = now_ns;
+    meter->last_ns = now_ns;
+    meter->last_bytes = 0;
+    meter->active = true;
+
+    if (meter->fn)
+        report(meter, now_ns);
+}
+
+
+void progress_update(struct progress_meter_s *meter, int rows_done, uint64_t bytes_done, uint64_t now_ns)
+{
+    if (!meter->active)
+        return;
+
+    meter->report.rows_done = rows_done;
+    meter->report.bytes_done = bytes_done;
+
+    if (meter->fn && now_ns - meter->last_ns >= meter->interval_ns)
+        report(meter, now_ns);
+}
+
+
+void progress_end(struct progress_meter_s *meter, uint64_t now_ns)
+{
+    if (!meter->active)
+        return;
+
+    meter->report.done = true;
+    meter->active = false;
+
+    if (meter->fn)
+        report(meter, now_ns);
+}
+
+
+const char *progress_phase_name(int phase)
+{
+    if (phase < 0 || phase >= PROGRESS_NUM_PHASES)
+        return "?";
+    return phase_names[phase];
+}
+
+
+void progress_print_line(FILE *fp, const struct progress_s *r)
+{
+    // \r and clear to end of line: each report overwrites the last, the final one stays
+    fprintf(fp, "\r%-8s", progress_phase_name(r->phase));
+
+    if (r->rows_total > 0)
+        fprintf(fp, " %5d/%d rows %3d%%", r->rows_done, r->rows_total, (int)(100LL * r->rows_done / r->rows_total));
+
+    if (r->bytes_total > 0)
+        fprintf(fp, "  %7.1f kB/s (avg %.1f)", r->rate_Bps / 1e3, r->avg_Bps / 1e3);
+
+    if (r->done)
+        fprintf(fp, "  %.2f s\033[K\n", r->elapsed_ns / 1e9);
+    else if (r->eta_ns >= 0)
+        fprintf(fp, "  ETA %.1f s\033[K", r->eta_ns / 1e9);
+    else
+        fprintf(fp, "\033[K");
+
+    fflush(fp);
+}
+
+
+void progress_print_event(FILE *fp, const char *source, const struct progress_s *r)
+{
+    fprintf(fp, "progress source=%s phase=%s rows=%d/%d bytes=%llu/%llu elapsed_ms=%llu rate_Bps=%llu avg_Bps=%llu eta_ms=%lld done=%d\n",
+        source ? source : "-", progress_phase_name(r->phase), r->rows_done, r->rows_total,
+        (unsigned long long)r->bytes_done, (unsigned long long)r->bytes_total,
+        (unsigned long long)(r->elapsed_ns / 1000000), (unsigned long long)r->rate_Bps, (unsigned long long)r->avg_Bps,
+        r->eta_ns < 0 ? -1LL : (long long)(r->eta_ns / 1000000), r->done ? 1 : 0);
+    fflush(fp);
+}
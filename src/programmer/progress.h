@@ -0,0 +1,100 @@
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Progress of long operations (erase, flash write, read, verify) for whoever drives the
+// programmer: a callback gets a report at the start of each phase, as rows get done (no more
+// often than the meter's interval) and once at the end of the phase.
+//
+// A report has rows and bytes done out of the phase total, the recent throughput (smoothed
+// over reports), the average over the phase and the time to go at the recent rate. Reports
+// are built in place in the meter: nothing is allocated, updates between reports are a
+// compare and a store. Times come from the caller (the transport clock: the simulator's is
+// virtual).
+//
+// progress_print_line() renders a report as a single updating terminal line,
+// progress_print_event() as one "key=value" line per report for fixture software.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+enum progress_phase_e
+{
+    PROGRESS_ERASE = 0,
+    PROGRESS_CHECKSUM,      // comparing flash to the image by checksum
+    PROGRESS_WRITE,
+    PROGRESS_READ,
+    PROGRESS_VERIFY,
+    PROGRESS_NUM_PHASES
+};
+
+#define PROGRESS_DEFAULT_INTERVAL_MS    100
+#define PROGRESS_RATE_SHIFT             2       // recent rate: new sample weighs 1/4
+
+struct progress_s
+{
+    int phase;
+    bool done;                  // last report of the phase
+    int rows_done;
+    int rows_total;
+    uint64_t bytes_done;
+    uint64_t bytes_total;       // 0: phase isn't counted in bytes (erase, checksum)
+    uint64_t elapsed_ns;        // since the phase began
+    uint64_t rate_Bps;          // recent
+    uint64_t avg_Bps;
+    int64_t eta_ns;             // -1: not known (yet)
+};
+
+typedef void (*progress_fn)(const struct progress_s *report, void *ctx);
+
+struct progress_meter_s
+{
+    progress_fn fn;             // NULL: no reporting
+    void *ctx;
+    uint64_t interval_ns;
+    struct progress_s report;
+    uint64_t start_ns;
+    uint64_t last_ns;           // of the last report
+    uint64_t last_bytes;
+    bool active;                // in a phase
+};
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void progress_init(struct progress_meter_s *meter, progress_fn fn, void *ctx, unsigned int interval_ms);
+
+void progress_begin(struct progress_meter_s *meter, int phase, int rows_total, uint64_t bytes_total, uint64_t now_ns);
+void progress_update(struct progress_meter_s *meter, int rows_done, uint64_t bytes_done, uint64_t now_ns);
+void progress_end(struct progress_meter_s *meter, uint64_t now_ns);
+
+const char *progress_phase_name(int phase);
+
+void progress_print_line(FILE *fp, const struct progress_s *report);
+void progress_print_event(FILE *fp, const char *source, const struct progress_s *report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
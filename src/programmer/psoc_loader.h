@@ -0,0 +1,78 @@
+#ifndef _PSOC_LOADER_H
+#define _PSOC_LOADER_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SRAM flash loader: a small Thumb program (psoc_loader.S) the host runs on the PSoC5 CPU
+// so flash rows are loaded into the SPC from SRAM rather than one SWD write per byte.
+//
+// EXPERIMENTAL: not yet run on a real PSoC5LP (the simulator only models what it does, see
+// SimTransport::loader_run), so it is off unless config.ini sets flash_loader = 1.
+//
+// The host writes row slots into a ring in SRAM with packed auto increment writes and bumps
+// HEAD; the loader does LOAD_ROW and the slot's program command for each and bumps TAIL.
+// HEAD and TAIL are free running slot counts (slot = count % NSLOTS). The host sets TAIL to
+// LOADER_NOT_STARTED before starting the CPU; the loader clears it (and ERROR) when it runs.
+//
+// SRAM (PSoC5LP upper 32K):
+//   0x20000000   code (entry, Thumb)
+//   0x20000100   control block: HEAD (host), TAIL (loader), ERROR (loader, SPC status), NSLOTS (host)
+//   0x20000200   ring of NSLOTS slots, LOADER_SLOT_STRIDE apart
+//   0x20008000   initial SP (loader uses no stack)
+//
+// Slot: u8 cmd (SPC_CMD_WRITE_ROW/PROG_ROW), u8 aid, u8 row hi, u8 row lo, u8 temp sign,
+//       u8 temp magnitude, u16 len (LE), data[len] (<= 288)
+
+#include <stdint.h>
+
+#define LOADER_ENTRY            0x20000000
+#define LOADER_CTL              0x20000100
+#define LOADER_RING             0x20000200
+#define LOADER_STACK_TOP        0x20008000
+
+#define LOADER_CTL_HEAD         (LOADER_CTL + 0)
+#define LOADER_CTL_TAIL         (LOADER_CTL + 4)
+#define LOADER_CTL_ERROR        (LOADER_CTL + 8)
+#define LOADER_CTL_NSLOTS       (LOADER_CTL + 12)
+
+#define LOADER_SLOT_HEADER_LEN  8
+#define LOADER_SLOT_MAX_DATA    288
+#define LOADER_SLOT_STRIDE      (LOADER_SLOT_HEADER_LEN + LOADER_SLOT_MAX_DATA)
+#define LOADER_NUM_SLOTS        16
+
+#define LOADER_NOT_STARTED      0xFFFFFFFF  // TAIL until the loader runs
+
+// Generated from psoc_loader.S (see there)
+static const uint8_t psoc_loader_image[] = {
+  0x24, 0x4c, 0x25, 0x4d, 0x00, 0x26, 0xa6, 0x60, 0x66, 0x60, 0x20, 0x68,
+  0xb0, 0x42, 0xfc, 0xd0, 0xe1, 0x68, 0xb6, 0xfb, 0xf1, 0xf2, 0x02, 0xfb,
+  0x11, 0x62, 0x40, 0xf2, 0x28, 0x13, 0x02, 0xfb, 0x03, 0xf2, 0x04, 0xf5,
+  0x80, 0x77, 0x17, 0x44, 0x00, 0xf0, 0x2c, 0xf8, 0xb6, 0x20, 0x28, 0x70,
+  0xd5, 0x20, 0x28, 0x70, 0x02, 0x20, 0x28, 0x70, 0x78, 0x78, 0x28, 0x70,
+  0xf9, 0x88, 0x07, 0xf1, 0x08, 0x02, 0x12, 0xf8, 0x01, 0x0b, 0x28, 0x70,
+  0x49, 0x1e, 0xfa, 0xd1, 0x00, 0xf0, 0x1a, 0xf8, 0xb6, 0x20, 0x28, 0x70,
+  0x39, 0x78, 0x11, 0xf1, 0xd3, 0x00, 0x28, 0x70, 0x29, 0x70, 0x78, 0x78,
+  0x28, 0x70, 0xb8, 0x78, 0x28, 0x70, 0xf8, 0x78, 0x28, 0x70, 0x38, 0x79,
+  0x28, 0x70, 0x78, 0x79, 0x28, 0x70, 0x00, 0xf0, 0x07, 0xf8, 0x81, 0x08,
+  0x02, 0xd1, 0x76, 0x1c, 0x66, 0x60, 0xc4, 0xe7, 0xa0, 0x60, 0xfd, 0xe7,
+  0x00, 0xbf, 0x00, 0xbf, 0x00, 0xbf, 0xa8, 0x78, 0x10, 0xf0, 0x02, 0x0f,
+  0xfb, 0xd0, 0x70, 0x47, 0x00, 0x01, 0x00, 0x20, 0x20, 0x47, 0x00, 0x40
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "swdreply.h"
+#include "SwdProtocol.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SWD_REPLY_X86
+#include <immintrin.h>
+#endif
+
+
+struct impl_s
+{
+    int id;
+    const char *name;
+    int (*check_acks)(const uint8_t *reply, int stride, int n);
+    void (*extract_b0)(const uint8_t *reply, int n, uint8_t *dst);
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static const struct impl_s *impl = NULL;
+
+
+static inline bool ack_ok(uint8_t ack)
+{
+    return ack == REPLY_OK || ack == REPLY_JTAGID_MATCHED;
+}
+
+
+static int check_acks_scalar(const uint8_t *reply, int stride, int n)
+{
+    const uint8_t *p = reply + stride - 1;
+    int i;
+
+    for (i=0; i<n; i++, p += stride)
+    {
+        if (!ack_ok(*p))
+            return i;
+    }
+    return -1;
+}
+
+
+static void extract_b0_scalar(const uint8_t *reply, int n, uint8_t *dst)
+{
+    int i;
+    for (i=0; i<n; i++)
+        dst[i] = reply[SWD_REPLY_READ_LEN * i];
+}
+
+
+static const struct impl_s impl_scalar = { SWD_REPLY_SCALAR, "scalar", check_acks_scalar, extract_b0_scalar };
+
+
+#ifdef SWD_REPLY_X86
+
+// A run of 5 byte records lines up with the vector width again every 5 vectors (16 or 32
+// records). Bit p of ack_mask_N[k] is set if byte p of vector k in such a block is an ACK.
+static uint32_t ack_mask_16[SWD_REPLY_READ_LEN];
+static uint32_t ack_mask_32[SWD_REPLY_READ_LEN];
+
+// pshufb controls gathering byte 0 of record r (of 16) from vector k into byte r, 0x80 elsewhere
+static uint8_t shuffle_b0[SWD_REPLY_READ_LEN][16] __attribute__((aligned(16)));
+
+
+static void init_tables(void)
+{
+    int k, p, r;
+
+    for (k=0; k<SWD_REPLY_READ_LEN; k++)
+    {
+        ack_mask_16[k] = 0;
+        for (p=0; p<16; p++)
+            if ((16 * k + p) % SWD_REPLY_READ_LEN == SWD_REPLY_READ_LEN - 1)
+                ack_mask_16[k] |= 1u << p;
+
+        ack_mask_32[k] = 0;
+        for (p=0; p<32; p++)
+            if ((32 * k + p) % SWD_REPLY_READ_LEN == SWD_REPLY_READ_LEN - 1)
+                ack_mask_32[k] |= 1u << p;
+    }
+
+    memset(shuffle_b0, 0x80, sizeof(shuffle_b0));
+    for (r=0; r<16; r++)
+    {
+        int src = SWD_REPLY_READ_LEN * r;
+        shuffle_b0[src / 16][r] = src % 16;
+    }
+}
+
+
+__attribute__((target("sse2")))
+static int check_acks_sse2(const uint8_t *reply, int stride, int n)
+{
+    if (stride != 1 && stride != SWD_REPLY_READ_LEN)
+        return check_acks_scalar(reply, stride, n);
+
+    const __m128i ok = _mm_set1_epi8(REPLY_OK);
+    const __m128i jtag_ok = _mm_set1_epi8(REPLY_JTAGID_MATCHED);
+    int i, k, rc;
+
+    // 16 records per block, in stride vectors
+    for (i=0; i + 16 <= n; i += 16)
+    {
+        const uint8_t *p = reply + stride * i;
+
+        for (k=0; k<stride; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            uint32_t good = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, ok), _mm_cmpeq_epi8(v, jtag_ok)));
+            uint32_t bad = ~good & (stride == 1 ? 0xffff : ack_mask_16[k]);
+
+            if (bad)
+                return i + (16 * k + __builtin_ctz(bad)) / stride;
+        }
+    }
+
+    rc = check_acks_scalar(reply + stride * i, stride, n - i);
+    return rc < 0 ? -1 : i + rc;
+}
+
+
+__attribute__((target("avx2")))
+static int check_acks_avx2(const uint8_t *reply, int stride, int n)
+{
+    if (stride != 1 && stride != SWD_REPLY_READ_LEN)
+        return check_acks_scalar(reply, stride, n);
+
+    const __m256i ok = _mm256_set1_epi8(REPLY_OK);
+    const __m256i jtag_ok = _mm256_set1_epi8(REPLY_JTAGID_MATCHED);
+    int i, k, rc;
+
+    // 32 records per block, in stride vectors
+    for (i=0; i + 32 <= n; i += 32)
+    {
+        const uint8_t *p = reply + stride * i;
+
+        for (k=0; k<stride; k++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+            uint32_t good = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, ok), _mm256_cmpeq_epi8(v, jtag_ok)));
+            uint32_t bad = ~good & (stride == 1 ? 0xffffffff : ack_mask_32[k]);
+
+            if (bad)
+                return i + (32 * k + __builtin_ctz(bad)) / stride;
+        }
+    }
+
+    rc = check_acks_scalar(reply + stride * i, stride, n - i);
+    return rc < 0 ? -1 : i + rc;
+}
+
+
+__attribute__((target("ssse3")))
+static void extract_b0_ssse3(const uint8_t *reply, int n, uint8_t *dst)
+{
+    // also used by the AVX2 implementation: pshufb doesn't cross 128 bit lanes, so 256 bit
+    // vectors gain nothing for a stride that doesn't divide 16
+    int i, k;
+
+    for (i=0; i + 16 <= n; i += 16)
+    {
+        const uint8_t *p = reply + SWD_REPLY_READ_LEN * i;
+        __m128i out = _mm_setzero_si128();
+
+        for (k=0; k<SWD_REPLY_READ_LEN; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+            out = _mm_or_si128(out, _mm_shuffle_epi8(v, _mm_load_si128((const __m128i *)shuffle_b0[k])));
+        }
+
+        _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+
+    extract_b0_scalar(reply + SWD_REPLY_READ_LEN * i, n - i, dst + i);
+}
+
+
+static const struct impl_s impl_sse = { SWD_REPLY_SSE, "sse2/ssse3", check_acks_sse2, extract_b0_ssse3 };
+static const struct impl_s impl_avx2 = { SWD_REPLY_AVX2, "avx2", check_acks_avx2, extract_b0_ssse3 };
+
+#endif
+
+
+static const struct impl_s *supported(int id)
+{
+#ifdef SWD_REPLY_X86
+    __builtin_cpu_init();
+    bool have_sse = __builtin_cpu_supports("sse2") && __builtin_cpu_supports("ssse3");
+    bool have_avx2 = have_sse && __builtin_cpu_supports("avx2");
+
+    if ((id == SWD_REPLY_AUTO || id == SWD_REPLY_AVX2) && have_avx2)
+        return &impl_avx2;
+    if ((id == SWD_REPLY_AUTO || id == SWD_REPLY_AVX2 || id == SWD_REPLY_SSE) && have_sse)
+        return &impl_sse;
+#endif
+    return &impl_scalar;
+}
+
+
+static void init(void)
+{
+#ifdef SWD_REPLY_X86
+    init_tables();
+#endif
+    impl = supported(SWD_REPLY_AUTO);
+}
+
+
+static inline const struct impl_s *get_impl(void)
+{
+    pthread_once(&init_once, init);
+    return impl;
+}
+
+
+int swd_reply_select(int id)
+{
+    get_impl();
+    impl = supported(id);
+    return impl->id;
+}
+
+
+const char *swd_reply_impl_name(void)
+{
+    return get_impl()->name;
+}
+
+
+int swd_reply_check_acks(const uint8_t *reply, int stride, int n)
+{
+    return get_impl()->check_acks(reply, stride, n);
+}
+
+
+int swd_reply_decode_b0(const uint8_t *reply, int n, uint8_t *dst)
+{
+    const struct impl_s *p = get_impl();
+
+    if (dst)
+        p->extract_b0(reply, n, dst);
+    return p->check_acks(reply, SWD_REPLY_READ_LEN, n);
+}
+
+
+int swd_reply_decode_b4(const uint8_t *reply, int n, uint8_t *dst)
+{
+    int i;
+
+    if (dst)
+    {
+        for (i=0; i<n; i++)
+            memcpy(dst + 4 * i, reply + SWD_REPLY_READ_LEN * i, 4);
+    }
+    return get_impl()->check_acks(reply, SWD_REPLY_READ_LEN, n);
+}
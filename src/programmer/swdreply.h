@@ -0,0 +1,69 @@
+#ifndef _SWDREPLY_H
+#define _SWDREPLY_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Decoding runs of SWD replies in place.
+//
+// The FX2 replies to each write with an ACK byte and to each read with 4 data bytes (LSB
+// first) then an ACK. A run of n writes is n ACKs (stride 1), a run of n reads is n 5 byte
+// records (stride 5). These check every ACK in a run in one pass and copy the data straight
+// from the reply buffer to its destination.
+//
+// ACKs are good if REPLY_OK or REPLY_JTAGID_MATCHED. Functions return the index of the first
+// record with a bad ACK, or -1 if all are good. Data is copied either way.
+//
+// x86 builds pick SSE2/SSSE3 or AVX2 code at run time from the host CPU; other hosts and the
+// tail of each run use plain C. All give the same results.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum swd_reply_impl_e
+{
+    SWD_REPLY_AUTO = 0,     // best the host supports
+    SWD_REPLY_SCALAR,
+    SWD_REPLY_SSE,          // SSE2 ACK checks, SSSE3 byte extraction
+    SWD_REPLY_AVX2
+};
+
+#define SWD_REPLY_READ_LEN      5
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// n ACKs, stride bytes apart: the ACK of record i is reply[stride * i + stride - 1]
+int swd_reply_check_acks(const uint8_t *reply, int stride, int n);
+
+// n read records. b0: byte 0 of each to dst[i] (SPC data is one byte wide), b4: all 4 to
+// dst[4 * i]. dst may be NULL (check only).
+int swd_reply_decode_b0(const uint8_t *reply, int n, uint8_t *dst);
+int swd_reply_decode_b4(const uint8_t *reply, int n, uint8_t *dst);
+
+// Force an implementation (falls back to scalar if the host can't run it). Returns the one in use.
+int swd_reply_select(int impl);
+const char *swd_reply_impl_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
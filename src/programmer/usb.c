@@ -19,10 +19,16 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "usb.h"
 #include "utils.h"
+#include "usbtrace.h"
+#include "latency.h"
+#include "usbtimeout.h"
 
 
 //#define CTRL_IN   (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN)
@@ -33,6 +39,25 @@
 
 static uint32_t usb_debug = 0;
 
+// libusb context of the calling thread. NULL (default context) unless usb_init_thread()
+// gave the thread its own, as gang mode does for each programmer.
+static __thread libusb_context *usb_ctx = NULL;
+
+
+// Where each vid.pid was last found. Saves a full device list scan (descriptor reads from
+// every device on every bus) on repeat opens. Entries hold a device reference.
+// Per thread, like the context the devices come from.
+#define USB_DEVICE_CACHE_SIZE   8
+
+struct usb_cache_entry_s
+{
+    int vid;
+    int pid;
+    libusb_device *dev;
+};
+
+static __thread struct usb_cache_entry_s device_cache[USB_DEVICE_CACHE_SIZE]; // devices belong to usb_ctx
+
 
 bool usb_init(void)
 {
@@ -48,13 +73,353 @@ bool usb_init(void)
     return true;
 }
 
+static void cache_release(void)
+{
+    int i;
+    for (i=0; i<USB_DEVICE_CACHE_SIZE; i++)
+    {
+        if (device_cache[i].dev)
+            libusb_unref_device(device_cache[i].dev);
+        device_cache[i].dev = NULL;
+    }
+}
+
+
 void usb_finalise(void)
 {
+    cache_release();
     libusb_exit(NULL);
 }
 
 
+bool usb_init_thread(void)
+{
+    int rc = libusb_init(&usb_ctx);
+    if (rc < 0)
+    {
+        fprintf(stderr, "Failed to initialise usb context: %d %s\n", rc, libusb_strerror((enum libusb_error)rc));
+        usb_ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+void usb_finalise_thread(void)
+{
+    cache_release();
+    if (usb_ctx)
+        libusb_exit(usb_ctx);
+    usb_ctx = NULL;
+}
+
+
+libusb_context *usb_context(void)
+{
+    return usb_ctx;
+}
+
+
+static libusb_device *cache_lookup(int vid, int pid)
+{
+    int i;
+    for (i=0; i<USB_DEVICE_CACHE_SIZE; i++)
+    {
+        if (device_cache[i].dev && device_cache[i].vid == vid && device_cache[i].pid == pid)
+            return device_cache[i].dev;
+    }
+    return NULL;
+}
+
+
+static void cache_drop(libusb_device *dev)
+{
+    int i;
+    for (i=0; i<USB_DEVICE_CACHE_SIZE; i++)
+    {
+        if (device_cache[i].dev == dev)
+        {
+            libusb_unref_device(dev);
+            device_cache[i].dev = NULL;
+        }
+    }
+}
+
+
+static void cache_store(int vid, int pid, libusb_device *dev)
+{
+    int i;
+    int slot = -1;
+
+    for (i=0; i<USB_DEVICE_CACHE_SIZE; i++)
+    {
+        if (device_cache[i].dev == dev)
+            return;
+        if (device_cache[i].dev && device_cache[i].vid == vid && device_cache[i].pid == pid)
+        {
+            slot = i; // replaces previous location (device moved or re-enumerated)
+            break;
+        }
+        if (!device_cache[i].dev && slot < 0)
+            slot = i;
+    }
+
+    if (slot < 0)
+        slot = 0; // full. FIXME: LRU, doesn't matter for a handful of programmers
+
+    if (device_cache[slot].dev)
+        libusb_unref_device(device_cache[slot].dev);
+
+    device_cache[slot].vid = vid;
+    device_cache[slot].pid = pid;
+    device_cache[slot].dev = libusb_ref_device(dev);
+}
+
+
+static bool device_port_path(libusb_device *dev, struct usb_port_path_s *path)
+{
+    path->bus = libusb_get_bus_number(dev);
+    int depth = libusb_get_port_numbers(dev, path->ports, USB_MAX_PORT_DEPTH);
+    path->depth = depth > 0 ? depth : 0;
+    return depth > 0;
+}
+
+
+static bool device_matches(libusb_device *dev, int vid, int pid, const struct usb_port_path_s *path)
+{
+    if (path && path->depth)
+    {
+        // cheap (no descriptor read) so check first
+        struct usb_port_path_s dev_path;
+        if (!device_port_path(dev, &dev_path))
+            return false;
+        if (dev_path.bus != path->bus || dev_path.depth != path->depth ||
+            memcmp(dev_path.ports, path->ports, path->depth) != 0)
+            return false;
+    }
+
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) < 0)
+        return false;
+
+    return desc.idVendor == vid && desc.idProduct == pid;
+}
+
+
+static libusb_device_handle *open_vid_pid(int vid, int pid, const struct usb_port_path_s *path)
+{
+    libusb_device_handle *dev_handle = NULL;
+    int rc;
+
+    libusb_device *dev = cache_lookup(vid, pid);
+    if (dev && (!path || device_matches(dev, vid, pid, path)))
+    {
+        rc = libusb_open(dev, &dev_handle);
+        if (rc == 0)
+            return dev_handle;
+
+        // unplugged or re-enumerated since
+        cache_drop(dev);
+        dev_handle = NULL;
+    }
+
+    libusb_device **devs;
+    ssize_t ndev = libusb_get_device_list(usb_ctx, &devs);
+    if (ndev < 0)
+        return NULL;
+
+    int i;
+    for (i=0; i<ndev; i++)
+    {
+        if (!device_matches(devs[i], vid, pid, path))
+            continue;
+
+        rc = libusb_open(devs[i], &dev_handle);
+        if (rc == 0)
+        {
+            cache_store(vid, pid, devs[i]);
+            break;
+        }
+        dev_handle = NULL;
+    }
+
+    libusb_free_device_list(devs, 1);
+    return dev_handle;
+}
+
+
+int usb_find_devices(int vid, int pid, struct usb_port_path_s *paths, int max_paths)
+{
+    libusb_device **devs;
+    ssize_t ndev = libusb_get_device_list(usb_ctx, &devs);
+    if (ndev < 0)
+        return 0;
+
+    int n = 0;
+    int i;
+    for (i=0; i<ndev && n<max_paths; i++)
+    {
+        if (device_matches(devs[i], vid, pid, NULL) && device_port_path(devs[i], &paths[n]))
+            n++;
+    }
+
+    libusb_free_device_list(devs, 1);
+    return n;
+}
+
+
+void usb_port_path_str(const struct usb_port_path_s *path, char *str, int len)
+{
+    // bus-port.port.port (as in /sys/bus/usb/devices)
+    int n = snprintf(str, len, "%d-", path->bus);
+
+    int i;
+    for (i=0; i<path->depth && n < len; i++)
+        n += snprintf(str + n, len - n, i ? ".%d" : "%d", path->ports[i]);
+}
+
+
+bool usb_parse_port_path(const char *str, struct usb_port_path_s *path)
+{
+    memset(path, 0, sizeof(*path));
+
+    char *end;
+    unsigned long value = strtoul(str, &end, 10);
+    if (end == str || *end != '-' || value > 255)
+        return false;
+    path->bus = value;
+
+    do
+    {
+        str = end + 1;
+        value = strtoul(str, &end, 10);
+        if (end == str || value > 255 || path->depth >= USB_MAX_PORT_DEPTH)
+            return false;
+        path->ports[path->depth++] = value;
+    } while (*end == '.');
+
+    return *end == '\0';
+}
+
+
+bool usb_port_path(libusb_device_handle *dev_handle, struct usb_port_path_s *path)
+{
+    memset(path, 0, sizeof(*path));
+    if (!dev_handle)
+        return false;
+    return device_port_path(libusb_get_device(dev_handle), path);
+}
+
+
+struct usb_wait_s
+{
+    int vid;
+    int pid;
+    const struct usb_port_path_s *path;
+    libusb_device *found;   // referenced
+    int completed;
+};
+
+
+static int LIBUSB_CALL hotplug_arrived(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    // libusb event context: don't open or do I/O here, just note the device
+    struct usb_wait_s *wait = (struct usb_wait_s *)user_data;
+
+    if (wait->found || event != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        return 0;
+
+    if (device_matches(dev, wait->vid, wait->pid, wait->path))
+    {
+        wait->found = libusb_ref_device(dev);
+        wait->completed = 1;
+    }
+
+    return 0;
+}
+
+
+static void poll_device_list(struct usb_wait_s *wait)
+{
+    libusb_device **devs;
+    ssize_t ndev = libusb_get_device_list(usb_ctx, &devs);
+    if (ndev < 0)
+        return;
+
+    int i;
+    for (i=0; i<ndev && !wait->found; i++)
+    {
+        if (device_matches(devs[i], wait->vid, wait->pid, wait->path))
+            wait->found = libusb_ref_device(devs[i]);
+    }
+
+    libusb_free_device_list(devs, 1);
+}
+
+
+bool wait_for_device(int vid, int pid, const struct usb_port_path_s *path, int timeout_ms)
+{
+    // Must not race another thread handling libusb events (the async transfer thread isn't
+    // running while a programmer is being configured).
+
+    struct usb_wait_s wait = { vid, pid, path, NULL, 0 };
+    uint64_t deadline = usbtrace_now_ns() + (uint64_t)timeout_ms * 1000000;
+
+    libusb_hotplug_callback_handle handle;
+    int rc = LIBUSB_ERROR_NOT_SUPPORTED;
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        // ENUMERATE: also called (from inside register) for a device that is already there
+        rc = libusb_hotplug_register_callback(usb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+                vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_arrived, &wait, &handle);
+        if (rc < 0)
+            fprintf(stderr, "libusb: hotplug register failed: %d %s - polling\n", rc, libusb_strerror((enum libusb_error)rc));
+    }
+
+    while (!wait.found && !usb_deadline_passed())
+    {
+        uint64_t now = usbtrace_now_ns();
+        if (now >= deadline)
+            break;
+
+        if (rc == 0)
+        {
+            uint64_t remaining_us = (deadline - now) / 1000;
+            if (remaining_us > 100000)
+                remaining_us = 100000; // recheck the job deadline now and then
+            struct timeval tv;
+            tv.tv_sec = remaining_us / 1000000;
+            tv.tv_usec = remaining_us % 1000000;
+            libusb_handle_events_timeout_completed(usb_ctx, &tv, &wait.completed);
+        }
+        else
+        {
+            poll_device_list(&wait);
+            if (!wait.found)
+                usleep(USB_WAIT_POLL_MS * 1000);
+        }
+    }
+
+    if (rc == 0)
+        libusb_hotplug_deregister_callback(usb_ctx, handle);
+
+    if (!wait.found)
+        return false;
+
+    cache_store(vid, pid, wait.found);
+    libusb_unref_device(wait.found);
+    return true;
+}
+
+
 libusb_device_handle *open_device(int vid, int pid, int config, int interface, int alternate)
+{
+    return open_device_path(NULL, vid, pid, config, interface, alternate);
+}
+
+
+libusb_device_handle *open_device_path(const struct usb_port_path_s *path, int vid, int pid, int config, int interface, int alternate)
 {
     fprintf(stderr,"Config:%d, Interface:%d, Alternate:%d\n", config, interface, alternate);
 
@@ -63,8 +428,7 @@ libusb_device_handle *open_device(int vid, int pid, int config, int interface, i
 
     libusb_device_handle *dev_handle;
 
-    // not supposed to use this conv. func:
-    dev_handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+    dev_handle = open_vid_pid(vid, pid, path);
     if (dev_handle == NULL)
     {
         fprintf(stderr,"libusb: open device failed\n"); // , rc, libusb_strerror(rc));
@@ -196,9 +560,21 @@ int control_transfer_out(libusb_device_handle *dev_handle, uint8_t bmRequestType
         uint16_t wValue, uint16_t wIndex, const uint8_t *data, int len)
 {
 
-    uint32_t timeout = 0;
+    if (usb_deadline_passed())
+    {
+        fprintf(stderr, "control transfer: job deadline passed\n");
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    uint32_t timeout = usb_timeout_ms(USB_TIMEOUT_CONTROL);
+    uint64_t t_start = usbtrace_now_ns();
 
     int len_xfer = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, (unsigned char *)data, len, timeout);
+    uint64_t elapsed = usbtrace_now_ns() - t_start;
+    latency_record(LATENCY_CONTROL, elapsed);
+    if (len_xfer >= 0) usb_timeout_sample(USB_TIMEOUT_CONTROL, elapsed);
+    if (len_xfer == LIBUSB_ERROR_TIMEOUT) usb_timeout_expired(USB_TIMEOUT_CONTROL);
+    usbtrace_control(bmRequestType, bRequest, wValue, wIndex, t_start, len_xfer < 0 ? len_xfer : 0, len, data, len_xfer);
 
     if (len_xfer < 0)
     {
@@ -212,16 +588,29 @@ int control_transfer_out(libusb_device_handle *dev_handle, uint8_t bmRequestType
 
 int control_transfer(libusb_device_handle *dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *reply_data, uint16_t *reply_length, uint16_t max_length)
 {
-    uint32_t timeout = 0;
+    uint32_t timeout;
 //    unsigned char send_data[1];
     int len;
 
+    if (usb_deadline_passed())
+    {
+        fprintf(stderr, "control transfer: job deadline passed\n");
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    timeout = usb_timeout_ms(USB_TIMEOUT_CONTROL);
+
 //    send_data[0] = 0;
 
     // DEBUG:
     memset(reply_data, 0, max_length);
 
+    uint64_t t_start = usbtrace_now_ns();
     len = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, reply_data, max_length, timeout);
+    uint64_t elapsed = usbtrace_now_ns() - t_start;
+    latency_record(LATENCY_CONTROL, elapsed);
+    if (len >= 0) usb_timeout_sample(USB_TIMEOUT_CONTROL, elapsed);
+    if (len == LIBUSB_ERROR_TIMEOUT) usb_timeout_expired(USB_TIMEOUT_CONTROL);
+    usbtrace_control(bmRequestType, bRequest, wValue, wIndex, t_start, len < 0 ? len : 0, max_length, reply_data, len);
     if (len < 0)
     {
         fprintf(stderr, "Failed transfer control data: %d %s\n", len, libusb_strerror((enum libusb_error)len));
@@ -246,9 +635,17 @@ int bulk_data_transfer(libusb_device_handle *dev_handle, uint8_t epaddr, uint8_t
 {
     // OUT: send *length data
     // IN:  *length > 0: expect *length bytes.  *length==0: take what we're given
-    int timeout_ms = 100;
+    int timeout_ms;
     int actual = 0;
     int rc;
+
+    if (usb_deadline_passed())
+    {
+        fprintf(stderr, "EP 0x%02x: job deadline passed\n", epaddr);
+        *length = 0;
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    timeout_ms = usb_timeout_ms(USB_TIMEOUT_BULK);
 //    uint8_t dir;
 
 //    dir = LIBUSB_ENDPOINT_OUT;
@@ -256,7 +653,15 @@ int bulk_data_transfer(libusb_device_handle *dev_handle, uint8_t epaddr, uint8_t
 //    if (dir == LIBUSB_ENDPOINT_IN)
 //        epaddr |= 0x80;
 
+    uint64_t t_start = usbtrace_now_ns();
     rc = libusb_bulk_transfer(dev_handle, epaddr, data, *length, &actual, timeout_ms);
+    uint64_t elapsed = usbtrace_now_ns() - t_start;
+    latency_record((epaddr & 0x80) ? LATENCY_BULK_IN : LATENCY_BULK_OUT, elapsed);
+
+    // IN is the round trip (the FX2 replies once it has run the request). OUT just queues
+    if ((epaddr & 0x80) && rc == 0) usb_timeout_sample(USB_TIMEOUT_BULK, elapsed);
+    if (rc == LIBUSB_ERROR_TIMEOUT) usb_timeout_expired(USB_TIMEOUT_BULK);
+    usbtrace_bulk(epaddr, t_start, rc, *length, data, actual);
 
     if (usb_debug & DEBUG_BULK)
     {
@@ -317,10 +722,15 @@ int recv_bulk_data(libusb_device_handle *dev_handle, uint8_t epaddr, uint8_t *da
 
 int clear_endpoint_stall(libusb_device_handle *dev_handle, uint8_t epaddr)
 {
-    uint32_t timeout = 0;
+    // no deadline check: clearing a stall is part of recovering/shutting down
+    uint32_t timeout = usb_timeout_ms(USB_TIMEOUT_CONTROL);
+    uint64_t t_start = usbtrace_now_ns();
 
     int len = libusb_control_transfer(dev_handle, LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT,
                 LIBUSB_REQUEST_CLEAR_FEATURE, 0 /* ENDPOINT_HALT wValue */, epaddr /* wIndex */, NULL /* reply_data */, 0, timeout);
+    latency_record(LATENCY_CONTROL, usbtrace_now_ns() - t_start);
+    usbtrace_control(LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT, LIBUSB_REQUEST_CLEAR_FEATURE, 0, epaddr,
+                     t_start, len < 0 ? len : 0, 0, NULL, 0);
     if (len < 0)
     {
         fprintf(stderr, "Failed transfer control data: %d %s\n", len, libusb_strerror((enum libusb_error)len));
@@ -390,7 +800,7 @@ void list_matching_devices(int vid, int pid)
 
     libusb_device **devs, *dev;
 
-    int ndev = libusb_get_device_list(NULL, &devs);
+    int ndev = libusb_get_device_list(usb_ctx, &devs);
 
     int i = 0;
     while ((dev = devs[i++]) != NULL)
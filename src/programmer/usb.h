@@ -24,16 +24,43 @@
 
 #include <libusb-1.0/libusb.h>
 
+// Physical location of a device: bus and hub port chain (USB 3.0 allows up to 7 tiers).
+// Survives re-enumeration (FX2 renumeration after a firmware load) unlike the device address.
+#define USB_MAX_PORT_DEPTH  7
+
+struct usb_port_path_s
+{
+    uint8_t bus;
+    uint8_t depth;  // 0: unknown
+    uint8_t ports[USB_MAX_PORT_DEPTH];
+};
+
+#define USB_WAIT_POLL_MS    10  // device list poll interval where hotplug is unavailable
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 bool usb_init(void);
 void usb_finalise(void);
+// Private libusb context for the calling thread (one per programmer in gang mode)
+bool usb_init_thread(void);
+void usb_finalise_thread(void);
+libusb_context *usb_context(void);
 
 libusb_device_handle *open_device(int vid, int pid, int config, int interface, int alternate);
+// path NULL: first vid.pid found
+libusb_device_handle *open_device_path(const struct usb_port_path_s *path, int vid, int pid, int config, int interface, int alternate);
 void close_device(libusb_device_handle *dev_handle, int interface);
 
+bool usb_port_path(libusb_device_handle *dev_handle, struct usb_port_path_s *path);
+int usb_find_devices(int vid, int pid, struct usb_port_path_s *paths, int max_paths); // returns number found
+void usb_port_path_str(const struct usb_port_path_s *path, char *str, int len);
+bool usb_parse_port_path(const char *str, struct usb_port_path_s *path);
+// Wait for vid.pid to (re)appear, optionally at a given port path. Uses hotplug events where
+// libusb supports them, else polls the device list. Found device is cached for open_device().
+bool wait_for_device(int vid, int pid, const struct usb_port_path_s *path, int timeout_ms);
+
 int control_transfer(libusb_device_handle *dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t *reply_length, uint16_t max_length);
 int control_transfer_out_hex(libusb_device_handle *dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const char *hex_str);
 int control_transfer_out(libusb_device_handle *dev_handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, int len);
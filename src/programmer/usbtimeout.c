@@ -0,0 +1,139 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "usbtimeout.h"
+#include "usbtrace.h"
+
+
+struct rtt_estimate_s
+{
+    uint64_t srtt_ns;
+    uint64_t rttvar_ns;
+    int nsamples;
+    unsigned int backoff_ms;    // non zero after a timeout
+    unsigned int initial_ms;
+    unsigned int min_ms;
+    unsigned int max_ms;
+};
+
+static __thread struct rtt_estimate_s estimates[USB_TIMEOUT_NUM_CLASSES] = {
+    { 0, 0, 0, 0, USB_TIMEOUT_BULK_INITIAL_MS, USB_TIMEOUT_BULK_MIN_MS, USB_TIMEOUT_BULK_MAX_MS },
+    { 0, 0, 0, 0, USB_TIMEOUT_CONTROL_INITIAL_MS, USB_TIMEOUT_CONTROL_MIN_MS, USB_TIMEOUT_CONTROL_MAX_MS },
+};
+
+static __thread uint64_t deadline_ns = 0;   // 0: none
+
+
+static uint64_t policy_ms(const struct rtt_estimate_s *est)
+{
+    // timeout before the deadline is applied
+    uint64_t ms;
+
+    if (est->backoff_ms)
+        ms = est->backoff_ms;
+    else if (est->nsamples == 0)
+        ms = est->initial_ms;
+    else
+        ms = (USB_TIMEOUT_MARGIN * (est->srtt_ns + 4 * est->rttvar_ns) + 999999) / 1000000;
+
+    if (ms < est->min_ms) ms = est->min_ms;
+    if (ms > est->max_ms) ms = est->max_ms;
+
+    return ms;
+}
+
+
+unsigned int usb_timeout_ms(int cls)
+{
+    uint64_t ms = policy_ms(&estimates[cls]);
+
+    if (deadline_ns)
+    {
+        uint64_t now = usbtrace_now_ns();
+        uint64_t remaining_ms = now < deadline_ns ? (deadline_ns - now) / 1000000 : 0;
+        if (ms > remaining_ms) ms = remaining_ms;
+    }
+
+    return ms > 0 ? ms : 1; // 0 would mean wait forever
+}
+
+
+void usb_timeout_sample(int cls, uint64_t rtt_ns)
+{
+    struct rtt_estimate_s *est = &estimates[cls];
+
+    // Jacobson/Karels: gains 1/8 (srtt) and 1/4 (rttvar)
+    if (est->nsamples == 0)
+    {
+        est->srtt_ns = rtt_ns;
+        est->rttvar_ns = rtt_ns / 2;
+    }
+    else
+    {
+        int64_t err = (int64_t)rtt_ns - (int64_t)est->srtt_ns;
+        uint64_t abs_err = err < 0 ? -err : err;
+        est->rttvar_ns = est->rttvar_ns + ((int64_t)abs_err - (int64_t)est->rttvar_ns) / 4;
+        est->srtt_ns = est->srtt_ns + err / 8;
+    }
+
+    est->nsamples++;
+    est->backoff_ms = 0;
+}
+
+
+void usb_timeout_expired(int cls)
+{
+    struct rtt_estimate_s *est = &estimates[cls];
+
+    uint64_t ms = 2 * policy_ms(est);
+    est->backoff_ms = ms < est->max_ms ? ms : est->max_ms;
+}
+
+
+void usb_timeout_set_limits(int cls, unsigned int min_ms, unsigned int max_ms)
+{
+    struct rtt_estimate_s *est = &estimates[cls];
+
+    if (min_ms < 1) min_ms = 1;
+    if (max_ms < min_ms) max_ms = min_ms;
+
+    est->min_ms = min_ms;
+    est->max_ms = max_ms;
+}
+
+
+void usb_deadline_set(uint64_t timeout_ms)
+{
+    deadline_ns = timeout_ms ? usbtrace_now_ns() + timeout_ms * 1000000 : 0;
+}
+
+
+void usb_deadline_clear(void)
+{
+    deadline_ns = 0;
+}
+
+
+bool usb_deadline_passed(void)
+{
+    return deadline_ns && usbtrace_now_ns() >= deadline_ns;
+}
@@ -0,0 +1,73 @@
+#ifndef _USBTIMEOUT_H
+#define _USBTIMEOUT_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Transfer timeout policy.
+//
+// Round trip time is estimated online per transfer class (TCP style smoothed RTT and mean
+// deviation) and each transfer gets  margin * (srtt + 4 * rttvar)  clamped to [min, max].
+// A timeout doubles the next one (up to max) until a good sample comes in.
+//
+// A job deadline (absolute, CLOCK_MONOTONIC) caps every timeout at the time remaining.
+// Once it has passed transfers fail straight away with LIBUSB_ERROR_TIMEOUT so a wedged
+// programmer or faulty board is rejected in bounded time. Never returns 0 (libusb: forever).
+//
+// Estimates and the deadline belong to the calling thread (one programmer per thread).
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum usb_timeout_class_e
+{
+    USB_TIMEOUT_BULK = 0,       // one bulk transfer, or the reply to one exchange
+    USB_TIMEOUT_CONTROL,
+    USB_TIMEOUT_NUM_CLASSES
+};
+
+#define USB_TIMEOUT_MARGIN              4
+
+// used until the first sample
+#define USB_TIMEOUT_BULK_INITIAL_MS     100
+#define USB_TIMEOUT_CONTROL_INITIAL_MS  1000
+
+#define USB_TIMEOUT_BULK_MIN_MS         25
+#define USB_TIMEOUT_BULK_MAX_MS         1000
+#define USB_TIMEOUT_CONTROL_MIN_MS      100
+#define USB_TIMEOUT_CONTROL_MAX_MS      5000
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned int usb_timeout_ms(int cls);
+void usb_timeout_sample(int cls, uint64_t rtt_ns);     // successful transfer took rtt_ns
+void usb_timeout_expired(int cls);                      // a transfer timed out
+void usb_timeout_set_limits(int cls, unsigned int min_ms, unsigned int max_ms);
+
+void usb_deadline_set(uint64_t timeout_ms);             // from now. 0 = no deadline
+void usb_deadline_clear(void);
+bool usb_deadline_passed(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbtrace.h"
+#include "utils.h"
+
+
+static __thread FILE *trace_fp = NULL;
+
+
+uint64_t usbtrace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void uint64_to_b8_LE(uint64_t data, uint8_t *b)
+{
+    uint32_to_b4_LE(data & 0xffffffff, b);
+    uint32_to_b4_LE(data >> 32, b + 4);
+}
+
+
+static uint64_t b8_LE_to_uint64(const uint8_t *b)
+{
+    return ((uint64_t)b4_LE_to_uint32(b + 4) << 32) | b4_LE_to_uint32(b);
+}
+
+
+bool usbtrace_open(const char *filepath, const char *source)
+{
+    uint8_t header[USBTRACE_HEADER_LEN];
+
+    usbtrace_close();
+
+    trace_fp = fopen(filepath, "wb");
+    if (!trace_fp)
+    {
+        fprintf(stderr, "Failed to open trace file: %s\n", filepath);
+        return false;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, USBTRACE_MAGIC, 8);
+    uint32_to_b4_LE(USBTRACE_VERSION, header + 8);
+    strncpy((char *)header + 12, source, USBTRACE_SOURCE_LEN - 1);
+
+    fwrite(header, 1, sizeof(header), trace_fp);
+    return true;
+}
+
+
+void usbtrace_close(void)
+{
+    if (trace_fp)
+        fclose(trace_fp);
+    trace_fp = NULL;
+}
+
+
+bool usbtrace_enabled(void)
+{
+    return trace_fp != NULL;
+}
+
+
+void usbtrace_record(const struct usbtrace_rec_s *rec, const uint8_t *out_data, const uint8_t *in_data)
+{
+    uint8_t b[USBTRACE_RECORD_LEN];
+
+    if (!trace_fp)
+        return;
+
+    b[0] = rec->type;
+    b[1] = rec->ep;
+    uint16_to_b2_LE(rec->aux, b + 2);
+    uint16_to_b2_LE(rec->wValue, b + 4);
+    uint16_to_b2_LE(rec->wIndex, b + 6);
+    uint32_to_b4_LE((uint32_t)rec->rc, b + 8);
+    uint32_to_b4_LE(rec->req_len, b + 12);
+    uint32_to_b4_LE(rec->out_len, b + 16);
+    uint32_to_b4_LE(rec->in_len, b + 20);
+    uint64_to_b8_LE(rec->t_start_ns, b + 24);
+    uint64_to_b8_LE(rec->t_end_ns, b + 32);
+
+    fwrite(b, 1, sizeof(b), trace_fp);
+    if (rec->out_len) fwrite(out_data, 1, rec->out_len, trace_fp);
+    if (rec->in_len) fwrite(in_data, 1, rec->in_len, trace_fp);
+}
+
+
+void usbtrace_mark(uint64_t t_ns, const char *label)
+{
+    struct usbtrace_rec_s rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = USBTRACE_MARK;
+    rec.out_len = strlen(label);
+    rec.t_start_ns = t_ns;
+    rec.t_end_ns = t_ns;
+
+    usbtrace_record(&rec, (const uint8_t *)label, NULL);
+}
+
+
+void usbtrace_bulk(uint8_t epaddr, uint64_t t_start_ns, int rc, int req_len, const uint8_t *data, int actual_len)
+{
+    struct usbtrace_rec_s rec;
+    bool is_in = epaddr & 0x80;
+
+    if (!trace_fp)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = is_in ? USBTRACE_BULK_IN : USBTRACE_BULK_OUT;
+    rec.ep = epaddr;
+    rec.rc = rc;
+    rec.req_len = req_len;
+    rec.t_start_ns = t_start_ns;
+    rec.t_end_ns = usbtrace_now_ns();
+
+    // OUT: what we asked to send (so a replay sends the same), IN: what actually came back
+    if (is_in)
+        rec.in_len = actual_len > 0 ? actual_len : 0;
+    else
+        rec.out_len = req_len;
+
+    usbtrace_record(&rec, data, data);
+}
+
+
+void usbtrace_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                      uint64_t t_start_ns, int rc, int req_len, const uint8_t *data, int actual_len)
+{
+    struct usbtrace_rec_s rec;
+    bool is_in = bmRequestType & 0x80;
+
+    if (!trace_fp)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = is_in ? USBTRACE_CTRL_IN : USBTRACE_CTRL_OUT;
+    rec.ep = bmRequestType;
+    rec.aux = bRequest;
+    rec.wValue = wValue;
+    rec.wIndex = wIndex;
+    rec.rc = rc;
+    rec.req_len = req_len;
+    rec.t_start_ns = t_start_ns;
+    rec.t_end_ns = usbtrace_now_ns();
+
+    if (is_in)
+        rec.in_len = actual_len > 0 ? actual_len : 0;
+    else
+        rec.out_len = req_len;
+
+    usbtrace_record(&rec, data, data);
+}
+
+
+bool usbtrace_read_header(FILE *fp, char *source)
+{
+    uint8_t header[USBTRACE_HEADER_LEN];
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+        return false;
+
+    if (memcmp(header, USBTRACE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "Not a trace file (bad magic)\n");
+        return false;
+    }
+
+    if (b4_LE_to_uint32(header + 8) != USBTRACE_VERSION)
+    {
+        fprintf(stderr, "Unsupported trace file version %u\n", b4_LE_to_uint32(header + 8));
+        return false;
+    }
+
+    if (source)
+    {
+        memcpy(source, header + 12, USBTRACE_SOURCE_LEN);
+        source[USBTRACE_SOURCE_LEN - 1] = '\0';
+    }
+
+    return true;
+}
+
+
+int usbtrace_read_record(FILE *fp, struct usbtrace_rec_s *rec, uint8_t *out_data, uint8_t *in_data)
+{
+    uint8_t b[USBTRACE_RECORD_LEN];
+
+    int n = fread(b, 1, sizeof(b), fp);
+    if (n == 0)
+        return 0;
+    if (n != sizeof(b))
+        return -1;
+
+    rec->type = b[0];
+    rec->ep = b[1];
+    rec->aux = b[2] | (b[3] << 8);
+    rec->wValue = b[4] | (b[5] << 8);
+    rec->wIndex = b[6] | (b[7] << 8);
+    rec->rc = (int32_t)b4_LE_to_uint32(b + 8);
+    rec->req_len = b4_LE_to_uint32(b + 12);
+    rec->out_len = b4_LE_to_uint32(b + 16);
+    rec->in_len = b4_LE_to_uint32(b + 20);
+    rec->t_start_ns = b8_LE_to_uint64(b + 24);
+    rec->t_end_ns = b8_LE_to_uint64(b + 32);
+
+    if (rec->out_len > USBTRACE_MAX_PAYLOAD || rec->in_len > USBTRACE_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "Corrupt trace record (payload %u/%u bytes)\n", rec->out_len, rec->in_len);
+        return -1;
+    }
+
+    if (rec->out_len && fread(out_data, 1, rec->out_len, fp) != rec->out_len)
+        return -1;
+    if (rec->in_len && fread(in_data, 1, rec->in_len, fp) != rec->in_len)
+        return -1;
+
+    return 1;
+}
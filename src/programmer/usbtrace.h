@@ -0,0 +1,95 @@
+#ifndef _USBTRACE_H
+#define _USBTRACE_H
+
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// USB transaction trace: every transfer the programmer makes (direction, endpoint,
+// payload, result, start/end time) written to a compact binary file.
+//
+// File:   header (USBTRACE_HEADER_LEN bytes), then records.
+//  header: "PSOCTRC1", u32 version, char source[16] (transport name, eg "usb" "sim")
+//  record: u8 type, u8 ep (or bmRequestType), u16 aux, u16 wValue, u16 wIndex,
+//          i32 rc, u32 req_len, u32 out_len, u32 in_len, u64 t_start_ns, u64 t_end_ns,
+//          then out_len bytes of OUT data and in_len bytes of IN data.
+// All fields little endian. Times are CLOCK_MONOTONIC (or the simulator's virtual clock).
+// The open trace file belongs to the calling thread (gang mode: one file per programmer).
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define USBTRACE_MAGIC          "PSOCTRC1"
+#define USBTRACE_VERSION        1
+#define USBTRACE_SOURCE_LEN     16
+#define USBTRACE_HEADER_LEN     (8 + 4 + USBTRACE_SOURCE_LEN)
+#define USBTRACE_RECORD_LEN     40
+#define USBTRACE_MAX_PAYLOAD    65536
+
+// record types
+#define USBTRACE_BULK_OUT       1
+#define USBTRACE_BULK_IN        2
+#define USBTRACE_CTRL_OUT       3   // ep = bmRequestType, aux = bRequest
+#define USBTRACE_CTRL_IN        4   // ep = bmRequestType, aux = bRequest
+#define USBTRACE_EXCHANGE       5   // async OUT + IN pair, ep = OUT ep, aux = exchanges in flight (incl this one)
+#define USBTRACE_MARK           6   // phase marker, OUT data = label
+
+
+struct usbtrace_rec_s
+{
+    uint8_t type;
+    uint8_t ep;
+    uint16_t aux;
+    uint16_t wValue;
+    uint16_t wIndex;
+    int32_t rc;
+    uint32_t req_len;   // OUT: length sent, IN: max length asked for
+    uint32_t out_len;   // payload bytes recorded
+    uint32_t in_len;
+    uint64_t t_start_ns;
+    uint64_t t_end_ns;
+};
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t usbtrace_now_ns(void);
+
+// writing (one trace at a time, not thread safe - record from the thread doing the transfers)
+bool usbtrace_open(const char *filepath, const char *source);
+void usbtrace_close(void);
+bool usbtrace_enabled(void);
+void usbtrace_record(const struct usbtrace_rec_s *rec, const uint8_t *out_data, const uint8_t *in_data);
+void usbtrace_mark(uint64_t t_ns, const char *label);
+
+// convenience for the blocking transfers in usb.c
+void usbtrace_bulk(uint8_t epaddr, uint64_t t_start_ns, int rc, int req_len, const uint8_t *data, int actual_len);
+void usbtrace_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                      uint64_t t_start_ns, int rc, int req_len, const uint8_t *data, int actual_len);
+
+// reading. Payload buffers must be USBTRACE_MAX_PAYLOAD bytes. Returns 1 record read, 0 EOF, -1 error
+bool usbtrace_read_header(FILE *fp, char *source);
+int usbtrace_read_record(FILE *fp, struct usbtrace_rec_s *rec, uint8_t *out_data, uint8_t *in_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
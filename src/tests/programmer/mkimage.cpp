@@ -0,0 +1,152 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Writes a PSoC5LP hex image for the simulator tests (sim_tests.sh): nrows flash rows of a
+// fixed pattern, config bytes too unless ECC is enabled, and the listed rows changed in one
+// byte so a second image differs from the first in just those rows. Rows can also have two
+// bytes swapped: different data, same checksum.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "AppData.h"
+#include "HexFileFormat.h"
+
+
+#define CODE_BYTES_PER_ROW      256     // PSOC5LP-xxx in devices.dat
+#define CONFIG_BYTES_PER_ROW    32
+#define CHANGED_BYTE            103     // in each changed row, swapped with the next one
+
+#define DEVICE_ID               0x2BA01477  // simulator default jtag id
+#define DEVCONFIG_ECCEN         (1 << 27)
+
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-e] [-c row[,row..]] [-s row[,row..]] nrows filename\n", progname);
+    fprintf(stderr, "  -e   ECC enabled (device config ECCEN set, no config bytes)\n");
+    fprintf(stderr, "  -c   change these rows\n");
+    fprintf(stderr, "  -s   swap two bytes in these rows\n");
+    exit(1);
+}
+
+
+static void parse_rows(char *arg, std::vector<int> &rows)
+{
+    char *p = arg;
+    while (*p)
+    {
+        rows.push_back(strtol(p, &p, 0));
+        if (*p == ',') p++;
+    }
+}
+
+
+static bool rows_ok(const std::vector<int> &rows, int nrows)
+{
+    int i;
+    for (i=0; i<(int)rows.size(); i++)
+    {
+        if (rows[i] < 0 || rows[i] >= nrows)
+        {
+            fprintf(stderr, "Row %d isn't in the image\n", rows[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int main(int argc, char **argv)
+{
+    bool ecc = false;
+    std::vector<int> changed;
+    std::vector<int> swapped;
+    int c;
+
+    while ((c = getopt(argc, argv, "ec:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'e':
+                ecc = true;
+                break;
+
+            case 'c':
+                parse_rows(optarg, changed);
+                break;
+
+            case 's':
+                parse_rows(optarg, swapped);
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    int nrows = atoi(argv[optind]);
+    const char *filename = argv[optind + 1];
+
+    v_uint8_t code(nrows * CODE_BYTES_PER_ROW);
+    v_uint8_t config(nrows * CONFIG_BYTES_PER_ROW);
+    int row, i;
+
+    for (row = 0; row < nrows; row++)
+    {
+        for (i=0; i<CODE_BYTES_PER_ROW; i++)
+            code[row * CODE_BYTES_PER_ROW + i] = (row * 31 + i * 7 + 3) & 0xFF;
+        for (i=0; i<CONFIG_BYTES_PER_ROW; i++)
+            config[row * CONFIG_BYTES_PER_ROW + i] = (row * 13 + i * 5 + 1) & 0xFF;
+    }
+
+    if (!rows_ok(changed, nrows) || !rows_ok(swapped, nrows))
+        exit(1);
+
+    for (i=0; i<(int)changed.size(); i++)
+        code[changed[i] * CODE_BYTES_PER_ROW + CHANGED_BYTE] ^= 0x5A;
+
+    for (i=0; i<(int)swapped.size(); i++)
+    {
+        uint8_t *p = &code[swapped[i] * CODE_BYTES_PER_ROW + CHANGED_BYTE];
+        uint8_t tmp = p[0];
+        p[0] = p[1];
+        p[1] = tmp;
+    }
+
+    AppData appdata;
+    appdata.code = new HexData(HexFileFormat::FLASH_CODE_ADDRESS, code);
+    if (!ecc)
+        appdata.config = new HexData(HexFileFormat::CONFIG_ADDRESS, config);
+    appdata.device_config = ecc ? DEVCONFIG_ECCEN : 0;
+    appdata.device_id = DEVICE_ID;
+    appdata.checksum = appdata.calc_checksum(true);
+
+    if (!appdata.write_hex_file(filename))
+        exit(1);
+
+    return 0;
+}
@@ -0,0 +1,307 @@
+#!/bin/sh
+#
+# Flash programming through prog against the simulated programmer (-t sim).
+# Usage: sim_tests.sh path/to/prog
+#
+# Each test starts from a blank simulated device in ./work (config dir work/config, sim state
+# work/psoc_sim.dat). Images come from mkimage. prog's messages (stderr) are checked for what
+# it did: rows written, rows read back, the verify result. KEEP=1 leaves ./work afterwards.
+
+PROG=${1:-../../programmer/prog}
+PROGD=`dirname $PROG`/progd
+MKIMAGE=`pwd`/mkimage
+DEVICES=../../../config/devices.dat
+DEVICE=PSOC5LP-xxx
+WORK=work
+
+case $PROG in
+    /*) ;;
+    *) PROG=`pwd`/$PROG; PROGD=`pwd`/$PROGD ;;
+esac
+
+nfailed=0
+testnum=0
+
+
+# setup [key=value ..] - blank device, config.ini with these [Programmer]/[Simulator] settings
+setup()
+{
+    rm -rf $WORK
+    mkdir -p $WORK/config
+    cp $DEVICES $WORK/config/
+
+    flash_write_retries=3
+    stall_at_exchange=0
+    device_config=0x00000000
+    gang_size=1
+    for setting in "$@"; do
+        eval $setting
+    done
+
+    cat > $WORK/config/config.ini <<EOF
+[Programmer]
+transport = sim
+flash_loader = 0
+flash_journal = 1
+flash_write_retries = $flash_write_retries
+
+[Simulator]
+state_file = psoc_sim.dat
+device_config = $device_config
+stall_at_exchange = $stall_at_exchange
+gang_size = $gang_size
+EOF
+}
+
+
+# set key value - change one setting in config.ini between runs
+set_config()
+{
+    sed -e "s/^$1 = .*/$1 = $2/" $WORK/config/config.ini > $WORK/config/config.ini.new
+    mv $WORK/config/config.ini.new $WORK/config/config.ini
+}
+
+
+# prog args.. - output in $WORK/out, exit status in $rc
+prog()
+{
+    (cd $WORK && $PROG -C config -d $DEVICE --quiet "$@") > $WORK/out 2>&1
+    rc=$?
+}
+
+
+# image [mkimage args..] nrows name - image in $WORK
+image()
+{
+    (cd $WORK && $MKIMAGE "$@")
+}
+
+
+# check description test-expression - test the last prog run
+check()
+{
+    testnum=`expr $testnum + 1`
+    desc=$1
+    shift
+    if "$@"; then
+        echo "Test $testnum: $desc: Passed" >&2
+    else
+        echo "Test $testnum: $desc: Failed" >&2
+        sed -e 's/^/    /' $WORK/out >&2
+        nfailed=`expr $nfailed + 1`
+    fi
+}
+
+said()
+{
+    grep -q -e "$1" $WORK/out
+}
+
+ok()
+{
+    [ $rc -eq 0 ]
+}
+
+journal()
+{
+    [ -f $WORK/config/$DEVICE.sim.journal ]
+}
+
+
+# ---- journal: a write stopped by a USB stall resumes
+# (exchange 1300 is part way through writing the rows, simulated time being deterministic)
+
+setup stall_at_exchange=1300 flash_write_retries=0
+image 40 a.hex
+prog program a.hex
+check "write stopped by a stall keeps its journal" eval '! ok && said "failed after 19 of 40 rows" && journal'
+
+set_config stall_at_exchange 0
+prog program a.hex
+check "rerun resumes from the journal" eval 'ok && said "journal has 19 of 40 rows" && said "21 rows to program" && ! journal'
+
+prog verify --strict a.hex
+check "resumed image verifies" eval 'ok && said "Verify: OK"'
+
+# a differential write doesn't need the journal, and leaves none behind
+setup stall_at_exchange=1300 flash_write_retries=0
+image 40 a.hex
+prog program a.hex
+set_config stall_at_exchange 0
+prog -i program a.hex
+check "differential rerun removes the journal" eval 'ok && said "20 of 40 rows differ" && ! journal'
+
+setup stall_at_exchange=1300
+image 40 a.hex
+prog program a.hex
+check "stall recovered in the same run" eval 'ok && said "failed after 19 of 40 rows - recovering" && ! journal'
+
+prog verify --strict a.hex
+check "recovered image verifies" eval 'ok && said "Verify: OK"'
+
+
+
+# ---- differential write (prog -i): only rows whose checksum differs are written
+
+setup
+image 40 a.hex
+image -c 0,39 40 b.hex
+prog program a.hex
+prog -i program a.hex
+check "differential write, no rows changed" eval 'ok && said "0 of 40 rows differ" && ! said "rows to program"'
+
+prog -i program b.hex
+check "differential write, first and last rows changed" eval 'ok && said "2 of 40 rows differ" && said "plan, 2 rows to program"'
+
+prog verify --strict b.hex
+check "differentially written image verifies" eval 'ok && said "Verify: OK"'
+
+# more than one flash array (256 rows each): rows either side of the boundary and in both arrays
+setup
+image 300 a.hex
+image -c 7,255,256,299 300 b.hex
+prog program a.hex
+prog -i program b.hex
+check "differential write across arrays" eval 'ok && said "4 of 300 rows differ" && said "plan, 4 rows to program"'
+
+prog verify --strict b.hex
+check "image written across arrays verifies" eval 'ok && said "Verify: OK"'
+
+# with ECC the device checksums include ECC bytes the image hasn't got: everything is written
+setup device_config=0x08000000
+image -e 40 a.hex
+image -e -c 5,17,33 40 b.hex
+prog program a.hex
+prog -i program b.hex
+check "differential write with ECC writes all rows" eval 'ok && said "ECC enabled" && ! said "rows differ" && said "plan, 40 rows to program"'
+
+prog verify --strict b.hex
+check "ECC image verifies" eval 'ok && said "Verify: OK"'
+
+
+
+# ---- verify: rows are compared by checksum, bisected to the rows that differ, only those read back
+
+setup
+image 40 a.hex
+image -c 0,16,17,39 40 b.hex
+prog program a.hex
+prog verify a.hex
+check "verify, no rows differ" eval 'ok && said "0 read back (checksum differs), 0 differ" && said "Verify: OK"'
+
+# first and last rows, and two neighbours: bisection has to split between them
+prog verify --all b.hex
+check "verify, first, last and neighbouring rows differ" eval '! ok && said "4 read back (checksum differs), 4 differ" &&
+    said "array 0 row 0 code byte 103" && said "array 0 row 16 code byte 103" && said "array 0 row 17 code byte 103" &&
+    said "array 0 row 39 code byte 103" && said "Mismatch: Code"'
+
+prog verify b.hex
+check "verify stops at the first row that differs" eval '! ok && said "1 differ (stopped at the first)" && said "array 0 row 0 code byte 103"'
+
+# neighbouring rows in different arrays (each array's checksums are read separately)
+setup
+image 300 a.hex
+image -c 255,256 300 b.hex
+prog program a.hex
+prog verify --all b.hex
+check "verify, rows either side of an array boundary differ" eval '! ok && said "2 read back (checksum differs), 2 differ" &&
+    said "array 0 row 255 code byte 103" && said "array 1 row 0 code byte 103"'
+
+# with ECC checksums can't be compared: every row is read back
+setup device_config=0x08000000
+image -e 40 a.hex
+image -e -c 0,39 40 b.hex
+prog program a.hex
+prog verify a.hex
+check "verify with ECC reads back every row" eval 'ok && said "40 read back (all, ECC), 0 differ" && said "Verify: OK"'
+
+prog verify --all b.hex
+check "verify with ECC finds the rows that differ" eval '! ok && said "40 read back (all, ECC), 2 differ"'
+
+
+
+# ---- strict verify: every image row read back and compared, whatever the checksums say
+
+setup
+image 40 a.hex
+image -c 0,39 40 b.hex
+image -s 9 40 s.hex
+prog program a.hex
+prog verify --strict a.hex
+check "strict verify reads back every row" eval 'ok && said "40 read back (all), 0 differ" && said "Verify: OK"'
+
+prog verify --strict --all b.hex
+check "strict verify finds the first and last rows" eval '! ok && said "40 read back (all), 2 differ" &&
+    said "array 0 row 0 code byte 103" && said "array 0 row 39 code byte 103"'
+
+# two bytes swapped in a row: the checksum can't tell, a strict verify can
+prog verify s.hex
+check "checksum verify misses swapped bytes" eval 'ok && said "Verify: OK"'
+
+prog verify --strict s.hex
+check "strict verify finds swapped bytes" eval '! ok && said "array 0 row 9 code byte 103" && said "Mismatch: Code"'
+
+# ... in the last row of the second array
+setup
+image 300 a.hex
+image -s 299 300 s.hex
+prog program a.hex
+prog verify s.hex
+check "checksum verify misses swapped bytes in the last row" eval 'ok && said "Verify: OK"'
+
+prog verify --strict s.hex
+check "strict verify finds swapped bytes in the last row" eval '! ok && said "300 read back (all), 1 differ" &&
+    said "array 1 row 43 code byte 103"'
+
+
+
+# ---- gang (prog -G): every simulated programmer (sim0, sim1, ..) programmed, each with its own
+# state file (psoc_sim.dat.simN)
+
+setup gang_size=3
+image 40 a.hex
+prog -G program a.hex
+check "gang program" eval 'ok && said "3/3 programmed" && [ -f $WORK/psoc_sim.dat.sim0 ] && [ -f $WORK/psoc_sim.dat.sim2 ]'
+
+for unit in sim0 sim1 sim2; do
+    prog -P $unit verify --strict a.hex
+    check "gang unit $unit verifies" eval 'ok && said "40 read back (all), 0 differ" && said "Verify: OK"'
+done
+
+
+
+# ---- progd: jobs sent with prog -S run in the daemon, which keeps the programmer open
+
+setup
+image 40 a.hex
+image -c 5,17,33 40 b.hex
+(cd $WORK && exec $PROGD -C config -s progd.sock) > $WORK/progd.out 2>&1 &
+progd_pid=$!
+n=0
+while [ ! -S $WORK/progd.sock ] && [ $n -lt 50 ]; do
+    sleep 0.1
+    n=`expr $n + 1`
+done
+check "progd socket is private" eval '[ -S $WORK/progd.sock ] && [ -z "`find $WORK/progd.sock -perm /077`" ]'
+
+prog -S progd.sock program a.hex
+check "program through progd" eval 'ok && said "progd: program OK"'
+
+prog -S progd.sock verify --strict a.hex
+check "verify through progd" eval 'ok && said "progd: verify OK"'
+
+prog -S progd.sock verify --all b.hex
+check "verify through progd finds the rows that differ" eval '! ok && said "progd: verify FAILED"'
+
+kill $progd_pid
+wait $progd_pid
+prog verify --strict a.hex
+check "progd left the image programmed" eval 'ok && said "40 read back (all), 0 differ" && said "Verify: OK"'
+
+
+[ -n "$KEEP" ] || rm -rf $WORK
+if [ $nfailed -ne 0 ]; then
+    echo "$nfailed tests failed" >&2
+    exit 1
+fi
+exit 0
@@ -0,0 +1,161 @@
+/*
+    Copyright (C) 2014 Kim Lester
+    http://www.dfusion.com.au/
+
+    This Program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This Program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this Program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SwdQueue against the simulator: block transfers that don't fit one FX2 buffer are split
+// (SWD_QUEUE_MAX_REQUEST_LEN / SWD_QUEUE_MAX_REPLY_LEN) and TAR is rewritten where auto
+// increment would wrap at a 1KB boundary.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "SimTransport.h"
+#include "SwdQueue.h"
+#include "SwdProtocol.h"
+#include "utils.h"
+
+
+#define EPADDR_BULK_OUT         0x02    // as Programmer.cpp
+#define EPADDR_BULK_IN          0x84
+
+#define SRAM_BASE               0x1FFF8000  // PSoC5LP (and simulator) SRAM
+#define BLOCK_ADDRESS           (SRAM_BASE + 0x3F0) // 4 words short of a 1KB boundary
+#define BLOCK_WORDS             3000        // 15000 bytes of writes, 15000 of read replies
+
+
+// simulator that checks every exchange fits the FX2 buffers
+class CheckedSim : public SimTransport
+{
+  public:
+    int n_requests;
+    int max_out_len;
+    int max_in_len;
+
+    CheckedSim() : SimTransport(EPADDR_BULK_OUT, EPADDR_BULK_IN, NULL), n_requests(0), max_out_len(0), max_in_len(0) {}
+
+    void clear_counts(void) { n_requests = 0; max_out_len = 0; max_in_len = 0; }
+
+    virtual int submit(const uint8_t *out_data, int out_len, uint8_t *in_data, int in_max_len, int timeout_ms)
+    {
+        n_requests++;
+        if (out_len > max_out_len) max_out_len = out_len;
+        return SimTransport::submit(out_data, out_len, in_data, in_max_len, timeout_ms);
+    }
+
+    virtual int wait(int ticket, int *in_len)
+    {
+        int rc = SimTransport::wait(ticket, in_len);
+        if (in_len && *in_len > max_in_len) max_in_len = *in_len;
+        return rc;
+    }
+};
+
+
+static int nfailed = 0;
+
+static void testcheck(int testnum, const char *what, bool ok)
+{
+    fprintf(stderr, "Test %d: %s: %s\n", testnum, what, ok ? "Passed" : "Failed");
+    if (!ok) nfailed++;
+}
+
+
+static bool split_ok(const CheckedSim &sim, int min_requests)
+{
+    fprintf(stderr, "  %d requests, largest %d bytes out, %d bytes in\n", sim.n_requests, sim.max_out_len, sim.max_in_len);
+    return sim.n_requests >= min_requests && sim.max_out_len <= SWD_QUEUE_MAX_REQUEST_LEN && sim.max_in_len <= SWD_QUEUE_MAX_REPLY_LEN;
+}
+
+
+static uint32_t read_word(SwdQueue &queue, CheckedSim &sim, uint32_t address)
+{
+    uint8_t data[4];
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    queue.ap_read(address, data);
+    if (!queue.flush(&sim))
+        return 0xDEADBEEF;
+    return b4_LE_to_uint32(data);
+}
+
+
+int main()
+{
+    CheckedSim sim;
+    SwdQueue queue;
+
+    if (!sim.open(0, 0) || !queue.attach(&sim))
+    {
+        fprintf(stderr, "Failed to open simulator\n");
+        exit(1);
+    }
+
+    std::vector<uint8_t> out(BLOCK_WORDS * 4);
+    std::vector<uint8_t> in(BLOCK_WORDS * 4, 0);
+    int i;
+    for (i=0; i<BLOCK_WORDS * 4; i++)
+        out[i] = (i * 7 + 3) & 0xFF;
+
+    int min_requests = (BLOCK_WORDS * 5 + SWD_QUEUE_MAX_REQUEST_LEN - 1) / SWD_QUEUE_MAX_REQUEST_LEN;
+
+    // 1: a block write bigger than one request is split
+    sim.clear_counts();
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+    queue.ap_write_block(BLOCK_ADDRESS, out.data(), BLOCK_WORDS);
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    bool ok = queue.flush(&sim);
+    testcheck(1, "ap_write_block split across requests", ok && split_ok(sim, min_requests));
+
+    // 2: a block read whose replies don't fit one transfer is split and comes back intact
+    sim.clear_counts();
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+    queue.ap_read_block(BLOCK_ADDRESS, in.data(), BLOCK_WORDS);
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    ok = queue.flush(&sim);
+    testcheck(2, "ap_read_block split across replies", ok && split_ok(sim, min_requests) && in == out);
+
+    // 3: the words either side of the first 1KB boundary are where they should be, and auto
+    // increment didn't wrap back to the start of the first block
+    uint32_t below = read_word(queue, sim, SRAM_BASE + 0x3FC);
+    uint32_t above = read_word(queue, sim, SRAM_BASE + 0x400);
+    uint32_t start = read_word(queue, sim, SRAM_BASE);
+    testcheck(3, "TAR rewritten at 1KB boundary", below == b4_LE_to_uint32(&out[0x3FC - 0x3F0]) &&
+              above == b4_LE_to_uint32(&out[0x400 - 0x3F0]) && start == 0);
+
+    // 4: a short block that ends exactly on a boundary, read back from the next one up
+    std::vector<uint8_t> small(16);
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT | AP_CSW_ADDRINC_SINGLE);
+    queue.ap_read_block(SRAM_BASE + 0x3F0, small.data(), 4);
+    queue.ap_read_block(SRAM_BASE + 0x400, in.data(), 4);
+    queue.apacc_ctrl_write(AP_CSW_PSOC_32BIT);
+    ok = queue.flush(&sim);
+    testcheck(4, "block ending on a 1KB boundary", ok && memcmp(small.data(), &out[0], 16) == 0 &&
+              memcmp(in.data(), &out[0x10], 16) == 0);
+
+    queue.detach(&sim);
+    sim.close();
+
+    if (nfailed)
+    {
+        fprintf(stderr, "%d tests failed\n", nfailed);
+        exit(1);
+    }
+    return 0;
+}